@@ -0,0 +1,109 @@
+#include "acquisition.h"
+
+
+// Acquisition constructor
+Acquisition::Acquisition(Mpu9250* imu, Mode mode, GpioLine* int_line,
+                         size_t ring_capacity)
+    : ptr_imu_(imu), ptr_int_line_(int_line), mode_(mode),
+      ring_(ring_capacity), running_(false), samples_(0), overruns_(0),
+      errors_(0) {
+}
+
+Acquisition::~Acquisition() {
+  Stop();
+}
+
+void Acquisition::Start() {
+  if (running_.load()) {
+    return;
+  }
+  if (mode_ == kFifo) {
+    ptr_imu_->EnableFifo();
+  }
+  running_.store(true);
+  thread_ = std::thread(&Acquisition::Run_, this);
+}
+
+void Acquisition::Stop() {
+  if (!running_.load()) {
+    return;
+  }
+  running_.store(false);
+  thread_.join();
+  if (mode_ == kFifo) {
+    ptr_imu_->DisableFifo();
+  }
+}
+
+void Acquisition::Push_(const Mpu9250Sample& sample) {
+  // Never block the sampling side: when the consumer lags behind the newest
+  // sample is dropped and counted
+  if (ring_.TryPush(sample)) {
+    samples_.store(samples_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+  } else {
+    overruns_.store(overruns_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+  }
+}
+
+void Acquisition::CountError_() {
+  errors_.store(errors_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+void Acquisition::Run_() {
+  Mpu9250Sample sample;
+  Mpu9250Sample fifo_samples[kFifoSize/kFifoPacketLen];
+  bool read_again = false;
+
+  while (running_.load(std::memory_order_relaxed)) {
+    switch (mode_) {
+      case kInterrupt:
+      case kPolling: {
+        if (mode_ == kInterrupt && !read_again) {
+          // Time out now and then so Stop() is noticed without an
+          // interrupt, and read on a timeout all the same: a pin latched
+          // before the wait began never rises again. A failed wait is
+          // counted like a failed read.
+          int edge = ptr_int_line_->WaitForEdge(100, nullptr);
+          if (edge < 0) {
+            CountError_();
+            usleep(500);
+            break;
+          }
+        }
+        // INT_STATUS is read with the sensors. A failed read leaves
+        // int_status clear, that sample is lost unless the read failed
+        // before INT_STATUS was read. Then the latched pin stays up and no
+        // new edge comes, so read again after a short pause instead of
+        // waiting for one.
+        read_again = false;
+        if (ptr_imu_->ReadSensorsBatched() < 0) {
+          CountError_();
+          read_again = mode_ == kInterrupt;
+        }
+        if (ptr_imu_->int_status & 0x01) {
+          ptr_imu_->CopySample(&sample);
+          Push_(sample);
+        } else if (mode_ == kPolling || read_again) {
+          // Also keeps a bus that fails every read from spinning
+          usleep(500);
+        }
+        break;
+      }
+      case kFifo: {
+        int n = ptr_imu_->ReadFifo(fifo_samples, kFifoSize/kFifoPacketLen);
+        if (n < 0) {
+          CountError_();
+        }
+        for (int i = 0; i < n; i++) {
+          Push_(fifo_samples[i]);
+        }
+        // Drain well before the 512 byte FIFO can fill up at 1 kHz
+        usleep(10*1000);
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,73 @@
+// Acquisition engine: owns a Mpu9250 on a dedicated thread and hands
+// timestamped raw samples to a consumer through a lock-free SPSC ring, so
+// neither side ever waits on the other. The timing statistics of the driver
+// are kept on the acquisition thread and can be read from any thread.
+
+#ifndef ACQUISITION_H_
+#define ACQUISITION_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <thread>  // Needed for std::thread
+#include "gpio.h"
+#include "mpu9250.h"
+#include "spsc_ring.h"
+
+
+class Acquisition {
+  public:
+    enum Mode {
+      kPolling = 0,  // Poll INT_STATUS with the batched read
+      kInterrupt,    // Wait for the INT pin, then do the batched read
+      kFifo          // Periodically drain the hardware FIFO
+    };
+
+  private:
+    Mpu9250* ptr_imu_;
+    GpioLine* ptr_int_line_;
+    Mode mode_;
+    SpscRing<Mpu9250Sample> ring_;
+    std::thread thread_;
+    std::atomic<bool> running_;
+
+    // Written by the acquisition thread only, padded away from the fields
+    // the consumer touches
+    char pad_before_[kCacheLineSize];
+    std::atomic<uint64_t> samples_;
+    std::atomic<uint64_t> overruns_;
+    std::atomic<uint64_t> errors_;
+    char pad_after_[kCacheLineSize];
+
+    void Run_();
+    void Push_(const Mpu9250Sample& sample);
+    void CountError_();
+
+  public:
+    // int_line is only used in kInterrupt mode. ring_capacity is rounded up
+    // to a power of two.
+    Acquisition(Mpu9250* imu, Mode mode, GpioLine* int_line,
+                size_t ring_capacity);
+    ~Acquisition();
+
+    void Start();
+    void Stop();
+
+    // Consumer side, pop up to max_n samples, oldest first
+    size_t PopN(Mpu9250Sample* out, size_t max_n) {
+      return ring_.PopN(out, max_n);
+    }
+
+    // Samples pushed into the ring
+    uint64_t Samples() const {
+      return samples_.load(std::memory_order_relaxed);
+    }
+    // Samples dropped because the consumer fell behind and the ring was full
+    uint64_t Overruns() const {
+      return overruns_.load(std::memory_order_relaxed);
+    }
+    // Reads that failed after the bus retried them, their samples are lost
+    uint64_t Errors() const {
+      return errors_.load(std::memory_order_relaxed);
+    }
+};  // class Acquisition
+
+#endif // ACQUISITION_H_
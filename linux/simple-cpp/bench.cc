@@ -0,0 +1,2354 @@
+// ***************************************************************************
+// Driver throughput and latency benchmark
+//
+// Runs every read strategy of the Mpu9250 driver against the simulated
+// MPU-9250 in sim_bus.h and reports, per strategy:
+//   - syscalls and bus transactions spent per delivered sample, polling for
+//     data ready included
+//   - per-sample read latency (p50/p99/max) of the reads that delivered data
+//   - samples delivered per second of bus time, the empty polls included:
+//     the rate the bus could carry with that strategy if it did nothing else
+//   - FIFO overflows and AK8963 measurements skipped
+// The aux- strategies let the MPU6500 read the AK8963 through its internal
+// I2C master, so the magnetometer arrives without any transaction of its own.
+//
+// The simulated bus takes as long as a real one at the selected clock, plus
+// a fixed per-transaction overhead for the syscall and adapter setup.
+//
+// With -d it checks every batch decoder kernel of decode.h bit for bit against
+// the scalar one instead and reports their throughput. With -f it does the same
+// for the filter banks of quaternion_filters.h against one filter object per
+// IMU, with -l it adds a log of the recorder to the data the precisions are
+// compared on, and it checks that a replayed recording ends where the live
+// filter did. With -r it times the recorder of recorder.h, reads the log back
+// and checks that a log cut short by a crash is recovered up to its last
+// complete record. With -i it prints the bus instrumentation of bus_stats.h for
+// a run of the driver, checks it against the simulator and times it. With -e it
+// injects bus faults and checks the retry policy of bus.h drops no more than
+// one sample per unrecovered fault. With -b it checks the accumulation kernels
+// of decode.h and compares Calibrate with the Arduino calibration on a
+// simulated device with a known gyro bias. With -u it times every phase of
+// bringing a device up. With -k it checks the calibration store of
+// calibration_store.h and times booting from it. With -w it checks the
+// wake-on-motion mode and the CPU a host blocked on it uses. With -g it
+// drives the INT pin from data ready and checks every edge wakes exactly
+// one read of a new sample. With -a it checks the SPSC ring of spsc_ring.h
+// across two threads and the overrun and error counts of acquisition.h.
+// With -m it runs the ImuManager of imu_manager.h on two buses with two
+// devices each.
+//***************************************************************************/
+
+#include <errno.h>  // Needed for EREMOTEIO, ETIMEDOUT, EFBIG
+#include <stdio.h>  // Needed for printf, snprintf
+#include <stdint.h>  // Needed for uint64_t
+#include <stdlib.h>  // Needed for exit, atoi, mkstemp
+#include <string.h>  // Needed for memcmp, strerror
+#include <unistd.h>  // Needed for getopt, usleep, fork, _exit, pread
+#include <fcntl.h>  // Needed for open
+#include <sys/wait.h>  // Needed for waitpid
+#include <sys/eventfd.h>  // Needed for eventfd
+#include <sys/resource.h>  // Needed for getrusage, setrlimit
+#include <signal.h>  // Needed for signal, SIGXFSZ
+#include <math.h>  // Needed for sinf, cosf, fabs, lround
+#include <algorithm>  // Needed for std::sort
+#include <atomic>  // Needed for std::atomic
+#include <thread>  // Needed for std::thread, std::this_thread::yield
+#include <vector>  // Needed for std::vector
+#include "sim_bus.h"
+#include "gpio.h"
+#include "acquisition.h"
+#include "imu_manager.h"
+#include "mpu9250.h"
+#include "sensor_config.h"
+#include "decode.h"
+#include "quaternion_filters.h"
+#include "recorder.h"
+#include "fusion_replay.h"
+#include "calibration_store.h"
+#include "checksum.h"
+#include "timing.h"
+
+enum Strategy {
+  kPerSensor = 0,  // INT_STATUS, ReadAccelData, ReadTempData, ReadGyroData,
+                   // ReadMagnetomData
+  kBurst,          // ReadAllSensors
+  kBatched,        // ReadSensorsBatched, magnetometer included
+  kFifoDrain,      // ReadFifo every few milliseconds
+  kMasterBatched,  // ReadSensorsBatched, magnetometer read by the MPU6500
+  kMasterFifo,     // ReadFifo, packets include the magnetometer
+  kNumStrategies
+};
+
+const char* const kStrategyNames[kNumStrategies] = {
+  "per-sensor", "burst", "batched", "fifo-drain", "aux-batched", "aux-fifo"
+};
+
+static double Percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t i = (size_t)(p*(sorted.size() - 1) + 0.5);
+  return (double)sorted[i];
+}
+
+void RunStrategy(Strategy strategy, uint32_t clock_hz, uint32_t overhead_ns,
+                 uint n_samples, uint poll_us) {
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  imu.InitMpu9250();
+  // Run the sensor at 1 kHz so the bus, not the sensor, is the bottleneck
+  imu.SetSampleRateDivider(0x00);
+  if (strategy == kMasterBatched || strategy == kMasterFifo) {
+    imu.EnableMagnetomMaster();
+  }
+  imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+  if (strategy == kFifoDrain || strategy == kMasterFifo) {
+    imu.EnableFifo();
+  }
+  bus.ResetStats();
+
+  // Read latency per delivered sample, in nanoseconds
+  std::vector<uint64_t> latency;
+  latency.reserve(n_samples + kFifoSize/kFifoPacketLen);
+  Mpu9250Sample fifo_samples[kFifoSize/kFifoPacketLen];
+  int16_t destination[3];
+  uint8_t int_status;
+  // Time spent on the bus, polls that found nothing included
+  uint64_t busy_ns = 0;
+
+  while (latency.size() < n_samples) {
+    uint64_t start = MonotonicRawNs();
+    uint delivered = 0;
+    switch (strategy) {
+      case kPerSensor:
+        bus.ReadFromMem(kMpu6500Addr, kIntStatus, &int_status);
+        if (int_status & 0x01) {
+          imu.ReadAccelData(destination);
+          imu.ReadTempData();
+          imu.ReadGyroData(destination);
+          // As the Arduino sketch does: poll ST1, then read HXL..ST2 if the
+          // AK8963 has a measurement
+          imu.ReadMagnetomData(destination);
+          delivered = 1;
+        }
+        break;
+      case kBurst:
+        imu.ReadAllSensors();
+        delivered = imu.int_status & 0x01;
+        break;
+      case kBatched:
+      case kMasterBatched:
+        imu.ReadSensorsBatched();
+        delivered = imu.int_status & 0x01;
+        break;
+      case kFifoDrain:
+      case kMasterFifo: {
+        int n = imu.ReadFifo(fifo_samples, kFifoSize/kFifoPacketLen);
+        delivered = n > 0 ? n : 0;
+        break;
+      }
+      default:
+        break;
+    }
+    uint64_t elapsed = MonotonicRawNs() - start;
+    busy_ns += elapsed;
+
+    for (uint i = 0; i < delivered; i++) {
+      latency.push_back(elapsed/delivered);
+    }
+    if (strategy == kFifoDrain || strategy == kMasterFifo) {
+      // Start a drain every 20 ms, about 20 packets at 1 kHz and well clear of
+      // an overflow unless the bus cannot keep up
+      if (elapsed < 20*1000000) {
+        usleep((20*1000000 - elapsed)/1000);
+      }
+    } else if (delivered == 0) {
+      usleep(poll_us);
+    }
+  }
+
+  SimBus::Stats stats = bus.GetStats();
+  double n = latency.size();
+  std::sort(latency.begin(), latency.end());
+
+  // Burst and FIFO drain never read the magnetometer, it overruns all along
+  char skipped[16] = "-";
+  if (strategy != kBurst && strategy != kFifoDrain) {
+    snprintf(skipped, sizeof(skipped), "%llu",
+             (unsigned long long)stats.magnetom_skipped);
+  }
+  printf("%-11s %7u %9.2f %9.2f %8.1f %8.1f %8.1f %10.0f %5llu %5s\n",
+         kStrategyNames[strategy], (uint)latency.size(),
+         stats.syscalls/n, stats.transfers/n,
+         Percentile(latency, 0.50)/1000.0, Percentile(latency, 0.99)/1000.0,
+         latency.back()/1000.0, 1e9*n/busy_ns,
+         (unsigned long long)imu.fifo_overflows, skipped);
+}
+
+// Decoded channels, accel x/y/z, temperature, gyro x/y/z, then magnetometer
+const int kNumChannels = 10;
+
+struct DecodeOutput {
+  std::vector<float> channel[kNumChannels];
+
+  explicit DecodeOutput(size_t n) {
+    for (int c = 0; c < kNumChannels; c++) {
+      channel[c].assign(n, 0.0f);
+    }
+  }
+  ImuBlock Imu() {
+    ImuBlock block = {{&channel[0][0], &channel[1][0], &channel[2][0]},
+                      &channel[3][0],
+                      {&channel[4][0], &channel[5][0], &channel[6][0]}};
+    return block;
+  }
+  MagnetomBlock Magnetom() {
+    MagnetomBlock block = {{&channel[7][0], &channel[8][0], &channel[9][0]}};
+    return block;
+  }
+};
+
+// Compare float bit patterns, so -0.0 and NaN mismatches are caught too
+static size_t CountMismatches(const DecodeOutput& a, const DecodeOutput& b) {
+  size_t mismatches = 0;
+  for (int c = 0; c < kNumChannels; c++) {
+    for (size_t i = 0; i < a.channel[c].size(); i++) {
+      if (memcmp(&a.channel[c][i], &b.channel[c][i], sizeof(float)) != 0) {
+        mismatches++;
+      }
+    }
+  }
+  return mismatches;
+}
+
+// Check every supported decode kernel against the scalar one, then time them.
+// Returns false if any kernel disagrees with the scalar kernel.
+bool RunDecode(uint n_samples) {
+  typedef Mpu9250Config<GyroFs::k2000, AccelFs::k16g, MagBits::k16> Config;
+  const DecodeScale scale = Config::SiDecodeScale();
+  // AK8963 ST1..ST2 as read in one go, data starts one byte in
+  const size_t kMagStride = 8;
+
+  // Words count up, seven to a packet. 7 and 65536 are coprime, so over 65536
+  // packets every channel sees every int16 value. A few more packets, not a
+  // multiple of any kernel width, exercise the scalar tail.
+  const size_t n_check = 65536 + 5;
+  std::vector<uint8_t> imu_raw(n_check*kFifoPacketLen);
+  std::vector<uint8_t> mag_raw(n_check*kMagStride);
+  for (size_t k = 0; k < n_check*kFifoPacketLen/2; k++) {
+    imu_raw[2*k] = (k >> 8) & 0xFF;
+    imu_raw[2*k + 1] = k & 0xFF;
+  }
+  for (size_t i = 0; i < n_check; i++) {
+    uint8_t* packet = &mag_raw[i*kMagStride];
+    packet[0] = 0x01;  // ST1 DRDY
+    for (int axis = 0; axis < 3; axis++) {
+      uint16_t word = (3*i + axis) & 0xFFFF;
+      packet[1 + 2*axis] = word & 0xFF;
+      packet[2 + 2*axis] = word >> 8;
+    }
+    packet[7] = 0x10;  // ST2 BITM
+  }
+
+  printf("===== MPU 9250 batch decoder =====\n");
+  printf("Best kernel: %s\n\n", DecodeKernelName(BestDecodeKernel()));
+
+  DecodeOutput reference(n_check);
+  DecodeImuPackets(&imu_raw[0], n_check, kFifoPacketLen, scale,
+                   reference.Imu(), DecodeKernel::kScalar);
+  DecodeMagnetomPackets(&mag_raw[1], n_check, kMagStride, scale,
+                        reference.Magnetom(), DecodeKernel::kScalar);
+
+  // Throughput over a FIFO sized batch, the usual drain
+  const size_t n_batch = kFifoSize/kFifoPacketLen;
+  DecodeOutput batch(n_batch);
+  uint rounds = n_samples/n_batch + 1;
+
+  bool ok = true;
+  printf("%-7s %10s %12s %10s\n", "kernel", "mismatch", "Msamples/s",
+         "ns/sample");
+  for (int k = 0; k < static_cast<int>(DecodeKernel::kNumKernels); k++) {
+    DecodeKernel kernel = static_cast<DecodeKernel>(k);
+    if (!DecodeKernelSupported(kernel)) {
+      printf("%-7s %10s\n", DecodeKernelName(kernel), "n/a");
+      continue;
+    }
+
+    DecodeOutput output(n_check);
+    DecodeImuPackets(&imu_raw[0], n_check, kFifoPacketLen, scale,
+                     output.Imu(), kernel);
+    DecodeMagnetomPackets(&mag_raw[1], n_check, kMagStride, scale,
+                          output.Magnetom(), kernel);
+    size_t mismatches = CountMismatches(reference, output);
+    ok = ok && mismatches == 0;
+
+    uint64_t start = MonotonicRawNs();
+    for (uint r = 0; r < rounds; r++) {
+      DecodeImuPackets(&imu_raw[(r % 64)*n_batch*kFifoPacketLen], n_batch,
+                       kFifoPacketLen, scale, batch.Imu(), kernel);
+    }
+    uint64_t elapsed = MonotonicRawNs() - start;
+    double n = (double)rounds*n_batch;
+    printf("%-7s %10zu %12.1f %10.2f\n", DecodeKernelName(kernel), mismatches,
+           n*1000.0/elapsed, elapsed/n);
+  }
+  printf("\n%s\n", ok ? "All kernels match the scalar decoder bit for bit"
+                       : "Kernel output differs from the scalar decoder");
+  return ok;
+}
+
+// Inputs of every IMU for one time step, one array per channel: accel x/y/z,
+// gyro x/y/z, magnetometer x/y/z and deltat
+struct FusionStep {
+  std::vector<float> channel[10];
+
+  FusionBatch Batch() const {
+    FusionBatch batch = {{&channel[0][0], &channel[1][0], &channel[2][0]},
+                         {&channel[3][0], &channel[4][0], &channel[5][0]},
+                         {&channel[6][0], &channel[7][0], &channel[8][0]},
+                         &channel[9][0]};
+    return batch;
+  }
+  FusionInput Input(size_t imu) const {
+    FusionInput in;
+    for (int axis = 0; axis < 3; axis++) {
+      in.accel[axis] = channel[axis][imu];
+      in.gyro[axis] = channel[3 + axis][imu];
+      in.magnetom[axis] = channel[6 + axis][imu];
+    }
+    in.deltat = channel[9][imu];
+    return in;
+  }
+};
+
+// Every IMU sits tilted by a few degrees and turns about z at its own rate,
+// in m/s^2, rad/s and uT. IMU 3 loses its magnetometer now and then so the
+// zero-norm path is exercised too.
+static std::vector<FusionStep> SyntheticFusionSteps(size_t n_imus,
+                                                    uint n_steps) {
+  const float deltat = 1.0f/1000.0f;
+  std::vector<FusionStep> steps(n_steps);
+  for (uint t = 0; t < n_steps; t++) {
+    for (int c = 0; c < 10; c++) {
+      steps[t].channel[c].resize(n_imus);
+    }
+    for (size_t k = 0; k < n_imus; k++) {
+      float rate = 0.1f + 0.05f*k;
+      float tilt = 0.02f*k;
+      float yaw = rate*deltat*t;
+      steps[t].channel[0][k] = 9.80665f*sinf(tilt);
+      steps[t].channel[1][k] = 0.0f;
+      steps[t].channel[2][k] = 9.80665f*cosf(tilt);
+      steps[t].channel[3][k] = 0.001f*k;
+      steps[t].channel[4][k] = -0.002f;
+      steps[t].channel[5][k] = rate;
+      bool dropout = k == 3 && (t/50) % 4 == 0;
+      steps[t].channel[6][k] = dropout ? 0.0f : 20.0f*cosf(yaw);
+      steps[t].channel[7][k] = dropout ? 0.0f : -20.0f*sinf(yaw);
+      steps[t].channel[8][k] = dropout ? 0.0f : -40.0f;
+      steps[t].channel[9][k] = deltat;
+    }
+  }
+  return steps;
+}
+
+// Drive the simulated MPU-9250 through the driver like the demo does and
+// capture n_steps samples at 1 kHz in SI units, magnetometer included. The
+// sensor turns about z while the device is tilted, the gyro has some bias.
+static std::vector<FusionStep> SimulatedFusionSteps(uint n_steps) {
+  typedef Mpu9250Fixed<GyroFs::k2000, AccelFs::k16g, MagBits::k16> Imu;
+  SimBus bus;
+  // Fast and cheap transfers, the sample clock sets the pace
+  bus.SetTiming(3400000, 0);
+  bus.SetRotationRate(45.0f);
+  bus.SetGyroBias(0.5f, -0.3f, 0.2f);
+  Imu imu(&bus);
+  imu.InitMpu9250();
+  imu.SetSampleRateDivider(0x00);
+  // 16-bit continuous measurement mode 2
+  imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+
+  std::vector<FusionStep> steps(n_steps);
+  Mpu9250Sample sample;
+  Mpu9250Reading reading;
+  float magnetom[3] = {0.0f, 0.0f, 0.0f};
+  uint t = 0;
+  while (t < n_steps) {
+    imu.ReadSensorsBatched();
+    if (!(imu.int_status & 0x01)) {
+      usleep(100);
+      continue;
+    }
+    imu.CopySample(&sample);
+    Imu::Convert(sample, &reading);
+    if (sample.magnetom_new) {
+      // Magnetometer x and y are the accelerometer y and x, as in the demo
+      magnetom[0] = reading.magnetom[1];
+      magnetom[1] = reading.magnetom[0];
+      magnetom[2] = reading.magnetom[2];
+    }
+    for (int c = 0; c < 10; c++) {
+      steps[t].channel[c].resize(1);
+    }
+    for (int axis = 0; axis < 3; axis++) {
+      steps[t].channel[axis][0] = reading.accel[axis];
+      steps[t].channel[3 + axis][0] = reading.gyro[axis];
+      steps[t].channel[6 + axis][0] = magnetom[axis];
+    }
+    steps[t].channel[9][0] = 1.0f/1000.0f;
+    t++;
+  }
+  return steps;
+}
+
+// The filter input of every record of the log at path with a known time
+// step, as mpu9250-replay feeds it. Empty if the log cannot be read.
+static std::vector<FusionStep> RecordedFusionSteps(const char* path) {
+  std::vector<FusionStep> steps;
+  RecordReader reader;
+  if (!reader.Open(path)) {
+    return steps;
+  }
+  steps.reserve(reader.Count());
+  ForEachFusionStep(reader, [&](const FusionInput& in, uint64_t) {
+    FusionStep step;
+    for (int axis = 0; axis < 3; axis++) {
+      step.channel[axis].push_back(in.accel[axis]);
+      step.channel[3 + axis].push_back(in.gyro[axis]);
+      step.channel[6 + axis].push_back(in.magnetom[axis]);
+    }
+    step.channel[9].push_back(in.deltat);
+    steps.push_back(step);
+  });
+  return steps;
+}
+
+struct FusionResult {
+  size_t mismatches;  // Bank lanes that differ from their filter object
+  uint64_t object_ns;
+  uint64_t bank_ns;
+  std::vector<float> track;  // Object quaternions after every step
+};
+
+// Run one filter object per IMU and a bank over the same steps, rounds times
+// in a row, and check every lane of the bank against its object bit for bit.
+// The quaternions of the first round are kept to compare precisions.
+template <typename Filter, typename Bank>
+static FusionResult RunFusionCase(const std::vector<FusionStep>& steps,
+                                  std::vector<Filter> objects, Bank bank,
+                                  uint rounds) {
+  size_t n_imus = bank.Size();
+  FusionResult result;
+  result.track.reserve(steps.size()*n_imus*4);
+
+  uint64_t start = MonotonicRawNs();
+  for (uint r = 0; r < rounds; r++) {
+    for (size_t t = 0; t < steps.size(); t++) {
+      for (size_t k = 0; k < n_imus; k++) {
+        objects[k].Update(steps[t].Input(k));
+      }
+      if (r == 0) {
+        for (size_t k = 0; k < n_imus; k++) {
+          result.track.insert(result.track.end(), objects[k].GetQ(),
+                              objects[k].GetQ() + 4);
+        }
+      }
+    }
+  }
+  result.object_ns = MonotonicRawNs() - start;
+
+  start = MonotonicRawNs();
+  for (uint r = 0; r < rounds; r++) {
+    for (size_t t = 0; t < steps.size(); t++) {
+      bank.Update(steps[t].Batch());
+    }
+  }
+  result.bank_ns = MonotonicRawNs() - start;
+
+  result.mismatches = 0;
+  for (size_t k = 0; k < n_imus; k++) {
+    float q[4];
+    bank.GetQ(k, q);
+    result.mismatches += memcmp(q, objects[k].GetQ(), sizeof(q)) != 0;
+  }
+  return result;
+}
+
+static void PrintFusionRow(const char* filter, const char* data,
+                           FusionPrecision precision,
+                           const FusionResult& result,
+                           const FusionResult& exact, size_t n_updates) {
+  double max_err = 0.0, sum_sq = 0.0;
+  size_t n_quats = result.track.size()/4;
+  for (size_t i = 0; i < n_quats; i++) {
+    double err = QuaternionAngle(&result.track[4*i], &exact.track[4*i])*
+                 180.0/M_PI;
+    max_err = std::max(max_err, err);
+    sum_sq += err*err;
+  }
+  printf("%-9s %-9s %-9s %8zu %10.1f %10.1f %10.5f %10.5f\n", filter, data,
+         FusionPrecisionName(precision), result.mismatches,
+         (double)result.object_ns/n_updates, (double)result.bank_ns/n_updates,
+         max_err, sqrt(sum_sq/n_quats));
+}
+
+// Every precision of both filters on one data set, timed and compared with
+// the exact precision. Returns false if a bank differs from its objects.
+static bool RunFusionData(const char* data,
+                          const std::vector<FusionStep>& steps,
+                          size_t n_imus, uint rounds) {
+  size_t n_updates = (size_t)rounds*steps.size()*n_imus;
+  bool ok = true;
+
+  FusionResult exact;
+  for (int p = 0; p < static_cast<int>(FusionPrecision::kNumPrecisions);
+       p++) {
+    FusionPrecision precision = static_cast<FusionPrecision>(p);
+    std::vector<MadgwickFilter> objects(n_imus);
+    MadgwickBank bank(n_imus);
+    for (size_t k = 0; k < n_imus; k++) {
+      objects[k].SetPrecision(precision);
+    }
+    bank.SetPrecision(precision);
+    FusionResult result = RunFusionCase(steps, objects, bank, rounds);
+    if (precision == FusionPrecision::kExact) {
+      exact = result;
+    }
+    PrintFusionRow("madgwick", data, precision, result, exact, n_updates);
+    ok = ok && result.mismatches == 0;
+  }
+
+  // Every other IMU with the integral term on
+  for (int p = 0; p < static_cast<int>(FusionPrecision::kNumPrecisions);
+       p++) {
+    FusionPrecision precision = static_cast<FusionPrecision>(p);
+    std::vector<MahonyFilter> objects(n_imus);
+    MahonyBank bank(n_imus);
+    for (size_t k = 0; k < n_imus; k++) {
+      if (k % 2 == 1) {
+        objects[k].SetGains(kMahonyKp, 0.1f);
+        bank.SetGains(k, kMahonyKp, 0.1f);
+      }
+      objects[k].SetPrecision(precision);
+    }
+    bank.SetPrecision(precision);
+    FusionResult result = RunFusionCase(steps, objects, bank, rounds);
+    if (precision == FusionPrecision::kExact) {
+      exact = result;
+    }
+    PrintFusionRow("mahony", data, precision, result, exact, n_updates);
+    ok = ok && result.mismatches == 0;
+  }
+  return ok;
+}
+
+// Records the simulated device, whose fuse ROM is not 128 and which has
+// hard-iron offsets set, while a filter is fed the way the demo feeds it,
+// then replays the log into another filter. Returns the angle in degrees
+// between the two orientations at the end, or -1 if the log cannot be
+// written or read. uncalibrated_deg gets the same for a replay without the
+// calibration of the log.
+static double ReplayAgainstLive(uint n_steps, double* uncalibrated_deg) {
+  typedef Mpu9250Fixed<GyroFs::k2000, AccelFs::k16g, MagBits::k16> Imu;
+  const float kMagnetomBias[3] = {150.0f, -80.0f, 40.0f};  // mG
+  SimBus bus;
+  bus.SetTiming(3400000, 0);
+  bus.SetRotationRate(45.0f);
+  Imu imu(&bus);
+  imu.InitMpu9250();
+  imu.SetSampleRateDivider(0x00);
+  imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+  imu.SetMagnetomBias(kMagnetomBias);
+
+  char path[] = "/tmp/mpu9250-bench-XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0) {
+    return -1.0;
+  }
+  close(file);
+  Recorder recorder(path, MakeRecordScale<Imu::Config>(),
+                    MakeRecordMagnetom(imu), n_steps);
+  MahonyFilter live;
+  Mpu9250Sample sample;
+  uint64_t last_ns = 0;
+  uint t = 0;
+  while (t < n_steps && recorder.Error() == 0) {
+    imu.ReadSensorsBatched();
+    if (!(imu.int_status & 0x01)) {
+      usleep(100);
+      continue;
+    }
+    imu.CopySample(&sample);
+    recorder.Append(sample);
+    // As main.cc converts and hands the sample over, the first one only
+    // starts the clock like it does in the replay
+    float field[3];
+    imu.ConvertMagnetom(sample.magnetom_count, field);
+    float gyro_res = Imu::Config::kGyroRes*kDegToRad;
+    FusionInput in = {
+      {sample.accel_count[0]*Imu::Config::kAccelRes,
+       sample.accel_count[1]*Imu::Config::kAccelRes,
+       sample.accel_count[2]*Imu::Config::kAccelRes},
+      {sample.gyro_count[0]*gyro_res, sample.gyro_count[1]*gyro_res,
+       sample.gyro_count[2]*gyro_res},
+      {field[1], field[0], field[2]},
+      (sample.timestamp_ns - last_ns)/1e9f
+    };
+    if (last_ns != 0) {
+      live.Update(in);
+    }
+    last_ns = sample.timestamp_ns;
+    t++;
+  }
+  recorder.Close();
+
+  RecordReader reader;
+  double live_deg = -1.0;
+  *uncalibrated_deg = -1.0;
+  if (recorder.Error() == 0 && reader.Open(path)) {
+    MahonyFilter replayed, uncalibrated;
+    FusionMagnetomScale none = MakeFusionMagnetomScale(
+        reader.Header().scale.si, kUncalibratedMagnetom);
+    uint64_t j = 1;  // Record of the step, the first one has none
+    ForEachFusionStep(reader, [&](const FusionInput& in, uint64_t) {
+      replayed.Update(in);
+      FusionInput raw;
+      RecordToFusionInput(reader.Record(j++), reader.Header().scale.si, none,
+                          in.deltat, &raw);
+      uncalibrated.Update(raw);
+    });
+    live_deg = QuaternionAngle(live.GetQ(), replayed.GetQ())*180.0/M_PI;
+    *uncalibrated_deg = QuaternionAngle(live.GetQ(), uncalibrated.GetQ())*
+                        180.0/M_PI;
+  }
+  reader.Close();
+  unlink(path);
+  return live_deg;
+}
+
+// Check every bank lane against its filter object at every precision, time
+// both and report the attitude error of each precision against the exact
+// one, on synthetic data for n_imus IMUs, on a single simulated sensor and
+// on the recorder log at log_path unless it is nullptr. Then checks that a
+// replayed recording ends where the live filter did. Returns false on any
+// mismatch or if the log cannot be read.
+bool RunFusion(size_t n_imus, uint n_samples, const char* log_path) {
+  const uint n_steps = 2000;
+  printf("===== Orientation filters =====\n");
+  printf("synthetic: %zu IMUs, simulated: 1 IMU through the driver\n",
+         n_imus);
+  std::vector<FusionStep> recorded;
+  if (log_path != nullptr) {
+    recorded = RecordedFusionSteps(log_path);
+    if (recorded.empty()) {
+      printf("No samples to replay in %s\n", log_path);
+      return false;
+    }
+    printf("recorded: %zu samples of %s\n", recorded.size(), log_path);
+  }
+  printf("Times per update, error against the exact precision\n\n");
+  printf("%-9s %-9s %-9s %8s %10s %10s %10s %10s\n", "filter", "data",
+         "precision", "mismatch", "object ns", "bank ns", "max deg",
+         "rms deg");
+
+  std::vector<FusionStep> synthetic = SyntheticFusionSteps(n_imus, n_steps);
+  bool ok = RunFusionData("synthetic", synthetic, n_imus,
+                          n_samples/(n_steps*n_imus) + 1);
+  std::vector<FusionStep> simulated = SimulatedFusionSteps(n_steps);
+  ok = RunFusionData("simulated", simulated, 1, n_samples/n_steps + 1) && ok;
+  if (!recorded.empty()) {
+    ok = RunFusionData("recorded", recorded, 1,
+                       n_samples/recorded.size() + 1) && ok;
+  }
+
+  printf("\n%s\n", ok ? "Every bank lane matches its filter object bit for bit"
+                       : "Bank output differs from the filter objects");
+
+  // The replay has to convert the log the way the driver did, the fuse ROM
+  // adjustment and hard-iron offsets included. The units differ, g and mG
+  // live and SI in the replay, so the two agree up to rounding.
+  double uncalibrated_deg;
+  double replay_deg = ReplayAgainstLive(n_steps, &uncalibrated_deg);
+  bool replay_ok = replay_deg >= 0.0 && replay_deg < 0.01;
+  printf("replay of a recording against the live filter: %.5f deg, %.2f deg"
+         " without the recorded calibration: %s\n", replay_deg,
+         uncalibrated_deg, replay_ok ? "yes" : "FAILED");
+  ok = ok && replay_ok;
+  return ok;
+}
+
+// Deterministic raw sample i, as a gyro streaming at 8 kHz would deliver it
+static void RecordBenchSample(uint64_t i, Mpu9250Sample* sample) {
+  sample->timestamp_ns = 1000000000ull + i*125000;
+  for (int a = 0; a < 3; a++) {
+    sample->accel_count[a] = (int16_t)(i*(a + 3));
+    sample->gyro_count[a] = (int16_t)(i*(a + 7) >> 2);
+    sample->magnetom_count[a] = (int16_t)(i >> (a + 4));
+  }
+  sample->temp_count = (int16_t)(i >> 10);
+  sample->magnetom_new = (i % 80) == 0;
+}
+
+static bool SameSample(const Mpu9250Sample& a, const Mpu9250Sample& b) {
+  bool same = a.timestamp_ns == b.timestamp_ns &&
+              a.temp_count == b.temp_count &&
+              a.magnetom_new == b.magnetom_new;
+  for (int i = 0; i < 3; i++) {
+    same = same && a.accel_count[i] == b.accel_count[i] &&
+           a.gyro_count[i] == b.gyro_count[i] &&
+           a.magnetom_count[i] == b.magnetom_count[i];
+  }
+  return same;
+}
+
+// Reads path back and compares every record with RecordBenchSample. Returns
+// the number of records the reader found, or -1 on a mismatch.
+static int64_t VerifyRecording(const char* path, bool verify_all,
+                               uint64_t* recovered) {
+  RecordReader reader;
+  if (!reader.Open(path, verify_all)) {
+    return -1;
+  }
+  Mpu9250Sample expected, got;
+  for (uint64_t i = 0; i < reader.Count(); i++) {
+    RecordBenchSample(i, &expected);
+    reader.Sample(i, &got);
+    if (!SameSample(expected, got)) {
+      printf("Record %llu differs\n", (unsigned long long)i);
+      return -1;
+    }
+  }
+  *recovered = reader.Recovered();
+  return reader.Count();
+}
+
+// Drives the driver over the simulated bus, prints the BusStats snapshot and
+// checks it against the counts of the simulator, then times the cost of the
+// instrumentation itself. Returns false if any check fails.
+bool RunInstrumentation(uint32_t clock_hz, uint32_t overhead_ns,
+                        uint n_samples) {
+  printf("===== Bus instrumentation =====\n");
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  imu.InitMpu9250();
+  imu.SetSampleRateDivider(0x00);
+  bus.ResetStats();
+  bus.ResetInstrumentation();
+
+  // Half the samples through the batched read, half through the burst read,
+  // and one read of an address nobody answers
+  uint delivered = 0;
+  while (delivered < n_samples) {
+    if (delivered < n_samples/2) {
+      imu.ReadSensorsBatched();
+    } else {
+      imu.ReadAllSensors();
+    }
+    delivered += imu.int_status & 0x01;
+  }
+  // Not retried, so the NACK is seen once
+  const uint16_t kAbsentAddr = 0x50;
+  uint8_t data;
+  RetryPolicy policy = bus.GetRetryPolicy();
+  bus.SetRetryPolicy({1, 0, 0});
+  bus.ReadFromMem(kAbsentAddr, 0x00, &data);
+  bus.SetRetryPolicy(policy);
+
+  BusStats::Snapshot snapshot;
+  uint64_t start = MonotonicRawNs();
+  bus.Instrumentation().TakeSnapshot(&snapshot);
+  uint64_t snapshot_ns = MonotonicRawNs() - start;
+
+  printf("%u samples at %u Hz, snapshot taken in %.1f us\n\n", n_samples,
+         clock_hz, snapshot_ns/1000.0);
+  printf("%-16s %8s %6s %8s %8s %8s %8s\n", "operation", "calls", "errors",
+         "p50 us", "p99 us", "max us", "mean us");
+  uint64_t calls = 0;
+  for (int op = 0; op < BusStats::kNumOps; op++) {
+    const BusStats::Snapshot::OpSummary& summary = snapshot.ops[op];
+    printf("%-16s %8llu %6llu %8.1f %8.1f %8.1f %8.1f\n",
+           BusStats::OpName((BusStats::Op)op),
+           (unsigned long long)summary.calls,
+           (unsigned long long)summary.errors, summary.p50_ns/1000.0,
+           summary.p99_ns/1000.0, summary.max_ns/1000.0,
+           summary.mean_ns/1000.0);
+    calls += summary.calls;
+  }
+
+  printf("\n%-8s %12s %10s %6s\n", "address", "transactions", "bytes",
+         "errors");
+  BusStats::Counts by_addr = {0, 0, 0};
+  BusStats::Counts absent = {0, 0, 0};
+  for (size_t i = 0; i < snapshot.addresses.size(); i++) {
+    const BusStats::Snapshot::Address& address = snapshot.addresses[i];
+    printf("%#-8x %12llu %10llu %6llu\n", address.addr,
+           (unsigned long long)address.counts.transactions,
+           (unsigned long long)address.counts.bytes,
+           (unsigned long long)address.counts.errors);
+    by_addr.transactions += address.counts.transactions;
+    by_addr.bytes += address.counts.bytes;
+    by_addr.errors += address.counts.errors;
+    if (address.addr == kAbsentAddr) {
+      absent = address.counts;
+    }
+  }
+
+  printf("\n%-8s %-8s %12s %10s %6s\n", "address", "register",
+         "transactions", "bytes", "errors");
+  uint64_t by_register = snapshot.untracked;
+  for (size_t i = 0; i < snapshot.registers.size(); i++) {
+    const BusStats::Snapshot::Register& reg = snapshot.registers[i];
+    printf("%#-8x %#-8x %12llu %10llu %6llu\n", reg.addr, reg.reg,
+           (unsigned long long)reg.counts.transactions,
+           (unsigned long long)reg.counts.bytes,
+           (unsigned long long)reg.counts.errors);
+    by_register += reg.counts.transactions;
+  }
+
+  // Every access carries one register address byte, which the simulator
+  // counts as data and BusStats does not. The data of the read nobody
+  // answered never went on the wire.
+  SimBus::Stats stats = bus.GetStats();
+  bool ok = true;
+  bool calls_ok = calls == stats.transfers;
+  bool bytes_ok = by_addr.bytes + by_addr.transactions ==
+                  stats.bytes + absent.bytes;
+  bool registers_ok = by_register == by_addr.transactions;
+  bool errors_ok = absent.errors == 1 && by_addr.errors == 1 &&
+                   snapshot.ops[BusStats::kReadFromMem].errors == 1;
+  printf("\ncalls vs simulated transfers: %s\n", calls_ok ? "match" : "FAILED");
+  printf("bytes vs simulated bytes: %s\n", bytes_ok ? "match" : "FAILED");
+  printf("registers vs addresses: %s\n", registers_ok ? "match" : "FAILED");
+  printf("nack counted once: %s\n", errors_ok ? "yes" : "FAILED");
+
+  // Back to back batched reads with the AK8963 at 100 Hz. Every
+  // measurement ends while only ST1 is being polled and is taken whole,
+  // then reads 25 ms apart let measurements overrun, which must show up as
+  // DOR.
+  SimBus magnetom_bus;
+  magnetom_bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 magnetom_imu(&magnetom_bus);
+  magnetom_imu.InitMpu9250();
+  magnetom_imu.SetSampleRateDivider(0x00);
+  magnetom_imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+  magnetom_bus.ResetStats();
+  uint magnetom_new = 0;
+  start = MonotonicRawNs();
+  for (delivered = 0; delivered < n_samples;) {
+    magnetom_imu.ReadSensorsBatched();
+    delivered += magnetom_imu.int_status & 0x01;
+    magnetom_new += magnetom_imu.magnetom_new;
+  }
+  uint64_t measurements = (MonotonicRawNs() - start)/10000000;
+  uint64_t skipped = magnetom_bus.GetStats().magnetom_skipped;
+  bool all_ok = skipped == 0 && magnetom_imu.magnetom_overruns == 0 &&
+                magnetom_new + 2 >= measurements;
+  printf("magnetometer read back to back: %u of %llu measurements, %llu "
+         "skipped: %s\n", magnetom_new, (unsigned long long)measurements,
+         (unsigned long long)skipped, all_ok ? "yes" : "FAILED");
+  for (uint i = 0; i < 20; i++) {
+    usleep(25000);
+    magnetom_imu.ReadSensorsBatched();
+  }
+  skipped = magnetom_bus.GetStats().magnetom_skipped;
+  bool skipped_ok = magnetom_imu.magnetom_overruns > 0 &&
+                    magnetom_imu.magnetom_overruns <= skipped;
+  printf("magnetometer read every 25 ms: %u DOR for %llu skipped: %s\n",
+         magnetom_imu.magnetom_overruns, (unsigned long long)skipped,
+         skipped_ok ? "yes" : "FAILED");
+  ok = calls_ok && bytes_ok && registers_ok && errors_ok && all_ok &&
+       skipped_ok;
+
+  // Cost per transaction: the two clock reads around the syscall and the
+  // counter updates, over the registers a batched read touches
+  const uint kRecords = 10000000;
+  const uint8_t kRegs[4] = {kIntStatus, kAccelXoutH, kSt1, kSmplrtDiv};
+  BusStats* counters = new BusStats();
+  start = MonotonicRawNs();
+  for (uint i = 0; i < kRecords; i++) {
+    MonotonicRawNs();
+  }
+  double clock_ns = (double)(MonotonicRawNs() - start)/kRecords;
+  start = MonotonicRawNs();
+  for (uint i = 0; i < kRecords; i++) {
+    counters->Record(BusStats::kReadFromMemInto,
+                     (i & 3) == 2 ? kAk8963Addr : kMpu6500Addr, kRegs[i & 3],
+                     14, true, 400 + (i & 1023));
+  }
+  double record_ns = (double)(MonotonicRawNs() - start)/kRecords;
+  delete counters;
+  printf("\ncost per transaction: %.1f ns counters + 2 x %.1f ns clock\n",
+         record_ns, clock_ns);
+
+  return ok;
+}
+
+struct FaultResult {
+  uint reads;
+  uint delivered;
+  uint read_errors;
+  uint64_t faults;
+  uint64_t lost;  // Samples taken by late faults
+  BusStats::Snapshot snapshot;
+  std::vector<uint64_t> latency;  // Of every read, sorted
+};
+
+// Batched reads until n_samples were delivered, or n_samples reads if every
+// transfer fails, with every every_n-th transfer failing with error, after
+// reaching the device if late
+static void RunFaultCase(uint32_t clock_hz, uint32_t overhead_ns,
+                         uint n_samples, const RetryPolicy& policy,
+                         uint every_n, int error, bool late,
+                         FaultResult* result) {
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  imu.InitMpu9250();
+  imu.SetSampleRateDivider(0x00);
+  bus.SetRetryPolicy(policy);
+  bus.ResetInstrumentation();
+  bus.InjectFaults(every_n, error, late);
+
+  result->reads = 0;
+  result->delivered = 0;
+  result->latency.clear();
+  while (result->delivered < n_samples &&
+         (every_n != 1 || result->reads < n_samples)) {
+    uint64_t start = MonotonicRawNs();
+    imu.ReadSensorsBatched();
+    result->latency.push_back(MonotonicRawNs() - start);
+    result->reads++;
+    result->delivered += imu.int_status & 0x01;
+  }
+  std::sort(result->latency.begin(), result->latency.end());
+  result->read_errors = imu.read_errors;
+  result->faults = bus.GetStats().faults;
+  result->lost = bus.GetStats().lost;
+  bus.Instrumentation().TakeSnapshot(&result->snapshot);
+}
+
+static void PrintFaultCase(const char* name, const FaultResult& result) {
+  const BusStats::Snapshot& snapshot = result.snapshot;
+  printf("%-18s %6u %6llu %7llu %6u %6llu %8.1f %8.1f\n", name, result.reads,
+         (unsigned long long)result.faults,
+         (unsigned long long)snapshot.ops[BusStats::kTransfer].retries,
+         result.read_errors, (unsigned long long)snapshot.recoveries,
+         Percentile(result.latency, 0.99)/1000.0,
+         result.latency.back()/1000.0);
+}
+
+// Injects bus faults under different retry policies and checks that every
+// transient fault is retried or surfaces as one dropped sample, that the
+// adapter is recovered when needed and that the latency budget holds.
+bool RunFaults(uint32_t clock_hz, uint32_t overhead_ns, uint n_samples) {
+  const uint kEveryN = 7;
+  const RetryPolicy kNoRetries = {1, 0, 0};
+  // Enough attempts that only the budget stops them
+  const RetryPolicy kBudgetOnly = {100, 100, 1000};
+  printf("===== Bus faults and retries =====\n");
+  printf("%u samples at %u Hz, every %u-th transfer fails\n\n", n_samples,
+         clock_hz, kEveryN);
+  printf("%-18s %6s %6s %7s %6s %6s %8s %8s\n", "case", "reads", "faults",
+         "retries", "errors", "recov", "p99 us", "max us");
+
+  FaultResult result;
+  RunFaultCase(clock_hz, overhead_ns, n_samples, kDefaultRetryPolicy, kEveryN,
+               -EREMOTEIO, false, &result);
+  PrintFaultCase("EREMOTEIO retried", result);
+  // A retry that finds no data ready counts as an error, the failed attempt
+  // may have taken the sample, so some errors are expected. A first attempt
+  // held up past the budget by a busy machine is not retried, that fault
+  // has to surface as an error too.
+  uint64_t retries = result.snapshot.ops[BusStats::kTransfer].retries;
+  bool retried_ok = result.faults > 0 && result.read_errors <= result.faults &&
+                    retries <= result.faults &&
+                    result.faults - retries <= result.read_errors;
+
+  RunFaultCase(clock_hz, overhead_ns, n_samples, kNoRetries, kEveryN,
+               -EREMOTEIO, false, &result);
+  PrintFaultCase("EREMOTEIO dropped", result);
+  bool dropped_ok = result.faults > 0 && result.read_errors == result.faults &&
+                    result.delivered == n_samples;
+
+  // Faults after the device was read clear data ready, the retry succeeds
+  // but the sample is gone and has to show up as an error
+  RunFaultCase(clock_hz, overhead_ns, n_samples, kDefaultRetryPolicy, kEveryN,
+               -EREMOTEIO, true, &result);
+  PrintFaultCase("EREMOTEIO late", result);
+  bool lost_ok = result.lost > 0 && result.read_errors >= result.lost;
+
+  RunFaultCase(clock_hz, overhead_ns, n_samples, kDefaultRetryPolicy, kEveryN,
+               -ETIMEDOUT, false, &result);
+  PrintFaultCase("ETIMEDOUT", result);
+  bool recovered_ok = result.faults > 0 &&
+                      result.read_errors <= result.faults &&
+                      result.snapshot.recoveries == result.faults &&
+                      result.snapshot.failed_recoveries == 0;
+
+  // Nothing gets through, every read gives up once the budget is spent.
+  // Sleeps overshoot on a busy machine, which can only cost attempts, so
+  // check the attempts the backoff allows within the budget and the median
+  // read time. The last attempt may start just before the budget runs out.
+  RunFaultCase(clock_hz, overhead_ns, n_samples/10, kBudgetOnly, 1,
+               -EREMOTEIO, false, &result);
+  PrintFaultCase("budget", result);
+  uint max_attempts = 1;
+  uint backoff_us = kBudgetOnly.backoff_us;
+  for (uint slept_us = backoff_us; slept_us <= kBudgetOnly.budget_us;
+       slept_us += backoff_us) {
+    max_attempts++;
+    backoff_us *= 2;
+  }
+  bool budget_ok = result.read_errors == result.reads &&
+                   result.faults <= (uint64_t)max_attempts*result.reads &&
+                   Percentile(result.latency, 0.5) <
+                       2*kBudgetOnly.budget_us*1000.0;
+
+  printf("\ntransient faults retried: %s\n", retried_ok ? "yes" : "FAILED");
+  printf("one sample dropped per fault without retries: %s\n",
+         dropped_ok ? "yes" : "FAILED");
+  printf("samples lost to late faults counted: %s\n",
+         lost_ok ? "yes" : "FAILED");
+  printf("adapter recovered after timeouts: %s\n",
+         recovered_ok ? "yes" : "FAILED");
+  printf("at most %u attempts per read within the %u us budget: %s\n",
+         max_attempts, kBudgetOnly.budget_us, budget_ok ? "yes" : "FAILED");
+  return retried_ok && dropped_ok && lost_ok && recovered_ok && budget_ok;
+}
+
+// Sums of every channel, compared field by field
+static bool SameSums(const ImuSums& a, const ImuSums& b) {
+  bool same = a.temp == b.temp;
+  for (int axis = 0; axis < 3; axis++) {
+    same = same && a.accel[axis] == b.accel[axis] &&
+           a.gyro[axis] == b.gyro[axis];
+  }
+  return same;
+}
+
+// calibrateMPU9250 of the Arduino library as far as the bus is concerned:
+// 40 ms of 12-byte accel and gyro packets into the FIFO, then one read per
+// packet. Returns the packets averaged into gyro_mean.
+static uint ArduinoCalibration(Bus* bus, double* gyro_mean) {
+  uint8_t config[4] = {0x00, 0x01, 0x00, 0x00};
+  bus->WriteToMemFrom(kMpu6500Addr, kSmplrtDiv, 4, &config[0]);
+  bus->WriteToMem(kMpu6500Addr, kUserCtrl, 0x04);  // FIFO_RST
+  bus->WriteToMem(kMpu6500Addr, kUserCtrl, 0x40);  // FIFO_EN
+  bus->WriteToMem(kMpu6500Addr, kFifoEn, 0x78);
+  usleep(40*1000);
+  bus->WriteToMem(kMpu6500Addr, kFifoEn, 0x00);
+  uint8_t data[12];
+  bus->ReadFromMemInto(kMpu6500Addr, kFifoCountH, 2, &data[0]);
+  uint packets = (((uint)data[0] << 8) | data[1])/12;
+  int32_t sums[3] = {0, 0, 0};
+  for (uint i = 0; i < packets; i++) {
+    bus->ReadFromMemInto(kMpu6500Addr, kFifoRW, 12, &data[0]);
+    for (int axis = 0; axis < 3; axis++) {
+      sums[axis] += (int16_t)(((int16_t)data[6 + 2*axis] << 8) |
+                              data[7 + 2*axis]);
+    }
+  }
+  for (int axis = 0; axis < 3; axis++) {
+    gyro_mean[axis] = packets > 0 ? (double)sums[axis]/packets : 0.0;
+  }
+  bus->WriteToMem(kMpu6500Addr, kUserCtrl, 0x00);
+  return packets;
+}
+
+// Checks the accumulation kernels against the scalar one and times them,
+// then calibrates a simulated device with a known gyroscope bias the way the
+// Arduino library does and with Calibrate over a few windows. Returns false
+// if a kernel disagrees or the biases are not cancelled.
+bool RunCalibration(uint32_t clock_hz, uint32_t overhead_ns) {
+  const float kGyroBias[3] = {1.5f, -2.25f, 0.75f};
+  printf("===== Gyroscope and accelerometer calibration =====\n");
+
+  // Counting words as in RunDecode, more packets than one int32 block and
+  // not a multiple of any kernel width. 22 bytes is the stride of packets
+  // that carry the magnetometer.
+  const size_t n_check = 65536 + 5;
+  const size_t kStrides[2] = {kFifoPacketLen, 22};
+  std::vector<uint8_t> raw(n_check*22);
+  for (size_t k = 0; k < raw.size()/2; k++) {
+    raw[2*k] = (k >> 8) & 0xFF;
+    raw[2*k + 1] = k & 0xFF;
+  }
+  ImuSums reference[2];
+  for (int s = 0; s < 2; s++) {
+    reference[s] = ImuSums{{0, 0, 0}, 0, {0, 0, 0}};
+    AccumulateImuPackets(&raw[0], n_check, kStrides[s], &reference[s],
+                         DecodeKernel::kScalar);
+  }
+
+  bool ok = true;
+  const size_t n_batch = kFifoSize/kFifoPacketLen;
+  const uint rounds = 100000;
+  printf("%-7s %8s %12s %10s\n", "kernel", "exact", "Msamples/s",
+         "ns/sample");
+  for (int k = 0; k < static_cast<int>(DecodeKernel::kNumKernels); k++) {
+    DecodeKernel kernel = static_cast<DecodeKernel>(k);
+    if (!DecodeKernelSupported(kernel)) {
+      printf("%-7s %8s\n", DecodeKernelName(kernel), "n/a");
+      continue;
+    }
+    bool exact = true;
+    for (int s = 0; s < 2; s++) {
+      ImuSums sums = {{0, 0, 0}, 0, {0, 0, 0}};
+      AccumulateImuPackets(&raw[0], n_check, kStrides[s], &sums, kernel);
+      exact = exact && SameSums(sums, reference[s]);
+    }
+    ok = ok && exact;
+
+    ImuSums sums = {{0, 0, 0}, 0, {0, 0, 0}};
+    uint64_t start = MonotonicRawNs();
+    for (uint r = 0; r < rounds; r++) {
+      AccumulateImuPackets(&raw[(r % 64)*n_batch*kFifoPacketLen], n_batch,
+                           kFifoPacketLen, &sums, kernel);
+    }
+    uint64_t elapsed = MonotonicRawNs() - start;
+    double n = (double)rounds*n_batch;
+    printf("%-7s %8s %12.1f %10.2f\n", DecodeKernelName(kernel),
+           exact ? "yes" : "NO", n*1000.0/elapsed, elapsed/n);
+  }
+
+  printf("\n%u Hz bus, %u ns per transaction, gyro bias %.2f %.2f %.2f dps\n",
+         clock_hz, overhead_ns, kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+  printf("%-9s %6s %7s %9s %9s %12s\n", "method", "window", "samples",
+         "syscalls", "time ms", "max err dps");
+  const uint kWindows[3] = {50, 200, 500};
+  for (int c = -1; c < 3; c++) {
+    SimBus bus;
+    bus.SetTiming(clock_hz, overhead_ns);
+    bus.SetRotationRate(0.0f);
+    bus.SetGyroBias(kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+    Mpu9250 imu(&bus);
+    imu.InitMpu9250();
+    bus.ResetStats();
+
+    double gyro_dps[3];
+    uint samples;
+    uint window_ms = 40;
+    uint64_t start = MonotonicRawNs();
+    if (c < 0) {
+      double gyro_mean[3];
+      samples = ArduinoCalibration(&bus, gyro_mean);
+      for (int axis = 0; axis < 3; axis++) {
+        gyro_dps[axis] = gyro_mean[axis]/131.0;
+      }
+    } else {
+      CalibrationConfig config = kDefaultCalibration;
+      config.window_ms = window_ms = kWindows[c];
+      CalibrationResult result;
+      if (imu.Calibrate(config, &result) < 0) {
+        printf("calibration failed\n");
+        return false;
+      }
+      samples = result.samples;
+      for (int axis = 0; axis < 3; axis++) {
+        gyro_dps[axis] = result.gyro_bias[axis];
+      }
+    }
+    uint64_t elapsed = MonotonicRawNs() - start;
+    double max_error = 0.0;
+    for (int axis = 0; axis < 3; axis++) {
+      max_error = std::max(max_error, fabs(gyro_dps[axis] - kGyroBias[axis]));
+    }
+    printf("%-9s %6u %7u %9llu %9.1f %12.4f\n", c < 0 ? "arduino" : "driver",
+           window_ms, samples,
+           (unsigned long long)bus.GetStats().syscalls, elapsed/1e6,
+           max_error);
+  }
+
+  // Calibrate, then calibrate again to see what is left. XG_OFFSET steps of
+  // 4 counts leave up to 2 counts, 0.015 dps, plus noise.
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  bus.SetRotationRate(0.0f);
+  bus.SetGyroBias(kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+  Mpu9250 imu(&bus);
+  imu.InitMpu9250();
+  CalibrationConfig config = kDefaultCalibration;
+  config.accel = true;
+  CalibrationResult first;
+  CalibrationResult second;
+  uint8_t trim[2];
+  bus.ReadFromMemInto(kMpu6500Addr, kXaOffsetH, 2, &trim[0]);
+  int error = imu.Calibrate(config, &first);
+  if (error == 0) {
+    error = imu.Calibrate(config, &second);
+  }
+  bool offsets_ok = error == 0;
+  bool residual_ok = error == 0;
+  for (int axis = 0; axis < 3 && error == 0; axis++) {
+    long expected = -lround(kGyroBias[axis]*131.0/4);
+    offsets_ok = offsets_ok && abs(first.gyro_offset[axis] - expected) <= 1;
+    residual_ok = residual_ok && fabs(second.gyro_bias[axis]) < 0.025;
+  }
+  // The simulated accelerometer has no bias, so the factory trim stays
+  // within one step and keeps its reserved bit
+  int16_t x_trim = ((int16_t)trim[0] << 8) | trim[1];
+  bool accel_ok = error == 0 && abs(second.accel_offset[0] - x_trim) <= 2 &&
+                  (second.accel_offset[0] & 1) == (x_trim & 1);
+  printf("\nwritten gyro offsets %d %d %d, then %.4f %.4f %.4f dps left\n",
+         first.gyro_offset[0], first.gyro_offset[1], first.gyro_offset[2],
+         second.gyro_bias[0], second.gyro_bias[1], second.gyro_bias[2]);
+  printf("gyro offsets as the Arduino code computes them: %s\n",
+         offsets_ok ? "yes" : "FAILED");
+  printf("bias cancelled to within one offset step: %s\n",
+         residual_ok ? "yes" : "FAILED");
+  printf("accel trim kept with its reserved bit: %s\n",
+         accel_ok ? "yes" : "FAILED");
+  printf("kernels exact: %s\n", ok ? "yes" : "FAILED");
+  return ok && offsets_ok && residual_ok && accel_ok;
+}
+
+// Brings a simulated device up n_runs times the way the demo does and
+// reports every start-up phase, and the time until the first batched read
+// that delivers accelerometer, gyroscope and magnetometer data. Returns
+// false if a phase fails or that read lacks any of them.
+bool RunStartup(uint32_t clock_hz, uint32_t overhead_ns, uint n_runs) {
+  printf("===== Start-up =====\n");
+  printf("%u runs at %u Hz, InitMpu9250 used to sleep 100 ms instead of"
+         " polling\n\n", n_runs, clock_hz);
+  const char* const kPhases[] = {"reset", "configuration", "first sample",
+                                 "AK8963 fuse ROM", "first measurement",
+                                 "first full read"};
+  const int kNumPhases = 6;
+  std::vector<uint64_t> phase_ns[kNumPhases];
+  bool ok = true;
+  for (uint r = 0; r < n_runs && ok; r++) {
+    SimBus bus;
+    bus.SetTiming(clock_hz, overhead_ns);
+    Mpu9250 imu(&bus);
+    uint64_t start = MonotonicRawNs();
+    int error = imu.Reset();
+    if (error == 0) {
+      error = imu.InitMpu9250();
+    }
+    if (error == 0) {
+      error = imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+    }
+    // The magnetometer measurement is waiting, the next data ready brings
+    // the rest
+    if (error == 0) {
+      do {
+        error = imu.ReadSensorsBatched();
+      } while (error == 0 && !(imu.int_status & 0x01));
+    }
+    uint64_t first_read = MonotonicRawNs() - start;
+    ok = error == 0 && imu.magnetom_new == 1;
+
+    const StartupTiming& startup = imu.startup;
+    phase_ns[0].push_back(startup.reset_ns);
+    phase_ns[1].push_back(startup.config_ns);
+    phase_ns[2].push_back(startup.data_ready_ns);
+    phase_ns[3].push_back(startup.fuse_rom_ns);
+    phase_ns[4].push_back(startup.magnetom_ns);
+    phase_ns[5].push_back(first_read);
+  }
+
+  printf("%-18s %8s %8s\n", "phase", "p50 ms", "max ms");
+  for (int i = 0; i < kNumPhases; i++) {
+    std::sort(phase_ns[i].begin(), phase_ns[i].end());
+    printf("%-18s %8.2f %8.2f\n", kPhases[i],
+           Percentile(phase_ns[i], 0.5)/1e6, phase_ns[i].back()/1e6);
+  }
+  printf("\nfirst read delivers every sensor: %s\n", ok ? "yes" : "FAILED");
+  return ok;
+}
+
+// Time spent on the CPU by the calling thread
+static uint64_t ThreadCpuNs() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1000000000ull +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)*1000ull;
+}
+
+// Waits up to timeout_ms for WOM_INT, checking INT_STATUS every
+// millisecond. Returns how long it took, 0 if it did not come.
+static uint64_t WaitForWake(Mpu9250* imu, uint timeout_ms) {
+  uint64_t start = MonotonicRawNs();
+  do {
+    if (imu->ReadIntStatus() == 0 && (imu->int_status & 0x40)) {
+      return MonotonicRawNs() - start;
+    }
+    usleep(1000);
+  } while (MonotonicRawNs() - start < timeout_ms*1000000ull);
+  return 0;
+}
+
+// Puts a simulated device to sleep in wake-on-motion mode, checks it stays
+// asleep while still and through a bump below the threshold, wakes up on
+// one above it and is back at full rate afterwards. Then blocks on a
+// stand-in for the INT pin and measures the CPU the wait costs. Returns
+// false if any check fails.
+bool RunWakeOnMotion(uint32_t clock_hz, uint32_t overhead_ns) {
+  const uint kThresholdMg = 40;
+  const Mpu9250::WakeRate kRate = Mpu9250::kWake62_5Hz;
+  const uint kLpPeriodMs = 16;
+  printf("===== Wake-on-motion =====\n");
+  printf("%u mg threshold, accelerometer at 62.5 Hz, bus at %u Hz\n\n",
+         kThresholdMg, clock_hz);
+
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  int error = imu.Reset();
+  if (error == 0) {
+    error = imu.InitMpu9250();
+  }
+  if (error == 0) {
+    error = imu.InitAk8963(Mpu9250::kMagnetom100Hz);
+  }
+  uint64_t start = MonotonicRawNs();
+  if (error == 0) {
+    error = imu.EnableWakeOnMotion(kThresholdMg, kRate);
+  }
+  uint64_t enable_ns = MonotonicRawNs() - start;
+  if (error < 0) {
+    printf("Could not enable wake-on-motion: %s\n", strerror(-error));
+    return false;
+  }
+  printf("enable %.2f ms\n", enable_ns/1e6);
+
+  // Lying still, then a bump of half the threshold
+  bool still_ok = WaitForWake(&imu, 500) == 0;
+  printf("still for 500 ms, no wake: %s\n", still_ok ? "yes" : "FAILED");
+  bus.SetAcceleration(0.5f*kThresholdMg/1000, 0.0f, 0.0f);
+  bool small_ok = WaitForWake(&imu, 100) == 0;
+  bus.SetAcceleration(0.0f, 0.0f, 0.0f);
+  small_ok = small_ok && WaitForWake(&imu, 100) == 0;
+  printf("bump of %u mg, no wake: %s\n", kThresholdMg/2,
+         small_ok ? "yes" : "FAILED");
+
+  // A bump of twice the threshold is flagged by the next sample
+  bus.SetAcceleration(2.0f*kThresholdMg/1000, 0.0f, 0.0f);
+  uint64_t wake_ns = WaitForWake(&imu, 10*kLpPeriodMs);
+  bus.SetAcceleration(0.0f, 0.0f, 0.0f);
+  bool wake_ok = wake_ns > 0 && wake_ns <= (kLpPeriodMs + 2)*1000000ull;
+  printf("bump of %u mg, woken after %.1f ms within one %u ms period: %s\n",
+         2*kThresholdMg, wake_ns/1e6, kLpPeriodMs,
+         wake_ok ? "yes" : "FAILED");
+
+  // Full rate again, gyroscope included
+  start = MonotonicRawNs();
+  error = imu.DisableWakeOnMotion();
+  uint64_t disable_ns = MonotonicRawNs() - start;
+  // The rate from the median span of ten samples. The read times beat
+  // against the samples, which the span evens out, and a sleep that
+  // overshoots on a busy machine and misses a sample does not move it.
+  const size_t kSpan = 10;
+  std::vector<uint64_t> times;
+  int16_t gyro_z = 0;
+  start = MonotonicRawNs();
+  while (error == 0 && MonotonicRawNs() - start < 500000000ull) {
+    error = imu.ReadSensorsBatched();
+    if (error == 0 && (imu.int_status & 0x01)) {
+      times.push_back(imu.sample_time_ns);
+      gyro_z = imu.gyro_count[2];
+    }
+    usleep(500);
+  }
+  std::vector<uint64_t> spans;
+  for (size_t i = kSpan; i < times.size(); i++) {
+    spans.push_back(times[i] - times[i - kSpan]);
+  }
+  std::sort(spans.begin(), spans.end());
+  double rate_hz = spans.empty() ? 0 : kSpan*1e9/Percentile(spans, 0.5);
+  bool full_ok = error == 0 && rate_hz > 190 && rate_hz < 210 && gyro_z != 0;
+  printf("disable %.2f ms, then %.1f Hz with gyro z %d: %s\n",
+         disable_ns/1e6, rate_hz, gyro_z, full_ok ? "yes" : "FAILED");
+
+  // Block on an eventfd standing in for the INT pin while another thread
+  // bumps the device and raises the edge
+  const uint kBlockMs = 300;
+  bool blocked_ok = false;
+  error = imu.EnableWakeOnMotion(kThresholdMg, kRate);
+  int event_fd = eventfd(0, EFD_CLOEXEC);
+  if (error == 0 && event_fd >= 0) {
+    GpioLine int_line(event_fd);
+    uint64_t edge_ns = 0;
+    std::thread bump([&]() {
+      usleep(kBlockMs*1000);
+      bus.SetAcceleration(2.0f*kThresholdMg/1000, 0.0f, 0.0f);
+      // The sample after the bump raises the pin
+      usleep(kLpPeriodMs*1000);
+      edge_ns = MonotonicRawNs();
+      uint64_t one = 1;
+      if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("eventfd");
+      }
+    });
+    uint64_t cpu_start = ThreadCpuNs();
+    start = MonotonicRawNs();
+    bool edge = int_line.WaitForEdge(-1, nullptr) == 1;
+    uint64_t cpu_ns = ThreadCpuNs() - cpu_start;
+    uint64_t blocked_ns = MonotonicRawNs() - start;
+    bump.join();
+    error = imu.ReadIntStatus();
+    uint64_t confirmed_ns = MonotonicRawNs() - edge_ns;
+    blocked_ok = edge && error == 0 && (imu.int_status & 0x40) &&
+                 cpu_ns < 1000000;
+    printf("blocked %.1f ms on the INT pin using %.3f ms of CPU, WOM_INT"
+           " read %.1f us after the edge: %s\n", blocked_ns/1e6, cpu_ns/1e6,
+           confirmed_ns/1e3, blocked_ok ? "yes" : "FAILED");
+    bus.SetAcceleration(0.0f, 0.0f, 0.0f);
+    imu.DisableWakeOnMotion();
+  } else {
+    printf("Could not set up the blocking wait: %s\n",
+           error < 0 ? strerror(-error) : strerror(errno));
+  }
+  return still_ok && small_ok && wake_ok && full_ok && blocked_ok;
+}
+
+// Samples a simulated device at 200 Hz with its INT pin driven onto an
+// eventfd, once with the -g loop of main.cc and once with an Acquisition in
+// kInterrupt mode, and checks every edge delivers exactly one new sample.
+// Returns false if any check fails.
+bool RunInterrupt(uint32_t clock_hz, uint32_t overhead_ns) {
+  const uint kRunMs = 1000;
+  printf("===== INT pin =====\n");
+  printf("data ready at 200 Hz on an eventfd, bus at %u Hz\n\n", clock_hz);
+
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  int error = imu.Reset();
+  if (error == 0) {
+    error = imu.InitMpu9250();
+  }
+  if (error == 0) {
+    error = imu.SetSampleRateDivider(4);
+  }
+  int event_fd = eventfd(0, EFD_CLOEXEC);
+  if (error < 0 || event_fd < 0) {
+    printf("Could not set up the device: %s\n",
+           error < 0 ? strerror(-error) : strerror(errno));
+    return false;
+  }
+
+  // Wait for the edge, then read, as main.cc does with -g
+  bool loop_ok = false;
+  {
+    GpioLine int_line(event_fd);
+    imu.ReadSensorsBatched();  // Releases a pin raised during setup
+    bus.ResetStats();
+    bus.SetIntPin(int_line.Fd());
+    uint64_t edges = 0;
+    uint64_t delivered = 0;
+    std::vector<uint64_t> intervals;
+    uint64_t last_ns = 0;
+    uint64_t start = MonotonicRawNs();
+    while (error == 0 && MonotonicRawNs() - start < kRunMs*1000000ull) {
+      int edge = int_line.WaitForEdge(1000, nullptr);
+      if (edge <= 0) {
+        error = edge < 0 ? edge : -ETIMEDOUT;
+        break;
+      }
+      edges++;
+      error = imu.ReadSensorsBatched();
+      if (error == 0 && (imu.int_status & 0x01)) {
+        delivered++;
+        if (last_ns != 0) {
+          intervals.push_back(imu.sample_time_ns - last_ns);
+        }
+        last_ns = imu.sample_time_ns;
+      }
+    }
+    bus.SetIntPin(-1);
+    // The pin may have risen once more after the last wait
+    uint64_t sim_edges = bus.GetStats().int_edges;
+    std::sort(intervals.begin(), intervals.end());
+    double rate_hz = intervals.empty() ? 0 : 1e9/Percentile(intervals, 0.5);
+    loop_ok = error == 0 && delivered > 0 && delivered == edges &&
+              sim_edges >= edges && sim_edges <= edges + 1 &&
+              rate_hz > 190 && rate_hz < 210;
+    printf("-g loop: %llu edges, %llu raised, %llu samples at %.1f Hz: %s\n",
+           (unsigned long long)edges, (unsigned long long)sim_edges,
+           (unsigned long long)delivered, rate_hz,
+           loop_ok ? "yes" : "FAILED");
+  }
+
+  // The same through the acquisition thread
+  bool acquisition_ok = false;
+  event_fd = eventfd(0, EFD_CLOEXEC);
+  if (event_fd < 0) {
+    printf("Could not open an eventfd: %s\n", strerror(errno));
+    return false;
+  }
+  {
+    GpioLine int_line(event_fd);
+    imu.ReadSensorsBatched();
+    bus.ResetStats();
+    Acquisition acquisition(&imu, Acquisition::kInterrupt, &int_line, 1024);
+    acquisition.Start();
+    bus.SetIntPin(int_line.Fd());
+    std::vector<Mpu9250Sample> samples;
+    Mpu9250Sample batch[64];
+    uint64_t start = MonotonicRawNs();
+    while (MonotonicRawNs() - start < kRunMs*1000000ull) {
+      size_t n = acquisition.PopN(batch, 64);
+      samples.insert(samples.end(), batch, batch + n);
+      usleep(20*1000);
+    }
+    // Stopped first, a read on a wait timeout after the pin stopped would
+    // deliver a sample that raised no edge
+    acquisition.Stop();
+    bus.SetIntPin(-1);
+    for (size_t n; (n = acquisition.PopN(batch, 64)) > 0;) {
+      samples.insert(samples.end(), batch, batch + n);
+    }
+    uint64_t sim_edges = bus.GetStats().int_edges;
+    std::vector<uint64_t> intervals;
+    bool increasing = true;
+    for (size_t i = 1; i < samples.size(); i++) {
+      increasing = increasing &&
+                   samples[i].timestamp_ns > samples[i - 1].timestamp_ns;
+      intervals.push_back(samples[i].timestamp_ns -
+                          samples[i - 1].timestamp_ns);
+    }
+    std::sort(intervals.begin(), intervals.end());
+    double rate_hz = intervals.empty() ? 0 : 1e9/Percentile(intervals, 0.5);
+    // Stop may come between an edge and the read it wakes up
+    acquisition_ok = samples.size() == acquisition.Samples() &&
+                     acquisition.Errors() == 0 &&
+                     acquisition.Overruns() == 0 && increasing &&
+                     samples.size() + 1 >= sim_edges &&
+                     samples.size() <= sim_edges &&
+                     rate_hz > 190 && rate_hz < 210;
+    printf("Acquisition::kInterrupt: %llu raised, %zu samples at %.1f Hz, "
+           "%llu errors, %llu overruns: %s\n",
+           (unsigned long long)sim_edges, samples.size(), rate_hz,
+           (unsigned long long)acquisition.Errors(),
+           (unsigned long long)acquisition.Overruns(),
+           acquisition_ok ? "yes" : "FAILED");
+  }
+  return loop_ok && acquisition_ok;
+}
+
+// A ring item large enough to tear if a slot were read while it is written
+struct RingItem {
+  uint64_t seq;
+  uint64_t check[7];
+};
+
+static RingItem MakeRingItem(uint64_t seq) {
+  RingItem item;
+  item.seq = seq;
+  for (int j = 0; j < 7; j++) {
+    item.check[j] = seq*(j + 2);
+  }
+  return item;
+}
+
+static bool IsRingItem(const RingItem& item, uint64_t seq) {
+  if (item.seq != seq) {
+    return false;
+  }
+  for (int j = 0; j < 7; j++) {
+    if (item.check[j] != seq*(j + 2)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks the SPSC ring on one thread, then streams n_items through it from a
+// producer to a consumer thread, then runs an Acquisition on a simulated
+// device with a consumer too slow to keep up and a bus that fails reads.
+// Returns false if any check fails.
+bool RunRing(uint32_t clock_hz, uint32_t overhead_ns, uint64_t n_items) {
+  printf("===== Sample ring and acquisition thread =====\n\n");
+
+  // Empty, full and a batch pop across the wrap point
+  SpscRing<RingItem> ring(6);
+  RingItem out[16];
+  bool single_ok = ring.Capacity() == 8 && !ring.TryPop(out) &&
+                   ring.PopN(out, 16) == 0;
+  uint64_t pushed = 0;
+  uint64_t popped = 0;
+  for (int round = 0; round < 3 && single_ok; round++) {
+    while (ring.TryPush(MakeRingItem(pushed))) {
+      pushed++;
+    }
+    single_ok = ring.Size() == 8 && pushed - popped == 8;
+    // Free 3 slots, refill them past the end of the slots, pop all of it
+    for (int i = 0; i < 3 && single_ok; i++) {
+      single_ok = ring.TryPop(out) && IsRingItem(out[0], popped++);
+    }
+    for (int i = 0; i < 3 && single_ok; i++) {
+      single_ok = ring.TryPush(MakeRingItem(pushed++));
+    }
+    single_ok = single_ok && !ring.TryPush(MakeRingItem(pushed)) &&
+                ring.PopN(out, 16) == 8;
+    for (int i = 0; i < 8 && single_ok; i++) {
+      single_ok = IsRingItem(out[i], popped++);
+    }
+    single_ok = single_ok && ring.Size() == 0 && ring.PopN(out, 16) == 0;
+  }
+  printf("capacity 6 rounds up to %zu, empty and full refused, batch pop "
+         "across the wrap point in order: %s\n", ring.Capacity(),
+         single_ok ? "yes" : "FAILED");
+
+  // Producer and consumer threads, the consumer pops batches of every size
+  // from one to more than the ring holds
+  SpscRing<RingItem> shared(64);
+  uint64_t full = 0;
+  std::atomic<bool> consuming(true);
+  std::thread producer([&]() {
+    for (uint64_t seq = 0; seq < n_items && consuming.load(); seq++) {
+      RingItem item = MakeRingItem(seq);
+      // Yield so the two threads also take turns on a single core
+      while (!shared.TryPush(item) && consuming.load()) {
+        full++;
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint64_t empty = 0;
+  uint64_t expected = 0;
+  bool order_ok = true;
+  RingItem batch[80];
+  size_t max_n = 1;
+  uint64_t start = MonotonicRawNs();
+  while (expected < n_items && order_ok) {
+    size_t n = shared.PopN(batch, max_n);
+    if (n == 0) {
+      empty++;
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < n && order_ok; i++) {
+      order_ok = IsRingItem(batch[i], expected++);
+    }
+    max_n = max_n % 80 + 1;
+  }
+  uint64_t ring_ns = MonotonicRawNs() - start;
+  consuming.store(false);
+  producer.join();
+  bool threads_ok = order_ok && expected == n_items && shared.Size() == 0 &&
+                    full > 0 && empty > 0;
+  printf("%llu items through %zu slots between two threads, %.1f M/s, "
+         "%llu pushes on a full and %llu pops on an empty ring, every item "
+         "complete and in order: %s\n", (unsigned long long)n_items,
+         shared.Capacity(), n_items*1e3/ring_ns, (unsigned long long)full,
+         (unsigned long long)empty, threads_ok ? "yes" : "FAILED");
+
+  // Acquisition at 200 Hz into 16 slots, emptied every 200 ms, on a bus
+  // that fails every 7th transfer without retrying it
+  const uint kFaultEvery = 7;
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  Mpu9250 imu(&bus);
+  int error = imu.Reset();
+  if (error == 0) {
+    error = imu.InitMpu9250();
+  }
+  if (error == 0) {
+    error = imu.SetSampleRateDivider(4);
+  }
+  int event_fd = eventfd(0, EFD_CLOEXEC);
+  if (error < 0 || event_fd < 0) {
+    printf("Could not set up the device: %s\n",
+           error < 0 ? strerror(-error) : strerror(errno));
+    return false;
+  }
+  GpioLine int_line(event_fd);
+  imu.ReadSensorsBatched();  // Releases a pin raised during setup
+  const RetryPolicy kNoRetries = {1, 0, 0};
+  bus.SetRetryPolicy(kNoRetries);
+  bus.InjectFaults(kFaultEvery, -EREMOTEIO);
+  bus.ResetStats();
+  Acquisition acquisition(&imu, Acquisition::kInterrupt, &int_line, 16);
+  acquisition.Start();
+  bus.SetIntPin(int_line.Fd());
+  std::vector<Mpu9250Sample> samples;
+  Mpu9250Sample sample_batch[64];
+  start = MonotonicRawNs();
+  while (MonotonicRawNs() - start < 1000000000ull) {
+    usleep(200*1000);
+    size_t n = acquisition.PopN(sample_batch, 64);
+    samples.insert(samples.end(), sample_batch, sample_batch + n);
+  }
+  acquisition.Stop();
+  bus.SetIntPin(-1);
+  bus.InjectFaults(0, 0);
+  for (size_t n; (n = acquisition.PopN(sample_batch, 64)) > 0;) {
+    samples.insert(samples.end(), sample_batch, sample_batch + n);
+  }
+  SimBus::Stats stats = bus.GetStats();
+  bool increasing = true;
+  for (size_t i = 1; i < samples.size(); i++) {
+    increasing = increasing &&
+                 samples[i].timestamp_ns > samples[i - 1].timestamp_ns;
+  }
+  // Every edge ends up in the ring or in the overruns, Stop may come
+  // between an edge and its read
+  uint64_t delivered = acquisition.Samples() + acquisition.Overruns();
+  bool slow_ok = samples.size() == acquisition.Samples() && increasing &&
+                 acquisition.Overruns() > 0 &&
+                 delivered + 1 >= stats.int_edges &&
+                 delivered <= stats.int_edges;
+  printf("slow consumer: %llu samples raised, %zu popped, %llu overruns: "
+         "%s\n", (unsigned long long)stats.int_edges, samples.size(),
+         (unsigned long long)acquisition.Overruns(),
+         slow_ok ? "yes" : "FAILED");
+  // A read that failed before INT_STATUS is read again, none of them loses
+  // its sample
+  bool errors_ok = stats.faults > 0 && acquisition.Errors() == stats.faults;
+  printf("%llu faults injected, %llu errors counted, read again without "
+         "losing a sample: %s\n", (unsigned long long)stats.faults,
+         (unsigned long long)acquisition.Errors(),
+         errors_ok ? "yes" : "FAILED");
+  return single_ok && threads_ok && slow_ok && errors_ok;
+}
+
+// Runs an ImuManager on two simulated buses with two MPU-9250s each, every
+// device at a rate of its own, and checks both addresses are found on each
+// bus, the magnetometers arrive through the internal I2C master, every
+// device keeps its rate and all timestamps are on the clock of the host.
+// Returns false if any check fails.
+bool RunManager(uint32_t clock_hz, uint32_t overhead_ns) {
+  const uint kNumBuses = 2;
+  // Slow enough that the bus threads, which spin for the simulated
+  // transfers, do not starve each other on a single core
+  const uint8_t kDividers[2*kNumBuses] = {9, 19, 14, 24};
+  const uint kRunMs = 1000;
+  printf("===== Devices on several buses =====\n");
+  printf("%u buses at %u Hz with two MPU-9250s each\n\n", kNumBuses,
+         clock_hz);
+
+  SimMultiBus buses[kNumBuses];
+  ImuManager manager(ImuManager::kPolling, 1024);
+  for (uint bus_n = 0; bus_n < kNumBuses; bus_n++) {
+    buses[bus_n].SetTiming(clock_hz, overhead_ns);
+    buses[bus_n].AddDevice(kMpu6500Addr);
+    buses[bus_n].AddDevice(kMpu6500AddrAd0);
+    manager.AddBus(&buses[bus_n], bus_n);
+  }
+  bool found_ok = manager.NumBuses() == kNumBuses &&
+                  manager.NumDevices() == 2*kNumBuses;
+  for (uint i = 0; i < manager.NumDevices() && found_ok; i++) {
+    const ImuManager::DeviceInfo& info = manager.Info(i);
+    found_ok = info.bus_n == i/2 && info.shared &&
+               info.addr == (i % 2 == 0 ? kMpu6500Addr : kMpu6500AddrAd0) &&
+               manager.SetSampleRateDivider(i, kDividers[i]) == 0;
+  }
+  printf("%u devices on %u buses, both AD0 addresses on every bus, all "
+         "shared: %s\n", manager.NumDevices(), manager.NumBuses(),
+         found_ok ? "yes" : "FAILED");
+  if (!found_ok) {
+    return false;
+  }
+
+  for (uint bus_n = 0; bus_n < kNumBuses; bus_n++) {
+    buses[bus_n].ResetStats();
+  }
+  std::vector<Mpu9250Sample> samples[2*kNumBuses];
+  Mpu9250Sample batch[64];
+  uint64_t start_ns = MonotonicRawNs();
+  manager.Start();
+  while (MonotonicRawNs() - start_ns < kRunMs*1000000ull) {
+    usleep(20*1000);
+    for (uint i = 0; i < manager.NumDevices(); i++) {
+      size_t n = manager.PopN(i, batch, 64);
+      samples[i].insert(samples[i].end(), batch, batch + n);
+    }
+  }
+  manager.Stop();
+  uint64_t stop_ns = MonotonicRawNs();
+  for (uint i = 0; i < manager.NumDevices(); i++) {
+    for (size_t n; (n = manager.PopN(i, batch, 64)) > 0;) {
+      samples[i].insert(samples[i].end(), batch, batch + n);
+    }
+  }
+
+  // No transfer went to the AK8963 address, it is not acknowledged with
+  // bypass off, so the magnetometer readings came through the MPU6500s
+  uint64_t nacks = 0;
+  for (uint bus_n = 0; bus_n < kNumBuses; bus_n++) {
+    nacks += buses[bus_n].GetStats().nacks;
+  }
+  bool magnetom_ok = nacks == 0;
+  bool rates_ok = true;
+  bool clock_ok = true;
+  printf("%-12s %8s %8s %8s %8s %9s %6s\n", "device", "samples", "set Hz",
+         "got Hz", "magnet.", "overruns", "errors");
+  for (uint i = 0; i < manager.NumDevices(); i++) {
+    const std::vector<Mpu9250Sample>& device = samples[i];
+    uint magnetom_new = 0;
+    for (size_t j = 0; j < device.size(); j++) {
+      // Within the run on the host clock, no matter which bus
+      clock_ok = clock_ok && device[j].timestamp_ns > start_ns &&
+                 device[j].timestamp_ns < stop_ns;
+      magnetom_new += device[j].magnetom_new;
+    }
+    // Over the whole run, the read times beat against the polling
+    double set_hz = 1000.0/(1 + kDividers[i]);
+    double rate_hz = device.size() < 2 ? 0 :
+        (device.size() - 1)*1e9/
+        (device.back().timestamp_ns - device.front().timestamp_ns);
+    rates_ok = rates_ok && fabs(rate_hz - set_hz) < 0.03*set_hz &&
+               manager.Overruns(i) == 0 && manager.Errors(i) == 0 &&
+               device.size() == manager.Samples(i);
+    // The AK8963 measures at 100 Hz, as fast as the fastest device
+    magnetom_ok = magnetom_ok && magnetom_new + 2 >= device.size();
+    // Sampling to the end on every bus, a clock running apart would leave
+    // the last timestamps of one bus behind
+    clock_ok = clock_ok && !device.empty() &&
+               stop_ns - device.back().timestamp_ns <
+                   2*1000000000ull/set_hz + 20000000ull;
+    printf("i2c-%u %#04x %8zu %8.1f %8.1f %8u %9llu %6llu\n",
+           manager.Info(i).bus_n, manager.Info(i).addr, device.size(),
+           set_hz, rate_hz, magnetom_new,
+           (unsigned long long)manager.Overruns(i),
+           (unsigned long long)manager.Errors(i));
+  }
+  printf("\nmagnetometers read through the internal I2C master, %llu "
+         "NACKs: %s\n", (unsigned long long)nacks,
+         magnetom_ok ? "yes" : "FAILED");
+  printf("every device at its own rate, no overruns or errors: %s\n",
+         rates_ok ? "yes" : "FAILED");
+  printf("timestamps of both buses within the run on one clock: %s\n",
+         clock_ok ? "yes" : "FAILED");
+  return found_ok && magnetom_ok && rates_ok && clock_ok;
+}
+
+// Times appending n_samples records, then checks the clean and the crash
+// recovery paths of the reader. Returns false if any check fails.
+bool RunRecord(const char* path, uint n_samples) {
+  typedef Mpu9250Config<GyroFs::k2000, AccelFs::k16g, MagBits::k16> Config;
+  const uint kSyncInterval = 1000;
+  // Some part's fuse ROM and hard-iron offsets
+  const RecordMagnetom kMagnetom = {{140, 117, 171}, 0, {12.5f, -30.0f, 4.0f}};
+  printf("===== Raw sample recorder =====\n");
+  printf("%u records of %zu bytes to %s\n\n", n_samples,
+         sizeof(RecordedSample), path);
+
+  // Start small so the file has to grow a few times on the way
+  std::vector<uint64_t> append_ns;
+  append_ns.reserve(n_samples);
+  Mpu9250Sample sample;
+  uint64_t total_start = MonotonicRawNs();
+  {
+    Recorder recorder(path, MakeRecordScale<Config>(), kMagnetom,
+                      n_samples/4 + 1, kDefaultSyncInterval);
+    if (recorder.Error() < 0) {
+      printf("Could not create %s: %s\n", path, strerror(-recorder.Error()));
+      return false;
+    }
+    for (uint i = 0; i < n_samples; i++) {
+      RecordBenchSample(i, &sample);
+      uint64_t start = MonotonicRawNs();
+      recorder.Append(sample);
+      append_ns.push_back(MonotonicRawNs() - start);
+    }
+    recorder.Close();
+  }
+  uint64_t total_ns = MonotonicRawNs() - total_start;
+  std::sort(append_ns.begin(), append_ns.end());
+  printf("append p50 %.0f ns, p99 %.0f ns, max %.1f us\n",
+         Percentile(append_ns, 0.5), Percentile(append_ns, 0.99),
+         append_ns.back()/1e3);
+  printf("%.2f M records/s including close, %.0f times the 8 kHz gyro rate\n",
+         n_samples*1e3/total_ns, n_samples*1e9/total_ns/8000.0);
+
+  uint64_t recovered;
+  bool ok = VerifyRecording(path, true, &recovered) == (int64_t)n_samples;
+  printf("closed log: %s\n", ok ? "all records read back" : "FAILED");
+
+  // The magnetometer calibration comes back with the log. A version 2 log,
+  // this one with its header turned back into one, reads as uncalibrated.
+  RecordReader reader;
+  bool calibration_ok = reader.Open(path) &&
+      memcmp(&reader.Magnetom(), &kMagnetom, sizeof(kMagnetom)) == 0;
+  reader.Close();
+  RecordHeader header;
+  int file = open(path, O_RDWR);
+  bool old_ok = file >= 0 &&
+                pread(file, &header, sizeof(header), 0) == sizeof(header);
+  if (old_ok) {
+    header.version = 2;
+    memset(&header.magnetom, 0, sizeof(header.magnetom));
+    header.checksum = Fnv1a(&header, offsetof(RecordHeader, checksum));
+    old_ok = pwrite(file, &header, sizeof(header), 0) == sizeof(header);
+  }
+  if (file >= 0) {
+    close(file);
+  }
+  old_ok = old_ok && reader.Open(path) &&
+           reader.Count() == n_samples &&
+           memcmp(&reader.Magnetom(), &kUncalibratedMagnetom,
+                  sizeof(kUncalibratedMagnetom)) == 0;
+  reader.Close();
+  printf("magnetometer calibration: %s\n",
+         calibration_ok ? "read back" : "FAILED");
+  printf("version 2 log: %s\n",
+         old_ok ? "read with unit ASA and no offsets" : "FAILED");
+  ok = ok && calibration_ok && old_ok;
+
+  // A process that dies without closing leaves everything it appended in
+  // the page cache, the records past the last sync point included
+  uint n_crash = kSyncInterval*5 + kSyncInterval/2;
+  pid_t pid = fork();
+  if (pid == 0) {
+    Recorder recorder(path, MakeRecordScale<Config>(), kMagnetom, n_samples,
+                      kSyncInterval);
+    for (uint i = 0; i < n_crash; i++) {
+      RecordBenchSample(i, &sample);
+      recorder.Append(sample);
+    }
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  bool crash_ok = VerifyRecording(path, false, &recovered) == n_crash &&
+                  recovered == kSyncInterval/2;
+  printf("crashed process: %s, %llu records past the last sync point\n",
+         crash_ok ? "all records recovered" : "FAILED",
+         (unsigned long long)recovered);
+  ok = ok && crash_ok;
+
+  // Tear the last record, as a power cut in the middle of writing it would
+  file = open(path, O_WRONLY);
+  uint8_t garbage = 0xA5;
+  off_t torn = sizeof(RecordHeader) + (n_crash - 1)*sizeof(RecordedSample) +
+               offsetof(RecordedSample, gyro_count);
+  bool torn_ok = file >= 0 && pwrite(file, &garbage, 1, torn) == 1;
+  if (file >= 0) {
+    close(file);
+  }
+  torn_ok = torn_ok &&
+            VerifyRecording(path, false, &recovered) == n_crash - 1;
+  printf("torn last record: %s\n", torn_ok ? "cut off" : "FAILED");
+  ok = ok && torn_ok;
+
+  // After a power cut the header may say more records were synced than made
+  // it to disk, a record lost below the last sync point ends the log there
+  uint n_lost = kSyncInterval*2 + 10;
+  file = open(path, O_WRONLY);
+  RecordedSample zero;
+  memset(&zero, 0, sizeof(zero));
+  bool lost_ok = file >= 0 &&
+      pwrite(file, &zero, sizeof(zero), sizeof(RecordHeader) +
+             n_lost*sizeof(RecordedSample)) == sizeof(zero);
+  if (file >= 0) {
+    close(file);
+  }
+  lost_ok = lost_ok && VerifyRecording(path, false, &recovered) == n_lost;
+  printf("record lost below the last sync point: %s\n",
+         lost_ok ? "cut off there" : "FAILED");
+  ok = ok && lost_ok;
+
+  // A disk that fills up stops the recording with an error, the process
+  // carries on and the log keeps what was appended before
+  uint n_room = kSyncInterval;
+  pid = fork();
+  if (pid == 0) {
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit limit;
+    limit.rlim_cur = limit.rlim_max =
+        sizeof(RecordHeader) + n_room*sizeof(RecordedSample);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    Recorder recorder(path, MakeRecordScale<Config>(), kMagnetom, n_room,
+                      kSyncInterval);
+    int error = recorder.Error();
+    uint i = 0;
+    for (; i < 2*n_room && error == 0; i++) {
+      RecordBenchSample(i, &sample);
+      error = recorder.Append(sample);
+    }
+    recorder.Close();
+    _exit(error == -EFBIG && i == n_room + 1 ? 0 : 1);
+  }
+  waitpid(pid, &status, 0);
+  bool full_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                 VerifyRecording(path, false, &recovered) == n_room;
+  printf("disk full: %s\n", full_ok ? "append fails, log kept" : "FAILED");
+  ok = ok && full_ok;
+
+  unlink(path);
+  return ok;
+}
+
+// Polls imu at its sample rate until check decides on a window
+BiasCheck::Status CheckWindow(Mpu9250* imu, BiasCheck* check) {
+  BiasCheck::Status status = BiasCheck::kCollecting;
+  while (status == BiasCheck::kCollecting) {
+    if (imu->ReadSensorsBatched() == 0 && (imu->int_status & 0x01)) {
+      Mpu9250Sample sample;
+      imu->CopySample(&sample);
+      status = check->Add(sample);
+    }
+  }
+  return status;
+}
+
+// Boots a simulated device with a known gyro bias through a calibration
+// and saves it to the store at path, then boots it again from the store.
+// Checks the offsets come back, that BiasCheck confirms them, catches a
+// drift and corrects it, and ignores motion, and that another part,
+// entries too old or too far in temperature, and corrupt or cut off files
+// are all rejected.
+bool RunCalibrationStore(const char* path, uint32_t clock_hz,
+                         uint32_t overhead_ns) {
+  const float kGyroBias[3] = {1.5f, -2.25f, 0.75f};
+  const float kDrift[3] = {0.4f, 0.0f, -0.3f};
+  const uint32_t kBusN = 1;
+  printf("===== Calibration store =====\n");
+  printf("%s, %u Hz bus, gyro bias %.2f %.2f %.2f dps\n\n", path, clock_hz,
+         kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+  unlink(path);
+
+  // First boot, nothing stored yet. The entry is stored at both addresses,
+  // the second copy is the one corrupted below.
+  SimBus cold_bus;
+  cold_bus.SetTiming(clock_hz, overhead_ns);
+  cold_bus.SetRotationRate(0.0f);
+  cold_bus.SetGyroBias(kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+  Mpu9250 cold(&cold_bus);
+  CalibrationStore store(path);
+  CalibrationEntry entry;
+  CalibrationResult result;
+  int error = cold.Reset();
+  if (error == 0) {
+    error = cold.InitMpu9250();
+  }
+  if (error == 0) {
+    error = cold.InitAk8963(Mpu9250::kMagnetom100Hz);
+  }
+  uint64_t start = MonotonicRawNs();
+  if (error == 0) {
+    error = store.Load();
+  }
+  if (error == 0) {
+    error = cold.Calibrate(kDefaultCalibration, &result);
+  }
+  if (error == 0) {
+    error = MakeCalibrationEntry(&cold, kBusN, result, false, &entry);
+  }
+  if (error == 0) {
+    store.Put(entry);
+    CalibrationEntry other = entry;
+    other.addr = kMpu6500AddrAd0;
+    store.Put(other);
+    error = store.Save();
+  }
+  uint64_t cold_ns = MonotonicRawNs() - start;
+  uint64_t cold_fuse_rom_ns = cold.startup.fuse_rom_ns;
+  if (error < 0) {
+    printf("first boot failed: %s\n", strerror(-error));
+    return false;
+  }
+
+  // Second boot of the same part, the offsets come from the store
+  SimBus bus;
+  bus.SetTiming(clock_hz, overhead_ns);
+  bus.SetRotationRate(0.0f);
+  bus.SetGyroBias(kGyroBias[0], kGyroBias[1], kGyroBias[2]);
+  Mpu9250 imu(&bus);
+  CalibrationStore warm_store(path);
+  const CalibrationEntry* found = nullptr;
+  bool usable = false;
+  error = imu.Reset();
+  if (error == 0) {
+    error = imu.InitMpu9250();
+  }
+  start = MonotonicRawNs();
+  uint8_t fingerprint[kFingerprintLen];
+  if (error == 0) {
+    error = warm_store.Load();
+  }
+  if (error == 0) {
+    error = imu.ReadFingerprint(fingerprint);
+  }
+  if (error == 0) {
+    found = warm_store.Find(kBusN, imu.Address(), fingerprint);
+    usable = found != nullptr &&
+             CalibrationUsable(*found, imu.ReadTempData()/333.87f + 21.0f,
+                               WallClockS(), kDefaultCalibrationPolicy);
+  }
+  if (usable) {
+    error = ApplyCalibration(&imu, *found);
+  }
+  uint64_t warm_ns = MonotonicRawNs() - start;
+  if (error == 0 && found != nullptr) {
+    error = imu.InitAk8963(Mpu9250::kMagnetom100Hz, found->asa);
+  }
+  if (error < 0 || !usable) {
+    printf("second boot failed: %s\n",
+           error < 0 ? strerror(-error) : "entry not found or not usable");
+    return false;
+  }
+  bool asa_ok = true;
+  for (int i = 0; i < 3; i++) {
+    asa_ok = asa_ok && imu.MagnetomAsa(i) == cold.MagnetomAsa(i);
+  }
+  printf("%-22s %12s %14s\n", "boot", "offsets ms", "fuse ROM ms");
+  printf("%-22s %12.2f %14.2f\n", "calibrate and save", cold_ns/1e6,
+         cold_fuse_rom_ns/1e6);
+  printf("%-22s %12.2f %14.2f\n", "load and apply", warm_ns/1e6,
+         imu.startup.fuse_rom_ns/1e6);
+
+  // Background revalidation at 1 kHz on the samples the demo would stream
+  imu.SetSampleRateDivider(0);
+  imu.GetGyroRes();
+  imu.GetAccelRes();
+  BiasCheck check(imu.gyro_res, imu.accel_res);
+  CalibrationEntry live = *found;
+  bool holds = CheckWindow(&imu, &check) == BiasCheck::kValid;
+  printf("\ncached offsets hold: %s, % 0.3f % 0.3f % 0.3f dps left\n",
+         holds ? "yes" : "FAILED", check.Residual(0), check.Residual(1),
+         check.Residual(2));
+
+  bus.SetGyroBias(kGyroBias[0] + kDrift[0], kGyroBias[1] + kDrift[1],
+                  kGyroBias[2] + kDrift[2]);
+  bool stale = CheckWindow(&imu, &check) == BiasCheck::kStale;
+  for (int i = 0; i < 3; i++) {
+    stale = stale && fabs(check.Residual(i) - kDrift[i]) < 0.05;
+  }
+  printf("drift of %.2f %.2f %.2f dps found: %s, % 0.3f % 0.3f % 0.3f dps\n",
+         kDrift[0], kDrift[1], kDrift[2], stale ? "yes" : "FAILED",
+         check.Residual(0), check.Residual(1), check.Residual(2));
+  check.Correct(live.gyro_offset);
+  bool corrected = imu.SetGyroOffsets(live.gyro_offset) == 0 &&
+                   CheckWindow(&imu, &check) == BiasCheck::kValid;
+  printf("correction holds: %s, % 0.3f % 0.3f % 0.3f dps left\n",
+         corrected ? "yes" : "FAILED", check.Residual(0), check.Residual(1),
+         check.Residual(2));
+
+  bus.SetRotationRate(30.0f);
+  bool moving = CheckWindow(&imu, &check) == BiasCheck::kMoving;
+  printf("turning at 30 dps taken for motion: %s\n", moving ? "yes" : "FAILED");
+
+  // Another part at the same address
+  SimBus other_bus;
+  const uint8_t kOtherSelfTest[6] = {0xC1, 0xD4, 0xDA, 0xA8, 0x97, 0xBC};
+  other_bus.SetSelfTestCodes(kOtherSelfTest);
+  Mpu9250 other(&other_bus);
+  bool other_ok = other.ReadFingerprint(fingerprint) == 0 &&
+                  warm_store.Find(kBusN, other.Address(), fingerprint) ==
+                      nullptr;
+  printf("another part not mistaken for it: %s\n",
+         other_ok ? "yes" : "FAILED");
+
+  const uint64_t kDayS = 24*3600;
+  uint64_t now_s = found->calibrated_s;
+  float temperature = found->temperature;
+  const CalibrationPolicy& policy = kDefaultCalibrationPolicy;
+  bool policy_ok = CalibrationUsable(*found, temperature + 5.0f,
+                                     now_s + 29*kDayS, policy) &&
+                   !CalibrationUsable(*found, temperature + 15.0f, now_s,
+                                      policy) &&
+                   !CalibrationUsable(*found, temperature - 15.0f, now_s,
+                                      policy) &&
+                   !CalibrationUsable(*found, temperature, now_s + 31*kDayS,
+                                      policy) &&
+                   !CalibrationUsable(*found, temperature, now_s - kDayS,
+                                      policy);
+  printf("entries too old, too far in temperature or from the future"
+         " rejected: %s\n", policy_ok ? "yes" : "FAILED");
+
+  // Flip a byte of the second entry, then cut it in half, then spoil the
+  // header
+  bool files_ok = false;
+  int file = open(path, O_RDWR);
+  if (file >= 0) {
+    off_t second = sizeof(CalibrationFileHeader) + sizeof(CalibrationEntry);
+    uint8_t byte;
+    bool flipped = pread(file, &byte, 1, second + 20) == 1;
+    byte ^= 0x40;
+    flipped = flipped && pwrite(file, &byte, 1, second + 20) == 1;
+    CalibrationStore check_store(path);
+    files_ok = flipped && check_store.Load() == 0 &&
+               check_store.NumEntries() == 1 && check_store.Dropped() == 1;
+    files_ok = files_ok && ftruncate(file, second + 32) == 0 &&
+               check_store.Load() == 0 && check_store.NumEntries() == 1 &&
+               check_store.Dropped() == 1;
+    byte = 'X';
+    files_ok = files_ok && pwrite(file, &byte, 1, 0) == 1 &&
+               check_store.Load() == -EINVAL &&
+               check_store.NumEntries() == 0;
+    close(file);
+  }
+  printf("corrupt and cut off entries dropped, foreign files refused: %s\n",
+         files_ok ? "yes" : "FAILED");
+  unlink(path);
+  return asa_ok && holds && stale && corrected && moving && other_ok &&
+         policy_ok && files_ok;
+}
+
+void PrintUsage(const char* name) {
+  printf("Usage: %s [-c clock_hz] [-o overhead_ns] [-n samples] "
+         "[-p poll_us] [-d] [-f imus [-l log]] [-r file] [-i] [-e] [-b] [-u] "
+         "[-k file] [-w] [-g] [-a] [-m]\n", name);
+  printf("  -c  bus clock, default runs 100000 and 400000\n");
+  printf("  -o  fixed cost of one transaction, default 25000 ns\n");
+  printf("  -n  samples per strategy, default 1000\n");
+  printf("  -p  sleep between data ready polls, default 200 us\n");
+  printf("  -d  verify and time the batch decoder kernels instead\n");
+  printf("  -f  verify and time the orientation filter banks instead\n");
+  printf("  -l  with -f, also compare the precisions on a recorder log\n");
+  printf("  -r  time and verify the raw sample recorder on file instead\n");
+  printf("  -i  show, verify and time the bus instrumentation instead\n");
+  printf("  -e  inject bus faults and verify the retry policy instead\n");
+  printf("  -b  verify and time the gyro and accel calibration instead\n");
+  printf("  -u  time every start-up phase over 20 runs instead\n");
+  printf("  -k  verify the calibration store on file and time booting from\n");
+  printf("      it instead\n");
+  printf("  -w  verify wake-on-motion and the CPU a blocked host uses\n");
+  printf("      instead\n");
+  printf("  -g  verify data ready on the INT pin wakes one read per sample\n");
+  printf("      instead\n");
+  printf("  -a  verify the sample ring and the acquisition thread instead\n");
+  printf("  -m  verify the device manager on two buses instead\n");
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<uint32_t> clocks;
+  uint32_t overhead_ns = 25000;
+  uint n_samples = 1000;
+  uint poll_us = 200;
+  bool decode = false;
+  size_t fusion_imus = 0;
+  const char* log_path = nullptr;
+  const char* record_path = nullptr;
+  bool instrumentation = false;
+  bool faults = false;
+  bool calibration = false;
+  bool startup = false;
+  const char* store_path = nullptr;
+  bool wake = false;
+  bool interrupt = false;
+  bool ring = false;
+  bool managed = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:o:n:p:df:l:r:iebuk:wgamh")) != -1) {
+    switch (opt) {
+      case 'c':
+        clocks.push_back(atoi(optarg));
+        break;
+      case 'o':
+        overhead_ns = atoi(optarg);
+        break;
+      case 'n':
+        n_samples = atoi(optarg);
+        break;
+      case 'p':
+        poll_us = atoi(optarg);
+        break;
+      case 'd':
+        decode = true;
+        break;
+      case 'f':
+        fusion_imus = atoi(optarg);
+        break;
+      case 'l':
+        log_path = optarg;
+        break;
+      case 'r':
+        record_path = optarg;
+        break;
+      case 'i':
+        instrumentation = true;
+        break;
+      case 'e':
+        faults = true;
+        break;
+      case 'b':
+        calibration = true;
+        break;
+      case 'u':
+        startup = true;
+        break;
+      case 'k':
+        store_path = optarg;
+        break;
+      case 'w':
+        wake = true;
+        break;
+      case 'g':
+        interrupt = true;
+        break;
+      case 'a':
+        ring = true;
+        break;
+      case 'm':
+        managed = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if (decode) {
+    // Decoding is cheap, time a few million samples by default
+    return RunDecode(n_samples < 1000000 ? 4000000 : n_samples) ? 0 : 1;
+  }
+  if (fusion_imus > 0) {
+    return RunFusion(fusion_imus, n_samples < 1000000 ? 2000000 : n_samples,
+                     log_path) ? 0 : 1;
+  }
+  if (record_path != nullptr) {
+    return RunRecord(record_path, n_samples < 1000000 ? 4000000 : n_samples)
+        ? 0 : 1;
+  }
+  if (instrumentation) {
+    return RunInstrumentation(clocks.empty() ? 400000 : clocks[0],
+                              overhead_ns, n_samples) ? 0 : 1;
+  }
+  if (faults) {
+    return RunFaults(clocks.empty() ? 400000 : clocks[0], overhead_ns,
+                     n_samples) ? 0 : 1;
+  }
+  if (calibration) {
+    return RunCalibration(clocks.empty() ? 400000 : clocks[0], overhead_ns)
+        ? 0 : 1;
+  }
+  if (startup) {
+    return RunStartup(clocks.empty() ? 400000 : clocks[0], overhead_ns, 20)
+        ? 0 : 1;
+  }
+  if (store_path != nullptr) {
+    return RunCalibrationStore(store_path,
+                               clocks.empty() ? 400000 : clocks[0],
+                               overhead_ns) ? 0 : 1;
+  }
+  if (wake) {
+    return RunWakeOnMotion(clocks.empty() ? 400000 : clocks[0], overhead_ns)
+        ? 0 : 1;
+  }
+  if (interrupt) {
+    return RunInterrupt(clocks.empty() ? 400000 : clocks[0], overhead_ns)
+        ? 0 : 1;
+  }
+  if (ring) {
+    return RunRing(clocks.empty() ? 400000 : clocks[0], overhead_ns,
+                   n_samples < 1000000 ? 10000000 : n_samples) ? 0 : 1;
+  }
+  if (managed) {
+    return RunManager(clocks.empty() ? 400000 : clocks[0], overhead_ns)
+        ? 0 : 1;
+  }
+  if (clocks.empty()) {
+    clocks.push_back(100000);
+    clocks.push_back(400000);
+  }
+
+  printf("===== MPU 9250 driver benchmark (simulated bus) =====\n");
+  for (size_t c = 0; c < clocks.size(); c++) {
+    printf("\nBus clock %u Hz, %u ns per transaction, sensor at 1 kHz\n",
+           clocks[c], overhead_ns);
+    printf("%-11s %7s %9s %9s %8s %8s %8s %10s %5s %5s\n", "strategy",
+           "samples", "syscalls", "xfers", "p50 us", "p99 us", "max us",
+           "bus Hz", "ovfl", "mskip");
+    for (int s = 0; s < kNumStrategies; s++) {
+      RunStrategy((Strategy)s, clocks[c], overhead_ns, n_samples, poll_us);
+    }
+  }
+
+  return 0;
+}
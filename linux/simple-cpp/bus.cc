@@ -0,0 +1,146 @@
+#include "bus.h"
+
+#include <errno.h>  // Needed for the E* error numbers
+
+
+// I2C transaction constructor
+I2cTransaction::I2cTransaction() {
+  Clear();
+}
+
+void I2cTransaction::Clear() {
+  n_msgs_ = 0;
+  write_used_ = 0;
+}
+
+bool I2cTransaction::WriteToMem(uint16_t addr, uint8_t mem_addr,
+                                uint8_t data) {
+  return WriteToMemFrom(addr, mem_addr, 1, &data);
+}
+
+bool I2cTransaction::WriteToMemFrom(uint16_t addr, uint8_t mem_addr,
+                                    uint n_bytes, const uint8_t* buff_ptr) {
+  // Queue a single write message holding the memory address followed by the
+  // data bytes. The payload is copied so buff_ptr may be reused right away.
+  if (n_msgs_ + 1 > kMaxMsgs || write_used_ + 1 + n_bytes > kMaxWriteBytes) {
+    return false;
+  }
+
+  uint8_t* w_buff = &write_buff_[write_used_];
+  w_buff[0] = mem_addr;
+  for (uint i = 1; i <= n_bytes; i++) {
+    w_buff[i] = buff_ptr[i-1];
+  }
+  write_used_ += 1 + n_bytes;
+
+  msgs_[n_msgs_].addr = addr;
+  msgs_[n_msgs_].flags = 0;  // Write
+  msgs_[n_msgs_].len = 1 + n_bytes;
+  msgs_[n_msgs_].buf = w_buff;
+  n_msgs_++;
+
+  return true;
+}
+
+bool I2cTransaction::ReadFromMem(uint16_t addr, uint8_t mem_addr,
+                                 uint8_t* data_ptr) {
+  return ReadFromMemInto(addr, mem_addr, 1, data_ptr);
+}
+
+bool I2cTransaction::ReadFromMemInto(uint16_t addr, uint8_t mem_addr,
+                                     uint n_bytes, uint8_t* buff_ptr) {
+  // Queue a write of the memory address followed by a read of n_bytes into
+  // buff_ptr, the same pair of messages I2cBus::ReadFromMemInto sends.
+  if (n_msgs_ + 2 > kMaxMsgs || write_used_ + 1 > kMaxWriteBytes) {
+    return false;
+  }
+
+  uint8_t* w_buff = &write_buff_[write_used_];
+  w_buff[0] = mem_addr;
+  write_used_ += 1;
+
+  msgs_[n_msgs_].addr = addr;
+  msgs_[n_msgs_].flags = 0;  // Write
+  msgs_[n_msgs_].len = 1;
+  msgs_[n_msgs_].buf = w_buff;
+  n_msgs_++;
+
+  msgs_[n_msgs_].addr = addr;
+  msgs_[n_msgs_].flags = I2C_M_RD;
+  msgs_[n_msgs_].len = n_bytes;
+  msgs_[n_msgs_].buf = buff_ptr;
+  n_msgs_++;
+
+  return true;
+}
+
+bool Bus::IsTransient(int error) {
+  // Programming errors and unsupported requests fail the same way every time
+  switch (-error) {
+    case EINVAL:
+    case EFAULT:
+    case EMSGSIZE:
+    case ENOTTY:
+    case EOPNOTSUPP:
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool Bus::NeedsRecovery(int error) {
+  // A NACK (ENXIO, EREMOTEIO) or lost arbitration (EAGAIN) is the slave or
+  // the wire, the adapter itself is fine
+  switch (-error) {
+    case ETIMEDOUT:
+    case EBADF:
+    case ENODEV:
+    case ESHUTDOWN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int Bus::WriteToMem(uint16_t addr, uint8_t mem_addr, uint8_t data) {
+  return Retry_(BusStats::kWriteToMem, [&]() {
+    return WriteMem_(BusStats::kWriteToMem, addr, mem_addr, 1, &data);
+  });
+}
+
+int Bus::WriteToMemFrom(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                        uint8_t* buff_ptr) {
+  return Retry_(BusStats::kWriteToMemFrom, [&]() {
+    return WriteMem_(BusStats::kWriteToMemFrom, addr, mem_addr, n_bytes,
+                     buff_ptr);
+  });
+}
+
+int Bus::ReadFromMem(uint16_t addr, uint8_t mem_addr, uint8_t* data_ptr) {
+  return Retry_(BusStats::kReadFromMem, [&]() {
+    return ReadMem_(BusStats::kReadFromMem, addr, mem_addr, 1, data_ptr);
+  });
+}
+
+int Bus::ReadFromMemInto(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                         uint8_t* buff_ptr) {
+  return Retry_(BusStats::kReadFromMemInto, [&]() {
+    return ReadMem_(BusStats::kReadFromMemInto, addr, mem_addr, n_bytes,
+                    buff_ptr);
+  });
+}
+
+int Bus::ReadFromMemIntoOnce(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                             uint8_t* buff_ptr) {
+  return ReadMem_(BusStats::kReadFromMemInto, addr, mem_addr, n_bytes,
+                  buff_ptr);
+}
+
+int Bus::Transfer(I2cTransaction* transaction) {
+  if (transaction->NumMsgs() == 0) {
+    return 0;
+  }
+  return Retry_(BusStats::kTransfer, [&]() {
+    return Transfer_(transaction, BusStats::kTransfer);
+  });
+}
@@ -0,0 +1,164 @@
+// Interface shared by every bus backend the Mpu9250 driver can talk through:
+// the i2c-dev adapter in i2c.h and the simulated device in sim_bus.h. The
+// register access methods follow the memory operations of I2cBus. Every
+// backend records its traffic in the BusStats of bus_stats.h.
+//
+// Failures are reported, never fatal: every operation returns 0 or a
+// negative errno after transient errors have been retried under the
+// RetryPolicy of the bus, so a caller can drop one bad sample and go on.
+
+#ifndef BUS_H_
+#define BUS_H_
+
+#include <cstdint>  // Needed for uint8_t
+#include <sys/types.h>  // Needed for uint
+#include <linux/i2c-dev.h>  // Needed for I2C_RDWR_IOCTL_MAX_MSGS
+#include <linux/i2c.h>  // Needed for i2c_msg and I2C_M_RD (I2C_RDWR)
+#include <unistd.h>  // Needed for usleep
+#include "bus_stats.h"
+#include "timing.h"
+
+
+// A queue of register reads and writes, possibly to different slaves, that is
+// handed to the kernel as a single I2C_RDWR ioctl. Messages are joined by
+// repeated starts and read results are scattered straight into the caller
+// buffers, which must stay valid until the transaction has been transferred.
+// Storage is fixed so building a transaction never allocates.
+class I2cTransaction {
+  public:
+    // A register read takes two messages (address write, data read)
+    static const uint kMaxMsgs = I2C_RDWR_IOCTL_MAX_MSGS;
+    static const uint kMaxWriteBytes = 128;
+
+    I2cTransaction();
+
+    // Empty the queue so the transaction can be reused
+    void Clear();
+    uint NumMsgs() const { return n_msgs_; }
+    // Messages in the format of the I2C_RDWR ioctl
+    struct i2c_msg* Msgs() { return msgs_; }
+
+    // The following methods queue an operation and return false if the
+    // transaction has no room left for it.
+    bool WriteToMem(uint16_t addr, uint8_t mem_addr, uint8_t data);
+    bool WriteToMemFrom(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                        const uint8_t* buff_ptr);
+    bool ReadFromMem(uint16_t addr, uint8_t mem_addr, uint8_t* data_ptr);
+    bool ReadFromMemInto(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                         uint8_t* buff_ptr);
+
+  private:
+    struct i2c_msg msgs_[kMaxMsgs];
+    uint n_msgs_;
+    // Register addresses and write payloads point into this buffer
+    uint8_t write_buff_[kMaxWriteBytes];
+    uint write_used_;
+};  // class I2cTransaction
+
+// How a failed bus operation is retried. Transient failures, such as a NACK
+// caused by noise or a lost arbitration, are tried again after a short sleep
+// that doubles every time. No attempt is started once the operation has
+// taken budget_us, so a hot loop never stalls for longer than that.
+struct RetryPolicy {
+  uint max_attempts;  // Attempts per operation, the first one included
+  uint backoff_us;    // Sleep before the first retry
+  uint budget_us;     // Time after which no further attempt is started
+};
+
+// Three attempts, retried after 100 and 200 us, well within one 5 ms sample
+const RetryPolicy kDefaultRetryPolicy = {3, 100, 1000};
+
+class Bus {
+  protected:
+    // Longest read the adapter handles in one message. Many controllers hold
+    // the transfer length in an 8-bit register, so stay below 256 by default.
+    uint max_transfer_ = 255;
+    // Written by the thread using the bus, see bus_stats.h
+    BusStats bus_stats_;
+    RetryPolicy retry_ = kDefaultRetryPolicy;
+    uint last_attempts_ = 0;
+
+    // Single attempts of the operations below, implemented by every backend.
+    // They return 0 on success or a negative errno and record the attempt as
+    // op in bus_stats_.
+    virtual int WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                          uint n_bytes, const uint8_t* buff_ptr) = 0;
+    virtual int ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                         uint n_bytes, uint8_t* buff_ptr) = 0;
+    virtual int Transfer_(I2cTransaction* transaction, BusStats::Op op) = 0;
+    // Bring the bus back after a failure that points at the adapter rather
+    // than the slave, e.g. by reopening it. Returns 0 or a negative errno.
+    virtual int Recover_() { return 0; }
+
+    template <typename Attempt>
+    int Retry_(BusStats::Op op, Attempt attempt);
+
+  public:
+    virtual ~Bus() {}
+
+    // Limit bulk reads to what the adapter supports, see max_transfer_
+    void SetMaxTransfer(uint n_bytes) { max_transfer_ = n_bytes; }
+    uint MaxTransfer() const { return max_transfer_; }
+
+    // max_attempts 1 turns retrying off
+    void SetRetryPolicy(const RetryPolicy& policy) { retry_ = policy; }
+    const RetryPolicy& GetRetryPolicy() const { return retry_; }
+    // Whether an operation that failed with error may succeed when retried
+    static bool IsTransient(int error);
+    // Whether error means the adapter, not the slave, needs attention
+    static bool NeedsRecovery(int error);
+    // Attempts the last retried operation took. A failed attempt may have
+    // reached the device, so more than one means registers cleared on read
+    // may have been cleared by an attempt whose data was lost.
+    uint LastAttempts() const { return last_attempts_; }
+
+    // Per address, per register and per operation counters, readable from
+    // any thread. Reset only from the thread using the bus.
+    const BusStats& Instrumentation() const { return bus_stats_; }
+    void ResetInstrumentation() { bus_stats_.Reset(); }
+
+    // The register operations return 0 on success or the negative errno of
+    // the last attempt, as the kernel does, once the retry policy gives up.
+    int WriteToMem(uint16_t addr, uint8_t mem_addr, uint8_t data);
+    int WriteToMemFrom(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                       uint8_t* buff_ptr);
+    int ReadFromMem(uint16_t addr, uint8_t mem_addr, uint8_t* data_ptr);
+    int ReadFromMemInto(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                        uint8_t* buff_ptr);
+    // Perform every operation queued in transaction as one combined transfer
+    int Transfer(I2cTransaction* transaction);
+    // ReadFromMemInto without retries, for registers whose reads have side
+    // effects, e.g. FIFO_R_W, where a retry would silently skip data
+    int ReadFromMemIntoOnce(uint16_t addr, uint8_t mem_addr, uint n_bytes,
+                            uint8_t* buff_ptr);
+};  // class Bus
+
+template <typename Attempt>
+int Bus::Retry_(BusStats::Op op, Attempt attempt) {
+  uint64_t start_ns = MonotonicRawNs();
+  int error = attempt();
+  last_attempts_ = 1;
+  uint backoff_us = retry_.backoff_us;
+  for (uint i = 1; i < retry_.max_attempts && error < 0; i++) {
+    if (!IsTransient(error)) {
+      break;
+    }
+    if (NeedsRecovery(error)) {
+      bus_stats_.RecordRecovery(Recover_() == 0);
+    }
+    uint64_t elapsed_us = (MonotonicRawNs() - start_ns)/1000;
+    if (elapsed_us + backoff_us > retry_.budget_us) {
+      break;
+    }
+    if (backoff_us > 0) {
+      usleep(backoff_us);
+    }
+    backoff_us *= 2;
+    bus_stats_.RecordRetry(op);
+    error = attempt();
+    last_attempts_++;
+  }
+  return error;
+}
+
+#endif // BUS_H_
@@ -0,0 +1,177 @@
+#include "bus_stats.h"
+
+#include <algorithm>  // Needed for std::sort
+
+
+// Slots looked at before a register is given up on as untracked
+static const uint kMaxProbes = 16;
+
+static const char* const kOpNames[BusStats::kNumOps] = {
+  "ReadFromMem", "ReadFromMemInto", "WriteToMem", "WriteToMemFrom", "Transfer"
+};
+
+static bool RegisterBefore(const BusStats::Snapshot::Register& a,
+                           const BusStats::Snapshot::Register& b) {
+  return a.addr != b.addr ? a.addr < b.addr : a.reg < b.reg;
+}
+
+// Bus statistics constructor
+BusStats::BusStats() {
+  Reset();
+}
+
+const char* BusStats::OpName(Op op) {
+  return kOpNames[op];
+}
+
+void BusStats::Reset() {
+  for (uint i = 0; i < kNumAddrs; i++) {
+    addrs_[i].counters.transactions.store(0, std::memory_order_relaxed);
+    addrs_[i].counters.bytes.store(0, std::memory_order_relaxed);
+    addrs_[i].counters.errors.store(0, std::memory_order_relaxed);
+  }
+  for (uint i = 0; i < kRegisterSlots; i++) {
+    registers_[i].key.store(0, std::memory_order_relaxed);
+    registers_[i].counters.transactions.store(0, std::memory_order_relaxed);
+    registers_[i].counters.bytes.store(0, std::memory_order_relaxed);
+    registers_[i].counters.errors.store(0, std::memory_order_relaxed);
+  }
+  untracked_.store(0, std::memory_order_relaxed);
+  recoveries_.store(0, std::memory_order_relaxed);
+  failed_recoveries_.store(0, std::memory_order_relaxed);
+  for (uint i = 0; i < kNumOps; i++) {
+    op_counters_[i].errors.store(0, std::memory_order_relaxed);
+    op_counters_[i].retries.store(0, std::memory_order_relaxed);
+    latency_ns_[i].Reset();
+  }
+}
+
+void BusStats::Count_(Counters* counters, uint n_bytes, bool ok) {
+  Add_(&counters->transactions, 1);
+  Add_(&counters->bytes, n_bytes);
+  if (!ok) {
+    Add_(&counters->errors, 1);
+  }
+}
+
+BusStats::Counters* BusStats::Register_(uint16_t addr, uint8_t reg) {
+  // Multiplicative hash, the top bits pick the first slot to probe
+  uint32_t key = RegisterKey_(addr, reg);
+  uint first = (key*2654435761u) >> (32 - 8);
+  for (uint i = 0; i < kMaxProbes; i++) {
+    RegisterSlot* slot = &registers_[(first + i) % kRegisterSlots];
+    uint32_t slot_key = slot->key.load(std::memory_order_relaxed);
+    if (slot_key == key) {
+      return &slot->counters;
+    }
+    if (slot_key == 0) {
+      // The counters of a free slot are zero, readers see them from now on
+      slot->key.store(key, std::memory_order_release);
+      return &slot->counters;
+    }
+  }
+  return nullptr;
+}
+
+void BusStats::Access_(uint16_t addr, uint8_t reg, uint n_bytes, bool ok) {
+  Count_(&addrs_[addr % kNumAddrs].counters, n_bytes, ok);
+  Counters* counters = Register_(addr, reg);
+  if (counters != nullptr) {
+    Count_(counters, n_bytes, ok);
+  } else {
+    Add_(&untracked_, 1);
+  }
+}
+
+void BusStats::Record(Op op, uint16_t addr, uint8_t reg, uint n_bytes,
+                      bool ok, uint64_t latency_ns) {
+  Access_(addr, reg, n_bytes, ok);
+  if (!ok) {
+    Add_(&op_counters_[op].errors, 1);
+  }
+  latency_ns_[op].Record(latency_ns);
+}
+
+void BusStats::RecordMsgs(Op op, const struct i2c_msg* msgs, uint n_msgs,
+                          bool ok, uint64_t latency_ns) {
+  uint i = 0;
+  while (i < n_msgs) {
+    const struct i2c_msg* msg = &msgs[i];
+    if (msg->flags & I2C_M_RD) {
+      // A read without a register address continues where the last one
+      // left off, count it against register 0
+      Access_(msg->addr, 0, msg->len, ok);
+      i++;
+    } else if (i + 1 < n_msgs && (msgs[i+1].flags & I2C_M_RD) &&
+               msgs[i+1].addr == msg->addr && msg->len == 1) {
+      Access_(msg->addr, msg->buf[0], msgs[i+1].len, ok);
+      i += 2;
+    } else {
+      Access_(msg->addr, msg->len > 0 ? msg->buf[0] : 0,
+              msg->len > 0 ? msg->len - 1 : 0, ok);
+      i++;
+    }
+  }
+  if (!ok) {
+    Add_(&op_counters_[op].errors, 1);
+  }
+  latency_ns_[op].Record(latency_ns);
+}
+
+void BusStats::RecordRecovery(bool ok) {
+  Add_(&recoveries_, 1);
+  if (!ok) {
+    Add_(&failed_recoveries_, 1);
+  }
+}
+
+void BusStats::TakeSnapshot(Snapshot* snapshot) const {
+  for (uint i = 0; i < kNumOps; i++) {
+    const Histogram& latency = latency_ns_[i];
+    Snapshot::OpSummary* summary = &snapshot->ops[i];
+    summary->calls = latency.Count();
+    summary->errors = op_counters_[i].errors.load(std::memory_order_relaxed);
+    summary->retries = op_counters_[i].retries.load(std::memory_order_relaxed);
+    summary->p50_ns = latency.Percentile(0.50);
+    summary->p99_ns = latency.Percentile(0.99);
+    summary->max_ns = latency.Max();
+    summary->mean_ns = latency.Mean();
+  }
+
+  snapshot->addresses.clear();
+  for (uint i = 0; i < kNumAddrs; i++) {
+    const Counters& counters = addrs_[i].counters;
+    Snapshot::Address address;
+    address.addr = i;
+    address.counts.transactions =
+        counters.transactions.load(std::memory_order_relaxed);
+    address.counts.bytes = counters.bytes.load(std::memory_order_relaxed);
+    address.counts.errors = counters.errors.load(std::memory_order_relaxed);
+    if (address.counts.transactions > 0) {
+      snapshot->addresses.push_back(address);
+    }
+  }
+
+  snapshot->registers.clear();
+  for (uint i = 0; i < kRegisterSlots; i++) {
+    uint32_t key = registers_[i].key.load(std::memory_order_acquire);
+    if (key == 0) {
+      continue;
+    }
+    const Counters& counters = registers_[i].counters;
+    Snapshot::Register reg;
+    reg.addr = (key - 1) >> 8;
+    reg.reg = (key - 1) & 0xff;
+    reg.counts.transactions =
+        counters.transactions.load(std::memory_order_relaxed);
+    reg.counts.bytes = counters.bytes.load(std::memory_order_relaxed);
+    reg.counts.errors = counters.errors.load(std::memory_order_relaxed);
+    snapshot->registers.push_back(reg);
+  }
+  std::sort(snapshot->registers.begin(), snapshot->registers.end(),
+            RegisterBefore);
+  snapshot->untracked = untracked_.load(std::memory_order_relaxed);
+  snapshot->recoveries = recoveries_.load(std::memory_order_relaxed);
+  snapshot->failed_recoveries =
+      failed_recoveries_.load(std::memory_order_relaxed);
+}
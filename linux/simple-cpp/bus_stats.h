@@ -0,0 +1,152 @@
+// Always-on instrumentation of a Bus: transactions, bytes and errors per slave
+// address and per register, and a latency histogram per operation type.
+//
+// Latency is the time spent in the syscall (or the simulated transfer), so
+// comparing it with the read latency the driver sees in SampleTiming tells
+// the bus and the kernel driver apart from our own code.
+//
+// Every counter is a relaxed atomic written by the thread that owns the bus
+// with a plain load and store, which costs no more than an ordinary
+// increment. Any other thread may TakeSnapshot() at any time, the counters
+// in it may be a transaction apart from each other. Each counter group sits
+// on a cache line of its own so readers never slow down the bus thread.
+
+#ifndef BUS_STATS_H_
+#define BUS_STATS_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <cstdint>  // Needed for uint64_t
+#include <sys/types.h>  // Needed for uint
+#include <vector>  // Needed for std::vector
+#include <linux/i2c.h>  // Needed for i2c_msg and I2C_M_RD
+#include "spsc_ring.h"  // Needed for kCacheLineSize
+#include "timing.h"
+
+
+class BusStats {
+  public:
+    // Bus operations, one latency histogram each
+    enum Op {
+      kReadFromMem = 0,
+      kReadFromMemInto,
+      kWriteToMem,
+      kWriteToMemFrom,
+      kTransfer,
+      kNumOps
+    };
+
+    // 7-bit slave addresses
+    static const uint kNumAddrs = 128;
+    // (address, register) pairs tracked, enough for two MPU-9250s and their
+    // AK8963s many times over
+    static const uint kRegisterSlots = 256;
+
+    struct Counts {
+      uint64_t transactions;
+      uint64_t bytes;   // Data bytes, register address excluded
+      uint64_t errors;  // Transactions that failed or were part of a failed
+                        // combined transfer
+    };
+
+    // Copy of the counters at one point in time
+    struct Snapshot {
+      struct Address {
+        uint16_t addr;
+        Counts counts;
+      };
+      struct Register {
+        uint16_t addr;
+        uint8_t reg;
+        Counts counts;
+      };
+      struct OpSummary {
+        uint64_t calls;    // Attempts, retries included
+        uint64_t errors;   // Failed attempts
+        uint64_t retries;
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+        uint64_t max_ns;
+        double mean_ns;
+      };
+
+      OpSummary ops[kNumOps];
+      std::vector<Address> addresses;   // Only the ones used, in order
+      std::vector<Register> registers;  // By address, then register
+      // Register accesses not in registers because the table was full
+      uint64_t untracked;
+      // Times the adapter was recovered after a failure, and how many of
+      // those recoveries failed themselves
+      uint64_t recoveries;
+      uint64_t failed_recoveries;
+    };
+
+  private:
+    struct Counters {
+      std::atomic<uint64_t> transactions;
+      std::atomic<uint64_t> bytes;
+      std::atomic<uint64_t> errors;
+    };
+    struct AddrSlot {
+      Counters counters;
+      char pad[kCacheLineSize - sizeof(Counters)];
+    };
+    // Open addressing, a slot is claimed by the first access to its register
+    // and never given back until Reset()
+    struct RegisterSlot {
+      std::atomic<uint32_t> key;  // 0 if free, else RegisterKey_()
+      uint32_t reserved;
+      Counters counters;
+      char pad[kCacheLineSize - 2*sizeof(uint32_t) - sizeof(Counters)];
+    };
+    struct OpCounters {
+      std::atomic<uint64_t> errors;
+      std::atomic<uint64_t> retries;
+      char pad[kCacheLineSize - 2*sizeof(std::atomic<uint64_t>)];
+    };
+
+    AddrSlot addrs_[kNumAddrs];
+    RegisterSlot registers_[kRegisterSlots];
+    std::atomic<uint64_t> untracked_;
+    std::atomic<uint64_t> recoveries_;
+    std::atomic<uint64_t> failed_recoveries_;
+    char pad_[kCacheLineSize];
+    OpCounters op_counters_[kNumOps];
+    Histogram latency_ns_[kNumOps];
+
+    static uint32_t RegisterKey_(uint16_t addr, uint8_t reg) {
+      return (((uint32_t)addr << 8) | reg) + 1;
+    }
+    static void Add_(std::atomic<uint64_t>* counter, uint64_t n) {
+      counter->store(counter->load(std::memory_order_relaxed) + n,
+                     std::memory_order_relaxed);
+    }
+    static void Count_(Counters* counters, uint n_bytes, bool ok);
+    Counters* Register_(uint16_t addr, uint8_t reg);
+    void Access_(uint16_t addr, uint8_t reg, uint n_bytes, bool ok);
+
+  public:
+    BusStats();
+
+    static const char* OpName(Op op);
+
+    // Writer side, only from the thread using the bus.
+    // A register access of n_bytes data bytes that took latency_ns.
+    void Record(Op op, uint16_t addr, uint8_t reg, uint n_bytes, bool ok,
+                uint64_t latency_ns);
+    // A combined transfer: every register address write followed by a read
+    // from the same slave counts as one register read, any other write as a
+    // register write.
+    void RecordMsgs(Op op, const struct i2c_msg* msgs, uint n_msgs, bool ok,
+                    uint64_t latency_ns);
+    // Another attempt of op after a failure, see RetryPolicy in bus.h
+    void RecordRetry(Op op) { Add_(&op_counters_[op].retries, 1); }
+    // A recovery of the adapter, which succeeded if ok
+    void RecordRecovery(bool ok);
+    void Reset();
+
+    // Reader side, from any thread
+    const Histogram& LatencyNs(Op op) const { return latency_ns_[op]; }
+    void TakeSnapshot(Snapshot* snapshot) const;
+};  // class BusStats
+
+#endif // BUS_STATS_H_
@@ -0,0 +1,294 @@
+#include "calibration_store.h"
+
+#include <errno.h>  // Needed for errno, EINVAL
+#include <fcntl.h>  // Needed for open
+#include <math.h>  // Needed for fabsf, sqrt, lround
+#include <stddef.h>  // Needed for offsetof
+#include <stdio.h>  // Needed for rename
+#include <string.h>  // Needed for memcpy, memcmp, memset
+#include <time.h>  // Needed for clock_gettime
+#include <unistd.h>  // Needed for read, write, fsync, close
+#include <sys/stat.h>  // Needed for fstat
+#include "checksum.h"
+
+
+// XG_OFFSET is added to the output at the 1000 dps scale whatever
+// GYRO_CONFIG says
+static const float kGyroOffsetLsbPerDps = 32.8f;
+
+static uint32_t HeaderChecksum(const CalibrationFileHeader& header) {
+  return Fnv1a(&header, offsetof(CalibrationFileHeader, checksum));
+}
+
+static uint32_t EntryChecksum(const CalibrationEntry& entry) {
+  return Fnv1a(&entry, offsetof(CalibrationEntry, checksum));
+}
+
+// Read or write all of n_bytes, 0 or a negative errno
+static int ReadAll(int file, void* data, size_t n_bytes) {
+  uint8_t* bytes = (uint8_t*)data;
+  while (n_bytes > 0) {
+    ssize_t n = read(file, bytes, n_bytes);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return n < 0 ? -errno : -EINVAL;
+    }
+    bytes += n;
+    n_bytes -= n;
+  }
+  return 0;
+}
+
+static int WriteAll(int file, const void* data, size_t n_bytes) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (n_bytes > 0) {
+    ssize_t n = write(file, bytes, n_bytes);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      return -errno;
+    }
+    bytes += n;
+    n_bytes -= n;
+  }
+  return 0;
+}
+
+uint64_t WallClockS() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec;
+}
+
+bool CalibrationUsable(const CalibrationEntry& entry, float temperature,
+                       uint64_t now_s, const CalibrationPolicy& policy) {
+  // A clock set back since makes the entry look younger than it is, it is
+  // not trusted either
+  if (now_s < entry.calibrated_s ||
+      now_s - entry.calibrated_s > policy.max_age_s) {
+    return false;
+  }
+  return fabsf(temperature - entry.temperature) <=
+         policy.max_temperature_delta;
+}
+
+int MakeCalibrationEntry(Mpu9250* imu, uint32_t bus_n,
+                         const CalibrationResult& result, bool accel,
+                         CalibrationEntry* entry) {
+  // Zero the reserved fields too, the checksum covers them
+  memset(entry, 0, sizeof(*entry));
+  int error = imu->ReadFingerprint(entry->fingerprint);
+  if (error < 0) {
+    return error;
+  }
+  entry->bus_n = bus_n;
+  entry->addr = imu->Address();
+  entry->has_accel = accel;
+  for (int i = 0; i < 3; i++) {
+    entry->gyro_offset[i] = result.gyro_offset[i];
+    entry->accel_offset[i] = result.accel_offset[i];
+    entry->asa[i] = imu->MagnetomAsa(i);
+    entry->magnetom_bias[i] = imu->MagnetomBias(i);
+  }
+  entry->temperature = result.temperature;
+  entry->calibrated_s = WallClockS();
+  return 0;
+}
+
+int ApplyCalibration(Mpu9250* imu, const CalibrationEntry& entry) {
+  int error = imu->SetGyroOffsets(entry.gyro_offset);
+  if (error == 0 && entry.has_accel) {
+    error = imu->SetAccelOffsets(entry.accel_offset);
+  }
+  if (error == 0) {
+    imu->SetMagnetomBias(entry.magnetom_bias);
+  }
+  return error;
+}
+
+// Calibration store constructor
+CalibrationStore::CalibrationStore(const char* path) : path_(path) {}
+
+int CalibrationStore::Load() {
+  entries_.clear();
+  dropped_ = 0;
+  int file = open(path_.c_str(), O_RDONLY);
+  if (file < 0) {
+    // Nothing calibrated on this host yet
+    return errno == ENOENT ? 0 : -errno;
+  }
+
+  CalibrationFileHeader header;
+  int error = ReadAll(file, &header, sizeof(header));
+  if (error == 0 &&
+      (memcmp(header.magic, kCalibrationMagic, sizeof(header.magic)) != 0 ||
+       header.checksum != HeaderChecksum(header) ||
+       header.version != kCalibrationVersion ||
+       header.entry_size != sizeof(CalibrationEntry))) {
+    error = -EINVAL;
+  }
+  if (error == 0) {
+    // A file cut short keeps the entries before the cut
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0) {
+      error = -errno;
+    } else {
+      uint64_t room = file_stat.st_size - sizeof(header);
+      uint count = header.count;
+      if (count > room/sizeof(CalibrationEntry)) {
+        count = room/sizeof(CalibrationEntry);
+      }
+      std::vector<CalibrationEntry> entries(count);
+      error = ReadAll(file, entries.data(), count*sizeof(CalibrationEntry));
+      for (uint i = 0; i < count && error == 0; i++) {
+        if (entries[i].checksum == EntryChecksum(entries[i])) {
+          entries_.push_back(entries[i]);
+        }
+      }
+      dropped_ = header.count - entries_.size();
+    }
+  }
+  close(file);
+  if (error < 0) {
+    entries_.clear();
+  }
+  return error;
+}
+
+int CalibrationStore::Save() const {
+  // Write next to the old file and rename it over the old one once it is
+  // on disk, so readers see one store or the other
+  std::string tmp_path = path_ + ".tmp";
+  int file = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) {
+    return -errno;
+  }
+
+  CalibrationFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kCalibrationMagic, sizeof(header.magic));
+  header.version = kCalibrationVersion;
+  header.entry_size = sizeof(CalibrationEntry);
+  header.count = entries_.size();
+  header.checksum = HeaderChecksum(header);
+  int error = WriteAll(file, &header, sizeof(header));
+  if (error == 0) {
+    error = WriteAll(file, entries_.data(),
+                     entries_.size()*sizeof(CalibrationEntry));
+  }
+  if (error == 0 && fsync(file) != 0) {
+    error = -errno;
+  }
+  close(file);
+  if (error == 0 && rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    error = -errno;
+  }
+  if (error < 0) {
+    unlink(tmp_path.c_str());
+  }
+  return error;
+}
+
+const CalibrationEntry* CalibrationStore::Find(
+    uint32_t bus_n, uint8_t addr, const uint8_t* fingerprint) const {
+  for (const CalibrationEntry& entry : entries_) {
+    if (entry.bus_n == bus_n && entry.addr == addr) {
+      return memcmp(entry.fingerprint, fingerprint, kFingerprintLen) == 0
+          ? &entry : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+void CalibrationStore::Put(const CalibrationEntry& entry) {
+  CalibrationEntry stored = entry;
+  stored.checksum = EntryChecksum(stored);
+  for (CalibrationEntry& old : entries_) {
+    if (old.bus_n == entry.bus_n && old.addr == entry.addr) {
+      old = stored;
+      return;
+    }
+  }
+  entries_.push_back(stored);
+}
+
+// Bias check constructor
+BiasCheck::BiasCheck(float gyro_res, float accel_res, uint window,
+                     float tolerance_dps)
+    : gyro_res_(gyro_res), accel_res_(accel_res), window_(window),
+      tolerance_dps_(tolerance_dps) {
+  Restart_();
+}
+
+void BiasCheck::Restart_() {
+  n_ = 0;
+  for (int i = 0; i < 3; i++) {
+    gyro_sum_[i] = 0.0;
+    gyro_squares_[i] = 0.0;
+    accel_sum_[i] = 0.0;
+    accel_squares_[i] = 0.0;
+  }
+  temp_sum_ = 0.0;
+}
+
+BiasCheck::Status BiasCheck::Add(const Mpu9250Sample& sample) {
+  // Sums of the raw counts and of their squares, the spread of a window
+  // follows from them without keeping its samples
+  for (int i = 0; i < 3; i++) {
+    double gyro = sample.gyro_count[i];
+    double accel = sample.accel_count[i];
+    gyro_sum_[i] += gyro;
+    gyro_squares_[i] += gyro*gyro;
+    accel_sum_[i] += accel;
+    accel_squares_[i] += accel*accel;
+  }
+  temp_sum_ += sample.temp_count;
+  if (++n_ < window_) {
+    return kCollecting;
+  }
+
+  bool still = true;
+  float mean_dps[3];
+  for (int i = 0; i < 3; i++) {
+    double gyro_mean = gyro_sum_[i]/n_;
+    double accel_mean = accel_sum_[i]/n_;
+    double gyro_variance = gyro_squares_[i]/n_ - gyro_mean*gyro_mean;
+    double accel_variance = accel_squares_[i]/n_ - accel_mean*accel_mean;
+    mean_dps[i] = gyro_mean*gyro_res_;
+    if (sqrt(gyro_variance > 0.0 ? gyro_variance : 0.0)*gyro_res_ >
+            kStillGyroDps ||
+        sqrt(accel_variance > 0.0 ? accel_variance : 0.0)*accel_res_ >
+            kStillAccelG ||
+        fabsf(mean_dps[i]) > kMaxResidualDps) {
+      still = false;
+    }
+  }
+  float temp_count = temp_sum_/n_;
+  Restart_();
+  if (!still) {
+    return kMoving;
+  }
+
+  Status status = kValid;
+  for (int i = 0; i < 3; i++) {
+    residual_[i] = mean_dps[i];
+    if (fabsf(mean_dps[i]) > tolerance_dps_) {
+      status = kStale;
+    }
+  }
+  temperature_ = temp_count/333.87f + 21.0f;
+  return status;
+}
+
+void BiasCheck::Correct(int16_t* gyro_offset) const {
+  for (int i = 0; i < 3; i++) {
+    long offset = gyro_offset[i] - lround(residual_[i]*kGyroOffsetLsbPerDps);
+    if (offset > INT16_MAX) {
+      offset = INT16_MAX;
+    } else if (offset < INT16_MIN) {
+      offset = INT16_MIN;
+    }
+    gyro_offset[i] = offset;
+  }
+}
@@ -0,0 +1,185 @@
+// On-disk store of the calibration of every MPU-9250 a host has seen, so a
+// unit calibrated once boots straight into its offsets instead of having to
+// sit still through another calibration window.
+//
+// An entry is keyed by the bus and address the device sits at and by its
+// fingerprint, see Mpu9250::ReadFingerprint, so another part plugged in at
+// the same place is not mistaken for the old one. It holds the offset
+// registers Calibrate left, the AK8963 fuse ROM values and hard-iron
+// offsets, and the temperature and wall clock time of the calibration. The
+// gyro bias drifts with temperature and over time, an entry too far from
+// either is not used, see CalibrationPolicy.
+//
+// Once cached offsets are in use, BiasCheck looks at the samples streamed
+// while the device happens to lie still. A still window whose mean rate is
+// within tolerance vouches for the entry again, one outside of it gives the
+// correction to the offsets. Both happen on the consumer side, acquisition
+// never stops for them.
+//
+// The file is a CalibrationFileHeader followed by the entries, each with its
+// own checksum, in host byte order. Save() writes a temporary file and
+// renames it over the old one, so a crash leaves either store but never half
+// of one.
+//
+//   CalibrationStore store("/var/lib/mpu9250/calibration");
+//   store.Load();
+//   const CalibrationEntry* entry = store.Find(1, kMpu6500Addr, fingerprint);
+
+#ifndef CALIBRATION_STORE_H_
+#define CALIBRATION_STORE_H_
+
+#include <stdint.h>  // Needed for uint8_t
+#include <string>  // Needed for std::string
+#include <vector>  // Needed for std::vector
+#include "mpu9250.h"
+
+const char kCalibrationMagic[8] = {'M', 'P', 'U', '9', '2', '5', '0', 'C'};
+const uint32_t kCalibrationVersion = 1;
+
+struct CalibrationFileHeader {
+  char magic[8];          // kCalibrationMagic
+  uint32_t version;       // kCalibrationVersion
+  uint32_t entry_size;    // Bytes per entry
+  uint32_t count;         // Entries following the header
+  uint32_t checksum;      // Of every field above
+  char reserved[8];
+};
+
+struct CalibrationEntry {
+  uint32_t bus_n;           // Adapter number, /dev/i2c-<bus_n>
+  uint8_t addr;             // kMpu6500Addr or kMpu6500AddrAd0
+  uint8_t has_accel;        // accel_offset was calibrated, else the factory
+                            // trim is left alone
+  uint8_t reserved[2];
+  uint8_t fingerprint[kFingerprintLen];
+  int16_t gyro_offset[3];   // XG/YG/ZG_OFFSET
+  int16_t accel_offset[3];  // XA/YA/ZA_OFFSET
+  uint8_t asa[3];           // AK8963 fuse ROM, see Mpu9250::MagnetomAsa
+  uint8_t reserved2;
+  float magnetom_bias[3];   // Hard-iron offsets in mG
+  float temperature;        // Celsius when calibrated or last revalidated
+  uint64_t calibrated_s;    // CLOCK_REALTIME seconds of the same moment
+  uint32_t checksum;        // Of every field above
+  uint32_t reserved3;
+};
+
+static_assert(sizeof(CalibrationFileHeader) == 32,
+              "CalibrationFileHeader must be 32 bytes");
+static_assert(sizeof(CalibrationEntry) == 64,
+              "CalibrationEntry must be 64 bytes");
+
+// How far from its calibration an entry may be and still be used
+struct CalibrationPolicy {
+  float max_temperature_delta;  // Celsius
+  uint64_t max_age_s;
+};
+
+// The MPU-9250 gyro zero-rate output moves by up to 30 dps over its whole
+// -40 to 85 C range, 10 C either way keeps the change to what BiasCheck
+// corrects on the typical part. A month old entry is calibrated afresh.
+const CalibrationPolicy kDefaultCalibrationPolicy = {10.0f, 30*24*3600};
+
+// Seconds on CLOCK_REALTIME, the clock of calibrated_s
+uint64_t WallClockS();
+
+// Whether entry may be used at temperature and now_s
+bool CalibrationUsable(const CalibrationEntry& entry, float temperature,
+                       uint64_t now_s, const CalibrationPolicy& policy);
+// Entry of the device imu on bus bus_n, whose fingerprint is read, from
+// what its latest Calibrate left. accel tells whether that one corrected
+// the accelerometer too. The AK8963 fuse ROM values and hard-iron offsets
+// are taken from imu, InitAk8963 has to have run.
+int MakeCalibrationEntry(Mpu9250* imu, uint32_t bus_n,
+                         const CalibrationResult& result, bool accel,
+                         CalibrationEntry* entry);
+// Push the offsets and hard-iron offsets of entry to imu. The fuse ROM
+// values are for InitAk8963.
+int ApplyCalibration(Mpu9250* imu, const CalibrationEntry& entry);
+
+class CalibrationStore {
+  private:
+    std::string path_;
+    std::vector<CalibrationEntry> entries_;
+    uint dropped_ = 0;
+
+  public:
+    explicit CalibrationStore(const char* path);
+
+    // Read the store from its file. A missing file is an empty store and
+    // entries failing their checksum are dropped. Returns 0, -EINVAL if the
+    // file is not a store this version reads, or the negative errno of the
+    // read. The store is empty after an error and Save() starts it over.
+    int Load();
+    // Replace the file with the entries, 0 or a negative errno
+    int Save() const;
+
+    // The entry at bus_n and addr, nullptr if there is none or it belongs
+    // to a part with another fingerprint
+    const CalibrationEntry* Find(uint32_t bus_n, uint8_t addr,
+                                 const uint8_t* fingerprint) const;
+    // Add entry, replacing whichever was at its bus and address
+    void Put(const CalibrationEntry& entry);
+
+    uint NumEntries() const { return entries_.size(); }
+    // Entries the last Load() dropped because they were corrupt or cut off
+    uint Dropped() const { return dropped_; }
+};  // class CalibrationStore
+
+// Decides from samples of a device at rest whether its gyro offsets still
+// cancel the bias. Samples are taken in windows of window samples, at any
+// rate. A window in which the rates or the acceleration spread more than
+// noise does, or whose mean rate is larger than a bias could have drifted,
+// was taken in motion and is thrown away. A turn slower than that at a
+// steady rate about the vertical cannot be told from a bias.
+class BiasCheck {
+  public:
+    // Largest standard deviation of a still window, a few times the noise
+    // of a typical part with the 41 Hz filters of InitMpu9250
+    static constexpr float kStillGyroDps = 0.3f;
+    static constexpr float kStillAccelG = 0.02f;
+    // Largest residual taken for drift, more is a steady turn
+    static constexpr float kMaxResidualDps = 2.0f;
+
+    enum Status {
+      kCollecting = 0,  // The window is not full yet
+      kMoving,          // The window was not still, a new one is started
+      kValid,           // Still, every axis within tolerance
+      kStale            // Still, Residual() is the bias left over
+    };
+
+  private:
+    float gyro_res_;
+    float accel_res_;
+    uint window_;
+    float tolerance_dps_;
+    uint n_ = 0;
+    double gyro_sum_[3];
+    double gyro_squares_[3];
+    double accel_sum_[3];
+    double accel_squares_[3];
+    double temp_sum_;
+    float residual_[3] = {0.0f, 0.0f, 0.0f};
+    float temperature_ = 0.0f;
+
+    void Restart_();
+
+  public:
+    // gyro_res and accel_res turn the counts of the samples fed into dps
+    // and g. 200 samples average the noise of a typical part down to about
+    // 0.01 dps.
+    BiasCheck(float gyro_res, float accel_res, uint window = 200,
+              float tolerance_dps = 0.1f);
+
+    // Add a sample, returns what the window it completed showed, or
+    // kCollecting
+    Status Add(const Mpu9250Sample& sample);
+
+    // Mean rate of the latest still window in dps, and its temperature
+    float Residual(int axis) const { return residual_[axis]; }
+    float Temperature() const { return temperature_; }
+    // Take the residual out of gyro_offset, the XG/YG/ZG_OFFSET values
+    // the window was taken with
+    void Correct(int16_t* gyro_offset) const;
+};  // class BiasCheck
+
+#endif // CALIBRATION_STORE_H_
@@ -0,0 +1,10 @@
+#include "checksum.h"
+
+
+uint32_t Fnv1a(const void* data, size_t n_bytes, uint32_t hash) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < n_bytes; i++) {
+    hash = (hash ^ bytes[i])*16777619u;
+  }
+  return hash;
+}
@@ -0,0 +1,17 @@
+// Checksum of the records the recorder and the calibration store write to
+// disk, telling torn or never written ones from valid ones.
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <cstddef>  // Needed for size_t
+#include <stdint.h>  // Needed for uint32_t
+
+const uint32_t kFnv1aBasis = 2166136261u;
+
+// 32-bit FNV-1a hash of n_bytes at data, cheap enough to run on every record.
+// Pass the hash of what came before as hash to cover pieces that are not
+// next to each other.
+uint32_t Fnv1a(const void* data, size_t n_bytes, uint32_t hash = kFnv1aBasis);
+
+#endif // CHECKSUM_H_
@@ -0,0 +1,576 @@
+// Batch decoder kernels. Every vector kernel loads four packets as rows of
+// eight 16-bit words, transposes them so each register holds one channel of
+// four consecutive packets, sign extends, converts to float and scales. It
+// returns how many packets it decoded and the scalar kernel does the rest, so
+// loads never read past the end of the buffer. The accumulation kernels load
+// the same rows but pair them up instead of transposing, see SumImuSse2_.
+
+#include "decode.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>  // Needed for the SSE2 intrinsics
+#define DECODE_HAVE_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>  // Needed for the AVX2 intrinsics
+// Built regardless of the compiler flags and only used when the CPU has it
+#define DECODE_HAVE_AVX2
+#define DECODE_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>  // Needed for the NEON intrinsics
+#define DECODE_HAVE_NEON
+#endif
+
+const char* const kDecodeKernelNames[] = {"scalar", "sse2", "avx2", "neon"};
+
+// The accumulation kernels sum into int32 lanes and move them to the int64
+// sums after at most this many packets, 32768 counts of at most 32768 each
+// stay well clear of overflow
+static const size_t kSumBlock = 32768;
+
+// Add lanes 0-3 of low to accel x/y/z and temperature and lanes 0-2 of high
+// to gyro x/y/z, the last one of high holds whatever followed the packet
+static inline void AddLanes_(const int32_t* low, const int32_t* high,
+                             ImuSums* sums) {
+  for (int axis = 0; axis < 3; axis++) {
+    sums->accel[axis] += low[axis];
+    sums->gyro[axis] += high[axis];
+  }
+  sums->temp += low[3];
+}
+
+// Scalar kernels, the reference for the vector ones ---------------------------
+
+static void ImuScalar_(const uint8_t* packets, size_t begin, size_t n,
+                       size_t stride, const DecodeScale& scale,
+                       const ImuBlock& out) {
+  for (size_t i = begin; i < n; i++) {
+    const uint8_t* p = &packets[i*stride];
+    // Turn the MSB and LSB into a signed 16-bit value
+    for (int axis = 0; axis < 3; axis++) {
+      int16_t accel = ((int16_t)p[2*axis] << 8) | p[2*axis + 1];
+      int16_t gyro = ((int16_t)p[8 + 2*axis] << 8) | p[9 + 2*axis];
+      out.accel[axis][i] = (float)accel*scale.accel;
+      out.gyro[axis][i] = (float)gyro*scale.gyro;
+    }
+    int16_t temp = ((int16_t)p[6] << 8) | p[7];
+    out.temp[i] = (float)temp*scale.temp_scale + scale.temp_offset;
+  }
+}
+
+static void SumImuScalar_(const uint8_t* packets, size_t begin, size_t n,
+                          size_t stride, ImuSums* sums) {
+  for (size_t i = begin; i < n; i++) {
+    const uint8_t* p = &packets[i*stride];
+    for (int axis = 0; axis < 3; axis++) {
+      int16_t accel = ((int16_t)p[2*axis] << 8) | p[2*axis + 1];
+      int16_t gyro = ((int16_t)p[8 + 2*axis] << 8) | p[9 + 2*axis];
+      sums->accel[axis] += accel;
+      sums->gyro[axis] += gyro;
+    }
+    int16_t temp = ((int16_t)p[6] << 8) | p[7];
+    sums->temp += temp;
+  }
+}
+
+static void MagnetomScalar_(const uint8_t* packets, size_t begin, size_t n,
+                            size_t stride, const DecodeScale& scale,
+                            const MagnetomBlock& out) {
+  for (size_t i = begin; i < n; i++) {
+    const uint8_t* p = &packets[i*stride];
+    // Data stored as little Endian
+    for (int axis = 0; axis < 3; axis++) {
+      int16_t magnetom = ((int16_t)p[2*axis + 1] << 8) | p[2*axis];
+      out.magnetom[axis][i] = (float)magnetom*scale.magnetom;
+    }
+  }
+}
+
+// SSE2 -----------------------------------------------------------------------
+
+#ifdef DECODE_HAVE_SSE2
+// Sign extend the low or high four words and convert them to float
+static inline __m128 LowToFloatSse2_(__m128i words) {
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16));
+}
+
+static inline __m128 HighToFloatSse2_(__m128i words) {
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16));
+}
+
+// Load 16 bytes and swap the bytes of every big endian word
+static inline __m128i LoadBigEndianSse2_(const uint8_t* p) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static size_t ImuSse2_(const uint8_t* packets, size_t begin, size_t n,
+                       size_t stride, const DecodeScale& scale,
+                       const ImuBlock& out) {
+  const __m128 accel = _mm_set1_ps(scale.accel);
+  const __m128 gyro = _mm_set1_ps(scale.gyro);
+  const __m128 temp_scale = _mm_set1_ps(scale.temp_scale);
+  const __m128 temp_offset = _mm_set1_ps(scale.temp_offset);
+
+  size_t i = begin;
+  // Rows load 16 bytes, two past the 14 byte packet, and the buffer may end
+  // right after the last packet's data
+  for (; (i + 4)*stride + 2 <= n*stride; i += 4) {
+    const uint8_t* p = &packets[i*stride];
+    __m128i r0 = LoadBigEndianSse2_(p);
+    __m128i r1 = LoadBigEndianSse2_(p + stride);
+    __m128i r2 = LoadBigEndianSse2_(p + 2*stride);
+    __m128i r3 = LoadBigEndianSse2_(p + 3*stride);
+
+    // Transpose, afterwards every register holds two channels of 4 packets
+    __m128i t0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi16(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi16(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi16(r2, r3);
+    __m128i ax_ay = _mm_unpacklo_epi32(t0, t1);
+    __m128i az_t = _mm_unpackhi_epi32(t0, t1);
+    __m128i gx_gy = _mm_unpacklo_epi32(t2, t3);
+    __m128i gz = _mm_unpackhi_epi32(t2, t3);
+
+    _mm_storeu_ps(&out.accel[0][i], _mm_mul_ps(LowToFloatSse2_(ax_ay), accel));
+    _mm_storeu_ps(&out.accel[1][i], _mm_mul_ps(HighToFloatSse2_(ax_ay), accel));
+    _mm_storeu_ps(&out.accel[2][i], _mm_mul_ps(LowToFloatSse2_(az_t), accel));
+    _mm_storeu_ps(&out.temp[i],
+                  _mm_add_ps(_mm_mul_ps(HighToFloatSse2_(az_t), temp_scale),
+                             temp_offset));
+    _mm_storeu_ps(&out.gyro[0][i], _mm_mul_ps(LowToFloatSse2_(gx_gy), gyro));
+    _mm_storeu_ps(&out.gyro[1][i], _mm_mul_ps(HighToFloatSse2_(gx_gy), gyro));
+    _mm_storeu_ps(&out.gyro[2][i], _mm_mul_ps(LowToFloatSse2_(gz), gyro));
+  }
+  return i;
+}
+
+static size_t SumImuSse2_(const uint8_t* packets, size_t begin, size_t n,
+                          size_t stride, ImuSums* sums) {
+  // Interleaving the words of two packets puts the two counts of a channel
+  // next to each other, PMADDWD with ones adds them into one int32 lane
+  const __m128i ones = _mm_set1_epi16(1);
+
+  size_t i = begin;
+  while ((i + 2)*stride + 2 <= n*stride) {
+    __m128i low = _mm_setzero_si128();
+    __m128i high = _mm_setzero_si128();
+    size_t block_end = i + kSumBlock;
+    for (; (i + 2)*stride + 2 <= n*stride && i < block_end; i += 2) {
+      const uint8_t* p = &packets[i*stride];
+      __m128i r0 = LoadBigEndianSse2_(p);
+      __m128i r1 = LoadBigEndianSse2_(p + stride);
+      low = _mm_add_epi32(low,
+                          _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), ones));
+      high = _mm_add_epi32(high,
+                           _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), ones));
+    }
+    int32_t lanes[8];
+    _mm_storeu_si128((__m128i*)&lanes[0], low);
+    _mm_storeu_si128((__m128i*)&lanes[4], high);
+    AddLanes_(&lanes[0], &lanes[4], sums);
+  }
+  return i;
+}
+
+static size_t MagnetomSse2_(const uint8_t* packets, size_t begin, size_t n,
+                            size_t stride, const DecodeScale& scale,
+                            const MagnetomBlock& out) {
+  const __m128 magnetom = _mm_set1_ps(scale.magnetom);
+
+  size_t i = begin;
+  // Rows load 8 bytes, two past the 6 byte packet
+  for (; (i + 4)*stride + 2 <= n*stride; i += 4) {
+    const uint8_t* p = &packets[i*stride];
+    __m128i r0 = _mm_loadl_epi64((const __m128i*)p);
+    __m128i r1 = _mm_loadl_epi64((const __m128i*)(p + stride));
+    __m128i r2 = _mm_loadl_epi64((const __m128i*)(p + 2*stride));
+    __m128i r3 = _mm_loadl_epi64((const __m128i*)(p + 3*stride));
+
+    __m128i t0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi16(r2, r3);
+    __m128i mx_my = _mm_unpacklo_epi32(t0, t1);
+    __m128i mz = _mm_unpackhi_epi32(t0, t1);
+
+    _mm_storeu_ps(&out.magnetom[0][i],
+                  _mm_mul_ps(LowToFloatSse2_(mx_my), magnetom));
+    _mm_storeu_ps(&out.magnetom[1][i],
+                  _mm_mul_ps(HighToFloatSse2_(mx_my), magnetom));
+    _mm_storeu_ps(&out.magnetom[2][i],
+                  _mm_mul_ps(LowToFloatSse2_(mz), magnetom));
+  }
+  return i;
+}
+#endif  // DECODE_HAVE_SSE2
+
+// AVX2 -----------------------------------------------------------------------
+
+#ifdef DECODE_HAVE_AVX2
+// Same as the SSE2 kernel with packets i..i+3 in the low and i+4..i+7 in the
+// high 128-bit lane. AVX2 unpacks work within each lane, so channel data ends
+// up in packet order.
+DECODE_AVX2 static inline __m256 LowToFloatAvx2_(__m256i words) {
+  return _mm256_cvtepi32_ps(
+      _mm256_srai_epi32(_mm256_unpacklo_epi16(words, words), 16));
+}
+
+DECODE_AVX2 static inline __m256 HighToFloatAvx2_(__m256i words) {
+  return _mm256_cvtepi32_ps(
+      _mm256_srai_epi32(_mm256_unpackhi_epi16(words, words), 16));
+}
+
+DECODE_AVX2 static inline __m256i LoadBigEndianAvx2_(const uint8_t* low,
+                                                     const uint8_t* high) {
+  __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)low)),
+      _mm_loadu_si128((const __m128i*)high), 1);
+  return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+DECODE_AVX2 static size_t ImuAvx2_(const uint8_t* packets, size_t begin,
+                                   size_t n, size_t stride,
+                                   const DecodeScale& scale,
+                                   const ImuBlock& out) {
+  const __m256 accel = _mm256_set1_ps(scale.accel);
+  const __m256 gyro = _mm256_set1_ps(scale.gyro);
+  const __m256 temp_scale = _mm256_set1_ps(scale.temp_scale);
+  const __m256 temp_offset = _mm256_set1_ps(scale.temp_offset);
+
+  size_t i = begin;
+  for (; (i + 8)*stride + 2 <= n*stride; i += 8) {
+    const uint8_t* p = &packets[i*stride];
+    __m256i r0 = LoadBigEndianAvx2_(p, p + 4*stride);
+    __m256i r1 = LoadBigEndianAvx2_(p + stride, p + 5*stride);
+    __m256i r2 = LoadBigEndianAvx2_(p + 2*stride, p + 6*stride);
+    __m256i r3 = LoadBigEndianAvx2_(p + 3*stride, p + 7*stride);
+
+    __m256i t0 = _mm256_unpacklo_epi16(r0, r1);
+    __m256i t1 = _mm256_unpacklo_epi16(r2, r3);
+    __m256i t2 = _mm256_unpackhi_epi16(r0, r1);
+    __m256i t3 = _mm256_unpackhi_epi16(r2, r3);
+    __m256i ax_ay = _mm256_unpacklo_epi32(t0, t1);
+    __m256i az_t = _mm256_unpackhi_epi32(t0, t1);
+    __m256i gx_gy = _mm256_unpacklo_epi32(t2, t3);
+    __m256i gz = _mm256_unpackhi_epi32(t2, t3);
+
+    _mm256_storeu_ps(&out.accel[0][i],
+                     _mm256_mul_ps(LowToFloatAvx2_(ax_ay), accel));
+    _mm256_storeu_ps(&out.accel[1][i],
+                     _mm256_mul_ps(HighToFloatAvx2_(ax_ay), accel));
+    _mm256_storeu_ps(&out.accel[2][i],
+                     _mm256_mul_ps(LowToFloatAvx2_(az_t), accel));
+    // Multiply and add kept separate, a fused multiply-add would round
+    // differently from the scalar kernel
+    _mm256_storeu_ps(&out.temp[i],
+                     _mm256_add_ps(_mm256_mul_ps(HighToFloatAvx2_(az_t),
+                                                 temp_scale), temp_offset));
+    _mm256_storeu_ps(&out.gyro[0][i],
+                     _mm256_mul_ps(LowToFloatAvx2_(gx_gy), gyro));
+    _mm256_storeu_ps(&out.gyro[1][i],
+                     _mm256_mul_ps(HighToFloatAvx2_(gx_gy), gyro));
+    _mm256_storeu_ps(&out.gyro[2][i],
+                     _mm256_mul_ps(LowToFloatAvx2_(gz), gyro));
+  }
+  return i;
+}
+
+DECODE_AVX2 static size_t SumImuAvx2_(const uint8_t* packets, size_t begin,
+                                      size_t n, size_t stride,
+                                      ImuSums* sums) {
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  size_t i = begin;
+  while ((i + 4)*stride + 2 <= n*stride) {
+    __m256i low = _mm256_setzero_si256();
+    __m256i high = _mm256_setzero_si256();
+    size_t block_end = i + kSumBlock;
+    for (; (i + 4)*stride + 2 <= n*stride && i < block_end; i += 4) {
+      const uint8_t* p = &packets[i*stride];
+      // Packets i and i+1 are paired in the low lane, i+2 and i+3 in the
+      // high one
+      __m256i r0 = LoadBigEndianAvx2_(p, p + 2*stride);
+      __m256i r1 = LoadBigEndianAvx2_(p + stride, p + 3*stride);
+      low = _mm256_add_epi32(
+          low, _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, r1), ones));
+      high = _mm256_add_epi32(
+          high, _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, r1), ones));
+    }
+    // Fold the high lane onto the low one, both hold the same channels
+    int32_t lanes[8];
+    _mm_storeu_si128((__m128i*)&lanes[0],
+                     _mm_add_epi32(_mm256_castsi256_si128(low),
+                                   _mm256_extracti128_si256(low, 1)));
+    _mm_storeu_si128((__m128i*)&lanes[4],
+                     _mm_add_epi32(_mm256_castsi256_si128(high),
+                                   _mm256_extracti128_si256(high, 1)));
+    AddLanes_(&lanes[0], &lanes[4], sums);
+  }
+  return i;
+}
+#endif  // DECODE_HAVE_AVX2
+
+// NEON -----------------------------------------------------------------------
+
+#ifdef DECODE_HAVE_NEON
+static inline float32x4_t LowToFloatNeon_(int32x4_t words) {
+  return vcvtq_f32_s32(vmovl_s16(vget_low_s16(vreinterpretq_s16_s32(words))));
+}
+
+static inline float32x4_t HighToFloatNeon_(int32x4_t words) {
+  return vcvtq_f32_s32(vmovl_s16(vget_high_s16(vreinterpretq_s16_s32(words))));
+}
+
+static inline int16x8_t LoadBigEndianNeon_(const uint8_t* p) {
+  return vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(p)));
+}
+
+static size_t ImuNeon_(const uint8_t* packets, size_t begin, size_t n,
+                       size_t stride, const DecodeScale& scale,
+                       const ImuBlock& out) {
+  const float32x4_t accel = vdupq_n_f32(scale.accel);
+  const float32x4_t gyro = vdupq_n_f32(scale.gyro);
+  const float32x4_t temp_scale = vdupq_n_f32(scale.temp_scale);
+  const float32x4_t temp_offset = vdupq_n_f32(scale.temp_offset);
+
+  size_t i = begin;
+  for (; (i + 4)*stride + 2 <= n*stride; i += 4) {
+    const uint8_t* p = &packets[i*stride];
+    int16x8_t r0 = LoadBigEndianNeon_(p);
+    int16x8_t r1 = LoadBigEndianNeon_(p + stride);
+    int16x8_t r2 = LoadBigEndianNeon_(p + 2*stride);
+    int16x8_t r3 = LoadBigEndianNeon_(p + 3*stride);
+
+    int16x8x2_t t01 = vzipq_s16(r0, r1);
+    int16x8x2_t t23 = vzipq_s16(r2, r3);
+    // ax|ay and az|temp
+    int32x4x2_t low = vzipq_s32(vreinterpretq_s32_s16(t01.val[0]),
+                                vreinterpretq_s32_s16(t23.val[0]));
+    // gx|gy and gz|unused
+    int32x4x2_t high = vzipq_s32(vreinterpretq_s32_s16(t01.val[1]),
+                                 vreinterpretq_s32_s16(t23.val[1]));
+
+    vst1q_f32(&out.accel[0][i], vmulq_f32(LowToFloatNeon_(low.val[0]), accel));
+    vst1q_f32(&out.accel[1][i], vmulq_f32(HighToFloatNeon_(low.val[0]), accel));
+    vst1q_f32(&out.accel[2][i], vmulq_f32(LowToFloatNeon_(low.val[1]), accel));
+    // vmlaq_f32 may become a fused multiply-add, which rounds differently
+    vst1q_f32(&out.temp[i],
+              vaddq_f32(vmulq_f32(HighToFloatNeon_(low.val[1]), temp_scale),
+                        temp_offset));
+    vst1q_f32(&out.gyro[0][i], vmulq_f32(LowToFloatNeon_(high.val[0]), gyro));
+    vst1q_f32(&out.gyro[1][i], vmulq_f32(HighToFloatNeon_(high.val[0]), gyro));
+    vst1q_f32(&out.gyro[2][i], vmulq_f32(LowToFloatNeon_(high.val[1]), gyro));
+  }
+  return i;
+}
+
+static size_t SumImuNeon_(const uint8_t* packets, size_t begin, size_t n,
+                          size_t stride, ImuSums* sums) {
+  size_t i = begin;
+  while ((i + 2)*stride + 2 <= n*stride) {
+    int32x4_t low = vdupq_n_s32(0);
+    int32x4_t high = vdupq_n_s32(0);
+    size_t block_end = i + kSumBlock;
+    for (; (i + 2)*stride + 2 <= n*stride && i < block_end; i += 2) {
+      const uint8_t* p = &packets[i*stride];
+      int16x8x2_t t = vzipq_s16(LoadBigEndianNeon_(p),
+                                LoadBigEndianNeon_(p + stride));
+      // Add the two counts of every channel and accumulate in int32
+      low = vpadalq_s16(low, t.val[0]);
+      high = vpadalq_s16(high, t.val[1]);
+    }
+    int32_t lanes[8];
+    vst1q_s32(&lanes[0], low);
+    vst1q_s32(&lanes[4], high);
+    AddLanes_(&lanes[0], &lanes[4], sums);
+  }
+  return i;
+}
+
+static size_t MagnetomNeon_(const uint8_t* packets, size_t begin, size_t n,
+                            size_t stride, const DecodeScale& scale,
+                            const MagnetomBlock& out) {
+  const float32x4_t magnetom = vdupq_n_f32(scale.magnetom);
+
+  size_t i = begin;
+  for (; (i + 4)*stride + 2 <= n*stride; i += 4) {
+    const uint8_t* p = &packets[i*stride];
+    int16x4_t r0 = vreinterpret_s16_u8(vld1_u8(p));
+    int16x4_t r1 = vreinterpret_s16_u8(vld1_u8(p + stride));
+    int16x4_t r2 = vreinterpret_s16_u8(vld1_u8(p + 2*stride));
+    int16x4_t r3 = vreinterpret_s16_u8(vld1_u8(p + 3*stride));
+
+    // x0 x1 y0 y1 | z0 z1 - -, then the same for packets 2 and 3
+    int16x4x2_t t01 = vzip_s16(r0, r1);
+    int16x4x2_t t23 = vzip_s16(r2, r3);
+    int32x2x2_t mx_my = vzip_s32(vreinterpret_s32_s16(t01.val[0]),
+                                 vreinterpret_s32_s16(t23.val[0]));
+    int32x2x2_t mz = vzip_s32(vreinterpret_s32_s16(t01.val[1]),
+                              vreinterpret_s32_s16(t23.val[1]));
+
+    vst1q_f32(&out.magnetom[0][i],
+              vmulq_f32(vcvtq_f32_s32(vmovl_s16(
+                  vreinterpret_s16_s32(mx_my.val[0]))), magnetom));
+    vst1q_f32(&out.magnetom[1][i],
+              vmulq_f32(vcvtq_f32_s32(vmovl_s16(
+                  vreinterpret_s16_s32(mx_my.val[1]))), magnetom));
+    vst1q_f32(&out.magnetom[2][i],
+              vmulq_f32(vcvtq_f32_s32(vmovl_s16(
+                  vreinterpret_s16_s32(mz.val[0]))), magnetom));
+  }
+  return i;
+}
+#endif  // DECODE_HAVE_NEON
+
+// Dispatch -------------------------------------------------------------------
+
+bool DecodeKernelSupported(DecodeKernel kernel) {
+  switch (kernel) {
+    case DecodeKernel::kScalar:
+      return true;
+#ifdef DECODE_HAVE_SSE2
+    case DecodeKernel::kSse2:
+      return true;
+#endif
+#ifdef DECODE_HAVE_AVX2
+    case DecodeKernel::kAvx2:
+      return __builtin_cpu_supports("avx2");
+#endif
+#ifdef DECODE_HAVE_NEON
+    case DecodeKernel::kNeon:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+DecodeKernel BestDecodeKernel() {
+  static const DecodeKernel best = [] {
+    const DecodeKernel order[] = {DecodeKernel::kAvx2, DecodeKernel::kNeon,
+                                  DecodeKernel::kSse2};
+    for (DecodeKernel kernel : order) {
+      if (DecodeKernelSupported(kernel)) {
+        return kernel;
+      }
+    }
+    return DecodeKernel::kScalar;
+  }();
+  return best;
+}
+
+const char* DecodeKernelName(DecodeKernel kernel) {
+  if (kernel >= DecodeKernel::kNumKernels) {
+    return "unknown";
+  }
+  return kDecodeKernelNames[static_cast<int>(kernel)];
+}
+
+void DecodeImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                      const DecodeScale& scale, const ImuBlock& out) {
+  DecodeImuPackets(packets, n, stride, scale, out, BestDecodeKernel());
+}
+
+void DecodeImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                      const DecodeScale& scale, const ImuBlock& out,
+                      DecodeKernel kernel) {
+  // Kernels that are not supported here fall through to the scalar one
+  size_t i = 0;
+  if (!DecodeKernelSupported(kernel)) {
+    kernel = DecodeKernel::kScalar;
+  }
+  switch (kernel) {
+#ifdef DECODE_HAVE_AVX2
+    case DecodeKernel::kAvx2:
+      i = ImuAvx2_(packets, i, n, stride, scale, out);
+#ifdef DECODE_HAVE_SSE2
+      // Up to seven packets left, take four more in one step if possible
+      i = ImuSse2_(packets, i, n, stride, scale, out);
+#endif
+      break;
+#endif
+#ifdef DECODE_HAVE_SSE2
+    case DecodeKernel::kSse2:
+      i = ImuSse2_(packets, i, n, stride, scale, out);
+      break;
+#endif
+#ifdef DECODE_HAVE_NEON
+    case DecodeKernel::kNeon:
+      i = ImuNeon_(packets, i, n, stride, scale, out);
+      break;
+#endif
+    default:
+      break;
+  }
+  ImuScalar_(packets, i, n, stride, scale, out);
+}
+
+void AccumulateImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                          ImuSums* sums) {
+  AccumulateImuPackets(packets, n, stride, sums, BestDecodeKernel());
+}
+
+void AccumulateImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                          ImuSums* sums, DecodeKernel kernel) {
+  size_t i = 0;
+  if (!DecodeKernelSupported(kernel)) {
+    kernel = DecodeKernel::kScalar;
+  }
+  switch (kernel) {
+#ifdef DECODE_HAVE_AVX2
+    case DecodeKernel::kAvx2:
+      i = SumImuAvx2_(packets, i, n, stride, sums);
+#ifdef DECODE_HAVE_SSE2
+      i = SumImuSse2_(packets, i, n, stride, sums);
+#endif
+      break;
+#endif
+#ifdef DECODE_HAVE_SSE2
+    case DecodeKernel::kSse2:
+      i = SumImuSse2_(packets, i, n, stride, sums);
+      break;
+#endif
+#ifdef DECODE_HAVE_NEON
+    case DecodeKernel::kNeon:
+      i = SumImuNeon_(packets, i, n, stride, sums);
+      break;
+#endif
+    default:
+      break;
+  }
+  SumImuScalar_(packets, i, n, stride, sums);
+}
+
+void DecodeMagnetomPackets(const uint8_t* packets, size_t n, size_t stride,
+                           const DecodeScale& scale,
+                           const MagnetomBlock& out) {
+  DecodeMagnetomPackets(packets, n, stride, scale, out, BestDecodeKernel());
+}
+
+void DecodeMagnetomPackets(const uint8_t* packets, size_t n, size_t stride,
+                           const DecodeScale& scale, const MagnetomBlock& out,
+                           DecodeKernel kernel) {
+  // The AK8963 outputs 100 Hz at most, so AVX2 uses the SSE2 kernel
+  size_t i = 0;
+  if (!DecodeKernelSupported(kernel)) {
+    kernel = DecodeKernel::kScalar;
+  }
+  switch (kernel) {
+#ifdef DECODE_HAVE_SSE2
+    case DecodeKernel::kAvx2:
+    case DecodeKernel::kSse2:
+      i = MagnetomSse2_(packets, i, n, stride, scale, out);
+      break;
+#endif
+#ifdef DECODE_HAVE_NEON
+    case DecodeKernel::kNeon:
+      i = MagnetomNeon_(packets, i, n, stride, scale, out);
+      break;
+#endif
+    default:
+      break;
+  }
+  MagnetomScalar_(packets, i, n, stride, scale, out);
+}
@@ -0,0 +1,92 @@
+// Batch decoder for raw sample blocks. Turns a buffer of MPU6500 packets
+// (accelerometer, temperature and gyroscope as big endian words, the FIFO
+// layout) or AK8963 packets (x/y/z as little endian words) into one float
+// array per channel, scaled to whatever units the caller picks.
+//
+// Besides the scalar reference kernel there are SSE2 and AVX2 kernels on x86
+// and a NEON kernel on ARM. They convert four or eight packets at a time and
+// give bit for bit the same result as the scalar one, which does exactly what
+// the driver does per sample: build the int16 count, convert it to float and
+// multiply (then add, for the temperature) in single precision.
+//
+//   float ax[n], ay[n], az[n], t[n], gx[n], gy[n], gz[n];
+//   ImuBlock out = {{ax, ay, az}, t, {gx, gy, gz}};
+//   DecodeImuPackets(fifo_bytes, n, kFifoPacketLen, scale, out);
+//
+// AccumulateImuPackets sums the raw counts of every channel instead, for
+// averaging the biases during calibration. Its kernels add two packets at a
+// time in int32 lanes and are exact, so they match the scalar one too.
+
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <cstddef>  // Needed for size_t
+#include <stdint.h>  // Needed for uint8_t
+
+// Factors from raw counts to output units
+struct DecodeScale {
+  float accel;        // Per LSB
+  float gyro;         // Per LSB
+  float magnetom;     // Per LSB
+  float temp_scale;   // temperature = count*temp_scale + temp_offset
+  float temp_offset;
+};
+
+// Destination of decoded MPU6500 packets, every array holds n floats
+struct ImuBlock {
+  float* accel[3];
+  float* temp;
+  float* gyro[3];
+};
+
+// Running sums of the raw counts of MPU6500 packets, zero them before the
+// first AccumulateImuPackets
+struct ImuSums {
+  int64_t accel[3];
+  int64_t temp;
+  int64_t gyro[3];
+};
+
+// Destination of decoded AK8963 packets, every array holds n floats
+struct MagnetomBlock {
+  float* magnetom[3];
+};
+
+enum class DecodeKernel {
+  kScalar = 0,
+  kSse2,
+  kAvx2,
+  kNeon,
+  kNumKernels
+};
+
+// Whether the kernel was compiled in and the CPU can run it
+bool DecodeKernelSupported(DecodeKernel kernel);
+// Fastest supported kernel, chosen once at run time. The decode functions
+// fall back to the scalar kernel when asked for one that is not supported.
+DecodeKernel BestDecodeKernel();
+const char* DecodeKernelName(DecodeKernel kernel);
+
+// Decode n packets spaced stride bytes apart (at least kFifoPacketLen), each
+// starting with ACCEL_XOUT_H through GYRO_ZOUT_L.
+void DecodeImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                      const DecodeScale& scale, const ImuBlock& out);
+void DecodeImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                      const DecodeScale& scale, const ImuBlock& out,
+                      DecodeKernel kernel);
+
+// Add the counts of n packets laid out as for DecodeImuPackets to sums
+void AccumulateImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                          ImuSums* sums);
+void AccumulateImuPackets(const uint8_t* packets, size_t n, size_t stride,
+                          ImuSums* sums, DecodeKernel kernel);
+
+// Decode n packets spaced stride bytes apart (at least 6), each starting with
+// HXL through HZH. Status bytes are left to the caller.
+void DecodeMagnetomPackets(const uint8_t* packets, size_t n, size_t stride,
+                           const DecodeScale& scale, const MagnetomBlock& out);
+void DecodeMagnetomPackets(const uint8_t* packets, size_t n, size_t stride,
+                           const DecodeScale& scale, const MagnetomBlock& out,
+                           DecodeKernel kernel);
+
+#endif // DECODE_H_
@@ -0,0 +1,95 @@
+// Turns a recorded log back into the filter input the demo would have fed
+// its orientation filter, for the offline tools. The magnetometer goes
+// through the fuse ROM adjustment and hard-iron offsets recorded with the
+// log, as Mpu9250::ConvertMagnetom took it through in the demo. The units
+// are SI rather than the g and mG of the demo, which the filters do not
+// see, they only use the directions of the two fields.
+//
+// The time step of every update comes from the recorded timestamps. The
+// driver stamps every sample on its own, FIFO samples one sample period
+// apart, so each record normally gets the time since the one before. Version
+// 1 logs stamped all the samples of a FIFO drain with the drain time, so
+// records are taken in runs that share a timestamp and every record of a run
+// gets an equal share of the time since the previous run. The first run only
+// sets the start time and records without a timestamp are skipped.
+
+#ifndef FUSION_REPLAY_H_
+#define FUSION_REPLAY_H_
+
+#include <stdint.h>  // Needed for uint64_t
+#include "recorder.h"
+#include "quaternion_filters.h"
+
+// Magnetometer counts to uT per AK8963 axis, count*gain + offset
+struct FusionMagnetomScale {
+  float gain[3];
+  float offset[3];
+};
+
+inline FusionMagnetomScale MakeFusionMagnetomScale(
+    const DecodeScale& si, const RecordMagnetom& magnetom) {
+  FusionMagnetomScale scale;
+  for (int i = 0; i < 3; i++) {
+    scale.gain[i] = si.magnetom*Mpu9250::AsaToAdjust(magnetom.asa[i]);
+    scale.offset[i] = -magnetom.bias[i]*0.1f;  // 10 mG = 1 uT
+  }
+  return scale;
+}
+
+// Sensor axes as the demo hands them to the filter: the x (y)-axis of the
+// accelerometer is aligned with the y (x)-axis of the magnetometer
+inline void RecordToFusionInput(const RecordedSample& record,
+                                const DecodeScale& si,
+                                const FusionMagnetomScale& magnetom,
+                                float deltat, FusionInput* in) {
+  float field[3];
+  for (int i = 0; i < 3; i++) {
+    in->accel[i] = record.accel_count[i]*si.accel;
+    in->gyro[i] = record.gyro_count[i]*si.gyro;
+    field[i] = record.magnetom_count[i]*magnetom.gain[i] + magnetom.offset[i];
+  }
+  in->magnetom[0] = field[1];
+  in->magnetom[1] = field[0];
+  in->magnetom[2] = field[2];
+  in->deltat = deltat;
+}
+
+// Call visit(in, timestamp_ns) for every record with a known time step, in
+// order. Returns the time span of the log in nanoseconds.
+template <typename Visitor>
+uint64_t ForEachFusionStep(const RecordReader& reader, Visitor visit) {
+  const DecodeScale& si = reader.Header().scale.si;
+  FusionMagnetomScale magnetom = MakeFusionMagnetomScale(si,
+                                                         reader.Magnetom());
+  uint64_t n = reader.Count();
+  FusionInput in;
+
+  uint64_t prev_ns = 0;
+  uint64_t first_ns = 0;
+  uint64_t i = 0;
+  while (i < n) {
+    uint64_t t_ns = reader.Record(i).timestamp_ns;
+    uint64_t end = i + 1;
+    while (end < n && reader.Record(end).timestamp_ns == t_ns) {
+      end++;
+    }
+    if (t_ns == 0) {
+      i = end;
+      continue;
+    }
+    if (prev_ns != 0 && t_ns > prev_ns) {
+      float deltat = (t_ns - prev_ns)/1e9f/(end - i);
+      for (uint64_t j = i; j < end; j++) {
+        RecordToFusionInput(reader.Record(j), si, magnetom, deltat, &in);
+        visit(in, t_ns);
+      }
+    } else if (first_ns == 0) {
+      first_ns = t_ns;
+    }
+    prev_ns = t_ns;
+    i = end;
+  }
+  return prev_ns > first_ns ? prev_ns - first_ns : 0;
+}
+
+#endif // FUSION_REPLAY_H_
@@ -0,0 +1,111 @@
+#include "gpio.h"
+
+#include <errno.h>  // Needed for errno, EINTR, EIO
+#include <string.h>  // Needed for strncpy
+#include <time.h>  // Needed for clock_gettime
+
+
+// GPIO line constructor
+GpioLine::GpioLine(uint chip_n, uint line_n) {
+  char file_name[20]; // To hold /dev/gpiochip#
+  snprintf(file_name, sizeof(file_name), "/dev/gpiochip%u", chip_n);
+
+  // A failure is kept in open_error_ for the caller to check
+  int chip_fd = open(file_name, O_RDWR);
+  if (chip_fd < 0) {
+    open_error_ = -errno;
+    return;
+  }
+
+  struct gpioevent_request request;
+  memset(&request, 0, sizeof(request));
+  request.lineoffset = line_n;
+  request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  request.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+  strncpy(request.consumer_label, "mpu9250-int",
+          sizeof(request.consumer_label) - 1);
+
+  int result = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &request);
+  if (result < 0) {
+    open_error_ = -errno;
+  }
+  // The line event handle stays valid after the chip is closed
+  close(chip_fd);
+  if (result < 0) {
+    return;
+  }
+
+  event_fd_ = request.fd;
+  line_event_ = true;
+}
+
+GpioLine::GpioLine(int event_fd) {
+  event_fd_ = event_fd;
+  line_event_ = false;
+}
+
+GpioLine::~GpioLine() {
+  if (event_fd_ >= 0) {
+    close(event_fd_);
+  }
+}
+
+// Milliseconds on CLOCK_MONOTONIC, the clock poll() times out on
+static int64_t MonotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+int GpioLine::WaitForEdge(int timeout_ms, uint64_t* timestamp_ns) {
+  struct pollfd pfd;
+  pfd.fd = event_fd_;
+  pfd.events = POLLIN | POLLPRI;
+
+  // A signal cuts poll() short, wait again for what is left of the timeout
+  int64_t deadline_ms = MonotonicMs() + timeout_ms;
+  int ret;
+  while ((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+    if (timeout_ms >= 0) {
+      int64_t left_ms = deadline_ms - MonotonicMs();
+      timeout_ms = left_ms > 0 ? left_ms : 0;
+    }
+  }
+  if (ret < 0) {
+    return -errno;
+  } else if (ret == 0) {
+    return 0;  // Timeout
+  }
+
+  uint64_t timestamp;
+  ssize_t n;
+  if (line_event_) {
+    // Consume the event so the next edge wakes us again
+    struct gpioevent_data event;
+    do {
+      n = read(event_fd_, &event, sizeof(event));
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(event)) {
+      return n < 0 ? -errno : -EIO;
+    }
+    timestamp = event.timestamp;
+  } else {
+    // eventfd stand-in: reading resets its counter, stamp it ourselves
+    uint64_t counter;
+    do {
+      n = read(event_fd_, &counter, sizeof(counter));
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(counter)) {
+      return n < 0 ? -errno : -EIO;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timestamp = (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+  }
+
+  if (timestamp_ns != nullptr) {
+    *timestamp_ns = timestamp;
+  }
+
+  return 1;
+}
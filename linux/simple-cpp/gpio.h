@@ -0,0 +1,48 @@
+// Edge events from a GPIO line through the Linux GPIO character device
+// (/dev/gpiochipN). Used to wait for the MPU-9250 INT pin instead of polling
+// INT_STATUS over I2C.
+
+#ifndef GPIO_H_
+#define GPIO_H_
+
+#include <stdio.h>  // Needed for snprintf
+#include <fcntl.h>  // Needed for open()
+#include <unistd.h>  // Needed for read, close
+#include <cstdint>  // Needed for uint64_t
+#include <sys/types.h>  // Needed for uint
+#include <poll.h>  // Needed for poll
+#include <sys/ioctl.h>  // Needed for ioctl
+#include <linux/gpio.h>  // Needed for GPIO_GET_LINEEVENT_IOCTL
+
+
+class GpioLine {
+  private:
+    int event_fd_ = -1;
+    int open_error_ = 0;  // Negative errno of the failed request, 0 if open
+    // False when event_fd_ is a stand-in such as an eventfd instead of a
+    // line event handle
+    bool line_event_ = true;
+
+  public:
+    // Request rising edge events for line_n of /dev/gpiochip<chip_n>. The
+    // MPU-9250 INT pin is configured active high in InitMpu9250. A line that
+    // could not be requested is kept closed, see IsOpen().
+    GpioLine(uint chip_n, uint line_n);
+    // Wait on an already open descriptor instead, for example an eventfd that
+    // a test or simulation writes to. The descriptor is closed with the line.
+    explicit GpioLine(int event_fd);
+    ~GpioLine();
+
+    int Fd() const { return event_fd_; }
+    bool IsOpen() const { return event_fd_ >= 0; }
+    // Negative errno of the failed open or request, 0 if the line is open
+    int OpenError() const { return open_error_; }
+
+    // Block until an edge arrives or timeout_ms expires (-1 waits forever),
+    // signals do not cut the wait short. Returns 1 on an edge and stores the
+    // kernel timestamp in nanoseconds if timestamp_ns is not null, 0 on
+    // timeout or the negative errno of a failed poll or read.
+    int WaitForEdge(int timeout_ms, uint64_t* timestamp_ns);
+};  // class GpioLine
+
+#endif // GPIO_H_
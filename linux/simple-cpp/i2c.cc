@@ -2,156 +2,150 @@
 
 
 // I2C bus constructor
-I2cBus::I2cBus(uint bus_n) {
-  // Access an I2C bus adapter from a C++ program
+I2cBus::I2cBus(uint bus_n) : bus_n_(bus_n) {
+  // Access an I2C bus adapter from a C++ program. A failure is kept in
+  // open_error_ for the caller to check, the bus is retried on first use.
+  open_error_ = Open_();
+}
+
+I2cBus::~I2cBus() {
+  if (file_ >= 0) {
+    close(file_);
+  }
+}
 
+int I2cBus::Open_() {
   char file_name[15]; // To hold /dev/i2c-#
-  snprintf(file_name, sizeof(file_name), "/dev/i2c-%d", bus_n);
+  snprintf(file_name, sizeof(file_name), "/dev/i2c-%d", bus_n_);
 
   // Open I2C bus driver
-  if ((file_ = open(file_name, O_RDWR)) < 0) {
-    // ERROR HANDLING: you can check errno to see what went wrong
-    perror("Failed to open the I2C bus.\n");
-    exit(1);
+  file_ = open(file_name, O_RDWR);
+  slave_addr_ = -1;
+  return file_ < 0 ? -errno : 0;
+}
+
+int I2cBus::Recover_() {
+  // A controller that timed out or an adapter that went away, e.g. a USB
+  // bridge that was replugged, comes back with a fresh file descriptor
+  if (file_ >= 0) {
+    close(file_);
   }
+  open_error_ = Open_();
+  return open_error_;
 }
 
-bool I2cBus::SetSlaveAddr_(uint16_t addr) {
-  bool success = false;
+int I2cBus::SetSlaveAddr_(uint16_t addr) {
+  // The address stays selected on the file descriptor, only issue the ioctl
+  // when talking to a different slave than last time.
+  if (slave_addr_ == addr) {
+    return 0;
+  }
 
   // Input output control setup to the slave device.
   if (ioctl(file_, I2C_SLAVE, addr) < 0) {
-    success = false;
-    perror("Failed to acquire bus access and/or talk to slave.\n");
-    // ERROR HANDLING; you can check errno to see what went wrong
-    exit(1);
-  } else {
-    success = true;
+    slave_addr_ = -1;
+    return -errno;
   }
+  slave_addr_ = addr;
+  return 0;
+}
 
-  return success;
+int I2cBus::ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                     uint n_bytes, uint8_t* buff_ptr) {
+  // Write the memory address and read back n_bytes in a single combined
+  // transfer. Both messages are joined by a repeated start so no stop
+  // condition goes on the wire and the register pointer cannot be moved by
+  // another master in between. The slave address travels inside each message,
+  // so no I2C_SLAVE ioctl is needed.
+  struct i2c_msg msgs[2];
+  struct i2c_rdwr_ioctl_data rdwr;
+
+  msgs[0].addr = addr;
+  msgs[0].flags = 0;  // Write
+  msgs[0].len = sizeof(mem_addr);
+  msgs[0].buf = &mem_addr;
+
+  msgs[1].addr = addr;
+  msgs[1].flags = I2C_M_RD;
+  msgs[1].len = n_bytes;
+  msgs[1].buf = buff_ptr;
+
+  rdwr.msgs = msgs;
+  rdwr.nmsgs = 2;
+
+  // I2C_RDWR returns the number of messages transferred
+  uint64_t start_ns = MonotonicRawNs();
+  int result = ioctl(file_, I2C_RDWR, &rdwr);
+  int error = result < 0 ? -errno : (result == 2 ? 0 : -EIO);
+  bus_stats_.Record(op, addr, mem_addr, n_bytes, error == 0,
+                    MonotonicRawNs() - start_ns);
+  return error;
 }
 
-bool I2cBus::ReadFromInto(uint16_t addr, uint8_t* buff_ptr) {
+int I2cBus::ReadFromInto(uint16_t addr, uint8_t* buff_ptr) {
   // Read into buff from the slave specified by addr. The number of bytes read
   // will be the length of buff
 
-  bool success = false;
-
-  SetSlaveAddr_(addr);
-  if (read(file_, buff_ptr, sizeof(buff_ptr)) == sizeof(buff_ptr)) {
-    success = true;
-  } else {
-    success = false;
-    perror("I2C read from slave into buffer failed.\n");
-    // ERROR HANDLING; you can check errno to see what went wrong
-    exit(1);
+  int error = SetSlaveAddr_(addr);
+  if (error < 0) {
+    return error;
   }
-
-  return success;
-}
-
-bool I2cBus::WriteToMem(uint16_t addr, uint8_t mem_addr, uint8_t data){
-  // Write data to the slave specified by addr starting from the memory
-  // address specified by mem_addr.
-
-  bool success = false;
-  uint8_t w_buf[2];
-  w_buf[0] = mem_addr;
-  w_buf[1] = data;
-
-  SetSlaveAddr_(addr);
-
-  // Write to defined register
-  if (write(file_, &w_buf, sizeof(w_buf)) == sizeof(w_buf)){
-    success = true;
-  } else {
-    success = false;
-    perror("I2C write to memory failed.\n");
-    // ERROR HANDLING; you can check errno to see what went wrong
-    exit(1);
+  ssize_t n_read = read(file_, buff_ptr, sizeof(buff_ptr));
+  if (n_read < 0) {
+    return -errno;
   }
-
-  return success;
+  return n_read == (ssize_t)sizeof(buff_ptr) ? 0 : -EIO;
 }
 
-bool I2cBus::WriteToMemFrom(uint16_t addr, uint8_t mem_addr, uint n_bytes,
-                            uint8_t* buff_ptr) {
+int I2cBus::WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                      uint n_bytes, const uint8_t* buff_ptr) {
   // Write buff to the slave specified by addr starting from the memory
   // address specified by mem_addr.
 
-  bool success = false;
   uint8_t w_buff[1 + n_bytes];  // cannot create type information for type
                                 // 'int [(n_bytes + 1)]' because it involves
                                 // types of variable size
 
-  SetSlaveAddr_(addr);
   w_buff[0] = mem_addr;
   // Shift and then fill the buffer
   for (uint i = 1; i <= n_bytes; i++) {
     w_buff[i] = buff_ptr[i-1];
   }
 
-  // Write to defined register
-  if (write(file_, &w_buff, sizeof(w_buff)) == int(sizeof(w_buff))) {
-                                            // ^ int casting due to
-                                            // uint comparison warning
-    success = true;
-  } else {
-    success = false;
-    perror("I2C write to memory from buffer failed.\n");
-    // ERROR HANDLING; you can check errno to see what went wrong
-    exit(1);
-  }
-
-  return success;
-}
-
-bool I2cBus::ReadFromMem(uint16_t addr, uint8_t mem_addr, uint8_t* data_ptr) {
-  // Read a byte from the slave specified by addr from the memory address
-  // specified by mem_addr.
-
-  bool success = false;
-
-  SetSlaveAddr_(addr);
-
-  // Write to defined register
-  if (write(file_, &mem_addr, sizeof(mem_addr)) == sizeof(mem_addr)) {
-    // Read back value
-    if (read(file_, data_ptr, sizeof(uint8_t)) == sizeof(uint8_t)) {
-      success = true;
-    } else {
-      success = false;
-      perror("I2C read from memory failed.\n");
-      // ERROR HANDLING; you can check errno to see what went wrong
-      exit(1);
+  // Write to defined register, selecting the slave first if needed
+  uint64_t start_ns = MonotonicRawNs();
+  int error = SetSlaveAddr_(addr);
+  if (error == 0) {
+    ssize_t written = write(file_, &w_buff, sizeof(w_buff));
+    if (written < 0) {
+      error = -errno;
+    } else if (written != int(sizeof(w_buff))) {
+                       // ^ int casting due to uint comparison warning
+      error = -EIO;
     }
   }
-
-  return success;
+  bus_stats_.Record(op, addr, mem_addr, n_bytes, error == 0,
+                    MonotonicRawNs() - start_ns);
+  return error;
 }
 
-bool I2cBus::ReadFromMemInto(uint16_t addr, uint8_t mem_addr, uint n_bytes,
-                             uint8_t* buff_ptr)
-{
-  // Read n_bytes into buff from the slave specified by addr starting from
-  // the memory address specified by mem_addr.
-
-  bool success = false;
-
-  SetSlaveAddr_(addr);
-  // Write to defined register
-  if (write(file_, &mem_addr, sizeof(mem_addr)) == sizeof(mem_addr)) {
-    // read back value
-    if (read(file_, buff_ptr, n_bytes) == int(n_bytes)) {
-      success = true;
-    } else {
-      success = false;
-      perror("I2C read from memory into buffer failed.\n");
-      // ERROR HANDLING; you can check errno to see what went wrong
-      exit(1);
-    }
+int I2cBus::Transfer_(I2cTransaction* transaction, BusStats::Op op) {
+  // Hand the whole queue to the kernel, every message carries its own slave
+  // address so several devices can be accessed in one go.
+
+  struct i2c_rdwr_ioctl_data rdwr;
+  rdwr.msgs = transaction->Msgs();
+  rdwr.nmsgs = transaction->NumMsgs();
+
+  uint64_t start_ns = MonotonicRawNs();
+  int result = ioctl(file_, I2C_RDWR, &rdwr);
+  int error = 0;
+  if (result < 0) {
+    error = -errno;
+  } else if (result != int(transaction->NumMsgs())) {
+    error = -EIO;
   }
-
-  return success;
+  bus_stats_.RecordMsgs(op, rdwr.msgs, rdwr.nmsgs, error == 0,
+                        MonotonicRawNs() - start_ns);
+  return error;
 }
@@ -4,43 +4,62 @@
 #ifndef I2C_H_
 #define I2C_H_
 
-#include <stdio.h>  // Needed for printf, snprintf, perror
+#include <stdio.h>  // Needed for snprintf
 #include <fcntl.h>  // Needed for open()
 #include <unistd.h>  // Needed for write, close
-#include <stdlib.h>  // Needed for exit()
+#include <errno.h>  // Needed for errno
 #include <cstdint>  // Needed for uint8_t
 #include <sys/ioctl.h>  // Needed for ioctl
 #include <linux/i2c-dev.h>  // Needed to use the I2C Linux driver (I2C_SLAVE)
+#include <linux/i2c.h>  // Needed for i2c_msg and I2C_M_RD (I2C_RDWR)
+#include "bus.h"
+#include "timing.h"
 
 
-class I2cBus {
+class I2cBus : public Bus {
   private:
-    int file_ = 0;
+    uint bus_n_;
+    int file_ = -1;
+    int open_error_ = 0;   // Negative errno of the last open, 0 if it worked
+    int slave_addr_ = -1;  // Last address set through I2C_SLAVE, -1 if none
 
-    bool SetSlaveAddr_(uint16_t addr);
+    int Open_();
+    int SetSlaveAddr_(uint16_t addr);
+
+  protected:
+    int WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                  uint n_bytes, const uint8_t* buff_ptr) override;
+    int ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                 uint n_bytes, uint8_t* buff_ptr) override;
+    int Transfer_(I2cTransaction* transaction, BusStats::Op op) override;
+    // Close and reopen the adapter, which drops any state the kernel kept
+    // for the file descriptor
+    int Recover_() override;
 
   public:
+    // Opens /dev/i2c-<bus_n>. A bus that could not be opened is kept closed,
+    // see IsOpen(), and is reopened by the first operation that recovers it.
     I2cBus(uint bus_n);
+    ~I2cBus();
+
+    bool IsOpen() const { return file_ >= 0; }
+    // Negative errno of the failed open, 0 if the bus is open
+    int OpenError() const { return open_error_; }
 
     // ----------------------- Standard bus operations -----------------------
     // The following methods implement the standard I2C master read and write
     // operations that target a given slave device.
-    bool ReadFromInto(uint16_t addr, uint8_t* buff);
+    int ReadFromInto(uint16_t addr, uint8_t* buff);
     // int WriteTo(int addr, uint8_t* buff);
 
     // -------------------------- Memory Operations --------------------------
     // Some I2C devices act as a memory device (or set of registers) that can
     // be read from and written to. In this case there are two addresses
     // associated with an I2C transaction: the slave address and the memory
-    // address. The following methods are convenience functions to communicate
-    // with such devices.
-
-    bool WriteToMem(uint16_t addr, uint8_t mem_addr, uint8_t data);
-    bool WriteToMemFrom(uint16_t addr, uint8_t mem_addr, uint n_bytes,
-                       uint8_t* buff_ptr);
-    bool ReadFromMem(uint16_t addr, uint8_t mem_addr, uint8_t* data_ptr);
-    bool ReadFromMemInto(uint16_t addr, uint8_t mem_addr, uint n_bytes,
-                        uint8_t* buff_ptr);
+    // address. The convenience functions to communicate with such devices,
+    // WriteToMem, WriteToMemFrom, ReadFromMem and ReadFromMemInto, and the
+    // combined Transfer are those of Bus. They retry transient failures and
+    // return 0 or a negative errno.
 
 };  // Class I2C
 
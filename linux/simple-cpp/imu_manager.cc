@@ -0,0 +1,192 @@
+#include "imu_manager.h"
+
+#include <unistd.h>  // Needed for usleep
+#include "i2c.h"
+
+
+// ImuManager constructor
+ImuManager::ImuManager(Mode mode, size_t ring_capacity)
+    : mode_(mode), ring_capacity_(ring_capacity), running_(false) {
+}
+
+ImuManager::~ImuManager() {
+  Stop();
+  for (uint i = 0; i < devices_.size(); i++) {
+    delete devices_[i]->imu;
+    delete devices_[i];
+  }
+  for (uint i = 0; i < buses_.size(); i++) {
+    if (buses_[i]->owned) {
+      delete buses_[i]->bus;
+    }
+    delete buses_[i];
+  }
+}
+
+uint ImuManager::AddBus(Bus* bus, uint bus_n) {
+  const uint8_t kAddrs[2] = {kMpu6500Addr, kMpu6500AddrAd0};
+  BusWorker* worker = new BusWorker();
+  worker->bus = bus;
+  worker->owned = false;
+
+  for (uint i = 0; i < 2; i++) {
+    // An address nobody answers is not acknowledged, the read fails
+    uint8_t who_am_i = 0;
+    if (bus->ReadFromMem(kAddrs[i], kWhoAmImpu6500, &who_am_i) < 0 ||
+        who_am_i != 0x71) {
+      continue;
+    }
+    // Reset first, a previous run may have left the internal I2C master on
+    Mpu9250* imu = new Mpu9250(bus, kAddrs[i]);
+    if (imu->Reset() < 0 || imu->InitMpu9250() < 0) {
+      delete imu;
+      continue;
+    }
+    DeviceInfo info = {bus_n, kAddrs[i], false};
+    worker->devices.push_back(new Device(imu, info, ring_capacity_));
+  }
+
+  uint n = worker->devices.size();
+  if (n == 0) {
+    delete worker;
+    return 0;
+  }
+  if (n > 1) {
+    // Keep the AK8963s off the bus, they share one address. Each one is
+    // still read, by the MPU6500 it sits behind.
+    for (uint i = 0; i < n; i++) {
+      worker->devices[i]->info.shared = true;
+      if (worker->devices[i]->imu->EnableMagnetomMaster() < 0) {
+        // Without its magnetometer then
+        worker->devices[i]->imu->SetBypass(false);
+      }
+    }
+  }
+  for (uint i = 0; i < n; i++) {
+    // A device whose AK8963 cannot be reached still delivers the rest
+    Mpu9250* imu = worker->devices[i]->imu;
+    if (!worker->devices[i]->info.shared || imu->MagnetomMaster()) {
+      imu->InitAk8963(Mpu9250::kMagnetom100Hz);
+    }
+  }
+  buses_.push_back(worker);
+  devices_.insert(devices_.end(), worker->devices.begin(),
+                  worker->devices.end());
+  return n;
+}
+
+uint ImuManager::Scan(uint first_bus, uint last_bus) {
+  uint n = 0;
+  for (uint bus_n = first_bus; bus_n <= last_bus; bus_n++) {
+    // Most adapter numbers do not exist, skip them without probing
+    I2cBus* bus = new I2cBus(bus_n);
+    if (!bus->IsOpen()) {
+      delete bus;
+      continue;
+    }
+    uint found = AddBus(bus, bus_n);
+    if (found == 0) {
+      delete bus;
+    } else {
+      buses_.back()->owned = true;
+      n += found;
+    }
+  }
+  return n;
+}
+
+void ImuManager::Start() {
+  if (running_.load()) {
+    return;
+  }
+  if (mode_ == kFifo) {
+    for (uint i = 0; i < devices_.size(); i++) {
+      devices_[i]->imu->EnableFifo();
+    }
+  }
+  running_.store(true);
+  for (uint i = 0; i < buses_.size(); i++) {
+    buses_[i]->thread = std::thread(&ImuManager::Run_, this, buses_[i]);
+  }
+}
+
+void ImuManager::Stop() {
+  if (!running_.load()) {
+    return;
+  }
+  running_.store(false);
+  for (uint i = 0; i < buses_.size(); i++) {
+    buses_[i]->thread.join();
+  }
+  if (mode_ == kFifo) {
+    for (uint i = 0; i < devices_.size(); i++) {
+      devices_[i]->imu->DisableFifo();
+    }
+  }
+}
+
+void ImuManager::Push_(Device* device, const Mpu9250Sample& sample) {
+  // Never block the bus thread: when a consumer lags behind the newest
+  // sample is dropped and counted
+  if (device->ring.TryPush(sample)) {
+    device->samples.store(device->samples.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+  } else {
+    device->overruns.store(
+        device->overruns.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+  }
+}
+
+void ImuManager::CountError_(Device* device) {
+  device->errors.store(device->errors.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+}
+
+void ImuManager::Run_(BusWorker* worker) {
+  // The only thread touching this bus and its devices while running
+  Mpu9250Sample sample;
+  Mpu9250Sample fifo_samples[kFifoSize/kFifoPacketLen];
+
+  while (running_.load(std::memory_order_relaxed)) {
+    if (mode_ == kFifo) {
+      for (uint i = 0; i < worker->devices.size(); i++) {
+        Device* device = worker->devices[i];
+        int n = device->imu->ReadFifo(fifo_samples, kFifoSize/kFifoPacketLen);
+        if (n < 0) {
+          CountError_(device);
+        }
+        for (int j = 0; j < n; j++) {
+          Push_(device, fifo_samples[j]);
+        }
+      }
+      // Drain well before the 512 byte FIFO can fill up at 1 kHz
+      usleep(10*1000);
+      continue;
+    }
+
+    bool new_data = false;
+    for (uint i = 0; i < worker->devices.size(); i++) {
+      Device* device = worker->devices[i];
+      int error;
+      if (device->info.shared && !device->imu->MagnetomMaster()) {
+        // The AK8963 is not reachable, read the MPU6500 block alone
+        error = device->imu->ReadAllSensors();
+      } else {
+        error = device->imu->ReadSensorsBatched();
+      }
+      // A failed read leaves int_status clear, only that sample is lost
+      if (error < 0) {
+        CountError_(device);
+      }
+      if (device->imu->int_status & 0x01) {
+        device->imu->CopySample(&sample);
+        Push_(device, sample);
+        new_data = true;
+      }
+    }
+    if (!new_data) {
+      usleep(500);
+    }
+  }
+}
@@ -0,0 +1,127 @@
+// Discovers and drives many MPU-9250s spread over several I2C buses. Every
+// bus is probed at both AD0 addresses and gets its own I/O thread, so the
+// buses are serviced in parallel while the devices sharing a bus take turns.
+// Each device hands timestamped raw samples to the consumer through its own
+// SPSC ring, as Acquisition does for a single device.
+//
+// The driver stamps every sample with MonotonicRawNs() of timing.h when its
+// read completes, so samples of different devices share one timebase and can
+// be aligned by time.
+//
+// Two MPU-9250s on one bus would both answer at the AK8963 address once
+// bypass is enabled, so on shared buses bypass is turned off and every
+// MPU-9250 reads its own AK8963 through its internal I2C master instead.
+
+#ifndef IMU_MANAGER_H_
+#define IMU_MANAGER_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <thread>  // Needed for std::thread
+#include <vector>  // Needed for std::vector
+#include "bus.h"
+#include "mpu9250.h"
+#include "spsc_ring.h"
+
+
+class ImuManager {
+  public:
+    enum Mode {
+      kPolling = 0,  // Poll INT_STATUS of every device in turn
+      kFifo          // Periodically drain the hardware FIFO of every device
+    };
+
+    struct DeviceInfo {
+      uint bus_n;    // Adapter number, /dev/i2c-<bus_n>
+      uint8_t addr;  // kMpu6500Addr or kMpu6500AddrAd0
+      bool shared;   // Another device is on the same bus, the magnetometer
+                     // is read through the internal I2C master
+    };
+
+  private:
+    struct Device {
+      Mpu9250* imu;
+      DeviceInfo info;
+      SpscRing<Mpu9250Sample> ring;
+
+      // Written by the bus thread only, padded away from the fields the
+      // consumer touches
+      char pad_before_[kCacheLineSize];
+      std::atomic<uint64_t> samples;
+      std::atomic<uint64_t> overruns;
+      std::atomic<uint64_t> errors;
+      char pad_after_[kCacheLineSize];
+
+      Device(Mpu9250* imu, const DeviceInfo& info, size_t ring_capacity)
+          : imu(imu), info(info), ring(ring_capacity), samples(0),
+            overruns(0), errors(0) {}
+    };
+
+    struct BusWorker {
+      Bus* bus;
+      bool owned;  // Opened by Scan() and deleted with the manager
+      std::vector<Device*> devices;
+      std::thread thread;
+    };
+
+    Mode mode_;
+    size_t ring_capacity_;
+    std::vector<BusWorker*> buses_;
+    std::vector<Device*> devices_;  // In the order they were found
+    std::atomic<bool> running_;
+
+    void Run_(BusWorker* worker);
+    static void Push_(Device* device, const Mpu9250Sample& sample);
+    static void CountError_(Device* device);
+
+  public:
+    // ring_capacity is rounded up to a power of two
+    ImuManager(Mode mode, size_t ring_capacity);
+    ~ImuManager();
+
+    // Probe both AD0 addresses on bus and initialize every MPU-9250 found.
+    // A device that fails to initialize is left out. Returns the number of
+    // devices found, the bus is only kept if there is at least one. The
+    // caller keeps ownership of bus.
+    uint AddBus(Bus* bus, uint bus_n);
+    // Open every /dev/i2c-<n> from first_bus to last_bus that can be opened
+    // and add it with AddBus(). Returns the number of devices found.
+    uint Scan(uint first_bus, uint last_bus);
+
+    // Start one I/O thread per bus, and stop them again
+    void Start();
+    void Stop();
+
+    uint NumDevices() const { return devices_.size(); }
+    uint NumBuses() const { return buses_.size(); }
+    const DeviceInfo& Info(uint device) const { return devices_[device]->info; }
+    // Sample rate of a device, 1 kHz/(1 + divider). Only before Start().
+    int SetSampleRateDivider(uint device, uint8_t divider) {
+      return devices_[device]->imu->SetSampleRateDivider(divider);
+    }
+    // Read latency, sample intervals and rate of a device
+    const SampleTiming& Timing(uint device) const {
+      return devices_[device]->imu->timing;
+    }
+
+    // Consumer side, pop up to max_n samples of a device, oldest first. Each
+    // device may have its own consumer thread.
+    size_t PopN(uint device, Mpu9250Sample* out, size_t max_n) {
+      return devices_[device]->ring.PopN(out, max_n);
+    }
+
+    // Samples of a device pushed into its ring
+    uint64_t Samples(uint device) const {
+      return devices_[device]->samples.load(std::memory_order_relaxed);
+    }
+    // Samples of a device dropped because its ring was full
+    uint64_t Overruns(uint device) const {
+      return devices_[device]->overruns.load(std::memory_order_relaxed);
+    }
+    // Reads of a device that failed after the bus retried them, their
+    // samples are lost but the device keeps being read
+    uint64_t Errors(uint device) const {
+      return devices_[device]->errors.load(std::memory_order_relaxed);
+    }
+};  // class ImuManager
+
+#endif // IMU_MANAGER_H_
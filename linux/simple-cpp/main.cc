@@ -16,33 +16,402 @@
 
 #include <stdio.h>  // Needed for printf, snprintf, perror
 #include <stdint.h>  // Needed for unit uint8_t data type
-#include <stdlib.h>  // Needed for exit()
+#include <stdlib.h>  // Needed for exit(), atoi, abs
+#include <string.h>  // Needed for strerror
+#include <unistd.h>  // Needed for getopt, usleep
 #include "i2c.h"
+#include "sim_bus.h"
+#include "gpio.h"
 #include "mpu9250.h"
+#include "sensor_config.h"
+#include "acquisition.h"
+#include "imu_manager.h"
+#include "recorder.h"
+#include "calibration_store.h"
+#include "quaternion_filters.h"
+#include "timing.h"
 
+// Most samples drained from the FIFO in one loop iteration
+const uint kMaxFifoSamples = kFifoSize/kFifoPacketLen;
 
-int main(){
-  I2cBus i2c_bus(1);
-  Mpu9250 imu(&i2c_bus);
+// Adapter of the single device demo, /dev/i2c-<kBusN>
+const uint kBusN = 1;
+// Number of simulated buses with -m -s, each has one IMU at both addresses
+const uint kNumSimBuses = 2;
+// Adapters searched with -m
+const uint kMaxBusN = 15;
+// With -w the device goes back to sleep once it has not moved for
+// kWakeIdleNs
+const uint64_t kWakeIdleNs = 10000000000ull;
+// Records the -r log is preallocated and grown by, about 17 min at 1 kHz
+const uint64_t kRecordChunk = 1 << 20;
+
+void PrintUsage(const char* name) {
+  printf("Usage: %s [-f] [-a] [-c ms] [-k file] [-g chip:line] [-w mg] [-t]"
+         " [-m] [-r file] [-s]\n", name);
+  printf("  -f  stream accel, temperature and gyro data through the FIFO\n");
+  printf("  -a  let the MPU6500 read the AK8963 through its internal I2C\n");
+  printf("      master, the magnetometer comes with every sensor read\n");
+  printf("  -c  keep the device still and calibrate the gyroscope over ms\n");
+  printf("      milliseconds at start-up, 200 is a good start\n");
+  printf("  -k  keep the calibration in file, see calibration_store.h. A\n");
+  printf("      device found there is not calibrated again, its offsets\n");
+  printf("      are checked whenever it lies still instead\n");
+  printf("  -g  wait for the INT pin on /dev/gpiochip<chip> line <line>\n");
+  printf("      instead of sleeping between reads\n");
+  printf("  -w  put the device in wake-on-motion mode whenever it has not\n");
+  printf("      moved by mg milli-g for 10 s, and block on the INT pin\n");
+  printf("      until it does. Needs -g, 40 is a good start\n");
+  printf("  -t  acquire on a background thread, this loop only consumes\n");
+  printf("  -m  acquire from every MPU-9250 on /dev/i2c-0 to /dev/i2c-%u,\n",
+         kMaxBusN);
+  printf("      with one thread per bus\n");
+  printf("  -r  record every raw sample to file, see recorder.h. Stop with\n");
+  printf("      Ctrl-C, the log is recovered up to the last complete sample\n");
+  printf("  -s  talk to a simulated MPU-9250 instead of /dev/i2c-%u\n",
+         kBusN);
+}
+
+// One line of sample timing statistics, times in microseconds
+void PrintTiming(const SampleTiming& timing) {
+  const Histogram& interval = timing.IntervalNs();
+  const Histogram& latency = timing.LatencyNs();
+  printf("Rate %.1f Hz, interval p50 %.1f p99 %.1f max %.1f us,"
+         " read p50 %.1f p99 %.1f us\n",
+         timing.RateMilliHz().Mean()/1000.0,
+         interval.Percentile(0.50)/1e3, interval.Percentile(0.99)/1e3,
+         interval.Max()/1e3, latency.Percentile(0.50)/1e3,
+         latency.Percentile(0.99)/1e3);
+}
+
+// Background check of a device started on the offsets of its entry in
+// store. Samples go to check until a still window decides, then the entry
+// is brought up to date. A correction goes to imu right away, unless it is
+// nullptr because another thread reads the device, then it takes effect at
+// the next start. Returns true once decided.
+bool Revalidate(BiasCheck* check, const Mpu9250Sample* samples, uint n,
+                Mpu9250* imu, CalibrationStore* store,
+                CalibrationEntry* entry) {
+  for (uint i = 0; i < n; i++) {
+    BiasCheck::Status status = check->Add(samples[i]);
+    if (status != BiasCheck::kValid && status != BiasCheck::kStale) {
+      continue;
+    }
+    printf("Cached calibration %s, % 0.3f % 0.3f % 0.3f degrees/sec left"
+           " at %.1f C\n", status == BiasCheck::kValid ? "holds" :
+           "corrected", check->Residual(0), check->Residual(1),
+           check->Residual(2), check->Temperature());
+    if (status == BiasCheck::kStale) {
+      check->Correct(entry->gyro_offset);
+      int error = imu != nullptr ? imu->SetGyroOffsets(entry->gyro_offset)
+                                 : 0;
+      if (error < 0) {
+        printf("Could not correct the offsets: %s\n", strerror(-error));
+      }
+    }
+    entry->temperature = check->Temperature();
+    entry->calibrated_s = WallClockS();
+    store->Put(*entry);
+    int error = store->Save();
+    if (error < 0) {
+      printf("Could not save the calibration: %s\n", strerror(-error));
+    }
+    return true;
+  }
+  return false;
+}
+
+// Put imu in wake-on-motion mode and block on int_line until it moves by
+// threshold_mg. Returns once the device samples at full rate again, the
+// first sample is ready by then.
+int SleepUntilMotion(Mpu9250* imu, uint threshold_mg, GpioLine* int_line) {
+  printf("Idle, sleeping until the device moves by %u mg...\n",
+         threshold_mg);
+  uint64_t start_ns = MonotonicRawNs();
+  int error = imu->EnableWakeOnMotion(threshold_mg, Mpu9250::kWake7_81Hz);
+  while (error == 0) {
+    // Only WOM_INT drives the pin now, INT_STATUS tells it from a spurious
+    // edge
+    int edge = int_line->WaitForEdge(-1, nullptr);
+    error = edge < 0 ? edge : 0;
+    if (error == 0) {
+      error = imu->ReadIntStatus();
+    }
+    if (error == 0 && (imu->int_status & 0x40)) {
+      break;
+    }
+  }
+  uint64_t woken_ns = MonotonicRawNs();
+  if (error == 0) {
+    error = imu->DisableWakeOnMotion();
+  }
+  if (error == 0) {
+    printf("Woken up after %.1f s, sampling at full rate again %.1f ms"
+           " later\n",
+           (woken_ns - start_ns)/1e9, (MonotonicRawNs() - woken_ns)/1e6);
+  }
+  return error;
+}
+
+// Loop of the -m mode, shows what every IMU found has delivered
+void RunManaged(bool simulated, bool fifo_mode) {
+  // The manager does not own the buses it is given, these outlive it
+  SimMultiBus sim_buses[kNumSimBuses];
+  ImuManager manager(fifo_mode ? ImuManager::kFifo : ImuManager::kPolling,
+                     1024);
+  if (simulated) {
+    for (uint bus_n = 0; bus_n < kNumSimBuses; bus_n++) {
+      sim_buses[bus_n].AddDevice(kMpu6500Addr);
+      sim_buses[bus_n].AddDevice(kMpu6500AddrAd0);
+      manager.AddBus(&sim_buses[bus_n], bus_n);
+    }
+  } else {
+    manager.Scan(0, kMaxBusN);
+  }
+  if (manager.NumDevices() == 0) {
+    printf("No MPU9250 found\n");
+    exit(1);
+  }
+  printf("Found %u MPU9250s on %u buses\n", manager.NumDevices(),
+         manager.NumBuses());
+  manager.Start();
+
+  typedef Mpu9250Config<GyroFs::k250, AccelFs::k2g, MagBits::k16> Config;
+  Mpu9250Sample samples[kMaxFifoSamples];
+  while (1) {
+    for (uint i = 0; i < manager.NumDevices(); i++) {
+      // Keep the newest sample of each device, timestamps of all of them
+      // are on the same clock
+      const ImuManager::DeviceInfo& info = manager.Info(i);
+      Mpu9250Sample latest;
+      bool new_data = false;
+      uint n;
+      while ((n = manager.PopN(i, samples, kMaxFifoSamples)) > 0) {
+        latest = samples[n-1];
+        new_data = true;
+      }
+      printf("i2c-%u %#04x: %llu samples, %llu overruns, %llu errors",
+             info.bus_n, info.addr, (unsigned long long)manager.Samples(i),
+             (unsigned long long)manager.Overruns(i),
+             (unsigned long long)manager.Errors(i));
+      const Histogram& interval = manager.Timing(i).IntervalNs();
+      printf(", interval p99 %.1f us", interval.Percentile(0.99)/1e3);
+      if (new_data) {
+        printf(", at %.6f s accel % 0.2f % 0.2f % 0.2f mg,"
+               " gyro % 0.2f % 0.2f % 0.2f degrees/sec",
+               latest.timestamp_ns/1e9,
+               1000*latest.accel_count[0]*Config::kAccelRes,
+               1000*latest.accel_count[1]*Config::kAccelRes,
+               1000*latest.accel_count[2]*Config::kAccelRes,
+               latest.gyro_count[0]*Config::kGyroRes,
+               latest.gyro_count[1]*Config::kGyroRes,
+               latest.gyro_count[2]*Config::kGyroRes);
+      }
+      printf("\n");
+    }
+    usleep(0.2*1000000);
+  }
+}
+
+int main(int argc, char* argv[]){
+  bool fifo_mode = false;
+  bool threaded = false;
+  bool simulated = false;
+  bool managed = false;
+  bool magnetom_master = false;
+  uint calibration_ms = 0;
+  uint wake_mg = 0;
+  const char* store_path = nullptr;
+  const char* record_path = nullptr;
+  GpioLine* int_line = nullptr;
+
+  int opt;
+  uint chip_n, line_n;
+  while ((opt = getopt(argc, argv, "fac:k:g:w:tmr:sh")) != -1) {
+    switch (opt) {
+      case 'f':
+        fifo_mode = true;
+        break;
+      case 'a':
+        magnetom_master = true;
+        break;
+      case 'c':
+        calibration_ms = atoi(optarg);
+        break;
+      case 'k':
+        store_path = optarg;
+        break;
+      case 'g':
+        if (sscanf(optarg, "%u:%u", &chip_n, &line_n) != 2) {
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        int_line = new GpioLine(chip_n, line_n);
+        if (!int_line->IsOpen()) {
+          printf("Could not request line %u of /dev/gpiochip%u: %s\n",
+                 line_n, chip_n, strerror(-int_line->OpenError()));
+          exit(1);
+        }
+        break;
+      case 'w':
+        wake_mg = atoi(optarg);
+        break;
+      case 't':
+        threaded = true;
+        break;
+      case 'm':
+        managed = true;
+        break;
+      case 'r':
+        record_path = optarg;
+        break;
+      case 's':
+        simulated = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if (fifo_mode && int_line != nullptr) {
+    // The FIFO exists so the host does not have to wake up for every sample
+    printf("-f and -g cannot be combined\n");
+    exit(1);
+  }
+  if (wake_mg > 0 && threaded) {
+    // Only the thread reading the device may put it to sleep
+    printf("-w and -t cannot be combined\n");
+    exit(1);
+  }
+  if (wake_mg > 0 && int_line == nullptr) {
+    // Without the pin the host would have to poll INT_STATUS while the
+    // device sleeps. With it this loop also waits for every data ready
+    // once the device is awake, so it runs at the sample rate.
+    printf("-w needs -g\n");
+    exit(1);
+  }
+  if (managed) {
+    if (threaded || int_line != nullptr || record_path != nullptr ||
+        magnetom_master || calibration_ms > 0 || store_path != nullptr ||
+        wake_mg > 0) {
+      // The manager always runs its own threads and polls, and picks the
+      // internal I2C master itself where it is needed
+      printf("-m cannot be combined with -a, -c, -g, -k, -t, -r or -w\n");
+      exit(1);
+    }
+    RunManaged(simulated, fifo_mode);
+  }
+
+  Bus* bus;
+  if (simulated) {
+    bus = new SimBus();
+  } else {
+    I2cBus* i2c_bus = new I2cBus(kBusN);
+    if (!i2c_bus->IsOpen()) {
+      printf("Could not open /dev/i2c-%u: %s\n", kBusN,
+             strerror(-i2c_bus->OpenError()));
+      exit(1);
+    }
+    bus = i2c_bus;
+  }
+  // Full-scale ranges are fixed at compile time
+  typedef Mpu9250Fixed<GyroFs::k250, AccelFs::k2g, MagBits::k16> Imu;
+  Imu imu(bus);
+  // Calibration of this device, from the -k store or the one made below
+  CalibrationStore* store = nullptr;
+  CalibrationEntry calibration;
+  bool stored = false;  // calibration was found in the store
+  bool cached = false;  // and its offsets are in use
 
   printf("===== MPU 9250 Demo using Linux =====\n");
   // Initiating communication
+  uint64_t startup_ns = MonotonicRawNs();
   uint8_t c = imu.ComTest(kWhoAmImpu6500);
 
   // Setup --------------------------------------------------------------------
   if (c == 0x71){  // WHO_AM_I should always be 0x71
     printf("MPU9250 is online...\n");
 
-    imu.InitMpu9250();
-    imu.GetGyroRes();
-    imu.GetAccelRes();
-    imu.GetMagnetomRes();
+    // Start from the defaults, a previous run may have left the FIFO or the
+    // internal I2C master running
+    int error = imu.Reset();
+    if (error < 0) {
+      printf("Could not reset MPU9250: %s\n", strerror(-error));
+      exit(1);
+    }
+    error = imu.InitMpu9250();
+    if (error < 0) {
+      printf("Could not initialize MPU9250: %s\n", strerror(-error));
+      exit(1);
+    }
+
+    // A device calibrated before gets its offsets back right away, and the
+    // AK8963 is spared the trip through fuse ROM access mode
+    if (store_path != nullptr) {
+      store = new CalibrationStore(store_path);
+      error = store->Load();
+      if (error < 0) {
+        printf("Starting %s over: %s\n", store_path, strerror(-error));
+      }
+      uint8_t fingerprint[kFingerprintLen];
+      error = imu.ReadFingerprint(fingerprint);
+      if (error < 0) {
+        printf("Could not read the MPU9250 fingerprint: %s\n",
+               strerror(-error));
+        exit(1);
+      }
+      const CalibrationEntry* entry = store->Find(kBusN, imu.Address(),
+                                                  fingerprint);
+      if (entry != nullptr) {
+        calibration = *entry;
+        stored = true;
+        float temperature = imu.ReadTempData()/333.87f + 21.0f;
+        uint64_t now_s = WallClockS();
+        cached = CalibrationUsable(calibration, temperature, now_s,
+                                   kDefaultCalibrationPolicy);
+        if (cached) {
+          error = ApplyCalibration(&imu, calibration);
+          if (error < 0) {
+            printf("Could not apply the calibration: %s\n",
+                   strerror(-error));
+            exit(1);
+          }
+        }
+        printf("Calibration from %s, %.1f days old at %.1f C, now %.1f C%s\n",
+               store_path, ((double)now_s - calibration.calibrated_s)/86400,
+               calibration.temperature, temperature,
+               cached ? "" : ", calibrating again");
+      } else {
+        printf("No calibration of this MPU9250 in %s\n", store_path);
+      }
+    }
 
     // Read the WIA register of the magnetometer, this is a good test of
     // communication
     uint8_t d = imu.ComTest(kWia);
     if (d == 0x48){  // WHO_AM_I should always be 0x48
       printf("AK8963 is online...\n");
+      error = imu.InitAk8963(Mpu9250::kMagnetom100Hz,
+                             stored ? calibration.asa : nullptr);
+      if (error < 0) {
+        printf("Could not initialize AK8963: %s\n", strerror(-error));
+        exit(1);
+      }
+      printf("X-Axis sensitivity adjustment value %0.2f\n",
+             imu.MagnetomAdjust(0));
+      printf("Y-Axis sensitivity adjustment value %0.2f\n",
+             imu.MagnetomAdjust(1));
+      printf("Z-Axis sensitivity adjustment value %0.2f\n",
+             imu.MagnetomAdjust(2));
+      if (magnetom_master) {
+        error = imu.EnableMagnetomMaster();
+        if (error < 0) {
+          printf("Could not start the internal I2C master: %s\n",
+                 strerror(-error));
+          exit(1);
+        }
+        printf("Reading the AK8963 through the internal I2C master...\n");
+      }
     } else {
       perror("Could not connect to AK8963");
       exit(1);
@@ -51,37 +420,243 @@ int main(){
     perror("Could not connect to MPU9250");
     exit(1);
   }
+  // Every step above polls the device instead of sleeping, this is how long
+  // it took until the first sample of each sensor was ready
+  const StartupTiming& startup = imu.startup;
+  printf("Start-up in %.1f ms: reset %.1f, configuration %.1f, first sample"
+         " %.1f, AK8963 fuse ROM %.1f, first measurement %.1f ms\n",
+         (MonotonicRawNs() - startup_ns)/1e6, startup.reset_ns/1e6,
+         startup.config_ns/1e6, startup.data_ready_ns/1e6,
+         startup.fuse_rom_ns/1e6, startup.magnetom_ns/1e6);
+
+  if (!cached && (calibration_ms > 0 || store != nullptr)) {
+    CalibrationConfig config = kDefaultCalibration;
+    if (calibration_ms > 0) {
+      config.window_ms = calibration_ms;
+    }
+    CalibrationResult result;
+    printf("Calibrating, keep the device still...\n");
+    uint64_t start_ns = MonotonicRawNs();
+    int error = imu.Calibrate(config, &result);
+    if (error < 0) {
+      printf("Could not calibrate: %s\n", strerror(-error));
+      exit(1);
+    }
+    printf("%u samples in %.1f ms at %.1f C\n", result.samples,
+           (MonotonicRawNs() - start_ns)/1e6, result.temperature);
+    printf("Gyro bias % 0.3f % 0.3f % 0.3f degrees/sec, offsets"
+           " %d %d %d\n", result.gyro_bias[0], result.gyro_bias[1],
+           result.gyro_bias[2], result.gyro_offset[0], result.gyro_offset[1],
+           result.gyro_offset[2]);
+    printf("Accel bias % 0.1f % 0.1f % 0.1f mg\n",
+           1000*result.accel_bias[0], 1000*result.accel_bias[1],
+           1000*result.accel_bias[2]);
+    if (store != nullptr) {
+      error = MakeCalibrationEntry(&imu, kBusN, result, config.accel,
+                                   &calibration);
+      if (error == 0) {
+        store->Put(calibration);
+        error = store->Save();
+      }
+      if (error < 0) {
+        printf("Could not save the calibration: %s\n", strerror(-error));
+      } else {
+        printf("Saved to %s\n", store_path);
+      }
+    }
+  }
+  // Cached offsets are checked against the samples the loop below gets
+  // while the device lies still, no window is set aside for it
+  BiasCheck* bias_check = nullptr;
+  if (cached) {
+    bias_check = new BiasCheck(Imu::Config::kGyroRes,
+                               Imu::Config::kAccelRes);
+  }
+  auto check_bias = [&](const Mpu9250Sample* checked, uint n) {
+    // Only this thread may write the offsets unless acquisition runs on
+    // its own
+    if (bias_check != nullptr &&
+        Revalidate(bias_check, checked, n, threaded ? nullptr : &imu,
+                   store, &calibration)) {
+      delete bias_check;
+      bias_check = nullptr;
+    }
+  };
+
+  Mpu9250Sample samples[kMaxFifoSamples];
+  Mpu9250Sample latest;
+  // Orientation estimate, updated with every new sample shown
+  MahonyFilter filter;
+  // The filter integrates over the time between the samples it is fed
+  uint64_t last_update_ns = MonotonicRawNs();
+  float yaw = 0.0f, pitch = 0.0f, roll = 0.0f;
+  // With -w, acceleration the device has stayed within wake_mg of since
+  // still_since_ns, 0 until the next sample starts over
+  int16_t still_count[3];
+  uint64_t still_since_ns = 0;
+  Recorder* recorder = nullptr;
+  if (record_path != nullptr) {
+    printf("Recording to %s...\n", record_path);
+    recorder = new Recorder(record_path, MakeRecordScale<Imu::Config>(),
+                            MakeRecordMagnetom(imu), kRecordChunk);
+    if (recorder->Error() < 0) {
+      printf("Could not create %s: %s\n", record_path,
+             strerror(-recorder->Error()));
+      exit(1);
+    }
+  }
+  auto record = [&](const Mpu9250Sample* recorded, uint n) {
+    // A recording that cannot grow, e.g. on a full disk, is closed with
+    // what it has and acquisition carries on without it
+    if (recorder != nullptr && recorder->Append(recorded, n) < 0) {
+      printf("Recording stopped after %llu samples: %s\n",
+             (unsigned long long)recorder->Count(),
+             strerror(-recorder->Error()));
+      delete recorder;
+      recorder = nullptr;
+    }
+  };
+  Acquisition* acquisition = nullptr;
+  if (threaded) {
+    // Sampling moves to its own thread, this loop only consumes
+    Acquisition::Mode mode = Acquisition::kPolling;
+    if (fifo_mode) {
+      mode = Acquisition::kFifo;
+    } else if (int_line != nullptr) {
+      mode = Acquisition::kInterrupt;
+    }
+    printf("Acquiring on a background thread...\n");
+    acquisition = new Acquisition(&imu, mode, int_line, 1024);
+    acquisition->Start();
+  } else if (fifo_mode) {
+    printf("Streaming through the FIFO...\n");
+    imu.EnableFifo();
+  }
+  if (wake_mg > 0) {
+    // Nothing happens until the device is picked up
+    int error = SleepUntilMotion(&imu, wake_mg, int_line);
+    if (error < 0) {
+      printf("Wake-on-motion failed: %s\n", strerror(-error));
+      exit(1);
+    }
+    last_update_ns = MonotonicRawNs();
+  }
 
   // End Setup ----------------------------------------------------------------
 
   while(1){  // Arduino loop like
-    // If intPin goes high, all data registers have new data
-    // On interrupt, check if data ready interrupt
-    uint8_t data;
-    i2c_bus.ReadFromMem(kMpu6500Addr, kIntStatus, &data);
-    if ( data == 0x01){
+    bool new_data = false;
+    if (threaded) {
+      // Take everything queued since the last iteration and keep the newest
+      // sample for display
+      uint n = acquisition->PopN(samples, kMaxFifoSamples);
+      while (n == kMaxFifoSamples) {
+        record(samples, n);
+        check_bias(samples, n);
+        latest = samples[n-1];
+        new_data = true;
+        n = acquisition->PopN(samples, kMaxFifoSamples);
+      }
+      if (n > 0) {
+        record(samples, n);
+        check_bias(samples, n);
+        latest = samples[n-1];
+        new_data = true;
+      }
+      printf("Acquired %llu samples, %llu overruns, %llu errors\n",
+             (unsigned long long)acquisition->Samples(),
+             (unsigned long long)acquisition->Overruns(),
+             (unsigned long long)acquisition->Errors());
+    } else if (fifo_mode) {
+      // Drain every complete packet gathered since the last iteration and
+      // keep the newest one for display
+      int n = imu.ReadFifo(samples, kMaxFifoSamples);
+      if (n < 0) {
+        // The FIFO was reset, the packets in it are lost
+        printf("FIFO read failed: %s\n", strerror(-n));
+        n = 0;
+      }
+      record(samples, n);
+      check_bias(samples, n);
+      if (n > 0) {
+        latest = samples[n-1];
+        // The magnetometer is only part of the FIFO packets when the
+        // internal I2C master reads it
+        if (!imu.MagnetomMaster()) {
+          imu.ReadMagnetomData(latest.magnetom_count);
+        }
+        new_data = true;
+      }
+      printf("Drained %d FIFO samples, %u overflows\n", n,
+             imu.fifo_overflows);
+    } else {
+      // If intPin goes high, all data registers have new data
+      // Read INT_STATUS together with every sensor in one bus transaction and
+      // only use the result if the data ready interrupt was set
+      // A failed read clears int_status, that sample is skipped
+      if (imu.ReadSensorsBatched() < 0) {
+        printf("Read failed, %u errors so far\n", imu.read_errors);
+      }
+      new_data = imu.int_status & 0x01;
+      imu.CopySample(&latest);
+      record(&latest, new_data ? 1 : 0);
+      check_bias(&latest, new_data ? 1 : 0);
+    }
 
-      imu.ReadAccelData(imu.accel_count);  // Read the x/y/z adc values
+    if (new_data) {
       // Now we'll calculate the acceleration value into actual g's
-      // This depends on scale being set
-      imu.accel_x = (float)imu.accel_count[0]*imu.accel_res;
-      imu.accel_y = (float)imu.accel_count[1]*imu.accel_res;
-      imu.accel_z = (float)imu.accel_count[2]*imu.accel_res;
+      // This depends on scale being set, the resolutions are constexpr
+      imu.accel_x = (float)latest.accel_count[0]*Imu::Config::kAccelRes;
+      imu.accel_y = (float)latest.accel_count[1]*Imu::Config::kAccelRes;
+      imu.accel_z = (float)latest.accel_count[2]*Imu::Config::kAccelRes;
 
-      imu.ReadGyroData(imu.gyro_count);  // Read the x/y/z adc values
       // Calculate the gyro value into actual degrees per second
       // This depends on scale being set
-      imu.gyro_x = (float)imu.gyro_count[0]*imu.gyro_res;
-      imu.gyro_y = (float)imu.gyro_count[1]*imu.gyro_res;
-      imu.gyro_z = (float)imu.gyro_count[2]*imu.gyro_res;
+      imu.gyro_x = (float)latest.gyro_count[0]*Imu::Config::kGyroRes;
+      imu.gyro_y = (float)latest.gyro_count[1]*Imu::Config::kGyroRes;
+      imu.gyro_z = (float)latest.gyro_count[2]*Imu::Config::kGyroRes;
+
+      // Get actual magnetometer value, the scale, factory sensitivity
+      // adjustment and hard-iron offsets are folded into one gain and offset
+      float field[3];
+      imu.ConvertMagnetom(latest.magnetom_count, field);
+      imu.magnetom_x = field[0];
+      imu.magnetom_y = field[1];
+      imu.magnetom_z = field[2];
+
+      // Temperature in degrees Centigrade
+      // TEMP_degC = ((TEMP_OUT - RoomTemp_Offset)/Temp_Sensitivity) + 21degC
+      // Data found on MPU-9250 Product Specification section 3.4.2
+      // Sensitivity = 333.87 LSB/°C
+      // Room Temp Offset = 0 LSB
+      imu.temperature = ((float) latest.temp_count) / 333.87 + 21.0;
 
-      imu.ReadMagnetomData(imu.magnetom_count);  // Read the x/y/z adc values
-      // Get actual magnetometer value, this depends on scale being set
-      imu.magnetom_x = (float)imu.magnetom_count[0]*imu.magnetom_res;
-      imu.magnetom_y = (float)imu.magnetom_count[1]*imu.magnetom_res;
-      imu.magnetom_z = (float)imu.magnetom_count[2]*imu.magnetom_res;
+      // Sensors x (y)-axis of the accelerometer is aligned with the y (x)-axis
+      // of the magnetometer, the same allowance as in the Arduino sketch is
+      // made when feeding the filter. Pass gyro rate as rad/s.
+      FusionInput in = {
+        {imu.accel_x, imu.accel_y, imu.accel_z},
+        {imu.gyro_x*kDegToRad, imu.gyro_y*kDegToRad, imu.gyro_z*kDegToRad},
+        {imu.magnetom_y, imu.magnetom_x, imu.magnetom_z},
+        (latest.timestamp_ns - last_update_ns)/1e9f
+      };
+      last_update_ns = latest.timestamp_ns;
+      filter.Update(in);
+      QuaternionToEuler(filter.GetQ(), &yaw, &pitch, &roll);
 
-      imu.temp_count = imu.ReadTempData();  // Read the adc values
+      if (wake_mg > 0) {
+        bool moved = still_since_ns == 0;
+        for (int i = 0; i < 3; i++) {
+          moved = moved || 1000*Imu::Config::kAccelRes*
+              abs(latest.accel_count[i] - still_count[i]) > wake_mg;
+        }
+        if (moved) {
+          for (int i = 0; i < 3; i++) {
+            still_count[i] = latest.accel_count[i];
+          }
+          still_since_ns = latest.timestamp_ns;
+        }
+      }
     }
 
     // Print acceleration values in milligs!
@@ -99,16 +674,40 @@ int main(){
     printf("Y-mag field: % 0.2f mG\n", imu.magnetom_y);
     printf("Z-mag field: % 0.2f mG\n", imu.magnetom_z);
 
-    // Temperature in degrees Centigrade
-    // TEMP_degC = ((TEMP_OUT - RoomTemp_Offset)/Temp_Sensitivity) + 21degC
-    // Data found on MPU-9250 Product Specification section 3.4.2
-    // Sensitivity = 333.87 LSB/°C
-    // Room Temp Offset = 0 LSB
-    imu.temperature = ((float) imu.temp_count) / 333.87 + 21.0;
     // Print temperature in degrees Centigrade
     printf("Temperature is % 0.2f degrees C\n", imu.temperature);
 
-    usleep(0.2*1000000);
+    // Print the orientation estimate in degrees
+    printf("Yaw, Pitch, Roll: % 0.2f, % 0.2f, % 0.2f\n", yaw/kDegToRad,
+           pitch/kDegToRad, roll/kDegToRad);
+
+    // Sampling statistics kept by the driver, safe to read while the
+    // acquisition thread updates them
+    PrintTiming(imu.timing);
+
+    if (wake_mg > 0 && still_since_ns != 0 &&
+        MonotonicRawNs() - still_since_ns > kWakeIdleNs) {
+      // Still for long enough, block without using the CPU until the
+      // device is moved again
+      int error = SleepUntilMotion(&imu, wake_mg, int_line);
+      if (error < 0) {
+        printf("Wake-on-motion failed: %s\n", strerror(-error));
+        exit(1);
+      }
+      still_since_ns = 0;
+      last_update_ns = MonotonicRawNs();
+    } else if (int_line != nullptr && !threaded) {
+      // Sleep until the data ready interrupt fires. INT_STATUS is read by
+      // every sensor read above, which releases the latched INT pin.
+      int edge = int_line->WaitForEdge(1000, nullptr);
+      if (edge < 0) {
+        printf("Waiting for the INT pin failed: %s\n", strerror(-edge));
+        usleep(0.2*1000000);
+      }
+    } else {
+      // At 200 Hz the 512 byte FIFO fills up in about 180 ms
+      usleep((fifo_mode ? 0.1 : 0.2)*1000000);
+    }
   }
 
   return 0;
@@ -3,26 +3,73 @@
 
 #include "mpu9250.h"
 
+#include <errno.h>  // Needed for ENXIO, ETIMEDOUT
+#include <math.h>  // Needed for lround
+#include <string.h>  // Needed for strerror
+#include "decode.h"
+
+// Turn HXL through HZH, stored as little Endian, into signed 16-bit values
+static void DecodeMagnetomCounts(const uint8_t* raw_data,
+                                 int16_t* destination) {
+  destination[0] = ((int16_t)raw_data[1] << 8) | raw_data[0];
+  destination[1] = ((int16_t)raw_data[3] << 8) | raw_data[2];
+  destination[2] = ((int16_t)raw_data[5] << 8) | raw_data[4];
+}
+
+// Readiness is polled at this interval, short next to every timeout below
+static const uint kPollUs = 100;
+// Start-up time for register read/write, 100 ms at most in the electrical
+// characteristics of the MPU-9250 Product Specification
+static const uint kResetTimeoutUs = 100000;
+// The gyroscope takes 35 ms to start up, MPU-9250 Product Specification
+// 3.1. Only a typical figure is given, allow twice that before the first
+// sample of the new sample rate.
+static const uint kGyroStartUs = 2*35000;
+// Single measurement time, 9 ms at most in the electrical characteristics
+// of the AK8963 datasheet
+static const uint kMagnetomMeasureUs = 9000;
+
+// Keep a corrected offset register value within its 16 bits
+static int16_t ClampToInt16(long value) {
+  if (value > INT16_MAX) {
+    return INT16_MAX;
+  }
+  return value < INT16_MIN ? INT16_MIN : value;
+}
+
 // Mpu9250 constructor
-Mpu9250::Mpu9250(I2cBus* i2c_n) {
+Mpu9250::Mpu9250(Bus* i2c_n, uint8_t mpu_addr) {
   ptr_i2c = i2c_n;
+  mpu_addr_ = mpu_addr;
+  for (int i = 0; i < 3; i++) {
+    magnetom_count[i] = 0;
+  }
+  int_status = 0;
+  magnetom_new = 0;
+  GetMagnetomRes();
 }
 
 uint8_t Mpu9250::ComTest(uint8_t test_who){
-  // Read the WHO_AM_I register, this is a good test of communication
-  uint8_t who_am_i;
+  // Read the WHO_AM_I register, this is a good test of communication. 0 is
+  // returned when the read fails.
+  uint8_t who_am_i = 0;
+  int error = 0;
 
   if (test_who == kWia){
     printf("AK8963 should be: 0x48\t");
-    ptr_i2c->ReadFromMem(kAk8963Addr, kWia, &who_am_i);
+    error = ptr_i2c->ReadFromMem(kAk8963Addr, kWia, &who_am_i);
   } else if (test_who == kWhoAmImpu6500) {
     printf("MPU9250 should be: 0x71\t");
-    ptr_i2c->ReadFromMem(kMpu6500Addr, kWhoAmImpu6500, &who_am_i);
+    error = ptr_i2c->ReadFromMem(mpu_addr_, kWhoAmImpu6500, &who_am_i);
   } else {
-    perror("Mpu9250 WHO_AM_I register not valid!\n");
-    exit(1);
+    printf("Mpu9250 WHO_AM_I register not valid!\n");
+    return 0;
   }
 
+  if (error < 0) {
+    printf("WHO_AM_I read failed: %s\n", strerror(-error));
+    return 0;
+  }
   printf("WHO_AM_I: %#X\n", who_am_i);
   return who_am_i;
 }
@@ -82,9 +129,64 @@ void Mpu9250::GetMagnetomRes() {
       magnetom_res = 10*4912.0/32760.0; // Proper scale to return milliGauss
       break;
   }
+  UpdateMagnetomScale_();
+}
+
+void Mpu9250::UpdateMagnetomScale_() {
+  // field = count*res*adjust - bias, AK8963 datasheet 8.3.11 for adjust
+  for (int i = 0; i < 3; i++) {
+    magnetom_gain_[i] = magnetom_res*magnetom_adjust_[i];
+    magnetom_offset_[i] = -magnetom_bias_[i];
+  }
 }
 
-void Mpu9250::InitMpu9250(){
+void Mpu9250::SetMagnetomBias(const float* bias) {
+  for (int i = 0; i < 3; i++) {
+    magnetom_bias_[i] = bias[i];
+  }
+  UpdateMagnetomScale_();
+}
+
+template <typename ReadReg>
+int Mpu9250::Poll_(ReadReg read, uint8_t mask, uint8_t want,
+                   uint timeout_us) {
+  uint64_t deadline_ns = MonotonicRawNs() + (uint64_t)timeout_us*1000;
+  while (true) {
+    uint8_t value;
+    int error = read(&value);
+    if (error == 0 && (value & mask) == want) {
+      return 0;
+    }
+    if (error < 0 && !Bus::IsTransient(error)) {
+      return error;
+    }
+    if (MonotonicRawNs() > deadline_ns) {
+      return -ETIMEDOUT;
+    }
+    usleep(kPollUs);
+  }
+}
+
+int Mpu9250::Reset() {
+  // H_RESET reads back set until the reset is done, so instead of sleeping
+  // for the worst case just wait for it to clear
+  uint64_t start_ns = MonotonicRawNs();
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kPwrMgmt1, 0x80);
+  if (error == 0) {
+    error = Poll_([this](uint8_t* value) {
+                    return ptr_i2c->ReadFromMem(mpu_addr_, kPwrMgmt1, value);
+                  }, 0x80, 0x00, kResetTimeoutUs);
+  }
+  startup.reset_ns = MonotonicRawNs() - start_ns;
+  // Whatever the driver had set up is gone
+  user_ctrl_ = 0x00;
+  magnetom_master_ = false;
+  magnetom_ready_ = false;
+  fifo_packet_len_ = kFifoPacketLen;
+  return error;
+}
+
+int Mpu9250::InitMpu9250(){
   // -------------------> Configure Gyro and Thermometer <-------------------
   // Disable FSYNC and set thermometer and gyro bandwith to 41 and 42 Hz
   // rerspectively; minimum delay time for this setting is 5.9 ms, which means
@@ -92,12 +194,22 @@ void Mpu9250::InitMpu9250(){
   // DLPF_CFG = bits 2:0 = 011; this limits the sample rate to 1000 Hz for
   // both. With the MPU9250, it is possible to get gyro sample rates of
   // 32 kHz (!), 8 kHz, or 1 kHz
-  ptr_i2c->WriteToMem(kMpu6500Addr, kConfig, 0x03);
+  //
+  // Every step stops at the first register write that fails for good, the
+  // bus has already retried it
+  uint64_t start_ns = MonotonicRawNs();
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kConfig, 0x03);
+  if (error < 0) {
+    return error;
+  }
 
   // ------> Set sample rate = gyroscope output rate/(1 + SMPLRT_DIV) <-------
   // Use a 200 Hz rate; a rate consistent with the filter update rate
   // determined in config above
-  ptr_i2c->WriteToMem(kMpu6500Addr, kSmplrtDiv, 0x04);
+  error = SetSampleRateDivider(0x04);
+  if (error < 0) {
+    return error;
+  }
 
   // -------------------> Set gyroscope full scale range <--------------------
   // Range selects FS_SEL and AFS_SEL are 0 - 3, so 2-bit values are
@@ -105,13 +217,19 @@ void Mpu9250::InitMpu9250(){
   uint8_t c = 0;
   c = c | gyro_scale << 3;  // Set full scale range for the gyro
   // Write new GYRO_CONFIG value to register
-  ptr_i2c->WriteToMem(kMpu6500Addr, kGyroConfig, c);
+  error = ptr_i2c->WriteToMem(mpu_addr_, kGyroConfig, c);
+  if (error < 0) {
+    return error;
+  }
 
   // Set accelerometer full-scale range configuration
   c = 0;
-  c = c & accel_scale << 3;  // Set full scale range for the accelerometer
+  c = c | accel_scale << 3;  // Set full scale range for the accelerometer
   // Write new ACCEL_CONFIG register value
-  ptr_i2c->WriteToMem(kMpu6500Addr, kAccelConfig, c);
+  error = ptr_i2c->WriteToMem(mpu_addr_, kAccelConfig, c);
+  if (error < 0) {
+    return error;
+  }
 
   // -------------> Set accelerometer sample rate configuration <-------------
   // It is possible to get a 4 kHz sample rate from the accelerometer by
@@ -120,7 +238,10 @@ void Mpu9250::InitMpu9250(){
   c = 0;
   c = c | 0x03;  // Set accelerometer rate to 1 kHz and bandwith to 41 Hz
   // Write a new ACCEL_CONFIG2 register value
-  ptr_i2c->WriteToMem(kMpu6500Addr, kAccelConfig2, c);
+  error = ptr_i2c->WriteToMem(mpu_addr_, kAccelConfig2, c);
+  if (error < 0) {
+    return error;
+  }
   // The accelerometer, gyro, and thermometer are set to 1 kHz sample rates,
   // but all these rates are further reduced by a factor of 5 to 200 Hz
   // because of the SMPLRT_DIV setting
@@ -130,60 +251,933 @@ void Mpu9250::InitMpu9250(){
   // until interrupt cleared, clear on read of INT_STATUS, and enable
   // I2C_BYPASS_EN so additional chips can join the I2C bus and all can be
   // controlled by Linux as master
-  ptr_i2c->WriteToMem(kMpu6500Addr, kIntPinCfg, 0x22);  // Enable magnetometer
+  error = SetBypass(true);  // Enable magnetometer
+  if (error < 0) {
+    return error;
+  }
   // Enable data ready (bit 0) interrupt
-  ptr_i2c->WriteToMem(kMpu6500Addr, kIntEnable, 0X01);
-  usleep(100*1000);
+  error = ptr_i2c->WriteToMem(mpu_addr_, kIntEnable, 0X01);
+  if (error < 0) {
+    return error;
+  }
+
+  // Rather than sleeping for the worst case, wait for the data ready bit of
+  // INT_STATUS. Reading it clears it, the next read finds the next sample.
+  uint64_t config_done_ns = MonotonicRawNs();
+  startup.config_ns = config_done_ns - start_ns;
+  error = Poll_([this](uint8_t* value) {
+                  return ptr_i2c->ReadFromMem(mpu_addr_, kIntStatus, value);
+                }, 0x01, 0x01, kGyroStartUs + 2*sample_period_ns_/1000);
+  startup.data_ready_ns = MonotonicRawNs() - config_done_ns;
+  return error;
+}
+
+int Mpu9250::SetSampleRateDivider(uint8_t divider) {
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kSmplrtDiv, divider);
+  if (error == 0) {
+    sample_period_ns_ = 1000000*(1 + (uint32_t)divider);
+  }
+  return error;
+}
+
+int Mpu9250::SetBypass(bool enable) {
+  // INT_PIN_CFG as set up by InitMpu9250, with or without I2C_BYPASS_EN. Two
+  // MPU-9250s on one bus both put their AK8963 at 0x0C once bypass is on, so
+  // it has to stay off for all but one of them.
+  return ptr_i2c->WriteToMem(mpu_addr_, kIntPinCfg, enable ? 0x22 : 0x20);
+}
+
+int Mpu9250::Ak8963Slv4_(bool read, uint8_t reg, uint8_t* data) {
+  // Single register read or write through SLV4. The internal I2C master
+  // only runs once per sample, so give it a few sample periods to raise
+  // SLV4_DONE.
+  uint8_t addr = read ? 0x80 | kAk8963Addr : kAk8963Addr;
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv4Addr, addr);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv4Reg, reg);
+  }
+  if (error == 0 && !read) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv4Do, *data);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv4Ctrl, 0x80);  // SLV4_EN
+  }
+  if (error < 0) {
+    return error;
+  }
+
+  uint64_t deadline_ns = MonotonicRawNs() + 4*(uint64_t)sample_period_ns_;
+  while (true) {
+    // I2C_MST_STATUS is cleared on read. A failed read may have cleared
+    // SLV4_DONE, which a retry would then never see, so the error is
+    // returned instead of timing out.
+    uint8_t status;
+    error = ptr_i2c->ReadFromMemIntoOnce(mpu_addr_, kI2cMstStatus, 1,
+                                         &status);
+    if (error < 0) {
+      return error;
+    }
+    if (status & 0x10) {  // I2C_SLV4_NACK
+      return -ENXIO;
+    }
+    if (status & 0x40) {  // I2C_SLV4_DONE
+      if (read) {
+        return ptr_i2c->ReadFromMem(mpu_addr_, kI2cSlv4Di, data);
+      }
+      return 0;
+    }
+    if (MonotonicRawNs() > deadline_ns) {
+      return -ETIMEDOUT;
+    }
+    usleep(100);
+  }
+}
 
+int Mpu9250::ReadAk8963_(uint8_t reg, uint n_bytes, uint8_t* data) {
+  if (!(user_ctrl_ & 0x20)) {
+    return ptr_i2c->ReadFromMemInto(kAk8963Addr, reg, n_bytes, data);
+  }
+  // SLV4 moves one byte at a time
+  for (uint i = 0; i < n_bytes; i++) {
+    int error = Ak8963Slv4_(true, reg + i, &data[i]);
+    if (error < 0) {
+      return error;
+    }
+  }
+  return 0;
 }
 
-void Mpu9250::ReadAccelData(int16_t* destination){
+int Mpu9250::WriteAk8963_(uint8_t reg, uint8_t data) {
+  if (!(user_ctrl_ & 0x20)) {
+    return ptr_i2c->WriteToMem(kAk8963Addr, reg, data);
+  }
+  return Ak8963Slv4_(false, reg, &data);
+}
+
+int Mpu9250::InitAk8963(MagnetomMode mode, const uint8_t* asa) {
+  // The AK8963 has to pass through power-down between any two modes and
+  // stay there at least 100 us, AK8963 datasheet 6.3. Nothing shows when
+  // that is over, so this is the only step that sleeps.
+  const uint kPowerDownUs = 100;
+  uint64_t start_ns = MonotonicRawNs();
+  magnetom_ready_ = false;
+  int error = WriteAk8963_(kCntl, kMagnetomPowerDown);
+  if (error < 0) {
+    return error;
+  }
+  usleep(kPowerDownUs);
+
+  uint8_t fuse_rom[3];
+  if (asa == nullptr) {
+    // Fuse ROM access mode, then read the x, y and z sensitivity adjustment
+    error = WriteAk8963_(kCntl, 0x0F);
+    if (error < 0) {
+      return error;
+    }
+    error = ReadAk8963_(kAsax, 3, &fuse_rom[0]);
+    if (error < 0) {
+      return error;
+    }
+    error = WriteAk8963_(kCntl, kMagnetomPowerDown);
+    if (error < 0) {
+      return error;
+    }
+    usleep(kPowerDownUs);
+    asa = fuse_rom;
+  }
+  for (int i = 0; i < 3; i++) {
+    magnetom_asa_[i] = asa[i];
+    magnetom_adjust_[i] = AsaToAdjust(asa[i]);
+  }
+  UpdateMagnetomScale_();
+  uint64_t mode_ns = MonotonicRawNs();
+  startup.fuse_rom_ns = mode_ns - start_ns;
+
+  // BIT (bit 4) selects 16-bit output, MODE (bits 3:0) the measurement mode
+  m_mode = mode;
+  error = WriteAk8963_(kCntl, magnetom_scale << 4 | m_mode);
+  magnetom_on_ = error == 0 && mode != kMagnetomPowerDown;
+  if (error < 0 || mode == kMagnetomPowerDown) {
+    return error;
+  }
+
+  // Every measuring mode starts with a measurement, wait for its DRDY.
+  // While SLV0 reads the AK8963 the bit only shows in EXT_SENS_DATA_00 for
+  // the sample the measurement arrived with, which polling does not miss.
+  // Reads through SLV4 take a few samples each.
+  uint timeout_us = kMagnetomMeasureUs + 4*sample_period_ns_/1000;
+  if (magnetom_master_) {
+    error = Poll_([this](uint8_t* value) {
+                    return ptr_i2c->ReadFromMem(mpu_addr_, kExtSensData00,
+                                                value);
+                  }, 0x01, 0x01, timeout_us);
+  } else {
+    error = Poll_([this](uint8_t* value) {
+                    return ReadAk8963_(kSt1, 1, value);
+                  }, 0x01, 0x01, timeout_us);
+  }
+  startup.magnetom_ns = MonotonicRawNs() - mode_ns;
+  // The measurement waits for the next batched read
+  magnetom_ready_ = error == 0 && !magnetom_master_;
+  return error;
+}
+
+int Mpu9250::TriggerMagnetom() {
+  return WriteAk8963_(kCntl, magnetom_scale << 4 | kMagnetomSingle);
+}
+
+int Mpu9250::EnableMagnetomMaster() {
+  // From here on only the internal I2C master talks to the AK8963
+  int error = SetBypass(false);
+  if (error < 0) {
+    return error;
+  }
+  // 400 kHz on the auxiliary bus. WAIT_FOR_ES holds the data ready interrupt
+  // back until the external sensor data of the sample has been loaded.
+  error = ptr_i2c->WriteToMem(mpu_addr_, kI2cMstCtrl, 0x40 | 0x0D);
+  if (error < 0) {
+    return error;
+  }
+  error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl,
+                              user_ctrl_ | 0x20);  // I2C_MST_EN
+  if (error < 0) {
+    return error;
+  }
+  user_ctrl_ |= 0x20;
+
+  // Measure in the mode InitAk8963 picked, at the output resolution picked
+  error = WriteAk8963_(kCntl, magnetom_scale << 4 | m_mode);
+  if (error < 0) {
+    return error;
+  }
+  magnetom_on_ = m_mode != kMagnetomPowerDown;
+
+  // Read ST1 through ST2 on every sample. ST2 comes last, reading it
+  // releases the AK8963 data registers for the next measurement.
+  error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv0Addr, 0x80 | kAk8963Addr);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv0Reg, kSt1);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv0Ctrl,
+                                0x80 | kMagnetomBlockLen);  // I2C_SLV0_EN
+  }
+  if (error < 0) {
+    return error;
+  }
+  magnetom_master_ = true;
+
+  // A running FIFO has to start over with the longer packets
+  if (user_ctrl_ & 0x40) {
+    error = EnableFifo();
+  }
+  return error;
+}
+
+int Mpu9250::DisableMagnetomMaster() {
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kI2cSlv0Ctrl, 0x00);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl, user_ctrl_ & ~0x20);
+  }
+  if (error < 0) {
+    return error;
+  }
+  user_ctrl_ &= ~0x20;
+  magnetom_master_ = false;
+
+  error = SetBypass(true);
+  if (error == 0 && (user_ctrl_ & 0x40)) {
+    error = EnableFifo();
+  }
+  return error;
+}
+
+int Mpu9250::ReadAccelData(int16_t* destination){
   uint8_t raw_data[6];  // x/y/z accel register data stored here
   // Read the six raw data registers into data array
-  ptr_i2c->ReadFromMemInto(kMpu6500Addr, kAccelXoutH, 6, &raw_data[0]);
+  int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kAccelXoutH, 6, &raw_data[0]);
+  if (error < 0) {
+    return error;
+  }
   // Turn the MSB and LSB into a signed 16-bit value
   destination[0] = ((int16_t)raw_data[0] << 8) | raw_data[1];
   destination[1] = ((int16_t)raw_data[2] << 8) | raw_data[3];
   destination[2] = ((int16_t)raw_data[4] << 8) | raw_data[5];
+  return 0;
 }
 
-void Mpu9250::ReadGyroData(int16_t* destination){
+int Mpu9250::ReadGyroData(int16_t* destination){
   uint8_t raw_data[6];  // x/y/z gyro register data stored here
   // Read the six raw data registers sequentially into data array
-  ptr_i2c->ReadFromMemInto(kMpu6500Addr, kGyroXoutH, 6, &raw_data[0]);
+  int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kGyroXoutH, 6, &raw_data[0]);
+  if (error < 0) {
+    return error;
+  }
   // Turn the MSB and LSB into a signed 16-bit value
   destination[0] = ((int16_t)raw_data[0] << 8) | raw_data[1];
   destination[1] = ((int16_t)raw_data[2] << 8) | raw_data[3];
   destination[2] = ((int16_t)raw_data[4] << 8) | raw_data[5];
+  return 0;
 }
 
-void Mpu9250::ReadMagnetomData(int16_t* destination){
+int Mpu9250::ReadMagnetomData(int16_t* destination){
+  if (magnetom_master_) {
+    // SLV0 already fetched ST1 through ST2, a single read gets them
+    uint8_t block[kMagnetomBlockLen];
+    int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kExtSensData00,
+                                         kMagnetomBlockLen, &block[0]);
+    if (error < 0) {
+      return error;
+    }
+    DecodeExtSensData_(&block[0], destination);
+    return 0;
+  }
+
   // x/y/z gyro register data, ST2 register stored here, must read ST2 at end
   // of data acquisition
   uint8_t raw_data[7];
   uint8_t data_ready;
   // Wait for magnetometer data ready bit to be set
-  ptr_i2c->ReadFromMem(kAk8963Addr, kSt1, &data_ready);
-  if( data_ready == 0x01)
-  {
+  int error = ptr_i2c->ReadFromMem(kAk8963Addr, kSt1, &data_ready);
+  if (error < 0) {
+    return error;
+  }
+  // DOR (bit 1) may be set along with DRDY when measurements were missed,
+  // the data is still the latest
+  if (data_ready & 0x01) {
     // Read the six raw data and ST2 registers sequentially into data array
-    ptr_i2c->ReadFromMemInto(kAk8963Addr, kHxl, 7, &raw_data[0]);
+    error = ptr_i2c->ReadFromMemInto(kAk8963Addr, kHxl, 7, &raw_data[0]);
+    if (error < 0) {
+      return error;
+    }
     uint8_t c = raw_data[6]; // End data read by reading ST2 register
     // Check if magnetic sensor overflow set, if not then report data
     if(!(c & 0x08)){
-      // Turn the MSB and LSB into a signed 16-bit value
-      destination[0] = ((int16_t)raw_data[1] << 8) | raw_data[0];
-      // Data stored as little Endian
-      destination[1] = ((int16_t)raw_data[3] << 8) | raw_data[2];
-      destination[2] = ((int16_t)raw_data[5] << 8) | raw_data[4];
+      DecodeMagnetomCounts(&raw_data[0], destination);
     }
   }
+  return 0;
 }
 
 int16_t Mpu9250::ReadTempData() {
   uint8_t raw_data[2];  // temperature register data stored here
-  // Read the two raw data registers sequentially into data array
-  ptr_i2c->ReadFromMemInto(kMpu6500Addr, kTempOutH, 2, &raw_data[0]);
+  // Read the two raw data registers sequentially into data array, keep the
+  // last count if that fails
+  if (ptr_i2c->ReadFromMemInto(mpu_addr_, kTempOutH, 2, &raw_data[0]) < 0) {
+    return temp_count;
+  }
   // Turn the MSB and LSB into a 16-bit value
-  return ((int16_t)raw_data[0] << 8) | raw_data[1];
+  temp_count = ((int16_t)raw_data[0] << 8) | raw_data[1];
+  return temp_count;
+}
+
+void Mpu9250::DecodeSensorBlock_(const uint8_t* block) {
+  // block holds the registers INT_STATUS (0x3A) through GYRO_ZOUT_L (0x48)
+  int_status = block[0];
+  // Turn the MSB and LSB into a signed 16-bit value
+  accel_count[0] = ((int16_t)block[1] << 8) | block[2];
+  accel_count[1] = ((int16_t)block[3] << 8) | block[4];
+  accel_count[2] = ((int16_t)block[5] << 8) | block[6];
+  temp_count = ((int16_t)block[7] << 8) | block[8];
+  gyro_count[0] = ((int16_t)block[9] << 8) | block[10];
+  gyro_count[1] = ((int16_t)block[11] << 8) | block[12];
+  gyro_count[2] = ((int16_t)block[13] << 8) | block[14];
+}
+
+bool Mpu9250::DecodeMagnetomBlock_(const uint8_t* block,
+                                   int16_t* destination) {
+  // block holds ST1, x/y/z data and ST2. Only take new magnetometer data
+  // when ST1 flagged it ready and ST2 reports no magnetic sensor overflow.
+  if (!(block[0] & 0x01) || (block[kMagnetomBlockLen - 1] & 0x08)) {
+    return false;
+  }
+  DecodeMagnetomCounts(&block[1], destination);
+  return true;
+}
+
+bool Mpu9250::DecodeExtSensData_(const uint8_t* block, int16_t* destination) {
+  // block holds ST1 through ST2 as SLV0 read them. SLV0 reads ST2 on every
+  // sample, so DRDY is only set in the sample a measurement arrived with,
+  // but the data stays until the next one. Take it unless it overflowed and
+  // report whether it is new.
+  if (block[kMagnetomBlockLen - 1] & 0x08) {
+    return false;
+  }
+  DecodeMagnetomCounts(&block[1], destination);
+  return (block[0] & 0x01) != 0;
+}
+
+void Mpu9250::CountLostSample_() {
+  // INT_STATUS is cleared on read. An attempt that failed after reaching
+  // the device took data ready with it, the retry then finds the bit clear
+  // and the sample is gone, so count it like a read that failed. The retry
+  // may as well just be early, which costs an error too many, not a sample
+  // lost without a trace.
+  if (ptr_i2c->LastAttempts() > 1 && !(int_status & 0x01)) {
+    read_errors++;
+  }
+}
+
+void Mpu9250::TimeRead_(uint64_t start_ns) {
+  // Every read counts towards the latency, only those that found the data
+  // ready bit set deliver a new sample
+  timing.OnRead(start_ns, sample_time_ns);
+  if (int_status & 0x01) {
+    timing.OnSample(sample_time_ns);
+  }
+}
+
+int Mpu9250::ReadAllSensors() {
+  // Read INT_STATUS, accelerometer, temperature and gyroscope registers in a
+  // single burst. The MPU6500 latches the output registers for the duration
+  // of a burst read, so all values come from the same sample instant.
+  // EXT_SENS_DATA_00 follows GYRO_ZOUT_L, so when the internal I2C master
+  // reads the AK8963 the same burst carries the magnetometer too.
+  uint8_t raw_data[kSensorBlockLen + kMagnetomBlockLen];
+  uint n_bytes = kSensorBlockLen;
+  if (magnetom_master_) {
+    n_bytes += kMagnetomBlockLen;
+  }
+  uint64_t start_ns = MonotonicRawNs();
+  int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kIntStatus, n_bytes,
+                                       &raw_data[0]);
+  sample_time_ns = MonotonicRawNs();
+  magnetom_new = 0;
+  if (error < 0) {
+    // Nothing new, the sample is dropped
+    int_status = 0;
+    read_errors++;
+    return error;
+  }
+  DecodeSensorBlock_(&raw_data[0]);
+  CountLostSample_();
+  TimeRead_(start_ns);
+  if (magnetom_master_) {
+    magnetom_new = DecodeExtSensData_(&raw_data[kSensorBlockLen],
+                                      magnetom_count);
+  }
+  return 0;
+}
+
+int Mpu9250::ReadSensorsBatched() {
+  // Fetch the whole INT_STATUS..GYRO_ZOUT_L block and the AK8963 ST1, or
+  // ST1..ST2 once a measurement is ready, in a single combined bus
+  // transaction instead of one round trip per sensor.
+  if (magnetom_master_) {
+    // The magnetometer is part of the MPU6500 block already, a plain burst
+    // is all it takes
+    return ReadAllSensors();
+  }
+  uint8_t raw_data[kSensorBlockLen];
+  uint8_t mag_raw[kMagnetomBlockLen];  // ST1, x/y/z little endian data, ST2
+  I2cTransaction transaction;
+
+  // The AK8963 protects its data registers from the first data byte read
+  // until ST2, and drops a measurement that ends meanwhile. Reading
+  // HXL..ST2 on every read would keep them on the wire for a good part of
+  // the time and lose as many measurements, so only ST1 is read until it
+  // shows DRDY and the data goes with the next read, long before the
+  // following measurement ends. Reads further apart than the measurements
+  // find one ready anyway and take it at once. A measurement skipped
+  // anyway raises DOR.
+  uint64_t magnetom_period_ns = m_mode == kMagnetom100Hz ? 10000000
+                                                         : 125000000;
+  bool magnetom_whole = magnetom_ready_ ||
+                        MonotonicRawNs() - sample_time_ns >=
+                            magnetom_period_ns;
+  uint magnetom_len = magnetom_whole ? kMagnetomBlockLen : 1;
+  transaction.ReadFromMemInto(mpu_addr_, kIntStatus, kSensorBlockLen,
+                              &raw_data[0]);
+  transaction.ReadFromMemInto(kAk8963Addr, kSt1, magnetom_len, &mag_raw[0]);
+  uint64_t start_ns = MonotonicRawNs();
+  int error = ptr_i2c->Transfer(&transaction);
+  sample_time_ns = MonotonicRawNs();
+  if (error < 0) {
+    // Nothing new, the sample is dropped
+    int_status = 0;
+    magnetom_new = 0;
+    read_errors++;
+    return error;
+  }
+
+  DecodeSensorBlock_(&raw_data[0]);
+  CountLostSample_();
+  TimeRead_(start_ns);
+
+  if (magnetom_whole) {
+    magnetom_new = DecodeMagnetomBlock_(&mag_raw[0], magnetom_count);
+    // ST1-only reads leave DOR standing, count it once with the data
+    if (mag_raw[0] & 0x02) {
+      magnetom_overruns++;
+    }
+    magnetom_ready_ = false;
+  } else {
+    magnetom_new = 0;
+    magnetom_ready_ = (mag_raw[0] & 0x01) != 0;
+  }
+  return 0;
+}
+
+void Mpu9250::CopySample(Mpu9250Sample* sample) const {
+  // Snapshot the raw counts and completion time of the latest read
+  sample->timestamp_ns = sample_time_ns;
+  for (int i = 0; i < 3; i++) {
+    sample->accel_count[i] = accel_count[i];
+    sample->gyro_count[i] = gyro_count[i];
+    sample->magnetom_count[i] = magnetom_count[i];
+  }
+  sample->temp_count = temp_count;
+  sample->magnetom_new = magnetom_new;
+}
+
+int Mpu9250::EnableFifo() {
+  // Stop FIFO writes, reset the FIFO and then let the accelerometer,
+  // temperature and gyroscope, and the AK8963 data SLV0 reads if the
+  // internal I2C master is on, be written to it at the sample rate set by
+  // SMPLRT_DIV.
+  uint8_t fifo_en = kFifoEnSensors;
+  fifo_packet_len_ = kFifoPacketLen;
+  if (magnetom_master_) {
+    fifo_en |= kFifoEnSlv0;
+    fifo_packet_len_ += kMagnetomBlockLen;
+  }
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kFifoEn, 0x00);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl,
+                                user_ctrl_ | 0x04);  // FIFO_RST
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl,
+                                user_ctrl_ | 0x40);  // FIFO_EN
+  }
+  if (error == 0) {
+    user_ctrl_ |= 0x40;
+    error = ptr_i2c->WriteToMem(mpu_addr_, kFifoEn, fifo_en);
+  }
+  return error;
+}
+
+int Mpu9250::DisableFifo() {
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kFifoEn, 0x00);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl, user_ctrl_ & ~0x40);
+  }
+  if (error == 0) {
+    user_ctrl_ &= ~0x40;
+  }
+  return error;
+}
+
+int Mpu9250::ReadFifoCount() {
+  uint8_t raw_data[2];  // FIFO_COUNTH and FIFO_COUNTL
+  int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kFifoCountH, 2,
+                                       &raw_data[0]);
+  if (error < 0) {
+    return error;
+  }
+  // Only the lower 13 bits hold the number of bytes in the FIFO
+  return (((uint16_t)raw_data[0] << 8) | raw_data[1]) & 0x1FFF;
+}
+
+int Mpu9250::ReadFifoPackets_(uint8_t* raw_data, uint packet_count) {
+  // Read packet_count whole packets from FIFO_R_W into raw_data. Reads are
+  // as large as the adapter allows but always hold a whole number of packets
+  // so none gets split across transfers.
+  //
+  // A failed FIFO_R_W read may have consumed part of a packet, so it is not
+  // retried. The FIFO is reset instead and the packets of this drain are
+  // dropped.
+  uint chunk_packets = ptr_i2c->MaxTransfer()/fifo_packet_len_;
+  if (chunk_packets == 0) {
+    chunk_packets = 1;
+  } else if (chunk_packets > kFifoSize/fifo_packet_len_) {
+    chunk_packets = kFifoSize/fifo_packet_len_;
+  }
+
+  uint n = 0;
+  while (n < packet_count) {
+    uint n_read = packet_count - n;
+    if (n_read > chunk_packets) {
+      n_read = chunk_packets;
+    }
+    int error = ptr_i2c->ReadFromMemIntoOnce(mpu_addr_, kFifoRW,
+                                             n_read*fifo_packet_len_,
+                                             &raw_data[n*fifo_packet_len_]);
+    if (error < 0) {
+      read_errors++;
+      ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl, user_ctrl_ | 0x04);  // FIFO_RST
+      return error;
+    }
+    n += n_read;
+  }
+  return 0;
+}
+
+int Mpu9250::ReadFifo(Mpu9250Sample* samples, uint max_samples) {
+  // Drain up to max_samples whole packets from FIFO_R_W and return how many
+  // were read, see ReadFifoPackets_.
+  //
+  // The newest packet in the FIFO was taken at most one sample period before
+  // FIFO_COUNT was read and every older one a period before the next, so the
+  // packets are stamped back from that read.
+  uint8_t raw_data[kFifoSize];
+  uint64_t start_ns = MonotonicRawNs();
+  int fifo_count = ReadFifoCount();
+  sample_time_ns = MonotonicRawNs();
+  if (fifo_count < 0) {
+    read_errors++;
+    return fifo_count;
+  }
+
+  // When the FIFO is full the oldest bytes get overwritten and the packet
+  // boundaries are lost, so start over with an empty FIFO
+  if (fifo_count > (int)(kFifoSize - kFifoSize % fifo_packet_len_)) {
+    fifo_overflows++;
+    ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl, user_ctrl_ | 0x04);  // FIFO_RST
+    return 0;
+  }
+
+  uint packet_count = fifo_count/fifo_packet_len_;
+  uint64_t oldest_ns = sample_time_ns;
+  if (packet_count > 0) {
+    oldest_ns -= (uint64_t)(packet_count - 1)*sample_period_ns_;
+  }
+  if (packet_count > max_samples) {
+    packet_count = max_samples;
+  }
+
+  int error = ReadFifoPackets_(&raw_data[0], packet_count);
+  if (error < 0) {
+    return error;
+  }
+
+  for (uint i = 0; i < packet_count; i++) {
+    const uint8_t* packet = &raw_data[i*fifo_packet_len_];
+    Mpu9250Sample* sample = &samples[i];
+    sample->timestamp_ns = oldest_ns + (uint64_t)i*sample_period_ns_;
+    // Turn the MSB and LSB into a signed 16-bit value
+    sample->accel_count[0] = ((int16_t)packet[0] << 8) | packet[1];
+    sample->accel_count[1] = ((int16_t)packet[2] << 8) | packet[3];
+    sample->accel_count[2] = ((int16_t)packet[4] << 8) | packet[5];
+    sample->temp_count = ((int16_t)packet[6] << 8) | packet[7];
+    sample->gyro_count[0] = ((int16_t)packet[8] << 8) | packet[9];
+    sample->gyro_count[1] = ((int16_t)packet[10] << 8) | packet[11];
+    sample->gyro_count[2] = ((int16_t)packet[12] << 8) | packet[13];
+    if (fifo_packet_len_ > kFifoPacketLen) {
+      // ST1 through ST2 as SLV0 read them for this sample
+      sample->magnetom_new = DecodeExtSensData_(&packet[kFifoPacketLen],
+                                                magnetom_count);
+      for (int j = 0; j < 3; j++) {
+        sample->magnetom_count[j] = magnetom_count[j];
+      }
+    } else {
+      sample->magnetom_count[0] = 0;
+      sample->magnetom_count[1] = 0;
+      sample->magnetom_count[2] = 0;
+      sample->magnetom_new = 0;
+    }
+  }
+
+  timing.OnRead(start_ns, MonotonicRawNs());
+  for (uint i = 0; i < packet_count; i++) {
+    timing.OnSample(samples[i].timestamp_ns);
+  }
+  return packet_count;
+}
+
+int Mpu9250::AverageFifo_(const CalibrationConfig& config,
+                          CalibrationResult* result, double* gyro_mean,
+                          double* accel_mean) {
+  // Collect window_ms worth of packets. The FIFO is drained whenever it is
+  // about half full, which takes two or three reads, so it does not
+  // overflow even if a drain comes late.
+  int error = EnableFifo();
+  uint target = (uint64_t)config.window_ms*1000000/sample_period_ns_;
+  if (target == 0) {
+    target = 1;
+  }
+  uint half_full_us =
+      (uint64_t)(kFifoSize/fifo_packet_len_/2)*sample_period_ns_/1000;
+  uint8_t raw_data[kFifoSize];
+  ImuSums sums = {{0, 0, 0}, 0, {0, 0, 0}};
+  uint packets = 0;
+  while (error == 0 && packets < target) {
+    uint64_t left_us = (uint64_t)(target - packets)*sample_period_ns_/1000;
+    usleep(left_us < half_full_us ? left_us : half_full_us);
+    int fifo_count = ReadFifoCount();
+    if (fifo_count < 0) {
+      error = fifo_count;
+      break;
+    }
+    if (fifo_count > (int)(kFifoSize - kFifoSize % fifo_packet_len_)) {
+      // The packet boundaries are lost, start over without these packets
+      fifo_overflows++;
+      error = ptr_i2c->WriteToMem(mpu_addr_, kUserCtrl,
+                                  user_ctrl_ | 0x04);  // FIFO_RST
+      continue;
+    }
+    uint n = fifo_count/fifo_packet_len_;
+    if (n > target - packets) {
+      n = target - packets;
+    }
+    error = ReadFifoPackets_(&raw_data[0], n);
+    if (error == 0) {
+      AccumulateImuPackets(&raw_data[0], n, fifo_packet_len_, &sums);
+      packets += n;
+    }
+  }
+  int stop_error = DisableFifo();
+  if (error == 0) {
+    error = stop_error;
+  }
+  if (error < 0) {
+    return error;
+  }
+
+  result->samples = packets;
+  for (int axis = 0; axis < 3; axis++) {
+    gyro_mean[axis] = sums.gyro[axis]/(double)packets;
+    accel_mean[axis] = sums.accel[axis]/(double)packets;
+  }
+  // TEMP_degC = TEMP_OUT/333.87 + 21, MPU-9250 Product Specification 3.4.2
+  result->temperature = sums.temp/(double)packets/333.87 + 21.0;
+  return 0;
+}
+
+int Mpu9250::Calibrate(const CalibrationConfig& config,
+                       CalibrationResult* result) {
+  // Same procedure as calibrateMPU9250 of the Arduino library, except that
+  // the window is configurable, the FIFO is drained many packets per read
+  // while it fills and the packets are summed with the vector kernels of
+  // decode.h. The offset registers are read back and corrected rather than
+  // overwritten, so no reset is needed beforehand.
+  //
+  // SMPLRT_DIV, CONFIG, GYRO_CONFIG and ACCEL_CONFIG follow each other, they
+  // are saved and restored in one go
+  uint8_t saved[4];
+  int error = ptr_i2c->ReadFromMemInto(mpu_addr_, kSmplrtDiv, 4, &saved[0]);
+  if (error < 0) {
+    return error;
+  }
+  bool fifo_running = (user_ctrl_ & 0x40) != 0;
+  uint32_t saved_period_ns = sample_period_ns_;
+
+  // 1 kHz with the 184 Hz filter, and the 250 dps and 2 g full scales for
+  // 131 LSB per dps and 16384 LSB per g
+  uint8_t calibration[4] = {0x00, 0x01, 0x00, 0x00};
+  double gyro_mean[3];
+  double accel_mean[3];
+  error = DisableFifo();
+  if (error == 0) {
+    error = ptr_i2c->WriteToMemFrom(mpu_addr_, kSmplrtDiv, 4,
+                                    &calibration[0]);
+  }
+  if (error == 0) {
+    sample_period_ns_ = 1000000;
+    usleep(config.settle_ms*1000);
+    error = AverageFifo_(config, result, gyro_mean, accel_mean);
+  }
+
+  if (error == 0) {
+    // Gravity is along z, whichever way up the device lies
+    accel_mean[2] += accel_mean[2] > 0 ? -16384.0 : 16384.0;
+    for (int axis = 0; axis < 3; axis++) {
+      result->gyro_bias[axis] = gyro_mean[axis]/131.0;
+      result->accel_bias[axis] = accel_mean[axis]/16384.0;
+    }
+
+    // XG_OFFSET is added to the output at 32.8 LSB per dps, 4 counts at
+    // 250 dps, so the mean is taken off it
+    uint8_t offsets[6];
+    error = ptr_i2c->ReadFromMemInto(mpu_addr_, kXgOffsetH, 6, &offsets[0]);
+    if (error == 0) {
+      for (int axis = 0; axis < 3; axis++) {
+        int16_t offset = ((int16_t)offsets[2*axis] << 8) | offsets[2*axis + 1];
+        result->gyro_offset[axis] = ClampToInt16(offset -
+                                                 lround(gyro_mean[axis]/4));
+      }
+      error = SetGyroOffsets(result->gyro_offset);
+    }
+  }
+
+  // XA_OFFSET holds the factory trim at 2048 LSB per g in bits 15:1, 8
+  // counts at 2 g per step of 2. Bit 0 is reserved and kept as it is.
+  const uint8_t accel_regs[3] = {kXaOffsetH, kYaOffsetH, kZaOffsetH};
+  for (int axis = 0; axis < 3 && error == 0; axis++) {
+    uint8_t word[2];
+    error = ptr_i2c->ReadFromMemInto(mpu_addr_, accel_regs[axis], 2,
+                                     &word[0]);
+    if (error < 0) {
+      break;
+    }
+    int16_t offset = ((int16_t)word[0] << 8) | word[1];
+    if (config.accel) {
+      int16_t corrected = ClampToInt16(offset -
+                                       2*lround(accel_mean[axis]/16));
+      offset = (corrected & ~1) | (offset & 1);
+      word[0] = (offset >> 8) & 0xFF;
+      word[1] = offset & 0xFF;
+      error = ptr_i2c->WriteToMemFrom(mpu_addr_, accel_regs[axis], 2,
+                                      &word[0]);
+    }
+    result->accel_offset[axis] = offset;
+  }
+
+  // Put the configuration back whether or not the calibration worked
+  int restore_error = ptr_i2c->WriteToMemFrom(mpu_addr_, kSmplrtDiv, 4,
+                                              &saved[0]);
+  if (restore_error == 0) {
+    sample_period_ns_ = saved_period_ns;
+    if (fifo_running) {
+      restore_error = EnableFifo();
+    }
+  }
+  return error < 0 ? error : restore_error;
+}
+
+int Mpu9250::SetGyroOffsets(const int16_t* offset) {
+  // XG_OFFSET_H through ZG_OFFSET_L follow each other, one write does all
+  uint8_t offsets[6];
+  for (int axis = 0; axis < 3; axis++) {
+    offsets[2*axis] = (offset[axis] >> 8) & 0xFF;
+    offsets[2*axis + 1] = offset[axis] & 0xFF;
+  }
+  return ptr_i2c->WriteToMemFrom(mpu_addr_, kXgOffsetH, 6, &offsets[0]);
+}
+
+int Mpu9250::SetAccelOffsets(const int16_t* offset) {
+  // The accelerometer registers are three bytes apart, each word is read
+  // for its reserved bit 0 and written back with the new offset
+  const uint8_t accel_regs[3] = {kXaOffsetH, kYaOffsetH, kZaOffsetH};
+  int error = 0;
+  for (int axis = 0; axis < 3 && error == 0; axis++) {
+    uint8_t word[2];
+    error = ptr_i2c->ReadFromMemInto(mpu_addr_, accel_regs[axis], 2,
+                                     &word[0]);
+    if (error == 0) {
+      int16_t value = (offset[axis] & ~1) | (word[1] & 1);
+      word[0] = (value >> 8) & 0xFF;
+      word[1] = value & 0xFF;
+      error = ptr_i2c->WriteToMemFrom(mpu_addr_, accel_regs[axis], 2,
+                                      &word[0]);
+    }
+  }
+  return error;
+}
+
+int Mpu9250::ReadFingerprint(uint8_t* fingerprint) {
+  // WHO_AM_I, SELF_TEST_X/Y/Z_GYRO at 0x00 and SELF_TEST_X/Y/Z_ACCEL at
+  // 0x0D in one combined transfer
+  I2cTransaction transaction;
+  transaction.ReadFromMemInto(mpu_addr_, kWhoAmImpu6500, 1, &fingerprint[0]);
+  transaction.ReadFromMemInto(mpu_addr_, kSelfTestXGyro, 3, &fingerprint[1]);
+  transaction.ReadFromMemInto(mpu_addr_, kSelfTestXAccel, 3,
+                              &fingerprint[4]);
+  fingerprint[kFingerprintLen - 1] = 0;
+  return ptr_i2c->Transfer(&transaction);
+}
+
+int Mpu9250::EnableWakeOnMotion(uint threshold_mg, WakeRate rate) {
+  // Accelerometer only low power mode with the wake-on-motion interrupt,
+  // in the order the MPU-9250 Product Specification gives. The CYCLE bit
+  // goes last, so no motion is flagged before the INT pin is released.
+  int error = 0;
+  if (magnetom_on_) {
+    error = WriteAk8963_(kCntl, kMagnetomPowerDown);
+  }
+  wake_fifo_ = (user_ctrl_ & 0x40) != 0;
+  if (error == 0 && wake_fifo_) {
+    error = DisableFifo();
+  }
+  // ACCEL_CONFIG2 and INT_ENABLE are 0x1D and 0x38, saved one by one
+  if (error == 0) {
+    error = ptr_i2c->ReadFromMem(mpu_addr_, kAccelConfig2, &wake_saved_[0]);
+  }
+  if (error == 0) {
+    error = ptr_i2c->ReadFromMem(mpu_addr_, kIntEnable, &wake_saved_[1]);
+  }
+  // Gyroscope x, y and z off, then the accelerometer filter setting the
+  // specification asks for, A_DLPF_CFG 1
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kPwrMgmt2, 0x07);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kAccelConfig2, 0x01);
+  }
+  // WOM_EN only, ACCEL_INTEL_EN comparing each sample with the one before
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kIntEnable, 0x40);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kMotDetectCtrl, 0xC0);
+  }
+  if (error == 0) {
+    uint threshold = (threshold_mg + 2)/4;
+    threshold = threshold < 1 ? 1 : (threshold > 255 ? 255 : threshold);
+    error = ptr_i2c->WriteToMem(mpu_addr_, kWomThr, threshold);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kLpAccelOdr, rate);
+  }
+  // The INT pin latches until INT_STATUS is read, a data ready left over
+  // would keep it high and no edge would come
+  if (error == 0) {
+    error = ReadIntStatus();
+  }
+  // CYCLE with the thermometer off (TEMP_DIS)
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kPwrMgmt1, 0x20 | 0x08);
+  }
+  if (error == 0) {
+    wake_on_motion_ = true;
+  }
+  return error;
+}
+
+int Mpu9250::ReadIntStatus() {
+  int error = ptr_i2c->ReadFromMem(mpu_addr_, kIntStatus, &int_status);
+  if (error < 0) {
+    int_status = 0;
+  }
+  return error;
+}
+
+int Mpu9250::DisableWakeOnMotion() {
+  // Out of cycle mode on the PLL with the thermometer on, as after a reset,
+  // and the gyroscope back on
+  int error = ptr_i2c->WriteToMem(mpu_addr_, kPwrMgmt1, 0x01);
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kMotDetectCtrl, 0x00);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kAccelConfig2, wake_saved_[0]);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kIntEnable, wake_saved_[1]);
+  }
+  if (error == 0) {
+    error = ptr_i2c->WriteToMem(mpu_addr_, kPwrMgmt2, 0x00);
+  }
+  if (error < 0) {
+    return error;
+  }
+  wake_on_motion_ = false;
+
+  // The gyroscope starts up as after a reset. Samples taken while asleep
+  // leave data ready set, clear it and wait for the first full one.
+  error = ReadIntStatus();
+  if (error == 0) {
+    error = Poll_([this](uint8_t* value) {
+                    return ptr_i2c->ReadFromMem(mpu_addr_, kIntStatus,
+                                                value);
+                  }, 0x01, 0x01, kGyroStartUs + 2*sample_period_ns_/1000);
+  }
+  // The first AK8963 measurement follows 7.2 ms after its mode is set
+  if (error == 0 && magnetom_on_) {
+    error = WriteAk8963_(kCntl, magnetom_scale << 4 | m_mode);
+  }
+  if (error == 0 && wake_fifo_) {
+    error = EnableFifo();
+  }
+  return error;
 }
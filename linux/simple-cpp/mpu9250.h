@@ -8,7 +8,8 @@
 #include <stdio.h>          // Needed for printf, snprintf, perror
 #include <stdlib.h>         // Needed for exit()
 #include <unistd.h>         // Needed for write, usleep
-#include "i2c.h"
+#include "bus.h"
+#include "timing.h"
 
 // See also MPU-9250 Register Map and Descriptions, Revision 6.0,
 // RM-MPU-9250A-00, Rev. 1.6, 01/07/2015 for registers not listed in above
@@ -18,17 +19,38 @@
 // Using the MPU-9250 breakout board, ADO is set to 0
 // Seven-bit device address is 110100 for ADO = 0 and 110101 for ADO = 1
 
-// const uint8_t kMpu6500Addr = 0x69;  // Device address when ADO = 1
-const uint8_t kMpu6500Addr = 0x68;  // Device address when ADO = 0
+const uint8_t kMpu6500Addr = 0x68;     // Device address when ADO = 0
+const uint8_t kMpu6500AddrAd0 = 0x69;  // Device address when ADO = 1
 
                                     // default value
+// Factory self-test codes, different on every part and kept through resets
+const uint8_t kSelfTestXGyro  = 0x00;  // Y and Z follow
+const uint8_t kSelfTestXAccel = 0x0D;  // Y and Z follow
+const uint8_t kXgOffsetH    = 0x13;  // 0x00, gyro offsets, X/Y/Z H then L
+const uint8_t kXgOffsetL    = 0x14;  // 0x00
+const uint8_t kYgOffsetH    = 0x15;  // 0x00
+const uint8_t kYgOffsetL    = 0x16;  // 0x00
+const uint8_t kZgOffsetH    = 0x17;  // 0x00
+const uint8_t kZgOffsetL    = 0x18;  // 0x00
 const uint8_t kSmplrtDiv    = 0x19;  // 0x00
 const uint8_t kConfig       = 0x1A; // 0x00
 const uint8_t kGyroConfig   = 0x1B;  // 0x00
 const uint8_t kAccelConfig  = 0x1C;  // 0x00
 const uint8_t kAccelConfig2 = 0x1D;  // 0x00
+const uint8_t kLpAccelOdr   = 0x1E;  // 0x00, wake-on-motion sample rate
+const uint8_t kWomThr       = 0x1F;  // 0x00, 4 mg per LSB
 
-const uint8_t kI2cMstCtrl = 0x24;  // 0x00
+const uint8_t kFifoEn       = 0x23;  // 0x00
+const uint8_t kI2cMstCtrl   = 0x24;  // 0x00
+const uint8_t kI2cSlv0Addr  = 0x25;  // 0x00
+const uint8_t kI2cSlv0Reg   = 0x26;  // 0x00
+const uint8_t kI2cSlv0Ctrl  = 0x27;  // 0x00
+const uint8_t kI2cSlv4Addr  = 0x31;  // 0x00
+const uint8_t kI2cSlv4Reg   = 0x32;  // 0x00
+const uint8_t kI2cSlv4Do    = 0x33;  // 0x00
+const uint8_t kI2cSlv4Ctrl  = 0x34;  // 0x00
+const uint8_t kI2cSlv4Di    = 0x35;  // 0x00
+const uint8_t kI2cMstStatus = 0x36;  // 0x00
 
 const uint8_t kIntPinCfg = 0x37;  // 0x00
 const uint8_t kIntEnable = 0x38;  // 0x00
@@ -48,9 +70,38 @@ const uint8_t kGyroYoutH  = 0x45;
 const uint8_t kGyroYoutL  = 0x46;
 const uint8_t kGyroZoutH  = 0x47;
 const uint8_t kGyroZoutL  = 0x48;
+// Number of bytes from INT_STATUS through GYRO_ZOUT_L
+const uint8_t kSensorBlockLen = kGyroZoutL - kIntStatus + 1;
+const uint8_t kExtSensData00 = 0x49;  // Through EXT_SENS_DATA_23 at 0x60
+const uint8_t kI2cSlv0Do     = 0x63;
+
+const uint8_t kMotDetectCtrl = 0x69;  // 0x00
+const uint8_t kUserCtrl   = 0x6A;  // 0x00
+const uint8_t kPwrMgmt1   = 0x6B;  // 0x01
+const uint8_t kPwrMgmt2   = 0x6C;  // 0x00
+const uint8_t kFifoCountH = 0x72;
+const uint8_t kFifoCountL = 0x73;
+const uint8_t kFifoRW     = 0x74;
 
 const uint8_t kWhoAmImpu6500 = 0x75;  // Should return 0x71
 
+// Accelerometer offsets, factory trimmed, bit 0 of the L register is reserved
+const uint8_t kXaOffsetH = 0x77;
+const uint8_t kXaOffsetL = 0x78;
+const uint8_t kYaOffsetH = 0x7A;
+const uint8_t kYaOffsetL = 0x7B;
+const uint8_t kZaOffsetH = 0x7D;
+const uint8_t kZaOffsetL = 0x7E;
+
+// FIFO configuration used for streaming: TEMP_OUT, GYRO_X/Y/ZOUT and ACCEL
+// enabled in FIFO_EN. Packets are written in register order, so each one
+// holds accel x/y/z, temperature and gyro x/y/z as big endian words. With
+// SLV_0 enabled as well the EXT_SENS_DATA bytes read by SLV0 follow.
+const uint8_t kFifoEnSensors  = 0xF8;
+const uint8_t kFifoEnSlv0     = 0x01;
+const uint8_t kFifoPacketLen  = 14;
+const uint16_t kFifoSize      = 512;  // Bytes
+
 // Magnetometer AK8963 Registers
 const uint8_t kAk8963Addr = 0x0C;
 
@@ -63,10 +114,96 @@ const uint8_t kHyl  = 0x05;
 const uint8_t kHyh  = 0x06;
 const uint8_t kHzl  = 0x07;
 const uint8_t kHzh  = 0x08;
+const uint8_t kSt2  = 0x09;  // data overflow bit 3, read ends data read
+const uint8_t kCntl  = 0x0A;  // Mode bits 3:0, output bit 4
+const uint8_t kCntl2 = 0x0B;  // Soft reset bit 0
+const uint8_t kAstc  = 0x0C;  // Self test control
+const uint8_t kAsax  = 0x10;  // Fuse ROM x/y/z sensitivity adjustment
+const uint8_t kAsay  = 0x11;
+const uint8_t kAsaz  = 0x12;
+// Number of bytes from ST1 through ST2, what SLV0 copies to EXT_SENS_DATA_00
+// when the internal I2C master reads the AK8963
+const uint8_t kMagnetomBlockLen = kSt2 - kSt1 + 1;
+
+// One raw sample. FIFO packets only carry magnetometer data when the AK8963
+// is read through the internal I2C master, see EnableMagnetomMaster, so
+// otherwise samples drained from the FIFO have no magnetometer data. Their
+// timestamps are worked out back from the drain, see ReadFifo.
+struct Mpu9250Sample {
+  uint64_t timestamp_ns;  // MonotonicRawNs() when the read completed
+  int16_t accel_count[3];
+  int16_t temp_count;
+  int16_t gyro_count[3];
+  int16_t magnetom_count[3];
+  uint8_t magnetom_new;  // 1 if magnetom_count holds a new AK8963 reading
+};
+
+// How Calibrate measures the biases, see kDefaultCalibration
+struct CalibrationConfig {
+  uint window_ms;  // Time the biases are averaged over
+  uint settle_ms;  // Wait after switching filter and ranges, not averaged
+  bool accel;      // Also correct the accelerometer offset registers
+};
+
+// Averages 200 samples at 1 kHz, a gyro bias noise of about 0.01 dps on a
+// part with the typical 0.01 dps/sqrt(Hz) noise density
+const CalibrationConfig kDefaultCalibration = {200, 20, false};
+
+// What Calibrate measured at rest, before correcting it
+struct CalibrationResult {
+  uint samples;             // Samples averaged
+  float gyro_bias[3];       // Degrees/s
+  float accel_bias[3];      // g, gravity taken out of the z axis
+  float temperature;        // Celsius, mean over the window
+  int16_t gyro_offset[3];   // Now in XG/YG/ZG_OFFSET
+  int16_t accel_offset[3];  // Now in XA/YA/ZA_OFFSET, reserved bit 0 kept
+};
+
+// WHO_AM_I, the three gyro and the three accel self-test codes and a zero
+// pad, see ReadFingerprint
+const uint kFingerprintLen = 8;
+
+// How long each step of bringing a device up took, as measured by Reset,
+// InitMpu9250 and InitAk8963 while they poll for the device to be ready. A
+// step that did not run stays 0.
+struct StartupTiming {
+  uint64_t reset_ns;       // H_RESET until PWR_MGMT_1 reads back clear
+  uint64_t config_ns;      // Writing the MPU6500 configuration
+  uint64_t data_ready_ns;  // Configured until the first sample is ready
+  uint64_t fuse_rom_ns;    // AK8963 fuse ROM read, power-downs included
+  uint64_t magnetom_ns;    // Mode set until the first AK8963 measurement
+};
 
 class Mpu9250 {
+  public:
+    // AK8963 measurement modes, the MODE field of CNTL1
+    enum MagnetomMode {
+      kMagnetomPowerDown = 0x00,
+      kMagnetomSingle = 0x01,  // One measurement, then back to power down
+      kMagnetom8Hz = 0x02,     // Continuous measurement mode 1
+      kMagnetom100Hz = 0x06    // Continuous measurement mode 2
+    };
+
+    // Accelerometer sample rates while waiting for motion, the
+    // LPOSC_CLKSEL field of LP_ACCEL_ODR
+    enum WakeRate {
+      kWake0_24Hz = 0,
+      kWake0_49Hz,
+      kWake0_98Hz,
+      kWake1_95Hz,
+      kWake3_91Hz,
+      kWake7_81Hz,
+      kWake15_63Hz,
+      kWake31_25Hz,
+      kWake62_5Hz,
+      kWake125Hz,
+      kWake250Hz,
+      kWake500Hz
+    };
+
   protected:
-    I2cBus* ptr_i2c;
+    Bus* ptr_i2c;
+    uint8_t mpu_addr_;  // kMpu6500Addr or kMpu6500AddrAd0
     // Set initial input parameters
     enum GyroScale {
       kGfs250Dps = 0,
@@ -92,11 +229,45 @@ class Mpu9250 {
     uint8_t accel_scale = kAfs2G;
     // Choose either 14-bit or 16-bit magnetometer resolution
     uint8_t magnetom_scale = kMfs16Bits;
-    // 2 for 8 Hz, 6 for 100 Hz continuous magnetometer data read
-    uint8_t m_mode = 0x02;
+    // Magnetometer measurement mode, see InitAk8963
+    uint8_t m_mode = kMagnetom8Hz;
+    // Time between samples as set by SMPLRT_DIV, with the 1 kHz internal
+    // rate of the DLPF setting in InitMpu9250
+    uint32_t sample_period_ns_ = 1000000;
+    // USER_CTRL bits that stay set, FIFO_EN and I2C_MST_EN
+    uint8_t user_ctrl_ = 0x00;
+    // SLV0 copies the AK8963 data into EXT_SENS_DATA on every sample
+    bool magnetom_master_ = false;
+    // ST1 of the latest batched read had DRDY set, the next one reads the
+    // measurement
+    bool magnetom_ready_ = false;
+    // Bytes per FIFO packet as set up by EnableFifo
+    uint8_t fifo_packet_len_ = kFifoPacketLen;
+    // InitAk8963 or EnableMagnetomMaster left the AK8963 measuring
+    bool magnetom_on_ = false;
+    // Set by EnableWakeOnMotion, with what DisableWakeOnMotion restores:
+    // ACCEL_CONFIG2, INT_ENABLE and whether the FIFO was running
+    bool wake_on_motion_ = false;
+    uint8_t wake_saved_[2];
+    bool wake_fifo_ = false;
+    // Factory sensitivity adjustment from the fuse ROM, as read and as a
+    // factor, and hard-iron offsets in mG. The factors and offsets are
+    // folded by UpdateMagnetomScale_ together with magnetom_res into one gain
+    // and offset per axis.
+    uint8_t magnetom_asa_[3] = {128, 128, 128};
+    float magnetom_adjust_[3] = {1.0f, 1.0f, 1.0f};
+    float magnetom_bias_[3] = {0.0f, 0.0f, 0.0f};
+    float magnetom_gain_[3];
+    float magnetom_offset_[3];
+
+    // Recompute magnetom_gain_ and magnetom_offset_, whenever magnetom_res,
+    // magnetom_adjust_ or magnetom_bias_ change
+    void UpdateMagnetomScale_();
 
   public:
-    Mpu9250(I2cBus* i2c_n);
+    Mpu9250(Bus* i2c_n, uint8_t mpu_addr = kMpu6500Addr);
+
+    uint8_t Address() const { return mpu_addr_; }
 
     // Stores the 16-bit signed sensor output
     int16_t accel_count[3];  // Accelerometer
@@ -110,21 +281,141 @@ class Mpu9250 {
     float magnetom_x, magnetom_y, magnetom_z;
 
     int16_t temp_count;  // Temperature raw count output
+    uint8_t int_status;  // INT_STATUS value from the latest batched read
+    uint8_t magnetom_new;  // 1 if the latest batched read had new mag data
+    uint32_t fifo_overflows = 0;  // Times the FIFO filled up and was reset
+    // Measurements ReadSensorsBatched took with DOR set in ST1: the AK8963
+    // skipped at least one measurement before each of them
+    uint32_t magnetom_overruns = 0;
+    // Sensor reads that failed after retries, or whose retry found the
+    // sample gone with a failed attempt
+    uint32_t read_errors = 0;
+    uint64_t sample_time_ns = 0;  // When the latest sensor read completed
+    // Read latency and interval between the new samples of the reads below,
+    // kept by the thread that reads the sensor
+    SampleTiming timing;
+    StartupTiming startup = {0, 0, 0, 0, 0};
     float temperature;  // Stores the real internal chip temperature in Celsius
 
   private:
   void ChooseDevice(bool magnetom);
+  void DecodeSensorBlock_(const uint8_t* block);
+  bool DecodeMagnetomBlock_(const uint8_t* block, int16_t* destination);
+  bool DecodeExtSensData_(const uint8_t* block, int16_t* destination);
+  // AK8963 register access, through SLV4 while the internal I2C master owns
+  // the auxiliary bus and directly otherwise
+  int Ak8963Slv4_(bool read, uint8_t reg, uint8_t* data);
+  int ReadAk8963_(uint8_t reg, uint n_bytes, uint8_t* data);
+  int WriteAk8963_(uint8_t reg, uint8_t data);
+  void CountLostSample_();
+  void TimeRead_(uint64_t start_ns);
+  // Read a register with read until (value & mask) == want, giving up with
+  // -ETIMEDOUT after timeout_us. Bus errors that may go away are polled
+  // through, like a device that does not answer while it resets.
+  template <typename ReadReg>
+  int Poll_(ReadReg read, uint8_t mask, uint8_t want, uint timeout_us);
+  int ReadFifoPackets_(uint8_t* raw_data, uint packet_count);
+  int AverageFifo_(const CalibrationConfig& config, CalibrationResult* result,
+                   double* gyro_mean, double* accel_mean);
 
   public:
+    // Methods returning int give 0 on success or the negative errno of the
+    // bus operation that failed after the bus retried it. A failed sensor
+    // read leaves int_status clear, so the sample is simply dropped.
     uint8_t ComTest(uint8_t test_who);
-    void InitMpu9250();
-    void ReadAccelData(int16_t* destination);
-    void ReadGyroData(int16_t* destination);
-    void ReadMagnetomData(int16_t* destination);
+    // Put every MPU6500 register back to its default and wait until the
+    // device answers again. The AK8963 is left alone.
+    int Reset();
+    // Returns once the first sample with the new configuration is ready
+    int InitMpu9250();
+    // Connect the auxiliary bus, and with it the AK8963, to the host bus
+    int SetBypass(bool enable);
+    // Read the factory sensitivity adjustment from the fuse ROM and start
+    // measuring in mode at the 14 or 16-bit resolution of magnetom_scale.
+    // Returns once the first measurement is ready. Works with bypass on or
+    // through the internal I2C master. asa, the MagnetomAsa of an earlier
+    // start of the same part, saves the trip through fuse ROM access mode.
+    int InitAk8963(MagnetomMode mode, const uint8_t* asa = nullptr);
+    // Start the next measurement in kMagnetomSingle mode, it is ready about
+    // 7.2 ms later
+    int TriggerMagnetom();
+    // Hard-iron offsets in mG, subtracted after the factory adjustment
+    void SetMagnetomBias(const float* bias);
+    // Fuse ROM sensitivity adjustment of an axis, 1 until InitAk8963
+    float MagnetomAdjust(int axis) const { return magnetom_adjust_[axis]; }
+    // The same as the raw ASAX, ASAY and ASAZ values, 128 until InitAk8963
+    uint8_t MagnetomAsa(int axis) const { return magnetom_asa_[axis]; }
+    // The factor a fuse ROM value stands for, AK8963 datasheet 8.3.11
+    static float AsaToAdjust(uint8_t asa) { return (asa - 128)/256.0f + 1.0f; }
+    float MagnetomBias(int axis) const { return magnetom_bias_[axis]; }
+    // Magnetometer counts to mG with the factory adjustment and hard-iron
+    // offsets applied, one multiply-add per axis
+    void ConvertMagnetom(const int16_t* count, float* field) const {
+      for (int i = 0; i < 3; i++) {
+        field[i] = count[i]*magnetom_gain_[i] + magnetom_offset_[i];
+      }
+    }
+    // Hand the AK8963 to the internal I2C master of the MPU6500 instead:
+    // bypass is turned off, the AK8963 is put in the mode of InitAk8963 (8 Hz
+    // if it was not called) through SLV4, and SLV0 copies ST1 through ST2 to
+    // EXT_SENS_DATA_00 on every sample. The burst and batched reads then get
+    // the magnetometer right after the gyroscope in one read, and FIFO
+    // packets carry it too.
+    int EnableMagnetomMaster();
+    // Stop SLV0 and the internal I2C master and turn bypass back on
+    int DisableMagnetomMaster();
+    bool MagnetomMaster() const { return magnetom_master_; }
+    // Sample rate = 1 kHz/(1 + divider)
+    int SetSampleRateDivider(uint8_t divider);
+    uint32_t SamplePeriodNs() const { return sample_period_ns_; }
+    int ReadAccelData(int16_t* destination);
+    int ReadGyroData(int16_t* destination);
+    int ReadMagnetomData(int16_t* destination);
     void GetGyroRes();
     void GetAccelRes();
     void GetMagnetomRes();
+    // The latest count if the read fails
     int16_t ReadTempData();
+    int ReadAllSensors();
+    int ReadSensorsBatched();
+    void CopySample(Mpu9250Sample* sample) const;
+    // Packets hold the magnetometer when the internal I2C master reads it,
+    // EnableMagnetomMaster restarts a running FIFO with the new layout
+    int EnableFifo();
+    int DisableFifo();
+    // Bytes in the FIFO, or a negative errno
+    int ReadFifoCount();
+    // Packets read, or a negative errno
+    int ReadFifo(Mpu9250Sample* samples, uint max_samples);
+    // Measure the gyroscope bias of a device at rest and cancel it in the
+    // offset registers, and the accelerometer bias too if config.accel is
+    // set, in which case z has to point up or down. Calibrating again
+    // corrects what is left. The configuration is restored afterwards, the
+    // FIFO started over if it was running.
+    int Calibrate(const CalibrationConfig& config, CalibrationResult* result);
+    // Write offsets, e.g. the gyro_offset and accel_offset of an earlier
+    // Calibrate, to XG/YG/ZG_OFFSET and XA/YA/ZA_OFFSET. The reserved bit 0
+    // of the accelerometer registers is kept as the device has it.
+    int SetGyroOffsets(const int16_t* offset);
+    int SetAccelOffsets(const int16_t* offset);
+    // Power down everything but the accelerometer, which samples at rate
+    // and raises WOM_INT in INT_STATUS, and the INT pin, as soon as an axis
+    // moves by more than threshold_mg (4 to 1020 mg) from one sample to the
+    // next. The gyroscope, thermometer and AK8963 are off and the FIFO is
+    // stopped. The INT pin is released first, so its next edge is motion.
+    int EnableWakeOnMotion(uint threshold_mg, WakeRate rate);
+    // Back to full rate: the configuration before EnableWakeOnMotion, the
+    // AK8963 measuring again and the FIFO started over if it was running.
+    // Returns once the gyroscope is up and the first sample is ready.
+    int DisableWakeOnMotion();
+    bool WakeOnMotion() const { return wake_on_motion_; }
+    // Read INT_STATUS alone into int_status, which clears it and releases
+    // the INT pin. WOM_INT is bit 6.
+    int ReadIntStatus();
+    // WHO_AM_I and the factory self-test codes, kFingerprintLen bytes. No
+    // two parts are likely to have the same codes, and they survive resets,
+    // so they tell whether the part at an address is still the same one.
+    int ReadFingerprint(uint8_t* fingerprint);
 };  // class MPU9250
 
 #endif // MPU9250_H_
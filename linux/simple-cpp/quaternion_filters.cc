@@ -0,0 +1,672 @@
+// Implementation of Sebastian Madgwick's "...efficient orientation filter
+// for... inertial/magnetic sensor arrays"
+// (see http://www.x-io.co.uk/category/open-source/ for examples & more details)
+// and of the Mahony filter, ported from the Arduino library.
+//
+// The update math is written once as templates over the value type. With
+// float it updates one filter; with Lanes, a GCC vector of four floats that
+// maps onto an SSE or NEON register, it updates four filters of a bank at
+// once. The zero-norm early return of the original becomes a mask that keeps
+// the old state of the affected lanes. A second template parameter picks how
+// square roots and their reciprocals are computed, see FusionPrecision.
+
+#include "quaternion_filters.h"
+
+#include <math.h>  // Needed for sqrtf, atan2f, asinf, acos
+#include <string.h>  // Needed for memcpy
+#include <stdint.h>  // Needed for int32_t
+
+#if defined(__SSE__)
+#include <xmmintrin.h>  // Needed for _mm_sqrt_ps, _mm_rsqrt_ps
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>  // Needed for vsqrtq_f32, vrsqrteq_f32
+#endif
+
+typedef float Lanes __attribute__((vector_size(16)));
+typedef int32_t LaneMask __attribute__((vector_size(16)));
+const size_t kLanes = sizeof(Lanes)/sizeof(float);
+
+// Per value type helpers --------------------------------------------------
+
+static inline float Sqrt_(float x) {
+  return sqrtf(x);
+}
+
+static inline Lanes Sqrt_(Lanes x) {
+#if defined(__SSE__)
+  return _mm_sqrt_ps(x);
+#elif defined(__aarch64__)
+  return (Lanes)vsqrtq_f32((float32x4_t)x);
+#else
+  // 32-bit NEON has no square root instruction
+  Lanes root;
+  for (size_t l = 0; l < kLanes; l++) {
+    root[l] = sqrtf(x[l]);
+  }
+  return root;
+#endif
+}
+
+static inline bool NonZero_(float x) {
+  return x != 0.0f;
+}
+
+static inline LaneMask NonZero_(Lanes x) {
+  const Lanes zero = {0.0f, 0.0f, 0.0f, 0.0f};
+  return x != zero;
+}
+
+static inline bool Positive_(float x) {
+  return x > 0.0f;
+}
+
+static inline LaneMask Positive_(Lanes x) {
+  const Lanes zero = {0.0f, 0.0f, 0.0f, 0.0f};
+  return x > zero;
+}
+
+static inline bool And_(bool a, bool b) {
+  return a && b;
+}
+
+static inline LaneMask And_(LaneMask a, LaneMask b) {
+  return a & b;
+}
+
+// a where the mask is set, b elsewhere
+static inline float Select_(bool mask, float a, float b) {
+  return mask ? a : b;
+}
+
+static inline Lanes Select_(LaneMask mask, Lanes a, Lanes b) {
+  return (Lanes)(((LaneMask)a & mask) | ((LaneMask)b & ~mask));
+}
+
+template <typename V>
+static inline V Load_(const float* p);
+
+template <>
+inline float Load_<float>(const float* p) {
+  return *p;
+}
+
+template <>
+inline Lanes Load_<Lanes>(const float* p) {
+  Lanes v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void Store_(float* p, float v) {
+  *p = v;
+}
+
+static inline void Store_(float* p, Lanes v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// Reciprocal square root ----------------------------------------------------
+
+#if defined(__SSE__)
+// Relative error below 1.5*2^-12, good enough to be used as it is
+const int kEstimateSteps = 0;
+
+static inline float RsqrtEstimate_(float x) {
+  return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+}
+
+static inline Lanes RsqrtEstimate_(Lanes x) {
+  return _mm_rsqrt_ps(x);
+}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+// About 8 bits, always refined once
+const int kEstimateSteps = 1;
+
+static inline float RsqrtEstimate_(float x) {
+  return vget_lane_f32(vrsqrte_f32(vdup_n_f32(x)), 0);
+}
+
+static inline Lanes RsqrtEstimate_(Lanes x) {
+  return (Lanes)vrsqrteq_f32((float32x4_t)x);
+}
+#else
+// The bit trick, relative error below 3.5%, always refined once
+const int kEstimateSteps = 1;
+
+static inline float RsqrtEstimate_(float x) {
+  int32_t i;
+  memcpy(&i, &x, sizeof(i));
+  i = 0x5F3759DF - (i >> 1);
+  float y;
+  memcpy(&y, &i, sizeof(y));
+  return y;
+}
+
+static inline Lanes RsqrtEstimate_(Lanes x) {
+  Lanes y;
+  for (size_t l = 0; l < kLanes; l++) {
+    y[l] = RsqrtEstimate_((float)x[l]);
+  }
+  return y;
+}
+#endif
+
+// One Newton-Raphson step from the estimate y of 1/sqrt(x), roughly doubles
+// the number of correct bits
+template <typename V>
+static inline V NewtonStep_(V x, V y) {
+  return y * (1.5f - 0.5f * x * y * y);
+}
+
+// Square root and reciprocal square root at the precision P. Both return inf
+// or NaN for zero and negative input, which the filters mask out.
+template <FusionPrecision P>
+struct FusionMath_ {
+  template <typename V>
+  static inline V InvSqrt(V x) {
+    V y = RsqrtEstimate_(x);
+    const int steps =
+        kEstimateSteps + (P == FusionPrecision::kRsqrtNewton ? 1 : 0);
+    for (int k = 0; k < steps; k++) {
+      y = NewtonStep_(x, y);
+    }
+    return y;
+  }
+
+  // sqrt(x) = x/sqrt(x), 0 is kept 0
+  template <typename V>
+  static inline V Sqrt(V x) {
+    return Select_(NonZero_(x), x * InvSqrt(x), V());
+  }
+};
+
+template <>
+struct FusionMath_<FusionPrecision::kExact> {
+  template <typename V>
+  static inline V InvSqrt(V x) {
+    return 1.0f/Sqrt_(x);
+  }
+
+  template <typename V>
+  static inline V Sqrt(V x) {
+    return Sqrt_(x);
+  }
+};
+
+typedef FusionMath_<FusionPrecision::kExact> ExactMath;
+typedef FusionMath_<FusionPrecision::kRsqrtNewton> RsqrtNewtonMath;
+typedef FusionMath_<FusionPrecision::kApproximate> ApproximateMath;
+
+// Filter math -------------------------------------------------------------
+
+template <typename M, typename V>
+static inline void MadgwickStep_(V* q, V ax, V ay, V az, V gx, V gy, V gz,
+                                 V mx, V my, V mz, V deltat, V beta) {
+  // short name local variable for readability
+  V q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];
+  V norm;
+  V hx, hy, _2bx, _2bz;
+  V s1, s2, s3, s4;
+  V qDot1, qDot2, qDot3, qDot4;
+
+  // Auxiliary variables to avoid repeated arithmetic
+  V _2q1mx;
+  V _2q1my;
+  V _2q1mz;
+  V _2q2mx;
+  V _4bx;
+  V _4bz;
+  V _2q1 = 2.0f * q1;
+  V _2q2 = 2.0f * q2;
+  V _2q3 = 2.0f * q3;
+  V _2q4 = 2.0f * q4;
+  V _2q1q3 = 2.0f * q1 * q3;
+  V _2q3q4 = 2.0f * q3 * q4;
+  V q1q1 = q1 * q1;
+  V q1q2 = q1 * q2;
+  V q1q3 = q1 * q3;
+  V q1q4 = q1 * q4;
+  V q2q2 = q2 * q2;
+  V q2q3 = q2 * q3;
+  V q2q4 = q2 * q4;
+  V q3q3 = q3 * q3;
+  V q3q4 = q3 * q4;
+  V q4q4 = q4 * q4;
+
+  // Normalise accelerometer measurement
+  norm = ax * ax + ay * ay + az * az;
+  auto valid = NonZero_(norm);  // handle NaN
+  norm = M::InvSqrt(norm);
+  ax *= norm;
+  ay *= norm;
+  az *= norm;
+
+  // Normalise magnetometer measurement
+  norm = mx * mx + my * my + mz * mz;
+  valid = And_(valid, NonZero_(norm));  // handle NaN
+  norm = M::InvSqrt(norm);
+  mx *= norm;
+  my *= norm;
+  mz *= norm;
+
+  // Reference direction of Earth's magnetic field
+  _2q1mx = 2.0f * q1 * mx;
+  _2q1my = 2.0f * q1 * my;
+  _2q1mz = 2.0f * q1 * mz;
+  _2q2mx = 2.0f * q2 * mx;
+  hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 +
+       _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
+  hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 +
+       my * q3q3 + _2q3 * mz * q4 - my * q4q4;
+  _2bx = M::Sqrt(hx * hx + hy * hy);
+  _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 +
+         _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
+  _4bx = 2.0f * _2bx;
+  _4bz = 2.0f * _2bz;
+
+  // Gradient decent algorithm corrective step
+  s1 = -_2q3 * (2.0f * q2q4 - _2q1q3 - ax) +
+       _2q2 * (2.0f * q1q2 + _2q3q4 - ay) -
+       _2bz * q3 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) +
+       (-_2bx * q4 + _2bz * q2) *
+           (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) +
+       _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+  s2 = _2q4 * (2.0f * q2q4 - _2q1q3 - ax) + _2q1 * (2.0f * q1q2 + _2q3q4 - ay) -
+       4.0f * q2 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) +
+       _2bz * q4 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) +
+       (_2bx * q3 + _2bz * q1) *
+           (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) +
+       (_2bx * q4 - _4bz * q2) *
+           (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+  s3 = -_2q1 * (2.0f * q2q4 - _2q1q3 - ax) +
+       _2q4 * (2.0f * q1q2 + _2q3q4 - ay) -
+       4.0f * q3 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) +
+       (-_4bx * q3 - _2bz * q1) *
+           (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) +
+       (_2bx * q2 + _2bz * q4) *
+           (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) +
+       (_2bx * q1 - _4bz * q3) *
+           (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+  s4 = _2q2 * (2.0f * q2q4 - _2q1q3 - ax) + _2q3 * (2.0f * q1q2 + _2q3q4 - ay) +
+       (-_4bx * q4 + _2bz * q2) *
+           (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) +
+       (-_2bx * q1 + _2bz * q3) *
+           (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) +
+       _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+  // normalise step magnitude. The gradient is exactly zero when the estimate
+  // already agrees with both measurements, skip the step instead of turning
+  // the quaternion into NaN.
+  norm = s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4;
+  norm = Select_(NonZero_(norm), M::InvSqrt(norm), V());
+  s1 *= norm;
+  s2 *= norm;
+  s3 *= norm;
+  s4 *= norm;
+
+  // Compute rate of change of quaternion
+  qDot1 = 0.5f * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
+  qDot2 = 0.5f * (q1 * gx + q3 * gz - q4 * gy) - beta * s2;
+  qDot3 = 0.5f * (q1 * gy - q2 * gz + q4 * gx) - beta * s3;
+  qDot4 = 0.5f * (q1 * gz + q2 * gy - q3 * gx) - beta * s4;
+
+  // Integrate to yield quaternion
+  q1 += qDot1 * deltat;
+  q2 += qDot2 * deltat;
+  q3 += qDot3 * deltat;
+  q4 += qDot4 * deltat;
+  // normalise quaternion
+  norm = M::InvSqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
+  q[0] = Select_(valid, q1 * norm, q[0]);
+  q[1] = Select_(valid, q2 * norm, q[1]);
+  q[2] = Select_(valid, q3 * norm, q[2]);
+  q[3] = Select_(valid, q4 * norm, q[3]);
+}
+
+// Similar to Madgwick scheme but uses proportional and integral filtering on
+// the error between estimated reference vectors and measured ones.
+template <typename M, typename V>
+static inline void MahonyStep_(V* q, V* e_int, V ax, V ay, V az, V gx, V gy,
+                               V gz, V mx, V my, V mz, V deltat, V kp, V ki) {
+  // short name local variable for readability
+  V q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];
+  V norm;
+  V hx, hy, bx, bz;
+  V vx, vy, vz, wx, wy, wz;
+  V ex, ey, ez;
+  V pa, pb, pc;
+
+  // Auxiliary variables to avoid repeated arithmetic
+  V q1q1 = q1 * q1;
+  V q1q2 = q1 * q2;
+  V q1q3 = q1 * q3;
+  V q1q4 = q1 * q4;
+  V q2q2 = q2 * q2;
+  V q2q3 = q2 * q3;
+  V q2q4 = q2 * q4;
+  V q3q3 = q3 * q3;
+  V q3q4 = q3 * q4;
+  V q4q4 = q4 * q4;
+
+  // Normalise accelerometer measurement
+  norm = ax * ax + ay * ay + az * az;
+  auto valid = NonZero_(norm);  // Handle NaN
+  norm = M::InvSqrt(norm);      // Use reciprocal for division
+  ax *= norm;
+  ay *= norm;
+  az *= norm;
+
+  // Normalise magnetometer measurement
+  norm = mx * mx + my * my + mz * mz;
+  valid = And_(valid, NonZero_(norm));  // Handle NaN
+  norm = M::InvSqrt(norm);              // Use reciprocal for division
+  mx *= norm;
+  my *= norm;
+  mz *= norm;
+
+  // Reference direction of Earth's magnetic field
+  hx = 2.0f * mx * (0.5f - q3q3 - q4q4) + 2.0f * my * (q2q3 - q1q4) +
+       2.0f * mz * (q2q4 + q1q3);
+  hy = 2.0f * mx * (q2q3 + q1q4) + 2.0f * my * (0.5f - q2q2 - q4q4) +
+       2.0f * mz * (q3q4 - q1q2);
+  bx = M::Sqrt((hx * hx) + (hy * hy));
+  bz = 2.0f * mx * (q2q4 - q1q3) + 2.0f * my * (q3q4 + q1q2) +
+       2.0f * mz * (0.5f - q2q2 - q3q3);
+
+  // Estimated direction of gravity and magnetic field
+  vx = 2.0f * (q2q4 - q1q3);
+  vy = 2.0f * (q1q2 + q3q4);
+  vz = q1q1 - q2q2 - q3q3 + q4q4;
+  wx = 2.0f * bx * (0.5f - q3q3 - q4q4) + 2.0f * bz * (q2q4 - q1q3);
+  wy = 2.0f * bx * (q2q3 - q1q4) + 2.0f * bz * (q1q2 + q3q4);
+  wz = 2.0f * bx * (q1q3 + q2q4) + 2.0f * bz * (0.5f - q2q2 - q3q3);
+
+  // Error is cross product between estimated direction and measured direction
+  // of gravity
+  ex = (ay * vz - az * vy) + (my * wz - mz * wy);
+  ey = (az * vx - ax * vz) + (mz * wx - mx * wz);
+  ez = (ax * vy - ay * vx) + (mx * wy - my * wx);
+  // Accumulate integral error, or reset it to prevent integral wind up when
+  // the integral gain is off
+  auto integrate = Positive_(ki);
+  const V zero = V();
+  V e_int0 = Select_(integrate, e_int[0] + ex, zero);
+  V e_int1 = Select_(integrate, e_int[1] + ey, zero);
+  V e_int2 = Select_(integrate, e_int[2] + ez, zero);
+
+  // Apply feedback terms
+  gx = gx + kp * ex + ki * e_int0;
+  gy = gy + kp * ey + ki * e_int1;
+  gz = gz + kp * ez + ki * e_int2;
+
+  // Integrate rate of change of quaternion
+  pa = q2;
+  pb = q3;
+  pc = q4;
+  q1 = q1 + (-q2 * gx - q3 * gy - q4 * gz) * (0.5f * deltat);
+  q2 = pa + (q1 * gx + pb * gz - pc * gy) * (0.5f * deltat);
+  q3 = pb + (q1 * gy - pa * gz + pc * gx) * (0.5f * deltat);
+  q4 = pc + (q1 * gz + pa * gy - pb * gx) * (0.5f * deltat);
+
+  // Normalise quaternion
+  norm = M::InvSqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
+  q[0] = Select_(valid, q1 * norm, q[0]);
+  q[1] = Select_(valid, q2 * norm, q[1]);
+  q[2] = Select_(valid, q3 * norm, q[2]);
+  q[3] = Select_(valid, q4 * norm, q[3]);
+  e_int[0] = Select_(valid, e_int0, e_int[0]);
+  e_int[1] = Select_(valid, e_int1, e_int[1]);
+  e_int[2] = Select_(valid, e_int2, e_int[2]);
+}
+
+// Bank steps, IMUs i..i+lanes-1 --------------------------------------------
+
+template <typename M, typename V>
+static inline void MadgwickBankStep_(size_t i, const FusionBatch& in,
+                                     std::vector<float>* q,
+                                     const std::vector<float>& beta) {
+  V q_lanes[4];
+  for (int k = 0; k < 4; k++) {
+    q_lanes[k] = Load_<V>(&q[k][i]);
+  }
+  MadgwickStep_<M, V>(
+      q_lanes, Load_<V>(&in.accel[0][i]), Load_<V>(&in.accel[1][i]),
+      Load_<V>(&in.accel[2][i]), Load_<V>(&in.gyro[0][i]),
+      Load_<V>(&in.gyro[1][i]), Load_<V>(&in.gyro[2][i]),
+      Load_<V>(&in.magnetom[0][i]), Load_<V>(&in.magnetom[1][i]),
+      Load_<V>(&in.magnetom[2][i]), Load_<V>(&in.deltat[i]),
+      Load_<V>(&beta[i]));
+  for (int k = 0; k < 4; k++) {
+    Store_(&q[k][i], q_lanes[k]);
+  }
+}
+
+template <typename M, typename V>
+static inline void MahonyBankStep_(size_t i, const FusionBatch& in,
+                                   std::vector<float>* q,
+                                   std::vector<float>* e_int,
+                                   const std::vector<float>& kp,
+                                   const std::vector<float>& ki) {
+  V q_lanes[4];
+  V e_int_lanes[3];
+  for (int k = 0; k < 4; k++) {
+    q_lanes[k] = Load_<V>(&q[k][i]);
+  }
+  for (int k = 0; k < 3; k++) {
+    e_int_lanes[k] = Load_<V>(&e_int[k][i]);
+  }
+  MahonyStep_<M, V>(
+      q_lanes, e_int_lanes, Load_<V>(&in.accel[0][i]),
+      Load_<V>(&in.accel[1][i]), Load_<V>(&in.accel[2][i]),
+      Load_<V>(&in.gyro[0][i]), Load_<V>(&in.gyro[1][i]),
+      Load_<V>(&in.gyro[2][i]), Load_<V>(&in.magnetom[0][i]),
+      Load_<V>(&in.magnetom[1][i]), Load_<V>(&in.magnetom[2][i]),
+      Load_<V>(&in.deltat[i]), Load_<V>(&kp[i]), Load_<V>(&ki[i]));
+  for (int k = 0; k < 4; k++) {
+    Store_(&q[k][i], q_lanes[k]);
+  }
+  for (int k = 0; k < 3; k++) {
+    Store_(&e_int[k][i], e_int_lanes[k]);
+  }
+}
+
+// Whole updates at one precision --------------------------------------------
+
+template <typename M>
+static void MadgwickUpdate_(float* q, float beta, const FusionInput& in) {
+  MadgwickStep_<M, float>(q, in.accel[0], in.accel[1], in.accel[2],
+                          in.gyro[0], in.gyro[1], in.gyro[2], in.magnetom[0],
+                          in.magnetom[1], in.magnetom[2], in.deltat, beta);
+}
+
+template <typename M>
+static void MahonyUpdate_(float* q, float* e_int, float kp, float ki,
+                          const FusionInput& in) {
+  MahonyStep_<M, float>(q, e_int, in.accel[0], in.accel[1], in.accel[2],
+                        in.gyro[0], in.gyro[1], in.gyro[2], in.magnetom[0],
+                        in.magnetom[1], in.magnetom[2], in.deltat, kp, ki);
+}
+
+template <typename M>
+static void MadgwickBankUpdate_(size_t n, const FusionBatch& in,
+                                std::vector<float>* q,
+                                const std::vector<float>& beta) {
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    MadgwickBankStep_<M, Lanes>(i, in, q, beta);
+  }
+  for (; i < n; i++) {
+    MadgwickBankStep_<M, float>(i, in, q, beta);
+  }
+}
+
+template <typename M>
+static void MahonyBankUpdate_(size_t n, const FusionBatch& in,
+                              std::vector<float>* q, std::vector<float>* e_int,
+                              const std::vector<float>& kp,
+                              const std::vector<float>& ki) {
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    MahonyBankStep_<M, Lanes>(i, in, q, e_int, kp, ki);
+  }
+  for (; i < n; i++) {
+    MahonyBankStep_<M, float>(i, in, q, e_int, kp, ki);
+  }
+}
+
+// Public API ----------------------------------------------------------------
+
+const char* FusionPrecisionName(FusionPrecision precision) {
+  switch (precision) {
+    case FusionPrecision::kExact:
+      return "exact";
+    case FusionPrecision::kRsqrtNewton:
+      return "rsqrt+nr";
+    case FusionPrecision::kApproximate:
+      return "approx";
+    default:
+      return "unknown";
+  }
+}
+
+void QuaternionToEuler(const float* q, float* yaw, float* pitch,
+                       float* roll) {
+  *yaw = atan2f(2.0f * (q[1] * q[2] + q[0] * q[3]),
+                q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
+  *pitch = -asinf(2.0f * (q[1] * q[3] - q[0] * q[2]));
+  *roll = atan2f(2.0f * (q[0] * q[1] + q[2] * q[3]),
+                 q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
+}
+
+double QuaternionAngle(const float* a, const float* b) {
+  double dot = 0.0, norm_a = 0.0, norm_b = 0.0;
+  for (int k = 0; k < 4; k++) {
+    dot += (double)a[k]*b[k];
+    norm_a += (double)a[k]*a[k];
+    norm_b += (double)b[k]*b[k];
+  }
+  dot = fabs(dot)/sqrt(norm_a*norm_b);
+  return dot >= 1.0 ? 0.0 : 2.0*acos(dot);
+}
+
+MadgwickFilter::MadgwickFilter(float gyro_meas_error, float gyro_meas_drift)
+    : beta_(sqrtf(3.0f / 4.0f) * gyro_meas_error),
+      zeta_(sqrtf(3.0f / 4.0f) * gyro_meas_drift) {
+  Reset();
+}
+
+void MadgwickFilter::Reset() {
+  q_[0] = 1.0f;
+  q_[1] = q_[2] = q_[3] = 0.0f;
+}
+
+void MadgwickFilter::Update(const FusionInput& in) {
+  switch (precision_) {
+    case FusionPrecision::kRsqrtNewton:
+      MadgwickUpdate_<RsqrtNewtonMath>(q_, beta_, in);
+      break;
+    case FusionPrecision::kApproximate:
+      MadgwickUpdate_<ApproximateMath>(q_, beta_, in);
+      break;
+    default:
+      MadgwickUpdate_<ExactMath>(q_, beta_, in);
+      break;
+  }
+}
+
+MahonyFilter::MahonyFilter(float kp, float ki) : kp_(kp), ki_(ki) {
+  Reset();
+}
+
+void MahonyFilter::Reset() {
+  q_[0] = 1.0f;
+  q_[1] = q_[2] = q_[3] = 0.0f;
+  e_int_[0] = e_int_[1] = e_int_[2] = 0.0f;
+}
+
+void MahonyFilter::Update(const FusionInput& in) {
+  switch (precision_) {
+    case FusionPrecision::kRsqrtNewton:
+      MahonyUpdate_<RsqrtNewtonMath>(q_, e_int_, kp_, ki_, in);
+      break;
+    case FusionPrecision::kApproximate:
+      MahonyUpdate_<ApproximateMath>(q_, e_int_, kp_, ki_, in);
+      break;
+    default:
+      MahonyUpdate_<ExactMath>(q_, e_int_, kp_, ki_, in);
+      break;
+  }
+}
+
+MadgwickBank::MadgwickBank(size_t n, float gyro_meas_error)
+    : n_(n), beta_(n, sqrtf(3.0f / 4.0f) * gyro_meas_error) {
+  for (int k = 0; k < 4; k++) {
+    q_[k].resize(n);
+  }
+  Reset();
+}
+
+void MadgwickBank::Reset() {
+  for (size_t i = 0; i < n_; i++) {
+    q_[0][i] = 1.0f;
+    q_[1][i] = q_[2][i] = q_[3][i] = 0.0f;
+  }
+}
+
+void MadgwickBank::Update(const FusionBatch& in) {
+  switch (precision_) {
+    case FusionPrecision::kRsqrtNewton:
+      MadgwickBankUpdate_<RsqrtNewtonMath>(n_, in, q_, beta_);
+      break;
+    case FusionPrecision::kApproximate:
+      MadgwickBankUpdate_<ApproximateMath>(n_, in, q_, beta_);
+      break;
+    default:
+      MadgwickBankUpdate_<ExactMath>(n_, in, q_, beta_);
+      break;
+  }
+}
+
+void MadgwickBank::GetQ(size_t i, float* q) const {
+  for (int k = 0; k < 4; k++) {
+    q[k] = q_[k][i];
+  }
+}
+
+MahonyBank::MahonyBank(size_t n, float kp, float ki)
+    : n_(n), kp_(n, kp), ki_(n, ki) {
+  for (int k = 0; k < 4; k++) {
+    q_[k].resize(n);
+  }
+  for (int k = 0; k < 3; k++) {
+    e_int_[k].resize(n);
+  }
+  Reset();
+}
+
+void MahonyBank::Reset() {
+  for (size_t i = 0; i < n_; i++) {
+    q_[0][i] = 1.0f;
+    q_[1][i] = q_[2][i] = q_[3][i] = 0.0f;
+    e_int_[0][i] = e_int_[1][i] = e_int_[2][i] = 0.0f;
+  }
+}
+
+void MahonyBank::Update(const FusionBatch& in) {
+  switch (precision_) {
+    case FusionPrecision::kRsqrtNewton:
+      MahonyBankUpdate_<RsqrtNewtonMath>(n_, in, q_, e_int_, kp_, ki_);
+      break;
+    case FusionPrecision::kApproximate:
+      MahonyBankUpdate_<ApproximateMath>(n_, in, q_, e_int_, kp_, ki_);
+      break;
+    default:
+      MahonyBankUpdate_<ExactMath>(n_, in, q_, e_int_, kp_, ki_);
+      break;
+  }
+}
+
+void MahonyBank::GetQ(size_t i, float* q) const {
+  for (int k = 0; k < 4; k++) {
+    q[k] = q_[k][i];
+  }
+}
@@ -0,0 +1,168 @@
+// Sebastian Madgwick's and Robert Mahony's orientation filters, which fuse
+// acceleration, rotation rate and magnetic field into a quaternion estimate
+// of absolute device orientation. Same math as quaternionFilters.cpp of the
+// Arduino library, but every filter owns its quaternion, gains and integral
+// error, so a process can fuse any number of IMUs and filters can be updated
+// from different threads.
+//
+// MadgwickBank and MahonyBank advance many IMUs one time step at a time. Their
+// state is kept as one array per component and the update runs on as many
+// IMUs as fit in a SIMD register at once, without branches. Each lane of a
+// bank gives bit for bit the same result as a filter object fed the same data
+// at the same precision.
+//
+// Every filter can trade accuracy for speed with SetPrecision. SSE has a 12
+// bit reciprocal square root estimate, so kRsqrtNewton is within a few float
+// ulps of kExact and kApproximate within about 0.04%. NEON's estimate is 8
+// bits and the portable fallback is the well known bit trick, so there both
+// tiers take one extra Newton step to get to comparable accuracy.
+
+#ifndef QUATERNION_FILTERS_H_
+#define QUATERNION_FILTERS_H_
+
+#include <cstddef>  // Needed for size_t
+#include <vector>  // Needed for std::vector
+
+const float kPi = 3.14159265358979f;
+
+// Madgwick defaults. In the original study beta 0.041 (gyroscope measurement
+// error of 2.7 degrees/s) gave the best accuracy, but takes about 10 s to
+// converge. 40 degrees/s brings that down to about 2 s.
+const float kGyroMeasError = kPi*(40.0f/180.0f);  // rad/s
+const float kGyroMeasDrift = kPi*(0.0f/180.0f);   // rad/s/s
+// Mahony defaults, Kp for proportional feedback, Ki for integral
+const float kMahonyKp = 2.0f*5.0f;
+const float kMahonyKi = 0.0f;
+
+// How the square roots and divisions of the updates are computed
+enum class FusionPrecision {
+  kExact = 0,    // sqrt and divide, as the Arduino code
+  kRsqrtNewton,  // Hardware reciprocal square root estimate and a Newton step
+  kApproximate,  // Hardware reciprocal square root estimate alone
+  kNumPrecisions
+};
+
+const char* FusionPrecisionName(FusionPrecision precision);
+
+// Measurements of one time step, accelerometer in any unit, gyroscope in
+// rad/s, magnetometer in any unit and deltat in seconds. The magnetometer axes
+// have to be aligned with the accelerometer ones by the caller.
+struct FusionInput {
+  float accel[3];
+  float gyro[3];
+  float magnetom[3];
+  float deltat;
+};
+
+// One time step for every IMU of a bank, each array holds Size() values
+struct FusionBatch {
+  const float* accel[3];
+  const float* gyro[3];
+  const float* magnetom[3];
+  const float* deltat;
+};
+
+// Tait-Bryan angles in radians, applied in yaw, pitch, roll order
+void QuaternionToEuler(const float* q, float* yaw, float* pitch, float* roll);
+// Angle in radians of the rotation between two orientations. Both are
+// normalised first, the approximate precisions leave the norm off by up to a
+// few 1e-4, which on its own would read as degrees of error.
+double QuaternionAngle(const float* a, const float* b);
+
+class MadgwickFilter {
+  private:
+    float q_[4];
+    // Gain of the gradient descent step, sqrt(3/4) times the gyroscope
+    // measurement error
+    float beta_;
+    // Gain of the gyroscope drift compensation, sqrt(3/4) times the drift.
+    // Kept for completeness, the update below does not estimate gyro bias.
+    float zeta_;
+    FusionPrecision precision_ = FusionPrecision::kExact;
+
+  public:
+    explicit MadgwickFilter(float gyro_meas_error = kGyroMeasError,
+                            float gyro_meas_drift = kGyroMeasDrift);
+
+    // Leaves the quaternion untouched if either the accelerometer or the
+    // magnetometer reading is zero
+    void Update(const FusionInput& in);
+    void Reset();
+
+    const float* GetQ() const { return q_; }
+    float Beta() const { return beta_; }
+    float Zeta() const { return zeta_; }
+    void SetBeta(float beta) { beta_ = beta; }
+    FusionPrecision Precision() const { return precision_; }
+    void SetPrecision(FusionPrecision precision) { precision_ = precision; }
+};  // class MadgwickFilter
+
+class MahonyFilter {
+  private:
+    float q_[4];
+    float e_int_[3];  // Integral error
+    float kp_;
+    float ki_;
+    FusionPrecision precision_ = FusionPrecision::kExact;
+
+  public:
+    explicit MahonyFilter(float kp = kMahonyKp, float ki = kMahonyKi);
+
+    // Leaves the quaternion untouched if either the accelerometer or the
+    // magnetometer reading is zero
+    void Update(const FusionInput& in);
+    void Reset();
+
+    const float* GetQ() const { return q_; }
+    float Kp() const { return kp_; }
+    float Ki() const { return ki_; }
+    void SetGains(float kp, float ki) { kp_ = kp; ki_ = ki; }
+    FusionPrecision Precision() const { return precision_; }
+    void SetPrecision(FusionPrecision precision) { precision_ = precision; }
+};  // class MahonyFilter
+
+class MadgwickBank {
+  private:
+    size_t n_;
+    std::vector<float> q_[4];
+    std::vector<float> beta_;
+    FusionPrecision precision_ = FusionPrecision::kExact;
+
+  public:
+    explicit MadgwickBank(size_t n, float gyro_meas_error = kGyroMeasError);
+
+    size_t Size() const { return n_; }
+    void Update(const FusionBatch& in);
+    void Reset();
+
+    // Quaternion of IMU i
+    void GetQ(size_t i, float* q) const;
+    void SetBeta(size_t i, float beta) { beta_[i] = beta; }
+    FusionPrecision Precision() const { return precision_; }
+    void SetPrecision(FusionPrecision precision) { precision_ = precision; }
+};  // class MadgwickBank
+
+class MahonyBank {
+  private:
+    size_t n_;
+    std::vector<float> q_[4];
+    std::vector<float> e_int_[3];
+    std::vector<float> kp_;
+    std::vector<float> ki_;
+    FusionPrecision precision_ = FusionPrecision::kExact;
+
+  public:
+    explicit MahonyBank(size_t n, float kp = kMahonyKp, float ki = kMahonyKi);
+
+    size_t Size() const { return n_; }
+    void Update(const FusionBatch& in);
+    void Reset();
+
+    // Quaternion of IMU i
+    void GetQ(size_t i, float* q) const;
+    void SetGains(size_t i, float kp, float ki) { kp_[i] = kp; ki_[i] = ki; }
+    FusionPrecision Precision() const { return precision_; }
+    void SetPrecision(FusionPrecision precision) { precision_ = precision; }
+};  // class MahonyBank
+
+#endif // QUATERNION_FILTERS_H_
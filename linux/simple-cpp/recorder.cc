@@ -0,0 +1,291 @@
+#include "recorder.h"
+
+#include <stdio.h>  // Needed for printf, perror
+#include <string.h>  // Needed for memcpy, memcmp, memset
+#include <errno.h>  // Needed for errno
+#include <fcntl.h>  // Needed for open, posix_fallocate
+#include <unistd.h>  // Needed for close, ftruncate, sysconf
+#include <time.h>  // Needed for clock_gettime
+#include <sys/mman.h>  // Needed for mmap, mremap, msync
+#include <sys/stat.h>  // Needed for fstat
+#include "checksum.h"
+
+
+static uint64_t ClockNs(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+static uint32_t HeaderChecksum(const RecordHeader& header) {
+  uint32_t hash = Fnv1a(&header, offsetof(RecordHeader, checksum));
+  if (header.version >= 3) {
+    hash = Fnv1a(&header.magnetom, sizeof(header.magnetom), hash);
+  }
+  return hash;
+}
+
+static uint32_t RecordChecksum(const RecordedSample& record) {
+  return Fnv1a(&record, offsetof(RecordedSample, checksum));
+}
+
+bool RecordValid(const RecordedSample& record, uint64_t i) {
+  // A zero filled slot fails the checksum, so unwritten ones are caught too
+  return record.seq == (uint32_t)i && record.checksum == RecordChecksum(record);
+}
+
+void RecordToSample(const RecordedSample& record, Mpu9250Sample* sample) {
+  sample->timestamp_ns = record.timestamp_ns;
+  for (int i = 0; i < 3; i++) {
+    sample->accel_count[i] = record.accel_count[i];
+    sample->gyro_count[i] = record.gyro_count[i];
+    sample->magnetom_count[i] = record.magnetom_count[i];
+  }
+  sample->temp_count = record.temp_count;
+  sample->magnetom_new = record.magnetom_new;
+}
+
+// Recorder constructor
+Recorder::Recorder(const char* path, const RecordScale& scale,
+                   const RecordMagnetom& magnetom, uint64_t capacity,
+                   uint32_t sync_interval) {
+  capacity_ = capacity > 0 ? capacity : 1;
+  grow_by_ = capacity_;
+  next_sync_ = sync_interval;
+
+  // A failure is kept in error_ for the caller to check, e.g. a full disk
+  // must not take acquisition down with it
+  if ((file_ = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    error_ = -errno;
+    return;
+  }
+  // Reserve the blocks up front, so appending never waits for the file
+  // system to allocate them
+  map_size_ = sizeof(RecordHeader) + capacity_*sizeof(RecordedSample);
+  int error = posix_fallocate(file_, 0, map_size_);
+  void* map = MAP_FAILED;
+  if (error != 0) {
+    error_ = -error;
+  } else {
+    map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_,
+               0);
+    if (map == MAP_FAILED) {
+      error_ = -errno;
+    }
+  }
+  if (error_ < 0) {
+    close(file_);
+    file_ = -1;
+    return;
+  }
+  map_ = (uint8_t*)map;
+  header_ = (RecordHeader*)map_;
+  records_ = (RecordedSample*)(map_ + sizeof(RecordHeader));
+
+  RecordHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kRecordMagic, sizeof(header.magic));
+  header.version = kRecordVersion;
+  header.header_size = sizeof(RecordHeader);
+  header.record_size = sizeof(RecordedSample);
+  header.sync_interval = sync_interval;
+  header.start_realtime_ns = ClockNs(CLOCK_REALTIME);
+  header.start_monotonic_ns = ClockNs(CLOCK_MONOTONIC_RAW);
+  header.scale = scale;
+  header.magnetom = magnetom;
+  header.checksum = HeaderChecksum(header);
+  *header_ = header;
+  msync(map_, sizeof(RecordHeader), MS_ASYNC);
+}
+
+Recorder::~Recorder() {
+  Close();
+}
+
+int Recorder::Grow_() {
+  // Rare, once every grow_by_ records. On failure the old mapping stays as
+  // it is, with every record appended so far.
+  size_t new_size = map_size_ + grow_by_*sizeof(RecordedSample);
+  int error = posix_fallocate(file_, map_size_, new_size - map_size_);
+  if (error != 0) {
+    return -error;
+  }
+  void* map = mremap(map_, map_size_, new_size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    return -errno;
+  }
+  map_ = (uint8_t*)map;
+  map_size_ = new_size;
+  capacity_ += grow_by_;
+  header_ = (RecordHeader*)map_;
+  records_ = (RecordedSample*)(map_ + sizeof(RecordHeader));
+  return 0;
+}
+
+int Recorder::Append(const Mpu9250Sample& sample) {
+  if (error_ < 0) {
+    return error_;
+  }
+  if (count_ == capacity_) {
+    int error = Grow_();
+    if (error < 0) {
+      error_ = error;
+      return error;
+    }
+  }
+  // Build the record on the stack and copy it in one go, the page cache
+  // never sees a record without its checksum for long
+  RecordedSample record;
+  record.timestamp_ns = sample.timestamp_ns;
+  record.seq = (uint32_t)count_;
+  for (int i = 0; i < 3; i++) {
+    record.accel_count[i] = sample.accel_count[i];
+    record.gyro_count[i] = sample.gyro_count[i];
+    record.magnetom_count[i] = sample.magnetom_count[i];
+  }
+  record.temp_count = sample.temp_count;
+  record.magnetom_new = sample.magnetom_new;
+  memset(record.reserved, 0, sizeof(record.reserved));
+  record.checksum = RecordChecksum(record);
+  records_[count_] = record;
+
+  count_++;
+  if (count_ >= next_sync_ && header_->sync_interval > 0) {
+    Sync();
+  }
+  return 0;
+}
+
+int Recorder::Append(const Mpu9250Sample* samples, size_t n) {
+  int error = 0;
+  for (size_t i = 0; i < n && error == 0; i++) {
+    error = Append(samples[i]);
+  }
+  return error;
+}
+
+void Recorder::Sync() {
+  // Start writeback of the records added since the last sync point and note
+  // their count in the header. MS_ASYNC only queues the pages, so this does
+  // not wait for the disk, and neither is ordered against the other: the
+  // reader does not take synced_count on trust unless the log was closed.
+  if (map_ == nullptr) {
+    return;
+  }
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  size_t begin = sizeof(RecordHeader) +
+                 header_->synced_count*sizeof(RecordedSample);
+  size_t end = sizeof(RecordHeader) + count_*sizeof(RecordedSample);
+  begin -= begin % kPageSize;
+  msync(map_ + begin, end - begin, MS_ASYNC);
+
+  header_->synced_count = count_;
+  msync(map_, sizeof(RecordHeader), MS_ASYNC);
+  next_sync_ = count_ + header_->sync_interval;
+}
+
+void Recorder::Close() {
+  if (map_ == nullptr) {
+    if (file_ >= 0) {
+      close(file_);
+      file_ = -1;
+    }
+    return;
+  }
+  // The records have to be on disk before the header says the log was
+  // closed, a log marked closed is read without checking them
+  size_t used = sizeof(RecordHeader) + count_*sizeof(RecordedSample);
+  msync(map_, used, MS_SYNC);
+  header_->synced_count = count_;
+  header_->closed = 1;
+  msync(map_, sizeof(RecordHeader), MS_SYNC);
+  munmap(map_, map_size_);
+  map_ = nullptr;
+  // Give back the preallocated space that was not used
+  if (ftruncate(file_, used) != 0) {
+    perror("Failed to truncate the recording.\n");
+  }
+  close(file_);
+  file_ = -1;
+}
+
+RecordReader::~RecordReader() {
+  Close();
+}
+
+bool RecordReader::Open(const char* path, bool verify_all) {
+  Close();
+  if ((file_ = open(path, O_RDONLY)) < 0) {
+    perror("Failed to open the recording.\n");
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(file_, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(RecordHeader)) {
+    printf("%s is too short for a recording\n", path);
+    Close();
+    return false;
+  }
+  map_size_ = file_stat.st_size;
+  map_ = (uint8_t*)mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, file_, 0);
+  if (map_ == MAP_FAILED) {
+    map_ = nullptr;
+    perror("Failed to map the recording.\n");
+    Close();
+    return false;
+  }
+  header_ = (const RecordHeader*)map_;
+  if (memcmp(header_->magic, kRecordMagic, sizeof(kRecordMagic)) != 0 ||
+      header_->checksum != HeaderChecksum(*header_)) {
+    printf("%s is not a recording\n", path);
+    Close();
+    return false;
+  }
+  if (header_->version < kRecordMinVersion ||
+      header_->version > kRecordVersion ||
+      header_->header_size != sizeof(RecordHeader) ||
+      header_->record_size != sizeof(RecordedSample)) {
+    printf("%s is a version %u recording, only versions %u to %u are"
+           " supported\n", path, header_->version, kRecordMinVersion,
+           kRecordVersion);
+    Close();
+    return false;
+  }
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+  records_ = (const RecordedSample*)(map_ + sizeof(RecordHeader));
+
+  // Slots the file has room for, and the ones the header vouches for
+  uint64_t slots = (map_size_ - sizeof(RecordHeader))/sizeof(RecordedSample);
+  uint64_t synced = header_->synced_count;
+  if (synced > slots) {
+    synced = slots;
+  }
+  if (header_->closed && !verify_all) {
+    count_ = synced;
+  } else {
+    // After a crash of the system the header may have reached the disk
+    // before records below synced_count did, so every record is checked and
+    // taken up to the first torn or missing one
+    count_ = 0;
+    while (count_ < slots && RecordValid(records_[count_], count_)) {
+      count_++;
+    }
+  }
+  recovered_ = (!header_->closed && count_ > synced) ? count_ - synced : 0;
+  return true;
+}
+
+void RecordReader::Close() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+  }
+  if (file_ >= 0) {
+    close(file_);
+    file_ = -1;
+  }
+  header_ = nullptr;
+  records_ = nullptr;
+  count_ = 0;
+  recovered_ = 0;
+}
@@ -0,0 +1,201 @@
+// Binary raw-sample log. A Recorder appends fixed-size, timestamped raw
+// samples to a preallocated memory-mapped file, so appending a sample is a
+// copy into memory and never a system call. A RecordReader maps a log back
+// for offline processing.
+//
+// The file starts with a self-describing RecordHeader (format version,
+// record size, clocks, the scale configuration the samples were taken with
+// and the magnetometer calibration of the driver) followed by one
+// RecordedSample per sample. Every record carries its
+// index and a checksum. At every sync point, each sync_interval records, the
+// number of complete records is stored in the header and the dirty pages are
+// handed to the kernel for writeback, without waiting for it. The mapping is
+// shared, so everything appended survives a crash of the process. After a
+// crash of the whole system nothing says which pages made it to disk, so the
+// reader checks the records of a log that was not closed one by one and
+// stops at the first torn or missing one. Close() writes the records out
+// before it marks the log closed.
+//
+// Fields are stored in host byte order.
+//
+//   Recorder recorder("imu.rec", MakeRecordScale<Imu::Config>(),
+//                     MakeRecordMagnetom(imu), 1 << 20);
+//   recorder.Append(samples, n);  // On the consumer thread
+//   recorder.Close();
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <cstddef>  // Needed for size_t
+#include <stdint.h>  // Needed for uint8_t
+#include "decode.h"
+#include "mpu9250.h"
+
+const char kRecordMagic[8] = {'M', 'P', 'U', '9', '2', '5', '0', 'R'};
+// Version 3 adds the magnetometer calibration. Version 2 logs have the same
+// layout without it, version 1 logs also have CLOCK_MONOTONIC stamps instead
+// of CLOCK_MONOTONIC_RAW ones. Both are still read.
+const uint32_t kRecordVersion = 3;
+const uint32_t kRecordMinVersion = 1;
+// One second of 8 kHz gyro data
+const uint32_t kDefaultSyncInterval = 8000;
+
+// Scale configuration the samples of a log were taken with
+struct RecordScale {
+  uint8_t gyro_scale;      // FS_SEL field of GYRO_CONFIG
+  uint8_t accel_scale;     // ACCEL_FS_SEL field of ACCEL_CONFIG
+  uint8_t magnetom_scale;  // BIT field of AK8963_CNTL
+  uint8_t reserved;
+  DecodeScale si;          // LSB to SI units, see Mpu9250Config
+};
+
+// Magnetometer calibration the driver converted the samples of a log with,
+// see Mpu9250::ConvertMagnetom
+struct RecordMagnetom {
+  uint8_t asa[3];  // AK8963 fuse ROM, see Mpu9250::MagnetomAsa
+  uint8_t reserved;
+  float bias[3];   // Hard-iron offsets in mG
+};
+
+// What logs before version 3 are read with: the unit sensitivity adjustment
+// and no hard-iron offsets
+const RecordMagnetom kUncalibratedMagnetom = {{128, 128, 128}, 0,
+                                              {0.0f, 0.0f, 0.0f}};
+
+struct RecordHeader {
+  char magic[8];                // kRecordMagic
+  uint32_t version;             // kRecordVersion
+  uint32_t header_size;         // Bytes, the first record follows
+  uint32_t record_size;         // Bytes per record
+  uint32_t sync_interval;       // Records between sync points
+  uint64_t start_realtime_ns;   // CLOCK_REALTIME when the log was created
+  uint64_t start_monotonic_ns;  // CLOCK_MONOTONIC_RAW at the same instant,
+                                // the clock of the sample timestamps
+  RecordScale scale;
+  uint32_t checksum;            // Of every field above
+  uint32_t closed;              // 1 once the recorder was closed cleanly
+  uint64_t synced_count;        // Records complete at the last sync point
+  // Version 3, after the fields above to keep the layout of older logs but
+  // covered by checksum too
+  RecordMagnetom magnetom;
+  char reserved[32];
+};
+
+struct RecordedSample {
+  uint64_t timestamp_ns;  // CLOCK_MONOTONIC_RAW, 0 if unknown
+  uint32_t seq;           // Index of the record, lower 32 bits
+  int16_t accel_count[3];
+  int16_t temp_count;
+  int16_t gyro_count[3];
+  int16_t magnetom_count[3];
+  uint8_t magnetom_new;
+  uint8_t reserved[3];
+  uint32_t checksum;      // Of every field above
+};
+
+static_assert(sizeof(RecordHeader) == 128, "RecordHeader must be 128 bytes");
+static_assert(sizeof(RecordedSample) == 40, "RecordedSample must be 40 bytes");
+
+// Scale configuration of a compile-time Mpu9250Config
+template <typename Config>
+inline RecordScale MakeRecordScale() {
+  RecordScale scale = {Config::kGyroScale, Config::kAccelScale,
+                       Config::kMagnetomScale, 0, Config::SiDecodeScale()};
+  return scale;
+}
+
+// Magnetometer calibration imu converts its samples with
+inline RecordMagnetom MakeRecordMagnetom(const Mpu9250& imu) {
+  RecordMagnetom magnetom;
+  for (int i = 0; i < 3; i++) {
+    magnetom.asa[i] = imu.MagnetomAsa(i);
+    magnetom.bias[i] = imu.MagnetomBias(i);
+  }
+  magnetom.reserved = 0;
+  return magnetom;
+}
+
+// Whether record holds the sample with index i and is not torn
+bool RecordValid(const RecordedSample& record, uint64_t i);
+void RecordToSample(const RecordedSample& record, Mpu9250Sample* sample);
+
+class Recorder {
+  private:
+    int file_;
+    uint8_t* map_;
+    size_t map_size_;
+    uint64_t capacity_;  // Records the file has room for
+    uint64_t grow_by_;   // Records added whenever the file is full
+    uint64_t count_ = 0;
+    uint64_t next_sync_;
+    int error_ = 0;
+    RecordHeader* header_;
+    RecordedSample* records_;
+
+    int Grow_();
+
+  public:
+    // Create path, or truncate it, with room for capacity records. The file
+    // grows by another capacity records whenever it fills up. Check Error()
+    // afterwards, nothing is recorded if the file could not be set up.
+    Recorder(const char* path, const RecordScale& scale,
+             const RecordMagnetom& magnetom, uint64_t capacity,
+             uint32_t sync_interval = kDefaultSyncInterval);
+    ~Recorder();
+
+    // Only one thread may append. Meant to be called by the consumer of an
+    // acquisition ring, never by the thread that talks to the sensor.
+    // Returns 0, or Error() once the file could not grow, e.g. because the
+    // disk is full. The records appended until then are kept and Close()
+    // still finishes the log.
+    int Append(const Mpu9250Sample& sample);
+    int Append(const Mpu9250Sample* samples, size_t n);
+    // Make a sync point now
+    void Sync();
+    // Final sync point, cut the file to the records written and unmap it
+    void Close();
+
+    uint64_t Count() const { return count_; }
+    // 0, or the negative errno that stopped the recording
+    int Error() const { return error_; }
+};  // class Recorder
+
+class RecordReader {
+  private:
+    int file_ = -1;
+    uint8_t* map_ = nullptr;
+    size_t map_size_ = 0;
+    uint64_t count_ = 0;
+    uint64_t recovered_ = 0;
+    const RecordHeader* header_ = nullptr;
+    const RecordedSample* records_ = nullptr;
+
+  public:
+    RecordReader() {}
+    ~RecordReader();
+
+    // Map path and find its last complete record. Every record of a log
+    // that was not closed cleanly is checked, with verify_all those of a
+    // closed one too. Prints why and returns false if path
+    // is not a log this version can read.
+    bool Open(const char* path, bool verify_all = false);
+    void Close();
+
+    const RecordHeader& Header() const { return *header_; }
+    // The magnetometer calibration of the header, kUncalibratedMagnetom for
+    // logs before version 3
+    const RecordMagnetom& Magnetom() const {
+      return header_->version >= 3 ? header_->magnetom : kUncalibratedMagnetom;
+    }
+    // Complete records, valid ones past the last sync point included
+    uint64_t Count() const { return count_; }
+    // Valid records found past the last sync point of a log not closed
+    // cleanly
+    uint64_t Recovered() const { return recovered_; }
+    const RecordedSample& Record(uint64_t i) const { return records_[i]; }
+    void Sample(uint64_t i, Mpu9250Sample* sample) const {
+      RecordToSample(records_[i], sample);
+    }
+};  // class RecordReader
+
+#endif // RECORDER_H_
@@ -0,0 +1,210 @@
+// ***************************************************************************
+// Offline replay of raw sample logs
+//
+// Feeds logs written by the recorder of recorder.h through the same
+// conversion and orientation filters as the demo, as fast as the CPU allows.
+// The time step of every update comes from the recorded timestamps instead
+// of the clock, so the result does not depend on how fast the replay runs,
+// see fusion_replay.h.
+//
+// Logs are independent of each other and are spread over a work-stealing
+// pool of worker threads, one per core by default.
+//***************************************************************************/
+
+#include <stdio.h>  // Needed for printf, fopen, fprintf
+#include <stdint.h>  // Needed for uint64_t
+#include <stdlib.h>  // Needed for exit, atoi
+#include <string.h>  // Needed for strcmp
+#include <unistd.h>  // Needed for getopt
+#include <string>  // Needed for std::string
+#include <vector>  // Needed for std::vector
+#include "recorder.h"
+#include "sensor_config.h"
+#include "quaternion_filters.h"
+#include "fusion_replay.h"
+#include "work_pool.h"
+#include "timing.h"
+
+enum FilterKind {
+  kMahony = 0,
+  kMadgwick
+};
+
+struct ReplayOptions {
+  FilterKind filter;
+  FusionPrecision precision;
+  bool verify_all;  // Check every record of closed logs too
+  bool write_csv;   // Write <log>.csv with the orientation after each sample
+};
+
+struct ReplayResult {
+  bool ok;
+  uint64_t records;
+  uint64_t recovered;  // Records found past the last sync point
+  uint64_t updates;    // Filter updates, records with a known time step
+  double recorded_s;   // Time span covered by the timestamps
+  double replay_s;     // Wall time spent on the log
+  float yaw, pitch, roll;  // Final orientation in radians
+};
+
+template <typename Filter>
+static void ReplayLog(const RecordReader& reader, Filter* filter, FILE* csv,
+                      ReplayResult* result) {
+  float yaw = 0.0f, pitch = 0.0f, roll = 0.0f;
+  uint64_t span_ns = ForEachFusionStep(reader,
+      [&](const FusionInput& in, uint64_t t_ns) {
+    filter->Update(in);
+    result->updates++;
+    if (csv != nullptr) {
+      const float* q = filter->GetQ();
+      QuaternionToEuler(q, &yaw, &pitch, &roll);
+      fprintf(csv, "%llu,%.7f,%.7f,%.7f,%.7f,%.3f,%.3f,%.3f\n",
+              (unsigned long long)t_ns, q[0], q[1], q[2], q[3],
+              yaw/kDegToRad, pitch/kDegToRad, roll/kDegToRad);
+    }
+  });
+
+  QuaternionToEuler(filter->GetQ(), &result->yaw, &result->pitch,
+                    &result->roll);
+  result->recorded_s = span_ns/1e9;
+}
+
+static ReplayResult ReplayFile(const char* path,
+                               const ReplayOptions& options) {
+  ReplayResult result = {false, 0, 0, 0, 0.0, 0.0, 0.0f, 0.0f, 0.0f};
+  uint64_t start_ns = MonotonicRawNs();
+  RecordReader reader;
+  if (!reader.Open(path, options.verify_all)) {
+    return result;
+  }
+  result.records = reader.Count();
+  result.recovered = reader.Recovered();
+
+  FILE* csv = nullptr;
+  if (options.write_csv) {
+    std::string csv_path = std::string(path) + ".csv";
+    if ((csv = fopen(csv_path.c_str(), "w")) == nullptr) {
+      perror("Failed to create the CSV file.\n");
+      return result;
+    }
+    fprintf(csv, "timestamp_ns,q0,q1,q2,q3,yaw,pitch,roll\n");
+  }
+
+  if (options.filter == kMadgwick) {
+    MadgwickFilter filter;
+    filter.SetPrecision(options.precision);
+    ReplayLog(reader, &filter, csv, &result);
+  } else {
+    MahonyFilter filter;
+    filter.SetPrecision(options.precision);
+    ReplayLog(reader, &filter, csv, &result);
+  }
+
+  if (csv != nullptr) {
+    fclose(csv);
+  }
+  result.replay_s = (MonotonicRawNs() - start_ns)/1e9;
+  result.ok = true;
+  return result;
+}
+
+void PrintUsage(const char* name) {
+  printf("Usage: %s [-j threads] [-a mahony|madgwick] [-p precision] [-v] "
+         "[-o] log...\n", name);
+  printf("  -j  worker threads, default one per core\n");
+  printf("  -a  orientation filter, default mahony\n");
+  printf("  -p  exact, rsqrt+nr or approx, default exact\n");
+  printf("  -v  verify every record of logs that were closed cleanly too,\n"
+         "      those of logs cut short are always verified\n");
+  printf("  -o  write the orientation after every sample to <log>.csv\n");
+}
+
+int main(int argc, char* argv[]) {
+  ReplayOptions options = {kMahony, FusionPrecision::kExact, false, false};
+  uint n_threads = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:a:p:voh")) != -1) {
+    switch (opt) {
+      case 'j':
+        n_threads = atoi(optarg);
+        break;
+      case 'a':
+        if (strcmp(optarg, "mahony") == 0) {
+          options.filter = kMahony;
+        } else if (strcmp(optarg, "madgwick") == 0) {
+          options.filter = kMadgwick;
+        } else {
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'p': {
+        int p = 0;
+        while (p < (int)FusionPrecision::kNumPrecisions &&
+               strcmp(optarg, FusionPrecisionName((FusionPrecision)p)) != 0) {
+          p++;
+        }
+        if (p == (int)FusionPrecision::kNumPrecisions) {
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        options.precision = (FusionPrecision)p;
+        break;
+      }
+      case 'v':
+        options.verify_all = true;
+        break;
+      case 'o':
+        options.write_csv = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  uint n_files = argc - optind;
+  if (n_files == 0) {
+    PrintUsage(argv[0]);
+    exit(1);
+  }
+  if (n_threads > n_files) {
+    n_threads = n_files;
+  }
+
+  std::vector<ReplayResult> results(n_files);
+  uint64_t start_ns = MonotonicRawNs();
+  WorkStealingPool pool(n_threads);
+  pool.Run(n_files, [&](size_t f, uint) {
+    results[f] = ReplayFile(argv[optind + f], options);
+  });
+  double wall_s = (MonotonicRawNs() - start_ns)/1e9;
+
+  printf("%-24s %10s %9s %10s %10s %9s %8s %8s %8s\n", "log", "records",
+         "recovered", "recorded s", "replay ms", "speedup", "yaw", "pitch",
+         "roll");
+  bool ok = true;
+  uint64_t total_records = 0;
+  double total_recorded_s = 0.0;
+  for (uint f = 0; f < n_files; f++) {
+    const ReplayResult& r = results[f];
+    if (!r.ok) {
+      printf("%-24s failed\n", argv[optind + f]);
+      ok = false;
+      continue;
+    }
+    total_records += r.records;
+    total_recorded_s += r.recorded_s;
+    printf("%-24s %10llu %9llu %10.1f %10.1f %8.0fx %8.2f %8.2f %8.2f\n",
+           argv[optind + f], (unsigned long long)r.records,
+           (unsigned long long)r.recovered, r.recorded_s, r.replay_s*1e3,
+           r.replay_s > 0.0 ? r.recorded_s/r.replay_s : 0.0,
+           r.yaw/kDegToRad, r.pitch/kDegToRad, r.roll/kDegToRad);
+  }
+  printf("\n%u logs on %u threads, %llu records in %.3f s, %.2f M records/s, "
+         "%.0fx real time\n", n_files, pool.NumThreads(),
+         (unsigned long long)total_records, wall_s,
+         total_records/wall_s/1e6, total_recorded_s/wall_s);
+
+  return ok ? 0 : 1;
+}
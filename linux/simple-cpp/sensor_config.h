@@ -0,0 +1,112 @@
+// Compile-time sensor configuration. The full-scale ranges are template
+// parameters, so register values and LSB to physical unit factors are
+// constexpr and converting a raw sample folds into one multiply per axis with
+// no branches or float state read at run time.
+//
+//   typedef Mpu9250Config<GyroFs::k2000, AccelFs::k16g, MagBits::k16> Config;
+//   Mpu9250Fixed<GyroFs::k2000, AccelFs::k16g, MagBits::k16> imu(&bus);
+//   imu.InitMpu9250();  // Writes Config::kGyroConfig, kAccelConfig
+//   Config::Convert(sample, &reading);
+
+#ifndef SENSOR_CONFIG_H_
+#define SENSOR_CONFIG_H_
+
+#include <stdint.h>  // Needed for uint8_t
+#include "mpu9250.h"
+#include "decode.h"
+
+// Gyroscope full scale, the value is the FS_SEL field of GYRO_CONFIG
+enum class GyroFs : uint8_t { k250 = 0, k500, k1000, k2000 };
+// Accelerometer full scale, the value is the ACCEL_FS_SEL field
+enum class AccelFs : uint8_t { k2g = 0, k4g, k8g, k16g };
+// Magnetometer output resolution, the value is the BIT field of AK8963_CNTL
+enum class MagBits : uint8_t { k14 = 0, k16 };
+
+constexpr float kStandardGravity = 9.80665f;  // m/s^2 per g
+constexpr float kDegToRad = 3.14159265358979f/180.0f;
+
+// One converted sample in SI units
+struct Mpu9250Reading {
+  float accel[3];      // m/s^2
+  float gyro[3];       // rad/s
+  float magnetom[3];   // uT, AK8963 axes, without the factory adjustment
+                       // of the device, see Mpu9250::ConvertMagnetom
+  float temperature;   // Degrees C
+};
+
+// Every combination of the three ranges is one the MPU-9250 supports, the
+// enum classes only admit register values, so there is nothing left to
+// reject at compile time
+template <GyroFs G, AccelFs A, MagBits M>
+struct Mpu9250Config {
+  // Register field values, as the runtime driver keeps them
+  static constexpr uint8_t kGyroScale = static_cast<uint8_t>(G);
+  static constexpr uint8_t kAccelScale = static_cast<uint8_t>(A);
+  static constexpr uint8_t kMagnetomScale = static_cast<uint8_t>(M);
+  // Register values, ranges left-shifted into bits 4:3 (GYRO_CONFIG,
+  // ACCEL_CONFIG) and the output bit 4 of AK8963_CNTL
+  static constexpr uint8_t kGyroConfig = kGyroScale << 3;
+  static constexpr uint8_t kAccelConfig = kAccelScale << 3;
+  static constexpr uint8_t kMagnetomCntlBits = kMagnetomScale << 4;
+
+  // Resolutions in the units GetGyroRes/GetAccelRes/GetMagnetomRes use:
+  // degrees/s, g and mG per LSB
+  static constexpr float kGyroRes = (250 << kGyroScale)/32768.0f;
+  static constexpr float kAccelRes = (2 << kAccelScale)/32768.0f;
+  static constexpr float kMagnetomRes =
+      kMagnetomScale ? 10*4912.0f/32760.0f : 10*4912.0f/8190.0f;
+
+  // LSB to SI factors
+  static constexpr float kGyroToRadS = kGyroRes*kDegToRad;
+  static constexpr float kAccelToMs2 = kAccelRes*kStandardGravity;
+  static constexpr float kMagnetomToUt = kMagnetomRes*0.1f;  // 10 mG = 1 uT
+  // TEMP_degC = TEMP_OUT/333.87 + 21, MPU-9250 Product Specification 3.4.2
+  static constexpr float kTempScale = 1.0f/333.87f;
+  static constexpr float kTempOffset = 21.0f;
+
+  static inline void Convert(const Mpu9250Sample& sample,
+                             Mpu9250Reading* reading) {
+    for (int i = 0; i < 3; i++) {
+      reading->accel[i] = sample.accel_count[i]*kAccelToMs2;
+      reading->gyro[i] = sample.gyro_count[i]*kGyroToRadS;
+      reading->magnetom[i] = sample.magnetom_count[i]*kMagnetomToUt;
+    }
+    reading->temperature = sample.temp_count*kTempScale + kTempOffset;
+  }
+
+  // Factors for the batch decoder, same SI units as Convert
+  static inline DecodeScale SiDecodeScale() {
+    DecodeScale scale = {kAccelToMs2, kGyroToRadS, kMagnetomToUt, kTempScale,
+                         kTempOffset};
+    return scale;
+  }
+};
+
+// Mpu9250 with its full-scale ranges fixed at compile time. The runtime
+// members are set once from the configuration so the paths of the base
+// class keep working, e.g. magnetom_res is folded into the magnetometer
+// gain, and InitMpu9250 programs the matching ranges. Conversions use the
+// constants of Config, GetGyroRes and friends are never needed.
+template <GyroFs G, AccelFs A, MagBits M>
+class Mpu9250Fixed : public Mpu9250 {
+  public:
+    typedef Mpu9250Config<G, A, M> Config;
+
+    explicit Mpu9250Fixed(Bus* i2c_n, uint8_t mpu_addr = kMpu6500Addr)
+        : Mpu9250(i2c_n, mpu_addr) {
+      gyro_scale = Config::kGyroScale;
+      accel_scale = Config::kAccelScale;
+      magnetom_scale = Config::kMagnetomScale;
+      gyro_res = Config::kGyroRes;
+      accel_res = Config::kAccelRes;
+      magnetom_res = Config::kMagnetomRes;
+      UpdateMagnetomScale_();
+    }
+
+    static inline void Convert(const Mpu9250Sample& sample,
+                               Mpu9250Reading* reading) {
+      Config::Convert(sample, reading);
+    }
+};
+
+#endif // SENSOR_CONFIG_H_
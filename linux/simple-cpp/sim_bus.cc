@@ -0,0 +1,815 @@
+#include "sim_bus.h"
+
+#include <errno.h>  // Needed for ENXIO
+#include <math.h>  // Needed for sin, cos, fabsf
+#include <string.h>  // Needed for memset, memcpy
+#include <algorithm>  // Needed for std::min
+#include <time.h>  // Needed for clock_gettime, clock_nanosleep
+#include <unistd.h>  // Needed for write
+
+// Factory accelerometer trim words, bit 0 set like on most parts
+static const uint16_t kFactoryAccelTrim[3] = {0x1A2F, 0xE5D1, 0x2E8B};
+// Factory self-test codes of the gyro and the accel axes
+static const uint8_t kFactorySelfTest[6] = {0xD3, 0xCB, 0xE1, 0x9E, 0xA2,
+                                            0xB7};
+// Typical AK8963 fuse ROM sensitivity adjustment values
+static const uint8_t kFactoryAsa[3] = {0xB0, 0xB3, 0xA7};
+// Earth field seen by the device in uT, horizontal and vertical (down)
+static const float kFieldNorthUt = 20.0f;
+static const float kFieldDownUt = 40.0f;
+// MPU6500 start-up time after a PWR_MGMT_1 H_RESET
+static const uint64_t kResetNs = 1000000;
+// Gyroscope start-up time, the first sample follows this long after the
+// reset, MPU-9250 Product Specification 3.1
+static const uint64_t kGyroStartNs = 35000000;
+// Accelerometer sample period in cycle mode for each LP_ACCEL_ODR setting,
+// 0.24 Hz to 500 Hz
+static const uint64_t kLpPeriodNs[12] = {
+  4166666667ull, 2040816327ull, 1020408163ull, 512820513ull, 255754476ull,
+  128040973ull, 63979527ull, 32000000ull, 16000000ull, 8000000ull, 4000000ull,
+  2000000ull
+};
+// AK8963 single measurement time
+static const uint64_t kMagMeasureNs = 7200000;
+
+
+static uint64_t NowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+static int16_t Saturate(float value) {
+  if (value > 32767.0f) {
+    return 32767;
+  } else if (value < -32768.0f) {
+    return -32768;
+  }
+  return (int16_t)lrintf(value);
+}
+
+// Simulated bus constructor
+SimBus::SimBus(uint8_t mpu_addr) : pin_running_(false) {
+  mpu_addr_ = mpu_addr;
+  memcpy(self_test_, kFactorySelfTest, sizeof(self_test_));
+  start_ns_ = NowNs();
+  ResetStats();
+  ResetMpu_();
+  ResetAk_();
+  reset_done_ns_ = start_ns_;
+  sensors_ready_ns_ = start_ns_;
+  next_sample_ns_ = start_ns_ + SamplePeriodNs_();
+}
+
+SimBus::~SimBus() {
+  SetIntPin(-1);
+}
+
+void SimBus::SetTiming(uint32_t clock_hz, uint32_t overhead_ns) {
+  clock_hz_ = clock_hz;
+  overhead_ns_ = overhead_ns;
+}
+
+void SimBus::SetAcceleration(float x_g, float y_g, float z_g) {
+  accel_g_[0] = x_g;
+  accel_g_[1] = y_g;
+  accel_g_[2] = z_g;
+}
+
+void SimBus::SetGyroBias(float x_dps, float y_dps, float z_dps) {
+  gyro_bias_dps_[0] = x_dps;
+  gyro_bias_dps_[1] = y_dps;
+  gyro_bias_dps_[2] = z_dps;
+}
+
+void SimBus::SetSelfTestCodes(const uint8_t* codes) {
+  memcpy(self_test_, codes, sizeof(self_test_));
+  memcpy(&mpu_regs_[kSelfTestXGyro], &self_test_[0], 3);
+  memcpy(&mpu_regs_[kSelfTestXAccel], &self_test_[3], 3);
+}
+
+void SimBus::ResetStats() {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void SimBus::ResetMpu_() {
+  memset(mpu_regs_, 0, sizeof(mpu_regs_));
+  mpu_regs_[kPwrMgmt1] = 0x01;
+  mpu_regs_[kWhoAmImpu6500] = 0x71;
+  memcpy(&mpu_regs_[kSelfTestXGyro], &self_test_[0], 3);
+  memcpy(&mpu_regs_[kSelfTestXAccel], &self_test_[3], 3);
+  const uint8_t trim_regs[3] = {kXaOffsetH, kYaOffsetH, kZaOffsetH};
+  for (int i = 0; i < 3; i++) {
+    mpu_regs_[trim_regs[i]] = kFactoryAccelTrim[i] >> 8;
+    mpu_regs_[trim_regs[i] + 1] = kFactoryAccelTrim[i] & 0xFF;
+  }
+  fifo_head_ = 0;
+  fifo_count_ = 0;
+}
+
+void SimBus::ResetAk_() {
+  memset(ak_regs_, 0, sizeof(ak_regs_));
+  ak_regs_[kWia] = 0x48;
+  ak_regs_[kInfo] = 0x9A;
+  for (int i = 0; i < 3; i++) {
+    ak_fuse_[i] = kFactoryAsa[i];
+  }
+}
+
+uint64_t SimBus::SamplePeriodNs_() const {
+  // In cycle mode only the accelerometer wakes up, at the LP_ACCEL_ODR rate
+  if (mpu_regs_[kPwrMgmt1] & 0x20) {
+    uint8_t lp_odr = mpu_regs_[kLpAccelOdr] & 0x0F;
+    return kLpPeriodNs[lp_odr < 12 ? lp_odr : 11];
+  }
+  // Internal sample rate is 32 kHz with the DLPF bypassed through FCHOICE_B,
+  // 8 kHz with DLPF_CFG 0 or 7 and 1 kHz otherwise. SMPLRT_DIV only divides
+  // the 1 kHz rate.
+  uint8_t dlpf_cfg = mpu_regs_[kConfig] & 0x07;
+  if (mpu_regs_[kGyroConfig] & 0x03) {
+    return 1000000000ull/32000;
+  } else if (dlpf_cfg == 0 || dlpf_cfg == 7) {
+    return 1000000000ull/8000;
+  }
+  return 1000000ull*(1 + mpu_regs_[kSmplrtDiv]);
+}
+
+int16_t SimBus::Noise_() {
+  // Small deterministic noise in [-4, 4] LSB from a linear congruential
+  // generator, so runs are repeatable
+  noise_state_ = noise_state_*1103515245u + 12345u;
+  return (int16_t)((noise_state_ >> 16) % 9) - 4;
+}
+
+void SimBus::Advance_(uint64_t now_ns) {
+  // Produce every sample that became due since the last access
+  bool sleeping = (mpu_regs_[kPwrMgmt1] & 0x40) != 0;
+  uint64_t period = SamplePeriodNs_();
+  if (sleeping || now_ns < sensors_ready_ns_) {
+    next_sample_ns_ = now_ns + period;
+  } else if (next_sample_ns_ <= now_ns) {
+    // After a long gap only the newest samples matter, the FIFO holds less
+    // than 64 packets
+    uint64_t missed = (now_ns - next_sample_ns_)/period;
+    if (missed > 64) {
+      next_sample_ns_ += (missed - 64)*period;
+      if ((mpu_regs_[kUserCtrl] & 0x40) && mpu_regs_[kFifoEn]) {
+        mpu_regs_[kIntStatus] |= 0x10;  // FIFO_OFLOW_INT
+      }
+    }
+    while (next_sample_ns_ <= now_ns) {
+      Sample_(next_sample_ns_);
+      next_sample_ns_ += period;
+    }
+  }
+  AkAdvance_(now_ns);
+}
+
+void SimBus::Sample_(uint64_t t_ns) {
+  float t = (t_ns - start_ns_)*1e-9f;
+
+  // Accelerometer: gravity along +z and any acceleration set, plus any
+  // offset programmed on top of the factory trim, in 2048 LSB/g steps
+  float accel_g[3] = {accel_g_[0], accel_g_[1], 1.0f + accel_g_[2]};
+  const uint8_t trim_regs[3] = {kXaOffsetH, kYaOffsetH, kZaOffsetH};
+  for (int i = 0; i < 3; i++) {
+    int16_t word = (int16_t)((mpu_regs_[trim_regs[i]] << 8) |
+                             mpu_regs_[trim_regs[i] + 1]);
+    accel_g[i] += (word - (int16_t)kFactoryAccelTrim[i])/2048.0f;
+  }
+  uint8_t accel_fs = (mpu_regs_[kAccelConfig] >> 3) & 0x03;
+  float accel_lsb = 32768.0f/(2 << accel_fs);
+
+  // Gyroscope: rotation about z plus bias, plus the offset registers which
+  // are added to the output at 4 LSB per step at 250 dps
+  float gyro_dps[3] = {gyro_bias_dps_[0], gyro_bias_dps_[1],
+                       gyro_bias_dps_[2] + rotation_dps_};
+  uint8_t gyro_fs = (mpu_regs_[kGyroConfig] >> 3) & 0x03;
+  float gyro_lsb = 32768.0f/(250 << gyro_fs);
+
+  // Outputs of sensors turned off in PWR_MGMT_1 and PWR_MGMT_2 hold
+  int16_t counts[7];
+  for (int i = 0; i < 7; i++) {
+    counts[i] = (int16_t)((mpu_regs_[kAccelXoutH + 2*i] << 8) |
+                          mpu_regs_[kAccelXoutL + 2*i]);
+  }
+  // Wake-on-motion compares every accelerometer sample with the one before,
+  // WOM_THR counts 4 mg per LSB
+  bool wake = false;
+  float wake_counts = mpu_regs_[kWomThr]*0.004f*accel_lsb;
+  for (int i = 0; i < 3; i++) {
+    int16_t accel = Saturate(accel_g[i]*accel_lsb + Noise_());
+    wake = wake || fabsf(accel - counts[i]) > wake_counts;
+    counts[i] = accel;
+    int16_t offset = (int16_t)((mpu_regs_[kXgOffsetH + 2*i] << 8) |
+                               mpu_regs_[kXgOffsetL + 2*i]);
+    int16_t gyro = Saturate(gyro_dps[i]*gyro_lsb + offset*4.0f/(1 << gyro_fs)
+                            + Noise_());
+    if (!(mpu_regs_[kPwrMgmt2] & (0x04 >> i))) {
+      counts[4 + i] = gyro;
+    }
+  }
+  // Temperature around 25 degrees C, 333.87 LSB/degree C from 21 degrees C
+  if (!(mpu_regs_[kPwrMgmt1] & 0x08)) {
+    float temp_c = 25.0f + 0.5f*sinf(t*0.01f);
+    counts[3] = Saturate((temp_c - 21.0f)*333.87f);
+  }
+
+  for (int i = 0; i < 7; i++) {
+    mpu_regs_[kAccelXoutH + 2*i] = (uint8_t)(counts[i] >> 8);
+    mpu_regs_[kAccelXoutL + 2*i] = (uint8_t)(counts[i] & 0xFF);
+  }
+  mpu_regs_[kIntStatus] |= 0x01;  // RAW_DATA_RDY_INT
+  if (wake && (mpu_regs_[kMotDetectCtrl] & 0x80) &&
+      (mpu_regs_[kIntEnable] & 0x40)) {
+    mpu_regs_[kIntStatus] |= 0x40;  // WOM_INT
+  }
+
+  // The internal I2C master runs once per sample
+  AkAdvance_(t_ns);
+  MasterSample_(t_ns);
+
+  // Packets are written in register order: accel, temperature, gyro x/y/z
+  // and then the external sensor data read by SLV0
+  uint8_t fifo_en = mpu_regs_[kFifoEn];
+  if ((mpu_regs_[kUserCtrl] & 0x40) && fifo_en) {
+    if (fifo_en & 0x08) {
+      for (int i = 0; i < 6; i++) {
+        PushFifo_(mpu_regs_[kAccelXoutH + i]);
+      }
+    }
+    if (fifo_en & 0x80) {
+      PushFifo_(mpu_regs_[kTempOutH]);
+      PushFifo_(mpu_regs_[kTempOutL]);
+    }
+    for (int i = 0; i < 3; i++) {
+      if (fifo_en & (0x40 >> i)) {
+        PushFifo_(mpu_regs_[kGyroXoutH + 2*i]);
+        PushFifo_(mpu_regs_[kGyroXoutL + 2*i]);
+      }
+    }
+    if (fifo_en & 0x01) {
+      uint8_t len = mpu_regs_[kI2cSlv0Ctrl] & 0x0F;
+      for (uint8_t i = 0; i < len; i++) {
+        PushFifo_(mpu_regs_[kExtSensData00 + i]);
+      }
+    }
+  }
+}
+
+void SimBus::MasterSample_(uint64_t t_ns) {
+  // SLV0 reads from (or writes to) the AK8963 on every sample while the
+  // internal I2C master is enabled
+  uint8_t ctrl = mpu_regs_[kI2cSlv0Ctrl];
+  if (!(mpu_regs_[kUserCtrl] & 0x20) || !(ctrl & 0x80)) {
+    return;
+  }
+  uint8_t addr = mpu_regs_[kI2cSlv0Addr];
+  if ((addr & 0x7F) != kAk8963Addr) {
+    mpu_regs_[kI2cMstStatus] |= 0x01;  // I2C_SLV0_NACK
+    return;
+  }
+  uint8_t reg = mpu_regs_[kI2cSlv0Reg];
+  if (addr & 0x80) {
+    uint8_t len = ctrl & 0x0F;
+    for (uint8_t i = 0; i < len && i < 24; i++) {
+      ak_ptr_ = reg + i;
+      mpu_regs_[kExtSensData00 + i] = ReadReg_(kAk8963Addr, t_ns);
+    }
+  } else {
+    WriteReg_(kAk8963Addr, reg, mpu_regs_[kI2cSlv0Do], t_ns);
+  }
+}
+
+void SimBus::PushFifo_(uint8_t byte) {
+  // A full FIFO drops its oldest byte, just like the part does
+  if (fifo_count_ == kFifoSize) {
+    fifo_head_ = (fifo_head_ + 1) % kFifoSize;
+    fifo_count_--;
+    mpu_regs_[kIntStatus] |= 0x10;  // FIFO_OFLOW_INT
+  }
+  fifo_[(fifo_head_ + fifo_count_) % kFifoSize] = byte;
+  fifo_count_++;
+}
+
+void SimBus::AkAdvance_(uint64_t now_ns) {
+  uint8_t mode = ak_regs_[kCntl] & 0x0F;
+  uint64_t period;
+  if (mode == 0x02) {
+    period = 125000000;  // Continuous measurement mode 1, 8 Hz
+  } else if (mode == 0x06) {
+    period = 10000000;  // Continuous measurement mode 2, 100 Hz
+  } else if (mode == 0x01 || mode == 0x08) {
+    // Single measurement and self-test power down after one measurement
+    if (now_ns >= next_mag_ns_) {
+      AkMeasure_(next_mag_ns_);
+      ak_regs_[kCntl] &= 0xF0;
+    }
+    return;
+  } else {
+    return;
+  }
+
+  if (next_mag_ns_ + 4*period < now_ns) {
+    // Several measurements were never read, the data overran
+    uint64_t skipped = (now_ns - next_mag_ns_)/period - 1;
+    next_mag_ns_ += skipped*period;
+    stats_.magnetom_skipped += skipped;
+    ak_regs_[kSt1] |= 0x02;  // DOR
+  }
+  while (next_mag_ns_ <= now_ns) {
+    if (next_mag_ns_ > ak_protect_from_ns_ &&
+        next_mag_ns_ <= ak_protect_until_ns_) {
+      // Ended while the host was reading the data registers, which are
+      // protected until ST2 is read. The measurement is dropped and DOR
+      // flags it to the next read.
+      stats_.magnetom_skipped++;
+      ak_regs_[kSt1] |= 0x02;  // DOR
+    } else {
+      AkMeasure_(next_mag_ns_);
+    }
+    next_mag_ns_ += period;
+  }
+}
+
+void SimBus::AkMeasure_(uint64_t t_ns) {
+  // Field in the device frame while it spins about z, mapped onto the
+  // AK8963 axes: x and y are swapped and z points the other way
+  float t = (t_ns - start_ns_)*1e-9f;
+  float angle = rotation_dps_*t*(float)M_PI/180.0f;
+  float device[3] = {kFieldNorthUt*cosf(angle), -kFieldNorthUt*sinf(angle),
+                     -kFieldDownUt};
+  float sensor[3] = {device[1], device[0], -device[2]};
+
+  bool bits16 = (ak_regs_[kCntl] & 0x10) != 0;
+  float ut_per_lsb = bits16 ? 0.15f : 0.6f;
+  for (int i = 0; i < 3; i++) {
+    // The factory adjustment gets applied by the host, so divide it out
+    float adjust = (ak_fuse_[i] - 128)/256.0f + 1.0f;
+    int16_t count = Saturate(sensor[i]/(ut_per_lsb*adjust) + Noise_()/2);
+    ak_regs_[kHxl + 2*i] = (uint8_t)(count & 0xFF);
+    ak_regs_[kHxh + 2*i] = (uint8_t)(count >> 8);
+  }
+
+  if (ak_regs_[kSt1] & 0x01) {
+    stats_.magnetom_skipped++;
+    ak_regs_[kSt1] |= 0x02;  // DOR, previous data was never read
+  }
+  ak_regs_[kSt1] |= 0x01;  // DRDY
+  ak_regs_[kSt2] = bits16 ? 0x10 : 0x00;  // BITM mirrors the output setting
+}
+
+void SimBus::AkSetMode_(uint8_t cntl, uint64_t now_ns) {
+  ak_regs_[kCntl] = cntl & 0x1F;
+  uint8_t mode = cntl & 0x0F;
+  if (mode == 0x01 || mode == 0x02 || mode == 0x06 || mode == 0x08) {
+    next_mag_ns_ = now_ns + kMagMeasureNs;
+  }
+}
+
+bool SimBus::AkPresent_() const {
+  // The host only reaches the AK8963 through the bypass multiplexer, which
+  // is off while the internal I2C master owns the auxiliary bus
+  return (mpu_regs_[kIntPinCfg] & 0x02) && !(mpu_regs_[kUserCtrl] & 0x20);
+}
+
+uint8_t SimBus::ReadReg_(uint16_t addr, uint64_t now_ns) {
+  uint8_t value;
+  if (addr == kAk8963Addr) {
+    uint8_t reg = ak_ptr_++;
+    if (reg >= sizeof(ak_regs_)) {
+      return 0;
+    }
+    if (reg >= kAsax && reg <= kAsaz) {
+      // Fuse ROM is only readable in fuse ROM access mode
+      return (ak_regs_[kCntl] & 0x0F) == 0x0F ? ak_fuse_[reg - kAsax] : 0;
+    }
+    value = ak_regs_[reg];
+    ak_data_read_ = ak_data_read_ || (reg >= kHxl && reg <= kSt2);
+    if (reg == kSt2) {
+      // Reading ST2 ends the data read and releases DRDY and DOR
+      ak_regs_[kSt1] &= ~0x03;
+    }
+    return value;
+  }
+
+  uint8_t reg = mpu_ptr_ & 0x7F;
+  if (reg == kFifoRW) {
+    // FIFO_R_W does not auto-increment, every byte comes from the FIFO
+    if (fifo_count_ == 0) {
+      return 0xFF;
+    }
+    value = fifo_[fifo_head_];
+    fifo_head_ = (fifo_head_ + 1) % kFifoSize;
+    fifo_count_--;
+    return value;
+  }
+  mpu_ptr_ = (mpu_ptr_ + 1) & 0x7F;
+
+  switch (reg) {
+    case kIntStatus:
+      value = mpu_regs_[kIntStatus];
+      mpu_regs_[kIntStatus] = 0;  // Cleared on read
+      break;
+    case kFifoCountH:
+      value = (fifo_count_ >> 8) & 0x1F;
+      break;
+    case kFifoCountL:
+      value = fifo_count_ & 0xFF;
+      break;
+    case kPwrMgmt1:
+      value = mpu_regs_[kPwrMgmt1];
+      if (now_ns < reset_done_ns_) {
+        value |= 0x80;  // H_RESET reads back set until the reset is done
+      }
+      break;
+    case kI2cMstStatus:
+      value = mpu_regs_[kI2cMstStatus];
+      mpu_regs_[kI2cMstStatus] = 0;  // Cleared on read
+      break;
+    default:
+      value = mpu_regs_[reg];
+      break;
+  }
+  return value;
+}
+
+void SimBus::WriteReg_(uint16_t addr, uint8_t reg, uint8_t data,
+                       uint64_t now_ns) {
+  if (addr == kAk8963Addr) {
+    switch (reg) {
+      case kCntl:
+        AkSetMode_(data, now_ns);
+        break;
+      case kCntl2:
+        if (data & 0x01) {
+          ResetAk_();
+        }
+        break;
+      case kAstc:
+      case 0x0F:  // I2CDIS
+        ak_regs_[reg] = data;
+        break;
+      default:
+        break;  // Read only
+    }
+    return;
+  }
+
+  reg &= 0x7F;
+  switch (reg) {
+    case kWhoAmImpu6500:
+    case kIntStatus:
+    case kFifoCountH:
+    case kFifoCountL:
+    case kI2cMstStatus:
+      break;  // Read only
+    case kFifoRW:
+      PushFifo_(data);
+      break;
+    case kPwrMgmt1:
+      if (data & 0x80) {
+        // H_RESET restores every register to its default value
+        ResetMpu_();
+        reset_done_ns_ = now_ns + kResetNs;
+        sensors_ready_ns_ = reset_done_ns_ + kGyroStartNs;
+      } else {
+        mpu_regs_[kPwrMgmt1] = data;
+      }
+      break;
+    case kPwrMgmt2:
+      if ((mpu_regs_[kPwrMgmt2] & 0x07) && !(data & 0x07)) {
+        // The gyroscope starts up again as after a reset
+        sensors_ready_ns_ = now_ns + kGyroStartNs;
+      }
+      mpu_regs_[kPwrMgmt2] = data;
+      break;
+    case kUserCtrl:
+      if (data & 0x04) {  // FIFO_RST, self clearing
+        fifo_head_ = 0;
+        fifo_count_ = 0;
+      }
+      mpu_regs_[kUserCtrl] = data & 0xF0;
+      break;
+    case kI2cSlv4Ctrl:
+      mpu_regs_[kI2cSlv4Ctrl] = data & 0x7F;
+      if ((data & 0x80) && (mpu_regs_[kUserCtrl] & 0x20)) {
+        // SLV4 runs a single transfer and raises SLV4_DONE
+        uint8_t slv4_addr = mpu_regs_[kI2cSlv4Addr];
+        if ((slv4_addr & 0x7F) != kAk8963Addr) {
+          mpu_regs_[kI2cMstStatus] |= 0x10;  // I2C_SLV4_NACK
+        } else if (slv4_addr & 0x80) {
+          ak_ptr_ = mpu_regs_[kI2cSlv4Reg];
+          mpu_regs_[kI2cSlv4Di] = ReadReg_(kAk8963Addr, now_ns);
+        } else {
+          WriteReg_(kAk8963Addr, mpu_regs_[kI2cSlv4Reg],
+                    mpu_regs_[kI2cSlv4Do], now_ns);
+        }
+        mpu_regs_[kI2cMstStatus] |= 0x40;  // I2C_SLV4_DONE
+      }
+      break;
+    default:
+      mpu_regs_[reg] = data;
+      break;
+  }
+}
+
+bool SimBus::Answers(uint16_t addr) const {
+  return addr == mpu_addr_ || (addr == kAk8963Addr && AkPresent_());
+}
+
+bool SimBus::XferMsg_(struct i2c_msg* msg, uint64_t now_ns) {
+  // Run one message against the register model, false if it is not acked
+  uint16_t addr = msg->addr;
+  stats_.messages++;
+  stats_.bytes += msg->len;
+
+  if (!Answers(addr)) {
+    // Nobody acknowledges the address, the transfer stops here
+    stats_.nacks++;
+    return false;
+  }
+
+  if (msg->flags & I2C_M_RD) {
+    for (uint j = 0; j < msg->len; j++) {
+      msg->buf[j] = ReadReg_(addr, now_ns);
+    }
+  } else if (msg->len > 0) {
+    // First byte sets the register pointer, the rest are written from there
+    // with auto-increment
+    uint8_t reg = msg->buf[0];
+    for (uint j = 1; j < msg->len; j++) {
+      WriteReg_(addr, reg++, msg->buf[j], now_ns);
+    }
+    if (addr == kAk8963Addr) {
+      ak_ptr_ = reg;
+    } else {
+      mpu_ptr_ = reg & 0x7F;
+    }
+  }
+  return true;
+}
+
+int SimBus::Xfer_(struct i2c_msg* msgs, uint n_msgs, BusStats::Op op) {
+  // Run the messages against the register model and then hold the caller
+  // for as long as the transfer would take on the wire
+  uint64_t start_ns = NowNs();
+  std::unique_lock<std::mutex> lock(mutex_);
+  Advance_(start_ns);
+  UpdatePin_();
+
+  uint64_t bits = 1;  // Stop condition
+  int error = 0;
+  stats_.transfers++;
+  bool fault = fault_every_ > 0 && stats_.transfers % fault_every_ == 0;
+  if (fault && !fault_late_) {
+    // Injected failure, the transfer ends after the first address byte
+    // without reaching the device
+    stats_.faults++;
+    bits += 1 + 9;
+    error = fault_error_;
+  }
+  bool data_ready = mpu_regs_[kIntStatus] & 0x01;
+  if (fault_took_sample_ && !data_ready) {
+    // The sample a late fault took is gone for good unless the caller gets
+    // a newer one
+    stats_.lost++;
+  }
+  fault_took_sample_ = false;
+  for (uint i = 0; i < n_msgs && error == 0; i++) {
+    uint64_t msg_start_ns = start_ns + overhead_ns_ +
+                            bits*1000000000ull/clock_hz_;
+    bits += 1 + 9 + 9*msgs[i].len;  // (Repeated) start, address and data bytes
+    ak_data_read_ = false;
+    if (!XferMsg_(&msgs[i], start_ns)) {
+      error = -ENXIO;  // What i2c-dev reports for a NACK
+    }
+    if (ak_data_read_ && (msgs[i].flags & I2C_M_RD)) {
+      // The registers are read at start_ns in the model, but on the wire
+      // they go out during this message
+      ak_protect_from_ns_ = msg_start_ns;
+      ak_protect_until_ns_ = start_ns + overhead_ns_ +
+                             bits*1000000000ull/clock_hz_;
+    }
+  }
+  if (fault && fault_late_ && error == 0) {
+    // Injected failure once every byte went over the wire, the caller gets
+    // none of them
+    stats_.faults++;
+    error = fault_error_;
+    fault_took_sample_ = data_ready && !(mpu_regs_[kIntStatus] & 0x01);
+  }
+  // Reading INT_STATUS drops the pin
+  UpdatePin_();
+  lock.unlock();
+
+  SpinUntil_(start_ns + overhead_ns_ + bits*1000000000ull/clock_hz_);
+  bus_stats_.RecordMsgs(op, msgs, n_msgs, error == 0, NowNs() - start_ns);
+  return error;
+}
+
+void SimBus::SpinUntil_(uint64_t done_ns) {
+  while (NowNs() < done_ns) {
+    // Spin, sleeping is far too coarse for transfers of a few microseconds
+  }
+}
+
+void SimBus::UpdatePin_() {
+  bool high = (mpu_regs_[kIntStatus] & mpu_regs_[kIntEnable] & 0x51) != 0;
+  if (high && !pin_high_ && pin_fd_ >= 0) {
+    uint64_t one = 1;
+    if (write(pin_fd_, &one, sizeof(one)) == sizeof(one)) {
+      stats_.int_edges++;
+    }
+  }
+  pin_high_ = high;
+}
+
+void SimBus::RunPin_() {
+  // Wake at every sample instant and let the model catch up, as the sample
+  // clock of the device would raise the pin
+  while (pin_running_.load(std::memory_order_relaxed)) {
+    uint64_t next_ns;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Advance_(NowNs());
+      UpdatePin_();
+      next_ns = next_sample_ns_;
+    }
+    // At most 10 ms, so a device that sleeps does not hold up SetIntPin(-1)
+    next_ns = std::min(next_ns, NowNs() + 10000000);
+    struct timespec wake;
+    wake.tv_sec = next_ns/1000000000ull;
+    wake.tv_nsec = next_ns%1000000000ull;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr);
+  }
+}
+
+void SimBus::SetIntPin(int event_fd) {
+  if (pin_running_.load()) {
+    pin_running_.store(false);
+    pin_thread_.join();
+  }
+  {
+    // Host transfers may be updating the pin meanwhile
+    std::lock_guard<std::mutex> lock(mutex_);
+    pin_fd_ = event_fd;
+    pin_high_ = false;
+  }
+  if (event_fd >= 0) {
+    pin_running_.store(true);
+    pin_thread_ = std::thread(&SimBus::RunPin_, this);
+  }
+}
+
+void SimBus::InjectFaults(uint every_n, int error, bool late) {
+  fault_every_ = every_n;
+  fault_error_ = error;
+  fault_late_ = late;
+}
+
+int SimBus::Recover_() {
+  // I2cBus reopens the adapter, which costs a close and an open and forgets
+  // the selected slave
+  stats_.syscalls += 2;
+  slave_addr_ = -1;
+  return 0;
+}
+
+int SimBus::WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                      uint n_bytes, const uint8_t* buff_ptr) {
+  // i2c-dev writes need an I2C_SLAVE ioctl whenever the address changes
+  stats_.syscalls += (slave_addr_ == addr) ? 1 : 2;
+  slave_addr_ = addr;
+
+  uint8_t w_buff[1 + n_bytes];
+  w_buff[0] = mem_addr;
+  for (uint i = 1; i <= n_bytes; i++) {
+    w_buff[i] = buff_ptr[i-1];
+  }
+
+  struct i2c_msg msg;
+  msg.addr = addr;
+  msg.flags = 0;
+  msg.len = 1 + n_bytes;
+  msg.buf = w_buff;
+  return Xfer_(&msg, 1, op);
+}
+
+int SimBus::ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                     uint n_bytes, uint8_t* buff_ptr) {
+  I2cTransaction transaction;
+  transaction.ReadFromMemInto(addr, mem_addr, n_bytes, buff_ptr);
+  return Transfer_(&transaction, op);
+}
+
+int SimBus::Transfer_(I2cTransaction* transaction, BusStats::Op op) {
+  stats_.syscalls++;  // One I2C_RDWR ioctl
+  return Xfer_(transaction->Msgs(), transaction->NumMsgs(), op);
+}
+
+// Simulated multi-device bus constructor
+SimMultiBus::SimMultiBus() {
+  ResetStats();
+}
+
+SimMultiBus::~SimMultiBus() {
+  for (uint i = 0; i < devices_.size(); i++) {
+    delete devices_[i];
+  }
+}
+
+SimBus* SimMultiBus::AddDevice(uint8_t mpu_addr) {
+  SimBus* device = new SimBus(mpu_addr);
+  devices_.push_back(device);
+  return device;
+}
+
+void SimMultiBus::SetTiming(uint32_t clock_hz, uint32_t overhead_ns) {
+  clock_hz_ = clock_hz;
+  overhead_ns_ = overhead_ns;
+}
+
+void SimMultiBus::ResetStats() {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+int SimMultiBus::Xfer_(struct i2c_msg* msgs, uint n_msgs,
+                       BusStats::Op op) {
+  // Same as SimBus::Xfer_, but every message goes to all devices that
+  // acknowledge its address. SDA is open drain, so when several of them
+  // answer (the AK8963s of two MPU-9250s in bypass mode) a read returns the
+  // AND of their data and a write reaches every one of them.
+  uint64_t start_ns = NowNs();
+  for (uint d = 0; d < devices_.size(); d++) {
+    devices_[d]->Advance_(start_ns);
+  }
+
+  uint64_t bits = 1;  // Stop condition
+  int error = 0;
+  stats_.transfers++;
+  for (uint i = 0; i < n_msgs && error == 0; i++) {
+    struct i2c_msg* msg = &msgs[i];
+    bits += 1 + 9 + 9*msg->len;  // (Repeated) start, address and data bytes
+    stats_.messages++;
+    stats_.bytes += msg->len;
+
+    uint8_t data[msg->len];
+    struct i2c_msg device_msg = *msg;
+    if (msg->flags & I2C_M_RD) {
+      device_msg.buf = data;
+    }
+    uint n_acks = 0;
+    for (uint d = 0; d < devices_.size(); d++) {
+      if (!devices_[d]->Answers(msg->addr)) {
+        continue;
+      }
+      devices_[d]->XferMsg_(&device_msg, start_ns);
+      if (msg->flags & I2C_M_RD) {
+        for (uint j = 0; j < msg->len; j++) {
+          msg->buf[j] = (n_acks == 0) ? data[j] : msg->buf[j] & data[j];
+        }
+      }
+      n_acks++;
+    }
+    if (n_acks == 0) {
+      stats_.nacks++;
+      error = -ENXIO;
+    }
+  }
+
+  SimBus::SpinUntil_(start_ns + overhead_ns_ + bits*1000000000ull/clock_hz_);
+  bus_stats_.RecordMsgs(op, msgs, n_msgs, error == 0, NowNs() - start_ns);
+  return error;
+}
+
+int SimMultiBus::WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                           uint n_bytes, const uint8_t* buff_ptr) {
+  stats_.syscalls += (slave_addr_ == addr) ? 1 : 2;
+  slave_addr_ = addr;
+
+  uint8_t w_buff[1 + n_bytes];
+  w_buff[0] = mem_addr;
+  for (uint i = 1; i <= n_bytes; i++) {
+    w_buff[i] = buff_ptr[i-1];
+  }
+
+  struct i2c_msg msg;
+  msg.addr = addr;
+  msg.flags = 0;
+  msg.len = 1 + n_bytes;
+  msg.buf = w_buff;
+  return Xfer_(&msg, 1, op);
+}
+
+int SimMultiBus::ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                          uint n_bytes, uint8_t* buff_ptr) {
+  I2cTransaction transaction;
+  transaction.ReadFromMemInto(addr, mem_addr, n_bytes, buff_ptr);
+  return Transfer_(&transaction, op);
+}
+
+int SimMultiBus::Transfer_(I2cTransaction* transaction, BusStats::Op op) {
+  stats_.syscalls++;  // One I2C_RDWR ioctl
+  return Xfer_(transaction->Msgs(), transaction->NumMsgs(), op);
+}
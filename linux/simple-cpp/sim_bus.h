@@ -0,0 +1,206 @@
+// In-process model of an MPU-9250 behind the Bus interface, so the driver can
+// be exercised and benchmarked on a plain Linux box without the sensor.
+//
+// The MPU6500 side models the register map with WHO_AM_I 0x71, the factory
+// self-test codes and accelerometer trim, a sample clock derived from CONFIG,
+// GYRO_CONFIG and SMPLRT_DIV that restarts after an H_RESET once the
+// gyroscope has started up, the data ready bit in INT_STATUS (cleared on
+// read), the 512 byte FIFO with FIFO_EN packet layout and overflow, and the
+// internal I2C master through SLV0 and SLV4. Cycle mode samples only the
+// accelerometer at the LP_ACCEL_ODR rate and flags wake-on-motion, sensors
+// turned off in PWR_MGMT_1 and 2 hold their output, and the gyroscope starts
+// up again when turned back on. The AK8963 side answers at 0x0C
+// while I2C_BYPASS_EN is set and models WIA 0x48, the fuse ROM, single and
+// continuous measurement modes, ST1 DRDY/DOR and ST2 HOFL/BITM with DRDY
+// cleared once ST2 is read, and the data protection that skips a
+// measurement ending while the host reads HXL..ST2.
+//
+// Sensor data follows a device lying flat and spinning about its z axis at a
+// configurable rate, with a little deterministic noise. The INT pin can be
+// modelled as an event descriptor, see SetIntPin. Every transfer takes
+// as long as it would on a real bus at the configured clock plus a fixed
+// per-transaction overhead, and the number of syscalls the i2c-dev backend
+// would have made is counted. Traffic is recorded in the BusStats of the Bus
+// the same way I2cBus records it.
+//
+// SimMultiBus puts several simulated MPU-9250s on one bus, e.g. one at each
+// AD0 address, and routes every message to whichever device acknowledges it.
+
+#ifndef SIM_BUS_H_
+#define SIM_BUS_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <cstdint>  // Needed for uint8_t
+#include <mutex>  // Needed for std::mutex
+#include <thread>  // Needed for std::thread
+#include <vector>  // Needed for std::vector
+#include "bus.h"
+#include "mpu9250.h"
+
+
+class SimBus : public Bus {
+  public:
+    struct Stats {
+      uint64_t syscalls;   // ioctl/read/write calls I2cBus would have made
+      uint64_t transfers;  // START..STOP bus transactions
+      uint64_t messages;   // Messages, each starts with a (repeated) start
+      uint64_t bytes;      // Data bytes on the wire, slave addresses excluded
+      uint64_t nacks;      // Transfers to an address nobody answered
+      uint64_t faults;     // Transfers failed by InjectFaults()
+      uint64_t lost;       // Samples late faults took, none newer followed
+      uint64_t int_edges;  // Rising edges of the INT pin, see SetIntPin
+      // AK8963 measurements never readable: overwritten before they were
+      // read, or ended while the host was reading the data registers
+      uint64_t magnetom_skipped;
+    };
+
+  private:
+    uint8_t mpu_addr_;
+    uint32_t clock_hz_ = 400000;
+    uint32_t overhead_ns_ = 0;
+    float rotation_dps_ = 10.0f;
+    float accel_g_[3] = {0.0f, 0.0f, 0.0f};
+    float gyro_bias_dps_[3] = {0.0f, 0.0f, 0.0f};
+    uint8_t self_test_[6];  // Gyro then accel, survive H_RESET
+
+    Stats stats_;
+    int slave_addr_ = -1;  // Mirrors the I2C_SLAVE caching of I2cBus
+    uint fault_every_ = 0;
+    int fault_error_ = 0;
+    bool fault_late_ = false;
+    bool fault_took_sample_ = false;
+
+    // INT pin, see SetIntPin. The pin thread and the transfers of the host
+    // share the register model under mutex_.
+    std::mutex mutex_;
+    std::thread pin_thread_;
+    std::atomic<bool> pin_running_;
+    int pin_fd_ = -1;
+    bool pin_high_ = false;
+
+    // MPU6500
+    uint8_t mpu_regs_[128];
+    uint8_t mpu_ptr_ = 0;  // Register pointer of the current transfer
+    uint8_t fifo_[kFifoSize];
+    uint fifo_head_ = 0;
+    uint fifo_count_ = 0;
+    uint64_t start_ns_;
+    uint64_t next_sample_ns_;
+    uint64_t reset_done_ns_;
+    uint64_t sensors_ready_ns_;  // No samples before, see kGyroStartNs
+    uint32_t noise_state_ = 1;
+
+    // AK8963
+    uint8_t ak_regs_[0x13];
+    uint8_t ak_fuse_[3];
+    uint8_t ak_ptr_ = 0;
+    uint64_t next_mag_ns_ = 0;
+    bool ak_data_read_ = false;  // The current message read HXL..ST2
+    // When the latest host read of HXL..ST2 was on the wire, measurements
+    // ending within it are skipped
+    uint64_t ak_protect_from_ns_ = 0;
+    uint64_t ak_protect_until_ns_ = 0;
+
+    void ResetMpu_();
+    void ResetAk_();
+    uint64_t SamplePeriodNs_() const;
+    int16_t Noise_();
+    void Advance_(uint64_t now_ns);
+    // Raise pin_fd_ if an enabled interrupt is pending and the pin was low
+    void UpdatePin_();
+    void RunPin_();
+    void Sample_(uint64_t t_ns);
+    void MasterSample_(uint64_t t_ns);
+    void PushFifo_(uint8_t byte);
+    void AkAdvance_(uint64_t now_ns);
+    void AkMeasure_(uint64_t t_ns);
+    void AkSetMode_(uint8_t cntl, uint64_t now_ns);
+    bool AkPresent_() const;
+    uint8_t ReadReg_(uint16_t addr, uint64_t now_ns);
+    void WriteReg_(uint16_t addr, uint8_t reg, uint8_t data, uint64_t now_ns);
+    bool XferMsg_(struct i2c_msg* msg, uint64_t now_ns);
+    // One transfer, recorded as op. Returns 0 or a negative errno.
+    int Xfer_(struct i2c_msg* msgs, uint n_msgs, BusStats::Op op);
+    static void SpinUntil_(uint64_t done_ns);
+
+    // Drives the register model of its devices directly
+    friend class SimMultiBus;
+
+  protected:
+    int WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                  uint n_bytes, const uint8_t* buff_ptr) override;
+    int ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                 uint n_bytes, uint8_t* buff_ptr) override;
+    int Transfer_(I2cTransaction* transaction, BusStats::Op op) override;
+    int Recover_() override;
+
+  public:
+    explicit SimBus(uint8_t mpu_addr = kMpu6500Addr);
+    ~SimBus();
+
+    // Bus clock in Hz (100 or 400 kHz for standard and fast mode) and the
+    // fixed cost of one transaction, e.g. syscall and adapter setup
+    void SetTiming(uint32_t clock_hz, uint32_t overhead_ns);
+    // Angular rate of the simulated device about its z axis
+    void SetRotationRate(float dps) { rotation_dps_ = dps; }
+    // Acceleration in g on top of gravity, e.g. to bump the device
+    void SetAcceleration(float x_g, float y_g, float z_g);
+    // Constant gyroscope zero-rate offset added to the simulated output
+    void SetGyroBias(float x_dps, float y_dps, float z_dps);
+    // Factory self-test codes, gyro x/y/z then accel x/y/z. Parts differ in
+    // them, setting others makes the device look like another unit.
+    void SetSelfTestCodes(const uint8_t* codes);
+
+    // Fail every every_n-th transfer with the negative errno error, as bus
+    // noise or a hung controller would. every_n 0 turns faults off. late
+    // faults hit after the device was read, as a failure on the last bytes
+    // would, so registers cleared on read are cleared all the same.
+    void InjectFaults(uint every_n, int error, bool late = false);
+    // Drive the INT pin onto event_fd, e.g. an eventfd a GpioLine waits on,
+    // by writing to it on every rising edge. The pin is latched as
+    // InitMpu9250 configures it: it rises when an interrupt INT_ENABLE
+    // selects is raised and stays up until INT_STATUS is read. A thread
+    // follows the sample clock, so edges come while the host waits. -1
+    // stops it, the descriptor is left open.
+    void SetIntPin(int event_fd);
+
+    Stats GetStats() const { return stats_; }
+    void ResetStats();
+
+    // Whether a message to addr would be acknowledged right now
+    bool Answers(uint16_t addr) const;
+};  // class SimBus
+
+class SimMultiBus : public Bus {
+  private:
+    std::vector<SimBus*> devices_;
+    uint32_t clock_hz_ = 400000;
+    uint32_t overhead_ns_ = 0;
+    SimBus::Stats stats_;
+    int slave_addr_ = -1;
+
+    int Xfer_(struct i2c_msg* msgs, uint n_msgs, BusStats::Op op);
+
+  protected:
+    int WriteMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                  uint n_bytes, const uint8_t* buff_ptr) override;
+    int ReadMem_(BusStats::Op op, uint16_t addr, uint8_t mem_addr,
+                 uint n_bytes, uint8_t* buff_ptr) override;
+    int Transfer_(I2cTransaction* transaction, BusStats::Op op) override;
+
+  public:
+    SimMultiBus();
+    ~SimMultiBus();
+
+    // Put another simulated MPU-9250 on the bus. The device is owned by the
+    // bus, its own timing and statistics are not used.
+    SimBus* AddDevice(uint8_t mpu_addr);
+    uint NumDevices() const { return devices_.size(); }
+
+    // Same as SimBus, for the bus as a whole
+    void SetTiming(uint32_t clock_hz, uint32_t overhead_ns);
+    SimBus::Stats GetStats() const { return stats_; }
+    void ResetStats();
+};  // class SimMultiBus
+
+#endif // SIM_BUS_H_
@@ -0,0 +1,101 @@
+// Bounded lock-free single-producer/single-consumer ring buffer. One thread
+// may push and one other thread may pop without any locking. The producer
+// and consumer indices are padded a cache line apart so the two threads do not
+// bounce a shared line on every operation. Padding is used rather than alignas
+// so the ring can be allocated with plain new under C++11.
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <cstddef>  // Needed for size_t
+
+const size_t kCacheLineSize = 64;
+
+template <typename T>
+class SpscRing {
+  private:
+    // Indices only grow, the slot is the index masked by capacity - 1
+    struct Index {
+      std::atomic<size_t> value;
+      // The other side's index as last seen, refreshed only when the ring
+      // looks full (producer) or empty (consumer)
+      size_t cached;
+      char pad[kCacheLineSize - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+
+    char pad_before_[kCacheLineSize];
+    Index head_;  // Next slot to pop, written by the consumer
+    Index tail_;  // Next slot to push, written by the producer
+    char pad_after_[kCacheLineSize];
+    T* slots_;
+    size_t mask_;
+
+  public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) {
+      size_t size = 1;
+      while (size < capacity) {
+        size <<= 1;
+      }
+      slots_ = new T[size];
+      mask_ = size - 1;
+      head_.value.store(0, std::memory_order_relaxed);
+      head_.cached = 0;
+      tail_.value.store(0, std::memory_order_relaxed);
+      tail_.cached = 0;
+    }
+
+    ~SpscRing() { delete[] slots_; }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t Capacity() const { return mask_ + 1; }
+
+    // Producer side. Returns false if the ring is full.
+    bool TryPush(const T& item) {
+      size_t tail = tail_.value.load(std::memory_order_relaxed);
+      if (tail - tail_.cached > mask_) {
+        tail_.cached = head_.value.load(std::memory_order_acquire);
+        if (tail - tail_.cached > mask_) {
+          return false;
+        }
+      }
+      slots_[tail & mask_] = item;
+      tail_.value.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool TryPop(T* item) {
+      return PopN(item, 1) == 1;
+    }
+
+    // Consumer side. Pop up to max_n items into out and return how many were
+    // popped, publishing the new head only once for the whole batch.
+    size_t PopN(T* out, size_t max_n) {
+      size_t head = head_.value.load(std::memory_order_relaxed);
+      size_t available = head_.cached - head;
+      if (available < max_n) {
+        head_.cached = tail_.value.load(std::memory_order_acquire);
+        available = head_.cached - head;
+      }
+      size_t n = available < max_n ? available : max_n;
+      for (size_t i = 0; i < n; i++) {
+        out[i] = slots_[(head + i) & mask_];
+      }
+      if (n > 0) {
+        head_.value.store(head + n, std::memory_order_release);
+      }
+      return n;
+    }
+
+    // Approximate number of queued items, exact only from a quiescent ring
+    size_t Size() const {
+      return tail_.value.load(std::memory_order_acquire) -
+             head_.value.load(std::memory_order_acquire);
+    }
+};  // class SpscRing
+
+#endif // SPSC_RING_H_
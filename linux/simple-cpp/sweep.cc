@@ -0,0 +1,522 @@
+// ***************************************************************************
+// Fusion parameter sweep over recorded logs
+//
+// Runs every configuration of a grid of Madgwick beta and Mahony Kp/Ki
+// values over a set of logs written by the recorder of recorder.h and ranks
+// the configurations by steady-state error or convergence time against a
+// reference orientation.
+//
+// The reference of log.rec is read from log.rec.ref.csv when it exists, rows
+// of timestamp_ns,q0,q1,q2,q3 with a header line, e.g. from a motion capture
+// system or mpu9250-replay -o with a trusted setup. Otherwise it is the
+// orientation the accelerometer and magnetometer give while the device lies
+// still, and only the stretches where it does are evaluated. No filter is
+// involved, so none of the swept ones is favoured, but a log without still
+// stretches cannot be swept without a reference file.
+//
+// Errors are evaluated at a fixed rate. A run has converged at the first
+// evaluation after which the error stays below the threshold for the rest of
+// the log, its steady-state error is the RMS error over the second half of
+// the evaluations. Every (configuration, log) pair is a task of a
+// work-stealing pool spread over all cores.
+//***************************************************************************/
+
+#include <stdio.h>  // Needed for printf, fopen, fgets
+#include <stdint.h>  // Needed for uint64_t
+#include <stdlib.h>  // Needed for exit, atoi, atof
+#include <string.h>  // Needed for strcmp
+#include <unistd.h>  // Needed for getopt
+#include <math.h>  // Needed for sqrt, fabs
+#include <algorithm>  // Needed for std::sort
+#include <string>  // Needed for std::string
+#include <vector>  // Needed for std::vector
+#include "recorder.h"
+#include "quaternion_filters.h"
+#include "fusion_replay.h"
+#include "work_pool.h"
+#include "timing.h"
+
+enum FilterKind {
+  kMadgwick = 0,
+  kMahony
+};
+
+struct SweepConfig {
+  FilterKind filter;
+  float beta;  // Madgwick
+  float kp;    // Mahony
+  float ki;
+};
+
+// Filter steps at which the error is evaluated, and the reference there
+struct LogReference {
+  RecordReader reader;
+  bool from_file;
+  uint64_t start_ns;  // Of the first filter step, convergence counts from it
+  std::vector<uint64_t> steps;
+  std::vector<uint64_t> t_ns;  // Timestamp of each evaluation step
+  std::vector<float> q;        // 4 per evaluation
+};
+
+struct RunResult {
+  double converge_s;  // Negative if the run never settles
+  double steady_rms_deg;
+  double max_deg;
+};
+
+struct ConfigSummary {
+  size_t config;
+  uint converged;  // Logs the run settled on
+  double worst_converge_s;
+  double mean_steady_rms_deg;
+  double max_deg;
+};
+
+// Parse "value" or "first:last:count" with count evenly spaced values
+static bool ParseRange(const char* arg, std::vector<float>* values) {
+  float first, last;
+  int count;
+  values->clear();
+  if (sscanf(arg, "%f:%f:%d", &first, &last, &count) == 3 && count > 0) {
+    for (int i = 0; i < count; i++) {
+      values->push_back(count == 1 ? first
+                                   : first + (last - first)*i/(count - 1));
+    }
+    return true;
+  }
+  if (sscanf(arg, "%f", &first) == 1) {
+    values->push_back(first);
+    return true;
+  }
+  return false;
+}
+
+// The evaluation steps: the first filter step at or after every multiple of
+// the evaluation period
+static void EvaluationSteps(LogReference* ref, double eval_hz) {
+  uint64_t period_ns = (uint64_t)(1e9/eval_hz);
+  uint64_t next_ns = 0, step = 0;
+  ref->start_ns = 0;
+  ForEachFusionStep(ref->reader, [&](const FusionInput&, uint64_t t_ns) {
+    if (ref->start_ns == 0) {
+      ref->start_ns = t_ns;
+    }
+    if (t_ns >= next_ns) {
+      ref->steps.push_back(step);
+      ref->t_ns.push_back(t_ns);
+      next_ns = t_ns + period_ns;
+    }
+    step++;
+  });
+}
+
+// Reference rows at the evaluation steps, the first row at or after the
+// time of each. Returns false if the file cannot be read or ends early.
+static bool LoadReferenceCsv(const char* path, LogReference* ref) {
+  FILE* csv = fopen(path, "r");
+  if (csv == nullptr) {
+    return false;
+  }
+  char line[256];
+  unsigned long long t_ns;
+  float q[4];
+  size_t k = 0;
+  size_t n = ref->steps.size();
+  ref->q.resize(4*n);
+  while (k < n && fgets(line, sizeof(line), csv) != nullptr) {
+    if (sscanf(line, "%llu,%f,%f,%f,%f", &t_ns, &q[0], &q[1], &q[2],
+               &q[3]) != 5) {
+      continue;  // Header
+    }
+    while (k < n && t_ns >= ref->t_ns[k]) {
+      for (int c = 0; c < 4; c++) {
+        ref->q[4*k + c] = q[c];
+      }
+      k++;
+    }
+  }
+  fclose(csv);
+  return k == n;
+}
+
+// Orientation, in the convention of the filters, that puts gravity along
+// earth z and the horizontal part of the magnetic field along earth x, from
+// the accelerometer and magnetometer readings alone. The rows of the
+// rotation matrix are the earth axes in sensor coordinates.
+static bool AccelMagnetomOrientation(const double* accel,
+                                     const double* magnetom, float* q) {
+  double r[3][3];
+  double a_norm = sqrt(accel[0]*accel[0] + accel[1]*accel[1] +
+                       accel[2]*accel[2]);
+  if (a_norm == 0.0) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    r[2][i] = accel[i]/a_norm;
+  }
+  double down = magnetom[0]*r[2][0] + magnetom[1]*r[2][1] +
+                magnetom[2]*r[2][2];
+  double h_norm = 0.0;
+  for (int i = 0; i < 3; i++) {
+    r[0][i] = magnetom[i] - down*r[2][i];
+    h_norm += r[0][i]*r[0][i];
+  }
+  h_norm = sqrt(h_norm);
+  if (h_norm == 0.0) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    r[0][i] /= h_norm;
+  }
+  r[1][0] = r[2][1]*r[0][2] - r[2][2]*r[0][1];
+  r[1][1] = r[2][2]*r[0][0] - r[2][0]*r[0][2];
+  r[1][2] = r[2][0]*r[0][1] - r[2][1]*r[0][0];
+
+  // Rotation matrix to quaternion, from the largest of the four terms
+  double trace = r[0][0] + r[1][1] + r[2][2];
+  double w, x, y, z;
+  if (trace > 0.0) {
+    double s = 2.0*sqrt(1.0 + trace);
+    w = s/4;
+    x = (r[2][1] - r[1][2])/s;
+    y = (r[0][2] - r[2][0])/s;
+    z = (r[1][0] - r[0][1])/s;
+  } else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+    double s = 2.0*sqrt(1.0 + r[0][0] - r[1][1] - r[2][2]);
+    w = (r[2][1] - r[1][2])/s;
+    x = s/4;
+    y = (r[0][1] + r[1][0])/s;
+    z = (r[0][2] + r[2][0])/s;
+  } else if (r[1][1] > r[2][2]) {
+    double s = 2.0*sqrt(1.0 + r[1][1] - r[0][0] - r[2][2]);
+    w = (r[0][2] - r[2][0])/s;
+    x = (r[0][1] + r[1][0])/s;
+    y = s/4;
+    z = (r[1][2] + r[2][1])/s;
+  } else {
+    double s = 2.0*sqrt(1.0 + r[2][2] - r[0][0] - r[1][1]);
+    w = (r[1][0] - r[0][1])/s;
+    x = (r[0][2] + r[2][0])/s;
+    y = (r[1][2] + r[2][1])/s;
+    z = s/4;
+  }
+  q[0] = w;
+  q[1] = x;
+  q[2] = y;
+  q[3] = z;
+  return true;
+}
+
+// Reference from the still windows of the log, independent of the filters
+// being swept. Once the device has turned slower than kStillDps and felt
+// gravity within kStillG for kStillS, every evaluation step until it moves
+// again gets the orientation of the accelerometer and magnetometer readings
+// averaged since it came to rest. The other evaluation steps are dropped.
+static void StillReference(LogReference* ref) {
+  const double kStillDps = 2.0;
+  const double kStillG = 0.05;
+  const double kStillS = 0.5;
+  const double kGravity = 9.80665;
+  std::vector<uint64_t> steps, t_ns;
+  std::vector<float> q;
+  double accel[3], magnetom[3];
+  uint64_t still_ns = 0;  // Since when the device is at rest, 0 if moving
+  uint64_t n_still = 0;
+  uint64_t step = 0;
+  size_t k = 0;
+  ForEachFusionStep(ref->reader, [&](const FusionInput& in, uint64_t now_ns) {
+    double rate = sqrt(in.gyro[0]*in.gyro[0] + in.gyro[1]*in.gyro[1] +
+                       in.gyro[2]*in.gyro[2])*180.0/M_PI;
+    double g = sqrt(in.accel[0]*in.accel[0] + in.accel[1]*in.accel[1] +
+                    in.accel[2]*in.accel[2])/kGravity;
+    if (rate < kStillDps && fabs(g - 1.0) < kStillG) {
+      if (still_ns == 0) {
+        still_ns = now_ns;
+        n_still = 0;
+        for (int i = 0; i < 3; i++) {
+          accel[i] = magnetom[i] = 0.0;
+        }
+      }
+      for (int i = 0; i < 3; i++) {
+        accel[i] += in.accel[i];
+        magnetom[i] += in.magnetom[i];
+      }
+      n_still++;
+    } else {
+      still_ns = 0;
+    }
+    if (k < ref->steps.size() && ref->steps[k] == step) {
+      float q_still[4];
+      if (still_ns != 0 && (now_ns - still_ns)/1e9 >= kStillS &&
+          AccelMagnetomOrientation(accel, magnetom, q_still)) {
+        steps.push_back(step);
+        t_ns.push_back(ref->t_ns[k]);
+        q.insert(q.end(), q_still, q_still + 4);
+      }
+      k++;
+    }
+    step++;
+  });
+  ref->steps.swap(steps);
+  ref->t_ns.swap(t_ns);
+  ref->q.swap(q);
+}
+
+template <typename Filter>
+static RunResult RunConfig(const LogReference& ref, Filter* filter,
+                           double threshold_deg) {
+  std::vector<double> err_deg(ref.steps.size());
+  uint64_t step = 0;
+  size_t k = 0;
+  ForEachFusionStep(ref.reader, [&](const FusionInput& in, uint64_t) {
+    filter->Update(in);
+    if (k < ref.steps.size() && ref.steps[k] == step) {
+      err_deg[k] = QuaternionAngle(filter->GetQ(), &ref.q[4*k])*180.0/M_PI;
+      k++;
+    }
+    step++;
+  });
+
+  RunResult result = {-1.0, 0.0, 0.0};
+  size_t n = err_deg.size();
+  if (n == 0) {
+    return result;
+  }
+  // Converged right after the last evaluation above the threshold
+  size_t settled = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (err_deg[i] > threshold_deg) {
+      settled = i + 1;
+    }
+    result.max_deg = std::max(result.max_deg, err_deg[i]);
+  }
+  if (settled < n) {
+    result.converge_s = (ref.t_ns[settled] - ref.start_ns)/1e9;
+  }
+  double sum_sq = 0.0;
+  for (size_t i = n/2; i < n; i++) {
+    sum_sq += err_deg[i]*err_deg[i];
+  }
+  result.steady_rms_deg = sqrt(sum_sq/(n - n/2));
+  return result;
+}
+
+static RunResult RunTask(const SweepConfig& config, const LogReference& ref,
+                         FusionPrecision precision, double threshold_deg) {
+  if (config.filter == kMadgwick) {
+    MadgwickFilter filter;
+    filter.SetBeta(config.beta);
+    filter.SetPrecision(precision);
+    return RunConfig(ref, &filter, threshold_deg);
+  }
+  MahonyFilter filter(config.kp, config.ki);
+  filter.SetPrecision(precision);
+  return RunConfig(ref, &filter, threshold_deg);
+}
+
+void PrintUsage(const char* name) {
+  printf("Usage: %s [-j threads] [-a madgwick|mahony|both] [-b beta] [-k kp] "
+         "[-i ki] [-e hz] [-t deg] [-p precision] [-c] [-n rows] log...\n",
+         name);
+  printf("  -j  worker threads, default one per core\n");
+  printf("  -a  filters to sweep, default both\n");
+  printf("  -b  Madgwick beta, value or first:last:count, default "
+         "0.02:0.6:15\n");
+  printf("  -k  Mahony Kp, value or first:last:count, default 0.5:20:14\n");
+  printf("  -i  Mahony Ki, value or first:last:count, default 0:0.5:6\n");
+  printf("  -e  error evaluation rate, default 100 Hz\n");
+  printf("  -t  convergence threshold, default 2 degrees\n");
+  printf("  -p  exact, rsqrt+nr or approx, default exact\n");
+  printf("  -c  rank by convergence time instead of steady-state error\n");
+  printf("  -n  configurations shown, default 20\n");
+}
+
+int main(int argc, char* argv[]) {
+  uint n_threads = 0;
+  bool madgwick = true, mahony = true;
+  std::vector<float> betas, kps, kis;
+  ParseRange("0.02:0.6:15", &betas);
+  ParseRange("0.5:20:14", &kps);
+  ParseRange("0:0.5:6", &kis);
+  double eval_hz = 100.0;
+  double threshold_deg = 2.0;
+  FusionPrecision precision = FusionPrecision::kExact;
+  bool by_convergence = false;
+  uint n_rows = 20;
+
+  int opt;
+  bool ok = true;
+  while ((opt = getopt(argc, argv, "j:a:b:k:i:e:t:p:cn:h")) != -1) {
+    switch (opt) {
+      case 'j':
+        n_threads = atoi(optarg);
+        break;
+      case 'a':
+        madgwick = strcmp(optarg, "madgwick") == 0 ||
+                   strcmp(optarg, "both") == 0;
+        mahony = strcmp(optarg, "mahony") == 0 || strcmp(optarg, "both") == 0;
+        ok = madgwick || mahony;
+        break;
+      case 'b':
+        ok = ParseRange(optarg, &betas);
+        break;
+      case 'k':
+        ok = ParseRange(optarg, &kps);
+        break;
+      case 'i':
+        ok = ParseRange(optarg, &kis);
+        break;
+      case 'e':
+        eval_hz = atof(optarg);
+        ok = eval_hz > 0.0;
+        break;
+      case 't':
+        threshold_deg = atof(optarg);
+        break;
+      case 'p': {
+        int p = 0;
+        while (p < (int)FusionPrecision::kNumPrecisions &&
+               strcmp(optarg, FusionPrecisionName((FusionPrecision)p)) != 0) {
+          p++;
+        }
+        ok = p < (int)FusionPrecision::kNumPrecisions;
+        precision = (FusionPrecision)p;
+        break;
+      }
+      case 'c':
+        by_convergence = true;
+        break;
+      case 'n':
+        n_rows = atoi(optarg);
+        break;
+      default:
+        PrintUsage(argv[0]);
+        exit(opt == 'h' ? 0 : 1);
+    }
+    if (!ok) {
+      PrintUsage(argv[0]);
+      exit(1);
+    }
+  }
+  size_t n_logs = argc - optind;
+  if (n_logs == 0) {
+    PrintUsage(argv[0]);
+    exit(1);
+  }
+
+  std::vector<SweepConfig> configs;
+  for (size_t b = 0; madgwick && b < betas.size(); b++) {
+    SweepConfig config = {kMadgwick, betas[b], 0.0f, 0.0f};
+    configs.push_back(config);
+  }
+  for (size_t p = 0; mahony && p < kps.size(); p++) {
+    for (size_t i = 0; i < kis.size(); i++) {
+      SweepConfig config = {kMahony, 0.0f, kps[p], kis[i]};
+      configs.push_back(config);
+    }
+  }
+
+  WorkStealingPool pool(n_threads);
+  uint64_t start_ns = MonotonicRawNs();
+
+  // Map every log and set up its reference, one task per log
+  std::vector<LogReference> refs(n_logs);
+  std::vector<char> loaded(n_logs, 0);
+  pool.Run(n_logs, [&](size_t l, uint) {
+    LogReference* ref = &refs[l];
+    if (!ref->reader.Open(argv[optind + l])) {
+      return;
+    }
+    EvaluationSteps(ref, eval_hz);
+    std::string ref_path = std::string(argv[optind + l]) + ".ref.csv";
+    ref->from_file = LoadReferenceCsv(ref_path.c_str(), ref);
+    if (!ref->from_file) {
+      StillReference(ref);
+    }
+    loaded[l] = 1;
+  });
+  uint64_t records = 0;
+  for (size_t l = 0; l < n_logs; l++) {
+    if (!loaded[l]) {
+      printf("%s could not be read\n", argv[optind + l]);
+      exit(1);
+    }
+    if (refs[l].steps.empty()) {
+      printf("%s never lies still and has no %s.ref.csv to compare with\n",
+             argv[optind + l], argv[optind + l]);
+      exit(1);
+    }
+    records += refs[l].reader.Count();
+    printf("%s: %llu records, %zu evaluations, reference %s\n",
+           argv[optind + l], (unsigned long long)refs[l].reader.Count(),
+           refs[l].steps.size(),
+           refs[l].from_file ? "from file"
+                             : "accel/mag orientation while still");
+  }
+
+  // The sweep proper, logs of different lengths make tasks of uneven cost
+  std::vector<RunResult> results(configs.size()*n_logs);
+  pool.Run(results.size(), [&](size_t task, uint) {
+    results[task] = RunTask(configs[task/n_logs], refs[task % n_logs],
+                            precision, threshold_deg);
+  });
+  double wall_s = (MonotonicRawNs() - start_ns)/1e9;
+
+  std::vector<ConfigSummary> summaries(configs.size());
+  for (size_t c = 0; c < configs.size(); c++) {
+    ConfigSummary* summary = &summaries[c];
+    summary->config = c;
+    summary->converged = 0;
+    summary->worst_converge_s = 0.0;
+    summary->mean_steady_rms_deg = 0.0;
+    summary->max_deg = 0.0;
+    for (size_t l = 0; l < n_logs; l++) {
+      const RunResult& r = results[c*n_logs + l];
+      if (r.converge_s >= 0.0) {
+        summary->converged++;
+        summary->worst_converge_s = std::max(summary->worst_converge_s,
+                                             r.converge_s);
+      }
+      summary->mean_steady_rms_deg += r.steady_rms_deg/n_logs;
+      summary->max_deg = std::max(summary->max_deg, r.max_deg);
+    }
+  }
+  // Configurations that settle on every log come first
+  std::sort(summaries.begin(), summaries.end(),
+            [&](const ConfigSummary& a, const ConfigSummary& b) {
+    if (a.converged != b.converged) {
+      return a.converged > b.converged;
+    }
+    if (by_convergence && a.worst_converge_s != b.worst_converge_s) {
+      return a.worst_converge_s < b.worst_converge_s;
+    }
+    return a.mean_steady_rms_deg < b.mean_steady_rms_deg;
+  });
+
+  printf("\n%zu configurations x %zu logs on %u threads in %.2f s, "
+         "%.1f M filter updates/s, %llu steals\n", configs.size(), n_logs,
+         pool.NumThreads(), wall_s, configs.size()*records/wall_s/1e6,
+         (unsigned long long)pool.Steals());
+  printf("Ranked by %s, convergence below %.1f degrees\n\n",
+         by_convergence ? "convergence time" : "steady-state error",
+         threshold_deg);
+  printf("%4s %-8s %8s %8s %8s %9s %11s %11s %9s\n", "rank", "filter", "beta",
+         "kp", "ki", "settled", "converge s", "steady deg", "max deg");
+  for (size_t r = 0; r < summaries.size() && r < n_rows; r++) {
+    const ConfigSummary& s = summaries[r];
+    const SweepConfig& config = configs[s.config];
+    char settled[16];
+    snprintf(settled, sizeof(settled), "%u/%zu", s.converged, n_logs);
+    if (config.filter == kMadgwick) {
+      printf("%4zu %-8s %8.4f %8s %8s", r + 1, "madgwick", config.beta, "-",
+             "-");
+    } else {
+      printf("%4zu %-8s %8s %8.3f %8.4f", r + 1, "mahony", "-", config.kp,
+             config.ki);
+    }
+    printf(" %9s %11.2f %11.3f %9.2f\n", settled, s.worst_converge_s,
+           s.mean_steady_rms_deg, s.max_deg);
+  }
+
+  return 0;
+}
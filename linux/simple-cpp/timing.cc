@@ -0,0 +1,124 @@
+#include "timing.h"
+
+#include <time.h>  // Needed for clock_gettime
+
+
+uint64_t MonotonicRawNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+// Histogram constructor
+Histogram::Histogram() {
+  Reset();
+}
+
+void Histogram::Reset() {
+  for (uint i = 0; i < kNumBuckets; i++) {
+    counts_[i].store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(UINT64_MAX, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint Histogram::BucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  // Octave of the value and its top kSubBucketBits bits below the leading one
+  uint magnitude = 63 - __builtin_clzll(value);
+  uint shift = magnitude - kSubBucketBits;
+  return kSubBuckets*(shift + 1) + ((value >> shift) - kSubBuckets);
+}
+
+uint64_t Histogram::BucketValue(uint index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  uint shift = index/kSubBuckets - 1;
+  uint64_t low = (uint64_t)(kSubBuckets + index % kSubBuckets) << shift;
+  return low + ((1ull << shift) >> 1);
+}
+
+void Histogram::Record(uint64_t value) {
+  // Single writer, so plain load and store instead of read-modify-write
+  std::atomic<uint64_t>* bucket = &counts_[BucketIndex(value)];
+  bucket->store(bucket->load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  sum_.store(sum_.load(std::memory_order_relaxed) + value,
+             std::memory_order_relaxed);
+  if (value < min_.load(std::memory_order_relaxed)) {
+    min_.store(value, std::memory_order_relaxed);
+  }
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+  count_.store(count_.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+}
+
+uint64_t Histogram::Min() const {
+  return Count() > 0 ? min_.load(std::memory_order_relaxed) : 0;
+}
+
+double Histogram::Mean() const {
+  uint64_t count = Count();
+  return count > 0 ? (double)sum_.load(std::memory_order_relaxed)/count : 0.0;
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  // Buckets may move on while they are summed, rank against what is there
+  uint64_t total = 0;
+  for (uint i = 0; i < kNumBuckets; i++) {
+    total += counts_[i].load(std::memory_order_relaxed);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p*total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (uint i = 0; i < kNumBuckets; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // Never report past the largest value actually recorded
+      uint64_t value = BucketValue(i);
+      uint64_t max = Max();
+      return value < max ? value : max;
+    }
+  }
+  return Max();
+}
+
+void SampleTiming::OnSample(uint64_t t_ns) {
+  if (last_sample_ns_ != 0 && t_ns > last_sample_ns_) {
+    interval_ns_.Record(t_ns - last_sample_ns_);
+  }
+  last_sample_ns_ = t_ns;
+
+  if (window_start_ns_ == 0) {
+    window_start_ns_ = t_ns;
+    return;
+  }
+  window_samples_++;
+  uint64_t elapsed_ns = t_ns - window_start_ns_;
+  if (elapsed_ns >= kRateWindowNs) {
+    rate_mhz_.Record(window_samples_*1000000000000ull/elapsed_ns);
+    window_start_ns_ = t_ns;
+    window_samples_ = 0;
+  }
+}
+
+void SampleTiming::Reset() {
+  interval_ns_.Reset();
+  latency_ns_.Reset();
+  rate_mhz_.Reset();
+  last_sample_ns_ = 0;
+  window_start_ns_ = 0;
+  window_samples_ = 0;
+}
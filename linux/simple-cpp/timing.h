@@ -0,0 +1,87 @@
+// Sample timing: the clock every sample is stamped with and the statistics
+// the driver keeps about it.
+//
+// Timestamps are CLOCK_MONOTONIC_RAW, which is never slewed by NTP, so the
+// intervals between samples are what the local oscillator measured.
+//
+// Histogram is a log-linear histogram in the style of HdrHistogram. Values
+// below 32 have a bucket each, above that every power of two is split into 32
+// buckets, so any value from 1 ns to centuries is kept within about 3% with a
+// fixed 15 kB of counters. Recording is a handful of instructions and never
+// allocates or locks. There must be only one writer, any thread may read.
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <cstdint>  // Needed for uint64_t
+#include <sys/types.h>  // Needed for uint
+
+// Nanoseconds on CLOCK_MONOTONIC_RAW
+uint64_t MonotonicRawNs();
+
+class Histogram {
+  public:
+    static const uint kSubBucketBits = 5;
+    static const uint kSubBuckets = 1 << kSubBucketBits;
+    static const uint kNumBuckets = kSubBuckets*(65 - kSubBucketBits);
+
+  private:
+    std::atomic<uint64_t> counts_[kNumBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+
+  public:
+    Histogram();
+
+    // Writer side
+    void Record(uint64_t value);
+    void Reset();
+
+    static uint BucketIndex(uint64_t value);
+    // Middle of the range of values that fall into bucket index
+    static uint64_t BucketValue(uint index);
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t Min() const;
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+    double Mean() const;
+    // Value that fraction p of the recorded values are at or below, within
+    // the bucket precision. Walks every bucket, meant for reporting.
+    uint64_t Percentile(double p) const;
+};  // class Histogram
+
+// Timing statistics of one sensor, updated by the thread that reads it
+class SampleTiming {
+  public:
+    // Length of the windows the achieved rate is measured over
+    static const uint64_t kRateWindowNs = 1000000000;
+
+  private:
+    Histogram interval_ns_;
+    Histogram latency_ns_;
+    Histogram rate_mhz_;
+    uint64_t last_sample_ns_ = 0;
+    uint64_t window_start_ns_ = 0;
+    uint64_t window_samples_ = 0;
+
+  public:
+    // A bus read that started and completed at the given times
+    void OnRead(uint64_t start_ns, uint64_t done_ns) {
+      latency_ns_.Record(done_ns - start_ns);
+    }
+    // A new sample stamped t_ns, in stamp order
+    void OnSample(uint64_t t_ns);
+    void Reset();
+
+    // Time between consecutive samples
+    const Histogram& IntervalNs() const { return interval_ns_; }
+    // Duration of the bus reads
+    const Histogram& LatencyNs() const { return latency_ns_; }
+    // Samples per second of every completed rate window, in mHz
+    const Histogram& RateMilliHz() const { return rate_mhz_; }
+};  // class SampleTiming
+
+#endif // TIMING_H_
@@ -0,0 +1,74 @@
+#include "work_pool.h"
+
+#include <thread>  // Needed for std::thread
+
+
+// WorkStealingPool constructor
+WorkStealingPool::WorkStealingPool(uint n_threads) : steals_(0) {
+  n_threads_ = n_threads > 0 ? n_threads : std::thread::hardware_concurrency();
+  if (n_threads_ == 0) {
+    n_threads_ = 1;
+  }
+  for (uint i = 0; i < n_threads_; i++) {
+    queues_.push_back(new Queue());
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  for (uint i = 0; i < n_threads_; i++) {
+    delete queues_[i];
+  }
+}
+
+bool WorkStealingPool::Pop_(uint worker, size_t* task) {
+  Queue* queue = queues_[worker];
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  if (queue->tasks.empty()) {
+    return false;
+  }
+  *task = queue->tasks.front();
+  queue->tasks.pop_front();
+  return true;
+}
+
+bool WorkStealingPool::Steal_(uint worker, size_t* task) {
+  // Visit the others starting with the next worker, so thieves spread out
+  // over the victims instead of all queueing on the first one
+  for (uint i = 1; i < n_threads_; i++) {
+    Queue* victim = queues_[(worker + i) % n_threads_];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      *task = victim->tasks.back();
+      victim->tasks.pop_back();
+      steals_++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::Run(size_t n_tasks,
+                           const std::function<void(size_t, uint)>& fn) {
+  for (uint w = 0; w < n_threads_; w++) {
+    size_t begin = n_tasks*w/n_threads_;
+    size_t end = n_tasks*(w + 1)/n_threads_;
+    for (size_t task = begin; task < end; task++) {
+      queues_[w]->tasks.push_back(task);
+    }
+  }
+
+  // Tasks never add tasks, so once a worker finds every queue empty it is
+  // done for good
+  std::vector<std::thread> threads;
+  for (uint w = 0; w < n_threads_; w++) {
+    threads.push_back(std::thread([this, w, &fn]() {
+      size_t task;
+      while (Pop_(w, &task) || Steal_(w, &task)) {
+        fn(task, w);
+      }
+    }));
+  }
+  for (uint w = 0; w < n_threads_; w++) {
+    threads[w].join();
+  }
+}
@@ -0,0 +1,55 @@
+// Work-stealing thread pool for batches of independent tasks of uneven cost,
+// such as offline runs over logs of different lengths.
+//
+// Tasks are numbered 0 to n - 1 and dealt out in contiguous blocks, one
+// block per worker. A worker takes tasks from the front of its own queue and
+// once that is empty steals from the back of the others, so no worker sits
+// idle while another still has a backlog.
+//
+//   WorkStealingPool pool(0);  // One thread per core
+//   pool.Run(n_tasks, [&](size_t task, uint worker) { ... });
+
+#ifndef WORK_POOL_H_
+#define WORK_POOL_H_
+
+#include <atomic>  // Needed for std::atomic
+#include <cstddef>  // Needed for size_t
+#include <cstdint>  // Needed for uint64_t
+#include <deque>  // Needed for std::deque
+#include <functional>  // Needed for std::function
+#include <mutex>  // Needed for std::mutex
+#include <sys/types.h>  // Needed for uint
+#include <vector>  // Needed for std::vector
+#include "spsc_ring.h"  // Needed for kCacheLineSize
+
+
+class WorkStealingPool {
+  private:
+    // Only contended while stealing, padded so the owners do not share lines
+    struct Queue {
+      std::mutex mutex;
+      std::deque<size_t> tasks;
+      char pad[kCacheLineSize];
+    };
+
+    uint n_threads_;
+    std::vector<Queue*> queues_;
+    std::atomic<uint64_t> steals_;
+
+    bool Pop_(uint worker, size_t* task);
+    bool Steal_(uint worker, size_t* task);
+
+  public:
+    // n_threads 0 means one per core
+    explicit WorkStealingPool(uint n_threads);
+    ~WorkStealingPool();
+
+    uint NumThreads() const { return n_threads_; }
+    // Run fn(task, worker) for every task in [0, n_tasks) and return once all
+    // of them are done. worker is below NumThreads(), for per-thread state.
+    void Run(size_t n_tasks, const std::function<void(size_t, uint)>& fn);
+    // Tasks run by another worker than the one they were dealt to
+    uint64_t Steals() const { return steals_.load(); }
+};  // class WorkStealingPool
+
+#endif // WORK_POOL_H_